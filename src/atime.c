@@ -0,0 +1,297 @@
+//
+//  atime.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "bcache.h"
+
+#include "atime.h"
+
+
+/* ========================= CONSTANTS ===================================== */
+#define ATIME_SLOTS     1024            // pending atimes kept in memory
+#define SLOT_EMPTY      -1              // slot was never used
+#define SLOT_DELETED    -2              // slot was used, inode forgotten
+
+static const int RELATIME_AGE = 24 * 60 * 60;  // seconds
+
+
+/* ========================= VARIABLES ===================================== */
+typedef struct atime_slot {
+    int ino;
+    int atime;
+} atime_slot;
+
+static atime_mode       mode = ATIME_STRICT;
+static int              interval;       // seconds between lazy flushes
+
+// pending atimes of the lazytime mode
+static atime_slot       slots[ATIME_SLOTS];
+static int              used;           // number of non empty slots
+
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   wake = PTHREAD_COND_INITIALIZER;
+static pthread_t        flusher;
+static int              running;
+
+
+
+
+/* ==================== LOCAL HELPERS ===================================== */
+/* Returns the slot of "ino", or the slot where it should be put */
+static
+atime_slot*
+__find_slot(const int ino)
+{
+    atime_slot* target = NULL;
+    unsigned int hash = (unsigned int)ino * 2654435761u;
+    
+    for (int ii = 0; ii < ATIME_SLOTS; ++ii) {
+        atime_slot* slot = &slots[(hash + ii) % ATIME_SLOTS];
+        
+        // ino is already pending
+        if (slot->ino == ino) {
+            return slot;
+        }
+        
+        // remember first reusable slot
+        if (slot->ino == SLOT_DELETED && target == NULL) {
+            target = slot;
+        }
+        
+        // end of the probe chain
+        if (slot->ino == SLOT_EMPTY) {
+            return (target != NULL) ? target : slot;
+        }
+    }
+    
+    return target;
+}
+
+/* Writes all pending atimes into the inodes, lock must be held */
+static
+void
+__flush_slots()
+{
+    trace("|--ATIME: flushing %d pending atimes\n", used); // log
+    
+    bcache_op_begin();
+    
+    for (int ii = 0; ii < ATIME_SLOTS; ++ii) {
+        if (slots[ii].ino >= 0) {
+            inode* node = disk_get_inode(slots[ii].ino);
+            
+            // inode could have been written since the access
+            if (slots[ii].atime > node->atime) {
+                node->atime = slots[ii].atime;
+            }
+        }
+        
+        slots[ii].ino = SLOT_EMPTY;
+    }
+    
+    bcache_op_end(1);
+    used = 0;
+}
+
+/* Periodically writes pending atimes back in one batch */
+static
+void*
+__flusher_main(void* arg)
+{
+    pthread_mutex_lock(&lock);
+    
+    while (running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval;
+        
+        int rv = pthread_cond_timedwait(&wake, &lock, &deadline);
+        
+        // timer expired, write the batch
+        if (rv == ETIMEDOUT && used > 0) {
+            __flush_slots();
+        }
+    }
+    
+    pthread_mutex_unlock(&lock);
+    
+    return NULL;
+}
+
+/* Should atime of the "node" change under "policy" when accessed at "now"? */
+static
+int
+__needs_update(const atime_mode policy, const inode* node,
+               const int atime, const time_t now)
+{
+    switch (policy) {
+        case ATIME_NOATIME:
+            return 0;
+        
+        case ATIME_RELATIME:
+            return atime <= node->mtime
+                || atime <= node->ctime
+                || now - atime >= RELATIME_AGE;
+        
+        default:
+            return atime != now;
+    }
+}
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Sets the atime policy, lazytime flushes every "interval" seconds */
+void
+atime_init(const atime_mode atime_mode, const int flush_interval)
+{
+    assert(flush_interval > 0);
+    
+    mode = atime_mode;
+    interval = flush_interval;
+    
+    for (int ii = 0; ii < ATIME_SLOTS; ++ii) {
+        slots[ii].ino = SLOT_EMPTY;
+    }
+    
+    used = 0;
+}
+
+/* Starts the flusher of lazytime, a process which forks after the mount
+   calls it in the child */
+void
+atime_start()
+{
+    if (mode != ATIME_LAZY) {
+        return;
+    }
+    
+    running = 1;
+    
+    int rv = pthread_create(&flusher, NULL, __flusher_main, NULL);
+    assert(rv == 0);
+}
+
+/* Stops the flusher and writes pending atimes back */
+void
+atime_stop()
+{
+    pthread_mutex_lock(&lock);
+    
+    int thread = running;
+    running = 0;
+    
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    
+    if (thread) {
+        pthread_join(flusher, NULL);
+    }
+    
+    atime_flush();
+}
+
+/* Records access to the "node" according to the atime policy */
+void
+atime_touch(inode* node)
+{
+    assert(node != NULL);
+    
+    time_t now = time(NULL);
+    
+    // atime is written into the inode right away
+    if (mode != ATIME_LAZY) {
+        if (__needs_update(mode, node, node->atime, now)) {
+            node->atime = now;
+            disk_dirty_inode(node);
+        }
+        
+        return;
+    }
+    
+    pthread_mutex_lock(&lock);
+    
+    atime_slot* slot = __find_slot(node->ino);
+    
+    // no place left, write the batch now
+    if (slot == NULL) {
+        __flush_slots();
+        slot = __find_slot(node->ino);
+    }
+    
+    // lazytime keeps relatime's rule for the in-memory value
+    int atime = (slot->ino == node->ino) ? slot->atime : node->atime;
+    if (__needs_update(ATIME_RELATIME, node, atime, now)) {
+        if (slot->ino != node->ino) {
+            used += 1;
+        }
+        
+        slot->ino = node->ino;
+        slot->atime = now;
+    }
+    
+    pthread_mutex_unlock(&lock);
+}
+
+/* Returns atime of the "node", including the one pending in memory */
+int
+atime_get(const inode* node)
+{
+    assert(node != NULL);
+    
+    if (mode != ATIME_LAZY) {
+        return node->atime;
+    }
+    
+    pthread_mutex_lock(&lock);
+    
+    atime_slot* slot = __find_slot(node->ino);
+    int atime = (slot != NULL && slot->ino == node->ino)
+        ? slot->atime : node->atime;
+    
+    pthread_mutex_unlock(&lock);
+    
+    return atime;
+}
+
+/* Drops pending atime of the inode which is deleted or rewritten */
+void
+atime_forget(const int ino)
+{
+    if (mode != ATIME_LAZY) {
+        return;
+    }
+    
+    pthread_mutex_lock(&lock);
+    
+    atime_slot* slot = __find_slot(ino);
+    if (slot != NULL && slot->ino == ino) {
+        slot->ino = SLOT_DELETED;
+        used -= 1;
+    }
+    
+    pthread_mutex_unlock(&lock);
+}
+
+/* Writes all pending atimes into the inodes */
+void
+atime_flush()
+{
+    pthread_mutex_lock(&lock);
+    
+    if (used > 0) {
+        __flush_slots();
+    }
+    
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,23 @@
+//
+//  atime.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef atime_h
+#define atime_h
+
+#include <stdio.h>
+#include "disk.h"
+
+void    atime_init(const atime_mode mode, const int interval);
+void    atime_start();
+void    atime_stop();
+
+void    atime_touch(inode* node);
+int     atime_get(const inode* node);
+void    atime_forget(const int ino);
+void    atime_flush();
+
+#endif /* atime_h */
@@ -0,0 +1,689 @@
+//
+//  bcache.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "blkdev.h"
+#include "csum.h"
+
+#include "bcache.h"
+
+
+/* ========================= VARIABLES ===================================== */
+/* Block of the data file held in memory */
+typedef struct bframe {
+    size_t          blk;        // block number in the data file
+    char*           data;
+    int             pins;       // operations using the frame right now
+    int             dirty;      // has to be written before it is dropped
+    int             own;        // allocated over the limit, not in the arena
+    int             bad;        // read data does not match its checksum
+    int             failed;     // block could not be read, the frame is
+                                // dropped when it is unpinned
+    
+    struct bframe*  hnext;      // next frame in the hash chain
+    struct bframe*  prev;       // LRU list of unpinned frames
+    struct bframe*  next;
+} bframe;
+
+static int              active;
+static int              bsize;
+static int              limit;      // frames allowed by the cache size
+static int              count;      // frames holding a block
+static void             (*evicted)();   // told when a dirty block was
+                                        // written back to make room
+
+static char*            arena;      // data of the frames within the limit
+static bframe*          frames;
+static bframe*          free_frames;
+
+static bframe**         buckets;    // hash table of the resident frames
+static size_t           bucket_mask;
+
+// unpinned frames, most recently used at the head
+static bframe*          lru_head;
+static bframe*          lru_tail;
+
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+
+// operations hold it shared, a checkpoint waits for all of them to end
+static pthread_rwlock_t gate = PTHREAD_RWLOCK_INITIALIZER;
+
+// frames pinned by the operation running in this thread
+static __thread bframe**    op_frames;
+static __thread int         op_count;
+static __thread int         op_cap;
+static __thread int         op_depth;
+static __thread int         op_dirty;
+static __thread int         op_bad;     // got a block with a bad checksum
+static __thread int         op_err;     // first read or write which failed
+
+
+
+
+/* ==================== LOCAL HELPERS ===================================== */
+/* Returns hash chain of the block "blk" */
+static
+bframe**
+__bucket(const size_t blk)
+{
+    return &buckets[(blk * 0x9e3779b97f4a7c15ull >> 32) & bucket_mask];
+}
+
+/* Takes the frame out of its hash chain */
+static
+void
+__unhash(bframe* frame)
+{
+    bframe** link = __bucket(frame->blk);
+    
+    while (*link != frame) {
+        link = &(*link)->hnext;
+    }
+    
+    *link = frame->hnext;
+}
+
+/* Puts the frame into the hash chain of its block */
+static
+void
+__hash(bframe* frame)
+{
+    bframe** bucket = __bucket(frame->blk);
+    
+    frame->hnext = *bucket;
+    *bucket = frame;
+}
+
+/* Takes the frame out of the LRU list */
+static
+void
+__lru_remove(bframe* frame)
+{
+    // pinned frames are not in the list
+    if (frame->prev == NULL && lru_head != frame) {
+        return;
+    }
+    
+    if (frame->prev != NULL) frame->prev->next = frame->next;
+    else lru_head = frame->next;
+    
+    if (frame->next != NULL) frame->next->prev = frame->prev;
+    else lru_tail = frame->prev;
+    
+    frame->prev = NULL;
+    frame->next = NULL;
+}
+
+/* Puts the frame at the head of the LRU list */
+static
+void
+__lru_push(bframe* frame)
+{
+    frame->prev = NULL;
+    frame->next = lru_head;
+    
+    if (lru_head != NULL) lru_head->prev = frame;
+    else lru_tail = frame;
+    
+    lru_head = frame;
+}
+
+/* Remembers the error "err" for the operation running in this thread,
+   it gets -ENOSPC when the data file is out of space and -EIO otherwise */
+static
+void
+__op_fail(const int err)
+{
+    if (op_err == 0) {
+        op_err = (err == -ENOSPC) ? -ENOSPC : -EIO;
+    }
+}
+
+/* Writes the frame into the data file when it is dirty, returns 0 or
+   -ERRNO with the frame still dirty, the next write back tries again */
+static
+int
+__write_back(bframe* frame)
+{
+    if (!frame->dirty) {
+        return 0;
+    }
+    
+    csum_update(frame->blk, frame->data);
+    
+    int rv = blkdev_write(frame->data, bsize, (off_t)frame->blk * bsize);
+    if (rv < 0) return rv;
+    
+    frame->dirty = 0;
+    return 0;
+}
+
+/* Writes back and frees an unpinned frame, returns 0 or -ERRNO when it
+   could not be written and is kept */
+static
+int
+__drop(bframe* frame)
+{
+    assert(frame->pins == 0);
+    
+    int rv = __write_back(frame);
+    if (rv < 0) return rv;
+    
+    __lru_remove(frame);
+    __unhash(frame);
+    count -= 1;
+    
+    if (frame->own) {
+        free(frame->data);
+        free(frame);
+        return 0;
+    }
+    
+    frame->next = free_frames;
+    free_frames = frame;
+    
+    return 0;
+}
+
+/* Returns an unused frame, evicts the least recently used one if needed */
+static
+bframe*
+__alloc_frame()
+{
+    bframe* frame = NULL;
+    
+    // free place in the arena
+    if (free_frames != NULL) {
+        frame = free_frames;
+        free_frames = frame->next;
+    }
+    
+    // reuse the least recently used frame, it stays when it can not be
+    // written back
+    else if (lru_tail != NULL) {
+        int dirty = lru_tail->dirty;
+        
+        if (__write_back(lru_tail) == 0) {
+            frame = lru_tail;
+            __lru_remove(frame);
+            __unhash(frame);
+            count -= 1;
+        }
+        
+        if (frame != NULL && dirty && evicted != NULL) {
+            evicted();
+        }
+    }
+    
+    // all frames are pinned, go over the limit until they are released
+    if (frame == NULL) {
+        frame = malloc(sizeof(bframe));
+        assert(frame != NULL);
+        frame->data = blkdev_alloc(bsize);
+        frame->own = 1;
+    }
+    
+    frame->pins = 0;
+    frame->dirty = 0;
+    frame->bad = 0;
+    frame->failed = 0;
+    frame->prev = NULL;
+    frame->next = NULL;
+    count += 1;
+    
+    return frame;
+}
+
+/* Returns a frame for the block "blk" which is not resident, lock held */
+static
+bframe*
+__load(const size_t blk)
+{
+    bframe* frame = __alloc_frame();
+    frame->blk = blk;
+    
+    int rv = blkdev_read(frame->data, bsize, (off_t)blk * bsize);
+    
+    // operation gets zeroes and the error, the block is read again later
+    if (rv < 0) {
+        memset(frame->data, 0, bsize);
+        frame->failed = 1;
+        __op_fail(rv);
+    }
+    
+    else if (csum_verifies()) {
+        frame->bad = (csum_check(blk, frame->data) < 0);
+    }
+    
+    __hash(frame);
+    
+    return frame;
+}
+
+/* Returns the resident frame of the block "blk", otherwise NULL */
+static
+bframe*
+__find(const size_t blk)
+{
+    bframe* frame = *__bucket(blk);
+    
+    while (frame != NULL && frame->blk != blk) {
+        frame = frame->hnext;
+    }
+    
+    return frame;
+}
+
+/* Remembers that the current operation pinned the frame */
+static
+void
+__op_track(bframe* frame)
+{
+    if (op_count == op_cap) {
+        op_cap = (op_cap == 0) ? 16 : op_cap * 2;
+        op_frames = realloc(op_frames, op_cap * sizeof(bframe*));
+        assert(op_frames != NULL);
+    }
+    
+    op_frames[op_count++] = frame;
+}
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Starts caching up to "cache_size" bytes of "block_size" blocks, in
+   huge pages when "huge" is set */
+void
+bcache_init(const size_t cache_size, const int block_size, const int huge)
+{
+    bsize = block_size;
+    limit = max((int)(cache_size / block_size), 1);
+    count = 0;
+    
+    // at least one bucket per frame
+    size_t buckets_num = 1;
+    while (buckets_num < (size_t)limit) {
+        buckets_num <<= 1;
+    }
+    
+    buckets = calloc(buckets_num, sizeof(bframe*));
+    assert(buckets != NULL);
+    bucket_mask = buckets_num - 1;
+    
+    // one arena the backend can register for all frames
+    arena = huge ? blkdev_alloc_huge((size_t)limit * block_size)
+                 : blkdev_alloc((size_t)limit * block_size);
+    frames = calloc(limit, sizeof(bframe));
+    assert(frames != NULL);
+    
+    free_frames = NULL;
+    for (int ii = limit - 1; ii >= 0; --ii) {
+        frames[ii].data = arena + (size_t)ii * block_size;
+        frames[ii].next = free_frames;
+        free_frames = &frames[ii];
+    }
+    
+    blkdev_register(arena, (size_t)limit * block_size);
+    
+    lru_head = NULL;
+    lru_tail = NULL;
+    active = 1;
+    
+    trace("|--BCACHE: caching %d blocks of %d bytes\n", // log
+          limit, block_size);
+}
+
+/* Writes everything back and frees the cache, returns 0 or -ERRNO when
+   blocks could not be written and are lost */
+int
+bcache_stop()
+{
+    if (!active) {
+        return 0;
+    }
+    
+    int rv = bcache_sync();
+    
+    while (lru_head != NULL) {
+        lru_head->dirty = 0;
+        __drop(lru_head);
+    }
+    
+    assert(count == 0);
+    blkdev_unregister();
+    
+    free(buckets);
+    free(frames);
+    free(arena);
+    buckets = NULL;
+    frames = NULL;
+    arena = NULL;
+    active = 0;
+    
+    return rv;
+}
+
+/* Are blocks read through the cache? */
+int
+bcache_active()
+{
+    return active;
+}
+
+/* Starts an operation, blocks it gets stay in memory until it ends */
+void
+bcache_op_begin()
+{
+    if (op_depth++ == 0) {
+        pthread_rwlock_rdlock(&gate);
+    }
+}
+
+/* Starts an operation like bcache_op_begin() which runs alone, it waits
+   for the others to end and new ones wait for it */
+void
+bcache_op_begin_alone()
+{
+    assert(op_depth == 0);
+    
+    op_depth = 1;
+    pthread_rwlock_wrlock(&gate);
+}
+
+/* Ends an operation, its blocks become dirty when "dirty" is set,
+   returns -EIO when one of them did not match its checksum, or the error
+   of a block which could not be read or written back */
+int
+bcache_op_end(const int dirty)
+{
+    assert(op_depth > 0);
+    op_dirty |= dirty;
+    
+    // inner operations leave their blocks to the outer one
+    if (--op_depth > 0) {
+        return 0;
+    }
+    
+    if (op_count > 0) {
+        pthread_mutex_lock(&lock);
+        
+        for (int ii = 0; ii < op_count; ++ii) {
+            bframe* frame = op_frames[ii];
+            frame->dirty |= op_dirty;
+            
+            if (--frame->pins > 0) {
+                continue;
+            }
+            
+            // zeroes of a block which could not be read are not written
+            if (frame->failed) {
+                frame->dirty = 0;
+            }
+            
+            if (!frame->own && !frame->failed) {
+                __lru_push(frame);
+                continue;
+            }
+            
+            // frames over the limit are written and given back right away,
+            // one which can not be written is kept like the others
+            int rv = __drop(frame);
+            if (rv < 0) {
+                __op_fail(rv);
+                __lru_push(frame);
+            }
+        }
+        
+        // keep the cache within its limit, blocks of other operations
+        // which can not be written stay dirty until the next sync
+        while (count > limit && lru_tail != NULL) {
+            if (__drop(lru_tail) < 0) break;
+        }
+        
+        pthread_mutex_unlock(&lock);
+    }
+    
+    int rv = (op_err < 0) ? op_err : (op_bad ? -EIO : 0);
+    
+    op_count = 0;
+    op_dirty = 0;
+    op_bad = 0;
+    op_err = 0;
+    
+    pthread_rwlock_unlock(&gate);
+    
+    return rv;
+}
+
+/* Waits until no operation runs and keeps new ones from starting */
+void
+bcache_quiesce()
+{
+    pthread_rwlock_wrlock(&gate);
+}
+
+/* Lets operations run again */
+void
+bcache_resume()
+{
+    pthread_rwlock_unlock(&gate);
+}
+
+/* Returns data of the block "blk", valid until the operation ends */
+void*
+bcache_get(const size_t blk)
+{
+    assert(active);
+    assert(op_depth > 0);
+    
+    pthread_mutex_lock(&lock);
+    
+    bframe* frame = __find(blk);
+    if (frame == NULL) {
+        frame = __load(blk);
+    }
+    
+    // pinned frames can not be evicted
+    else if (frame->pins == 0) {
+        __lru_remove(frame);
+    }
+    
+    frame->pins += 1;
+    op_bad |= frame->bad;
+    
+    // another operation is still holding the zeroes of a failed read
+    if (frame->failed) {
+        __op_fail(-EIO);
+    }
+    
+    pthread_mutex_unlock(&lock);
+    
+    __op_track(frame);
+    
+    return frame->data;
+}
+
+/* Marks block "blk" pinned by the current operation as changed */
+void
+bcache_dirty(const size_t blk)
+{
+    pthread_mutex_lock(&lock);
+    
+    bframe* frame = __find(blk);
+    assert(frame != NULL);
+    frame->dirty = 1;
+    
+    pthread_mutex_unlock(&lock);
+}
+
+/* Reads blocks of "blks" which are not in memory in one batch, blocks
+   of a batch which failed are left to the operations reading them */
+void
+bcache_prefetch(const size_t* blks, const int blks_num)
+{
+    if (!active || blks_num == 0) {
+        return;
+    }
+    
+    blkdev_io ios[blks_num];
+    bframe* loaded[blks_num];
+    int num = 0;
+    
+    pthread_mutex_lock(&lock);
+    
+    for (int ii = 0; ii < blks_num; ++ii) {
+        
+        // prefetch never goes over the limit
+        if (free_frames == NULL && lru_tail == NULL) {
+            break;
+        }
+        
+        if (__find(blks[ii]) != NULL) {
+            continue;
+        }
+        
+        // frame is hashed before it is read, the lock is held until then
+        bframe* frame = __alloc_frame();
+        frame->blk = blks[ii];
+        __hash(frame);
+        
+        ios[num].buf = frame->data;
+        ios[num].len = bsize;
+        ios[num].offset = (off_t)frame->blk * bsize;
+        ios[num].write = 0;
+        loaded[num++] = frame;
+    }
+    
+    int rv = blkdev_submit(ios, num);
+    
+    for (int ii = 0; ii < num; ++ii) {
+        if (rv < 0) {
+            __drop(loaded[ii]);
+            continue;
+        }
+        
+        if (csum_verifies()) {
+            loaded[ii]->bad = (csum_check(loaded[ii]->blk,
+                                          loaded[ii]->data) < 0);
+        }
+        
+        __lru_push(loaded[ii]);
+    }
+    
+    pthread_mutex_unlock(&lock);
+}
+
+/* Calls "hook" with the cache locked whenever a dirty block is written back
+   to make room for another one, NULL calls nothing */
+void
+bcache_on_evict(void (*hook)())
+{
+    pthread_mutex_lock(&lock);
+    evicted = hook;
+    pthread_mutex_unlock(&lock);
+}
+
+/* Writes all dirty blocks into the data file in one batch, returns 0 or
+   -ERRNO with the blocks still dirty */
+int
+bcache_sync()
+{
+    pthread_mutex_lock(&lock);
+    
+    blkdev_io* ios = malloc(count * sizeof(blkdev_io));
+    bframe** written = malloc(count * sizeof(bframe*));
+    assert(count == 0 || (ios != NULL && written != NULL));
+    int num = 0;
+    
+    for (size_t ii = 0; ii <= bucket_mask; ++ii) {
+        for (bframe* frame = buckets[ii]; frame != NULL; frame = frame->hnext) {
+            if (!frame->dirty) {
+                continue;
+            }
+            
+            csum_update(frame->blk, frame->data);
+            
+            ios[num].buf = frame->data;
+            ios[num].len = bsize;
+            ios[num].offset = (off_t)frame->blk * bsize;
+            ios[num].write = 1;
+            written[num++] = frame;
+        }
+    }
+    
+    int rv = blkdev_submit(ios, num);
+    
+    // which blocks of a failed batch made it is not known
+    for (int ii = 0; ii < num && rv == 0; ++ii) {
+        written[ii]->dirty = 0;
+    }
+    
+    free(ios);
+    free(written);
+    
+    pthread_mutex_unlock(&lock);
+    
+    return rv;
+}
+
+/* Reads block "blk" into "buf" and checks its checksum unless it is
+   cached, the cached data is newer, returns 0, 1 when skipped or -EIO */
+int
+bcache_scrub(const size_t blk, void* buf)
+{
+    pthread_mutex_lock(&lock);
+    
+    int rv = 1;
+    
+    // write back can not change the block while it is read
+    if (__find(blk) == NULL) {
+        rv = blkdev_read(buf, bsize, (off_t)blk * bsize);
+        
+        if (rv == 0) {
+            rv = csum_check(blk, buf);
+        }
+    }
+    
+    pthread_mutex_unlock(&lock);
+    
+    return rv;
+}
+
+/* Forgets block "blk" which was freed, its frame is dropped without being
+   written back, returns 0 or -EBUSY when an operation still has it */
+int
+bcache_forget(const size_t blk)
+{
+    if (!active) {
+        return 0;
+    }
+    
+    pthread_mutex_lock(&lock);
+    
+    int rv = 0;
+    bframe* frame = __find(blk);
+    
+    if (frame != NULL && frame->pins > 0) {
+        rv = -EBUSY;
+    }
+    
+    else if (frame != NULL) {
+        frame->dirty = 0;
+        __drop(frame);
+    }
+    
+    pthread_mutex_unlock(&lock);
+    
+    return rv;
+}
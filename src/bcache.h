@@ -0,0 +1,34 @@
+//
+//  bcache.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef bcache_h
+#define bcache_h
+
+#include <stdio.h>
+
+#define BCACHE_SIZE     (16 * 1024 * 1024)  // default bytes of cached blocks
+
+void    bcache_init(const size_t cache_size, const int block_size,
+                    const int huge);
+int     bcache_stop();
+int     bcache_active();
+
+void    bcache_op_begin();
+void    bcache_op_begin_alone();
+int     bcache_op_end(const int dirty);
+void    bcache_quiesce();
+void    bcache_resume();
+
+void*   bcache_get(const size_t blk);
+void    bcache_dirty(const size_t blk);
+void    bcache_prefetch(const size_t* blks, const int blks_num);
+int     bcache_sync();
+void    bcache_on_evict(void (*hook)());
+int     bcache_scrub(const size_t blk, void* buf);
+int     bcache_forget(const size_t blk);
+
+#endif /* bcache_h */
@@ -0,0 +1,631 @@
+//
+//  blkdev.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "blkdev.h"
+#include "snapshot.h"
+#include "stripe.h"
+#include "tier.h"
+#include "ckpt.h"
+
+
+/* ========================= CONSTANTS ===================================== */
+#define DIRECT_ALIGN    4096        // buffer alignment O_DIRECT accepts
+#define URING_DEPTH     128         // I/Os the ring keeps in flight
+
+
+/* ========================= VARIABLES ===================================== */
+/* Operations every backend provides */
+typedef struct blkdev_ops {
+    int     (*submit)(blkdev_io* ios, int count);
+    void    (*close)();
+} blkdev_ops;
+
+static const blkdev_ops*    ops;    // backend of the open data file
+static int                  fd = -1;
+
+// io_uring shared with the kernel, one submitter at a time
+static int                  ring_fd = -1;
+static pthread_mutex_t      ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void*                sq_ptr;
+static size_t               sq_size;
+static void*                cq_ptr;
+static size_t               cq_size;
+static struct io_uring_sqe* sqes;
+static size_t               sqes_size;
+
+static unsigned*            sq_tail;
+static unsigned*            sq_mask;
+static unsigned*            sq_array;
+static unsigned             sq_entries;
+static unsigned*            cq_head;
+static unsigned*            cq_tail;
+static unsigned*            cq_mask;
+static struct io_uring_cqe* cqes;
+
+// buffer registered with the ring, I/O inside of it skips page pinning
+static char*                fixed_buf;
+static size_t               fixed_len;
+
+
+
+
+/* ==================== PREAD BACKEND ====================================== */
+/* Reads "len" bytes at "offset", bytes past the end of the file are zeros */
+static
+int
+__pread_read(void* buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    
+    while (done < len) {
+        ssize_t rv = pread(fd, (char*)buf + done, len - done, offset + done);
+        
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv < 0) return -errno;
+        
+        // end of the file
+        if (rv == 0) {
+            memset((char*)buf + done, 0, len - done);
+            break;
+        }
+        
+        done += rv;
+    }
+    
+    return 0;
+}
+
+/* Writes "len" bytes at "offset" */
+static
+int
+__pread_write(const void* buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    
+    while (done < len) {
+        ssize_t rv = pwrite(fd, (const char*)buf + done,
+                            len - done, offset + done);
+        
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv < 0) return -errno;
+        
+        done += rv;
+    }
+    
+    return 0;
+}
+
+/* Makes written blocks durable */
+static
+int
+__pread_sync()
+{
+    return (fdatasync(fd) < 0) ? -errno : 0;
+}
+
+/* Does every I/O of the batch one after another */
+static
+int
+__pread_submit(blkdev_io* ios, int count)
+{
+    for (int ii = 0; ii < count; ++ii) {
+        int rv = ios[ii].write
+            ? __pread_write(ios[ii].buf, ios[ii].len, ios[ii].offset)
+            : __pread_read(ios[ii].buf, ios[ii].len, ios[ii].offset);
+        
+        if (rv < 0) return rv;
+    }
+    
+    return 0;
+}
+
+/* Nothing to release */
+static
+void
+__pread_close()
+{
+}
+
+static const blkdev_ops pread_ops = {
+    .submit = __pread_submit,
+    .close  = __pread_close,
+};
+
+
+
+
+/* ==================== URING BACKEND ====================================== */
+/* Unmaps the rings and closes them, the maps which failed are NULL */
+static
+void
+__uring_unmap()
+{
+    if (sqes != NULL) munmap(sqes, sqes_size);
+    if (cq_ptr != NULL && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+    if (sq_ptr != NULL) munmap(sq_ptr, sq_size);
+    if (ring_fd >= 0) close(ring_fd);
+    
+    sqes = NULL;
+    cq_ptr = NULL;
+    sq_ptr = NULL;
+    ring_fd = -1;
+}
+
+/* Maps one region of the ring, NULL when it fails */
+static
+void*
+__uring_map(const size_t size, const off_t offset)
+{
+    void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+    
+    return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+/* Sets up a ring with the data file registered, returns 0 or -ERRNO and
+   leaves no ring behind when it fails */
+static
+int
+__uring_setup()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    
+    ring_fd = syscall(__NR_io_uring_setup, URING_DEPTH, &params);
+    if (ring_fd < 0) return -errno;
+    
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes
+            + params.cq_entries * sizeof(struct io_uring_cqe);
+    
+    // newer kernels map both rings at once
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = max(sq_size, cq_size);
+    }
+    
+    sq_ptr = __uring_map(sq_size, IORING_OFF_SQ_RING);
+    
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        cq_ptr = sq_ptr;
+    }
+    
+    else {
+        cq_ptr = __uring_map(cq_size, IORING_OFF_CQ_RING);
+    }
+    
+    sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = __uring_map(sqes_size, IORING_OFF_SQES);
+    
+    if (sq_ptr == NULL || cq_ptr == NULL || sqes == NULL) {
+        int err = -errno;
+        __uring_unmap();
+        return err;
+    }
+    
+    sq_tail = (unsigned*)((char*)sq_ptr + params.sq_off.tail);
+    sq_mask = (unsigned*)((char*)sq_ptr + params.sq_off.ring_mask);
+    sq_array = (unsigned*)((char*)sq_ptr + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    
+    cq_head = (unsigned*)((char*)cq_ptr + params.cq_off.head);
+    cq_tail = (unsigned*)((char*)cq_ptr + params.cq_off.tail);
+    cq_mask = (unsigned*)((char*)cq_ptr + params.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe*)((char*)cq_ptr + params.cq_off.cqes);
+    
+    // requests name the data file by index and skip the fd lookup
+    int rv = syscall(__NR_io_uring_register, ring_fd,
+                     IORING_REGISTER_FILES, &fd, 1);
+    
+    // seccomp filters and old kernels may refuse it, the caller uses pread
+    if (rv < 0) {
+        int err = -errno;
+        __uring_unmap();
+        return err;
+    }
+    
+    return 0;
+}
+
+/* Fills the next submission entry with "io", tagged with "tag" */
+static
+void
+__uring_prep(const blkdev_io* io, const unsigned tag)
+{
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    struct io_uring_sqe* sqe = &sqes[index];
+    
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = 0;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->addr = (unsigned long)io->buf;
+    sqe->len = io->len;
+    sqe->off = io->offset;
+    sqe->user_data = tag;
+    
+    // registered buffer is already pinned by the kernel
+    char* buf = io->buf;
+    if (fixed_buf != NULL && buf >= fixed_buf
+        && buf + io->len <= fixed_buf + fixed_len) {
+        sqe->opcode = io->write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = 0;
+    }
+    
+    else {
+        sqe->opcode = io->write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/* Finishes an I/O the kernel did only partly, returns 0 or -ERRNO */
+static
+int
+__uring_complete(const blkdev_io* io, const int res)
+{
+    if (res < 0) return res;
+    
+    // rest of a short read or write is done synchronously
+    if ((size_t)res < io->len) {
+        char* buf = (char*)io->buf + res;
+        size_t len = io->len - res;
+        off_t offset = io->offset + res;
+        
+        return io->write ? __pread_write(buf, len, offset)
+                         : __pread_read(buf, len, offset);
+    }
+    
+    return 0;
+}
+
+/* Submits the batch in chunks of the ring size, waits for all of them */
+static
+int
+__uring_submit(blkdev_io* ios, int count)
+{
+    int err = 0;
+    
+    pthread_mutex_lock(&ring_lock);
+    
+    for (int first = 0; first < count; first += sq_entries) {
+        int batch = min(count - first, sq_entries);
+        
+        for (int ii = 0; ii < batch; ++ii) {
+            __uring_prep(&ios[first + ii], first + ii);
+        }
+        
+        // submit the whole chunk and wait for all of it in one call
+        int done = 0;
+        int submitted = 0;
+        
+        while (done < batch) {
+            int rv = syscall(__NR_io_uring_enter, ring_fd,
+                             batch - submitted, batch - done,
+                             IORING_ENTER_GETEVENTS, NULL, 0);
+            
+            if (rv < 0 && errno == EINTR) continue;
+            assert(rv >= 0);
+            submitted += rv;
+            
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            
+            for (; head != tail; ++head) {
+                struct io_uring_cqe* cqe = &cqes[head & *cq_mask];
+                int res = __uring_complete(&ios[cqe->user_data], cqe->res);
+                
+                if (res < 0 && err == 0) err = res;
+                done += 1;
+            }
+            
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+    
+    pthread_mutex_unlock(&ring_lock);
+    
+    return err;
+}
+
+/* Tears the ring down */
+static
+void
+__uring_close()
+{
+    __uring_unmap();
+    fixed_buf = NULL;
+}
+
+static const blkdev_ops uring_ops = {
+    .submit = __uring_submit,
+    .close  = __uring_close,
+};
+
+
+/* Layers of a snapshot or branch, see snapshot.c */
+static const blkdev_ops snap_ops = {
+    .submit = snap_submit,
+    .close  = snap_close,
+};
+
+
+/* Data files of a striped set, see stripe.c */
+static const blkdev_ops stripe_ops = {
+    .submit = stripe_submit,
+    .close  = stripe_close,
+};
+
+
+/* Fast and slow tier of one disk, see tier.c */
+static const blkdev_ops tier_ops = {
+    .submit = tier_submit,
+    .close  = tier_close,
+};
+
+
+/* Data file written by checkpoints only, see ckpt.c */
+static const blkdev_ops ckpt_ops = {
+    .submit = ckpt_submit,
+    .close  = ckpt_close,
+};
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Opens the data file for the backend, creates a sparse one of
+   "create_size" bytes when it is not 0, returns 0 or -ERRNO */
+int
+blkdev_open(const char* data_file, const io_backend backend,
+            const int direct, const size_t create_size)
+{
+    assert(backend != IO_MMAP);
+    
+    int flags = O_RDWR;
+    if (create_size > 0) flags |= O_CREAT | O_TRUNC;
+    
+    fd = open(data_file, flags | (direct ? O_DIRECT : 0), 0644);
+    
+    // file system of the data file does not support O_DIRECT
+    if (fd < 0 && direct && errno == EINVAL) {
+        trace("|--BLKDEV: no O_DIRECT, using page cache\n"); // log
+        fd = open(data_file, flags, 0644);
+    }
+    
+    if (fd < 0) return -errno;
+    
+    // the file stays sparse
+    if (create_size > 0 && ftruncate(fd, create_size) < 0) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    
+    ops = &pread_ops;
+    
+    // kernels without io_uring, or with it disabled, use pread
+    if (backend == IO_URING) {
+        int rv = __uring_setup();
+        
+        if (rv == 0) {
+            ops = &uring_ops;
+        }
+        
+        else {
+            trace("|--BLKDEV: no io_uring (%d), using pread\n", rv); // log
+            ring_fd = -1;
+        }
+    }
+    
+    trace("|--BLKDEV: opened %s%s\n", data_file, // log
+          direct ? " for direct I/O" : "");
+    
+    return 0;
+}
+
+/* Opens "data_file" through the layers of "branch" on top of snapshot
+   "from", or snapshot "from" read-only, see snap_open(), returns 0 or -ERRNO */
+int
+blkdev_open_layers(const char* data_file, const char* branch,
+                   const char* from, const int reset)
+{
+    int rv = snap_open(data_file, branch, from, reset);
+    if (rv < 0) return rv;
+    
+    ops = &snap_ops;
+    
+    return 0;
+}
+
+/* Opens "data_file" and the comma separated "members" as one striped
+   disk, see stripe_open(), returns 0 or -ERRNO */
+int
+blkdev_open_stripes(const char* data_file, const char* members,
+                    const int direct, const size_t create_size,
+                    stripe_geom* geom)
+{
+    int rv = stripe_open(data_file, members, direct, create_size, geom);
+    if (rv < 0) return rv;
+    
+    ops = &stripe_ops;
+    
+    return 0;
+}
+
+/* Opens "data_file" as the fast tier and "slow_file" as the slow tier of
+   one disk, see tier_open(), returns 0 or -ERRNO */
+int
+blkdev_open_tier(const char* data_file, const char* slow_file,
+                 const int direct, const int create, tier_geom* geom)
+{
+    int rv = tier_open(data_file, slow_file, direct, create, geom);
+    if (rv < 0) return rv;
+    
+    ops = &tier_ops;
+    
+    return 0;
+}
+
+/* Opens "data_file" which gets writes at checkpoints only, see
+   ckpt_open(), returns 0 or -ERRNO */
+int
+blkdev_open_ckpt(const char* data_file, const size_t create_size)
+{
+    int rv = ckpt_open(data_file, create_size);
+    if (rv < 0) return rv;
+    
+    ops = &ckpt_ops;
+    
+    return 0;
+}
+
+/* Starts the threads of the backend, until then its I/O is done by the
+   callers */
+void
+blkdev_start()
+{
+    if (ops == &stripe_ops) stripe_start();
+    if (ops == &tier_ops) tier_start();
+}
+
+/* Closes the data file */
+void
+blkdev_close()
+{
+    if (ops != NULL) {
+        ops->close();
+    }
+    
+    if (fd >= 0) {
+        close(fd);
+    }
+    
+    fd = -1;
+    ops = NULL;
+}
+
+/* Reads "len" bytes of the data file at "offset" into "buf" */
+int
+blkdev_read(void* buf, const size_t len, const off_t offset)
+{
+    blkdev_io io = { buf, len, offset, 0 };
+    
+    return ops->submit(&io, 1);
+}
+
+/* Writes "len" bytes of "buf" into the data file at "offset" */
+int
+blkdev_write(const void* buf, const size_t len, const off_t offset)
+{
+    blkdev_io io = { (void*)buf, len, offset, 1 };
+    
+    return ops->submit(&io, 1);
+}
+
+/* Does all "count" I/Os, as many at once as the backend can,
+   returns 0 or -ERRNO of the first failed one */
+int
+blkdev_submit(blkdev_io* ios, const int count)
+{
+    return ops->submit(ios, count);
+}
+
+/* Waits until everything written reaches the data file */
+int
+blkdev_sync()
+{
+    if (ops == &snap_ops) return snap_sync();
+    if (ops == &stripe_ops) return stripe_sync();
+    if (ops == &tier_ops) return tier_sync();
+    if (ops == &ckpt_ops) return ckpt_sync();
+    
+    return __pread_sync();
+}
+
+/* Allocates a buffer every backend can do I/O with, even O_DIRECT */
+void*
+blkdev_alloc(const size_t len)
+{
+    void* buf = NULL;
+    
+    int rv = posix_memalign(&buf, DIRECT_ALIGN, len);
+    assert(rv == 0);
+    
+    return buf;
+}
+
+/* Allocates a buffer like blkdev_alloc() which the kernel backs with
+   transparent huge pages where it can */
+void*
+blkdev_alloc_huge(const size_t len)
+{
+    void* buf = NULL;
+    
+    int rv = posix_memalign(&buf, HUGE_PAGE_SIZE, len);
+    assert(rv == 0);
+    
+    // kernels without transparent huge pages keep small pages
+    if (madvise(buf, len, MADV_HUGEPAGE) < 0) {
+        trace("|--BLKDEV: no huge pages (%d)\n", -errno); // log
+    }
+    
+    return buf;
+}
+
+/* Registers "buf" for I/O of the backend, blocks inside of it are
+   transferred without pinning their pages every time */
+void
+blkdev_register(void* buf, const size_t len)
+{
+    if (ops != &uring_ops) {
+        return;
+    }
+    
+    struct iovec iov = { buf, len };
+    int rv = syscall(__NR_io_uring_register, ring_fd,
+                     IORING_REGISTER_BUFFERS, &iov, 1);
+    
+    // over the locked memory limit, I/O works without it
+    if (rv < 0) {
+        trace("|--BLKDEV: buffer not registered (%d)\n", -errno); // log
+        return;
+    }
+    
+    fixed_buf = buf;
+    fixed_len = len;
+}
+
+/* Forgets the buffer given to blkdev_register() */
+void
+blkdev_unregister()
+{
+    if (fixed_buf == NULL) {
+        return;
+    }
+    
+    syscall(__NR_io_uring_register, ring_fd, IORING_UNREGISTER_BUFFERS,
+            NULL, 0);
+    fixed_buf = NULL;
+    fixed_len = 0;
+}
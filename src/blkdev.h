@@ -0,0 +1,58 @@
+//
+//  blkdev.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef blkdev_h
+#define blkdev_h
+
+#include <sys/types.h>
+#include <stdio.h>
+
+#define HUGE_PAGE_SIZE  (2 * 1024 * 1024)   // huge page of the MMU
+
+struct stripe_geom;
+struct tier_geom;
+
+/* How blocks of the data file get into memory */
+typedef enum io_backend {
+    IO_MMAP,            // whole data file is mapped, the kernel pages it
+    IO_PREAD,           // blocks are read into a cache with pread/pwrite
+    IO_URING,           // blocks are read into a cache in io_uring batches
+} io_backend;
+
+/* One transfer of a batch */
+typedef struct blkdev_io {
+    void*       buf;
+    size_t      len;
+    off_t       offset;
+    int         write;      // write "buf" out instead of reading into it
+} blkdev_io;
+
+int     blkdev_open(const char* data_file, const io_backend backend,
+                    const int direct, const size_t create_size);
+int     blkdev_open_layers(const char* data_file, const char* branch,
+                           const char* from, const int reset);
+int     blkdev_open_stripes(const char* data_file, const char* members,
+                            const int direct, const size_t create_size,
+                            struct stripe_geom* geom);
+int     blkdev_open_tier(const char* data_file, const char* slow_file,
+                         const int direct, const int create,
+                         struct tier_geom* geom);
+int     blkdev_open_ckpt(const char* data_file, const size_t create_size);
+void    blkdev_start();
+void    blkdev_close();
+
+int     blkdev_read(void* buf, const size_t len, const off_t offset);
+int     blkdev_write(const void* buf, const size_t len, const off_t offset);
+int     blkdev_submit(blkdev_io* ios, const int count);
+int     blkdev_sync();
+
+void*   blkdev_alloc(const size_t len);
+void*   blkdev_alloc_huge(const size_t len);
+void    blkdev_register(void* buf, const size_t len);
+void    blkdev_unregister();
+
+#endif /* blkdev_h */
@@ -5,6 +5,7 @@
 //  Created by Oleksandr Litus on 11/29/19.
 //
 
+#include <string.h>
 #include <assert.h>
 
 #include "bmap.h"
@@ -85,6 +86,60 @@ bmap_free(void* bmap, const int pos)
     bmap_put(bmap, pos, 0);
 }
 
+/* Returns position of the first free entry in [from, to), otherwise -1 */
+int
+bmap_find_free(void* bmap, const int from, const int to)
+{
+    assert(bmap != NULL);
+    assert(from >= 0);
+    
+    unsigned char* words = (unsigned char*)bmap;
+    
+    for (int pos = from; pos < to; ) {
+        
+        // skip fully used words at once
+        if (pos % 8 == 0 && words[pos / 8] == 0xff) {
+            pos += 8;
+            continue;
+        }
+        
+        if (bmap_isfree(bmap, pos)) {
+            return pos;
+        }
+        
+        ++pos;
+    }
+    
+    return -1;
+}
+
+/* Puts 0 to the map at "count" positions from "from" on */
+void
+bmap_free_range(void* bmap, const int from, const int count)
+{
+    assert(bmap != NULL);
+    assert(from >= 0);
+    assert(count >= 0);
+    
+    int pos = from;
+    int end = from + count;
+    
+    // free entries up to the first whole word
+    for (; pos < end && pos % 8 != 0; ++pos) {
+        bmap_free(bmap, pos);
+    }
+    
+    // free whole words at once
+    int words = (end - pos) / 8;
+    memset((char*)bmap + pos / 8, 0, words);
+    pos += words * 8;
+    
+    // free entries after the last whole word
+    for (; pos < end; ++pos) {
+        bmap_free(bmap, pos);
+    }
+}
+
 /* Inializes "bmap" will vals set to 0 */
 void
 bmap_init(void* bmap, const int size)
@@ -92,8 +147,12 @@ bmap_init(void* bmap, const int size)
     assert(bmap != NULL);
     assert(size > 0);
     
-    // free all the entries
-    for (int ii = 0; ii < size; ++ii) {
-        bmap_free(bmap, ii);
-    }
+    bmap_init_range(bmap, 0, size);
+}
+
+/* Sets "count" vals starting at "from" to 0 */
+void
+bmap_init_range(void* bmap, const int from, const int count)
+{
+    bmap_free_range(bmap, from, count);
 }
@@ -11,8 +11,11 @@
 #include <stdio.h>
 
 void    bmap_init(void* bmap, const int size);
+void    bmap_init_range(void* bmap, const int from, const int count);
 int     bmap_isfree(void* bmap, const int pos);
 void    bmap_set(void* bmap, const int pos);
 void    bmap_free(void* bmap, const int pos);
+void    bmap_free_range(void* bmap, const int from, const int count);
+int     bmap_find_free(void* bmap, const int from, const int to);
 
 #endif /* bmap_h */
@@ -0,0 +1,410 @@
+//
+//  ckpt.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#define _GNU_SOURCE
+
+#include <sys/uio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "csum.h"
+#include "ckpt.h"
+
+
+/* ========================= CONSTANTS ===================================== */
+#define CKPT_HEAD_SIZE  4096        // bytes of a head and its padding
+#define CKPT_RECORDS    (2 * CKPT_HEAD_SIZE)    // first record of the log
+#define CKPT_BATCH      512         // iovecs written at once
+#define CKPT_COPY       (1 << 20)   // bytes copied at once into the data file
+
+/*
+ * Blocks written between checkpoints stay in memory, a checkpoint writes
+ * the ones which changed into the log "data_file.ckpt" and then into the
+ * data file. The log starts with two heads, checkpoints take turns to
+ * write them:
+ *
+ *   records       every write as a ckpt_record and its bytes, after
+ *                 CKPT_RECORDS, and synced
+ *   head          of the new checkpoint, over the older one of the two,
+ *                 synced, the checkpoint is taken from here on
+ *   data file     gets the records and is synced
+ *   head          again with "applied" set
+ *
+ * A crash before the head is written leaves the last checkpoint, which is
+ * in the data file already, the other head is still valid. A crash after
+ * it is repaired by the next open, which copies the records of a head
+ * which is not applied into the data file again.
+ */
+
+/* Write of a checkpoint in its log */
+typedef struct ckpt_record {
+    int64_t         offset;     // where the bytes go in the data file
+    int64_t         len;
+} ckpt_record;
+
+
+/* ========================= VARIABLES ===================================== */
+static int              fd = -1;    // data file
+static int              log_fd = -1;
+static ckpt_head        last;       // head of the last checkpoint
+
+// records written since the last checkpoint
+static off_t            log_end;
+static int64_t          pending;
+static uint32_t         pending_crc;
+
+
+
+
+/* ==================== LOCAL HELPERS ===================================== */
+/* Returns crc32c which validates "head" */
+static
+uint32_t
+__head_crc(const ckpt_head* head)
+{
+    return csum_crc32c(0, head, offsetof(ckpt_head, head_crc));
+}
+
+/* Reads "len" bytes at "offset", bytes past the end of the file are zeros */
+static
+int
+__read_full(const int file, void* buf, const size_t len, const off_t offset)
+{
+    size_t done = 0;
+    
+    while (done < len) {
+        ssize_t rv = pread(file, (char*)buf + done, len - done, offset + done);
+        
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv < 0) return -errno;
+        
+        if (rv == 0) {
+            memset((char*)buf + done, 0, len - done);
+            break;
+        }
+        
+        done += rv;
+    }
+    
+    return 0;
+}
+
+/* Writes "len" bytes at "offset" */
+static
+int
+__write_full(const int file, const void* buf, const size_t len,
+             const off_t offset)
+{
+    size_t done = 0;
+    
+    while (done < len) {
+        ssize_t rv = pwrite(file, (const char*)buf + done,
+                            len - done, offset + done);
+        
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv < 0) return -errno;
+        
+        done += rv;
+    }
+    
+    return 0;
+}
+
+/* Writes all "iovs_num" buffers at "offset" of the log */
+static
+int
+__write_iovs(struct iovec* iovs, int iovs_num, off_t offset)
+{
+    while (iovs_num > 0) {
+        ssize_t rv = pwritev(log_fd, iovs, iovs_num, offset);
+        
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv < 0) return -errno;
+        
+        offset += rv;
+        
+        // skip what was written, a buffer may be written in part
+        while (iovs_num > 0 && (size_t)rv >= iovs->iov_len) {
+            rv -= iovs->iov_len;
+            iovs += 1;
+            iovs_num -= 1;
+        }
+        
+        if (iovs_num > 0) {
+            iovs->iov_base = (char*)iovs->iov_base + rv;
+            iovs->iov_len -= rv;
+        }
+    }
+    
+    return 0;
+}
+
+/* Writes "head" into its place in the log and waits for it */
+static
+int
+__write_head(ckpt_head* head)
+{
+    head->head_crc = __head_crc(head);
+    
+    char* page = calloc(1, CKPT_HEAD_SIZE);
+    assert(page != NULL);
+    memcpy(page, head, sizeof(ckpt_head));
+    
+    // checkpoints take turns with the two heads
+    off_t at = (head->seq % 2) * CKPT_HEAD_SIZE;
+    int rv = __write_full(log_fd, page, CKPT_HEAD_SIZE, at);
+    free(page);
+    
+    if (rv == 0 && fdatasync(log_fd) < 0) rv = -errno;
+    
+    return rv;
+}
+
+/* Copies the records of "head" from the log into the data file, they are
+   checked first when "check" is set, returns 0 or -ERRNO */
+static
+int
+__apply(const ckpt_head* head, const int check)
+{
+    char* buf = malloc(CKPT_COPY);
+    assert(buf != NULL);
+    
+    int rv = 0;
+    
+    for (int pass = check ? 0 : 1; pass < 2 && rv == 0; ++pass) {
+        off_t at = CKPT_RECORDS;
+        uint32_t crc = 0;
+        
+        for (int64_t ii = 0; ii < head->count && rv == 0; ++ii) {
+            ckpt_record rec;
+            rv = __read_full(log_fd, &rec, sizeof(rec), at);
+            crc = csum_crc32c(crc, &rec, sizeof(rec));
+            at += sizeof(rec);
+            
+            for (int64_t done = 0; done < rec.len && rv == 0; ) {
+                size_t len = (rec.len - done < CKPT_COPY) ? rec.len - done
+                                                          : CKPT_COPY;
+                
+                rv = __read_full(log_fd, buf, len, at);
+                crc = csum_crc32c(crc, buf, len);
+                
+                // first pass only checks the records
+                if (rv == 0 && pass == 1) {
+                    rv = __write_full(fd, buf, len, rec.offset + done);
+                }
+                
+                at += len;
+                done += len;
+            }
+        }
+        
+        if (rv == 0 && pass == 0 && crc != head->records_crc) {
+            rv = -EIO;
+        }
+    }
+    
+    free(buf);
+    
+    if (rv == 0 && fsync(fd) < 0) rv = -errno;
+    
+    return rv;
+}
+
+/* Opens the log of "data_file" and finishes its last checkpoint when the
+   data file does not have it yet, returns 0 or -ERRNO */
+static
+int
+__open_log(const char* data_file, const int create)
+{
+    char path[PATH_MAX];
+    snprintf(path, PATH_MAX, "%s.ckpt", data_file);
+    
+    int flags = O_RDWR | O_CREAT | (create ? O_TRUNC : 0);
+    log_fd = open(path, flags, 0644);
+    if (log_fd < 0) return -errno;
+    
+    memset(&last, 0, sizeof(last));
+    
+    // valid head with the larger number is the last checkpoint
+    for (int ii = 0; ii < 2; ++ii) {
+        ckpt_head head;
+        int rv = __read_full(log_fd, &head, sizeof(head),
+                             ii * CKPT_HEAD_SIZE);
+        if (rv < 0) return rv;
+        
+        if (head.magic != CKPT_MAGIC || head.head_crc != __head_crc(&head)) {
+            continue;
+        }
+        
+        if (head.seq > last.seq) {
+            last = head;
+        }
+    }
+    
+    if (last.seq == 0 || last.applied) {
+        return 0;
+    }
+    
+    trace("|--CKPT: finishing checkpoint %ld\n", last.seq); // log
+    
+    int rv = __apply(&last, 1);
+    if (rv < 0) return rv;
+    
+    last.applied = 1;
+    
+    return __write_head(&last);
+}
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Opens "data_file" whose blocks are written only by checkpoints, creates
+   a sparse one of "create_size" bytes when it is not 0, returns 0 or -ERRNO */
+int
+ckpt_open(const char* data_file, const size_t create_size)
+{
+    int flags = O_RDWR;
+    if (create_size > 0) flags |= O_CREAT | O_TRUNC;
+    
+    fd = open(data_file, flags, 0644);
+    if (fd < 0) return -errno;
+    
+    // the file stays sparse
+    int rv = 0;
+    if (create_size > 0 && ftruncate(fd, create_size) < 0) rv = -errno;
+    
+    if (rv == 0) rv = __open_log(data_file, create_size > 0);
+    
+    if (rv < 0) {
+        if (log_fd >= 0) close(log_fd);
+        close(fd);
+        fd = -1;
+        log_fd = -1;
+        return rv;
+    }
+    
+    log_end = CKPT_RECORDS;
+    pending = 0;
+    pending_crc = 0;
+    
+    trace("|--CKPT: opened %s at checkpoint %ld\n", // log
+          data_file, last.seq);
+    
+    return 0;
+}
+
+/* Closes the data file and its log, writes after the last checkpoint are
+   lost */
+void
+ckpt_close()
+{
+    if (pending > 0) {
+        fprintf(stderr, "|--CKPT: %ld writes after the last checkpoint lost\n",
+                pending);
+    }
+    
+    close(log_fd);
+    close(fd);
+    log_fd = -1;
+    fd = -1;
+}
+
+/* Reads from the data file, writes go into the log until the next
+   checkpoint, returns 0 or -ERRNO of the first failed one */
+int
+ckpt_submit(blkdev_io* ios, const int count)
+{
+    ckpt_record recs[CKPT_BATCH / 2];
+    struct iovec iovs[CKPT_BATCH];
+    int iovs_num = 0;
+    off_t at = log_end;
+    
+    for (int ii = 0; ii < count; ++ii) {
+        if (!ios[ii].write) {
+            int rv = __read_full(fd, ios[ii].buf, ios[ii].len, ios[ii].offset);
+            if (rv < 0) return rv;
+            continue;
+        }
+        
+        ckpt_record* rec = &recs[iovs_num / 2];
+        rec->offset = ios[ii].offset;
+        rec->len = ios[ii].len;
+        
+        pending_crc = csum_crc32c(pending_crc, rec, sizeof(*rec));
+        pending_crc = csum_crc32c(pending_crc, ios[ii].buf, ios[ii].len);
+        pending += 1;
+        
+        iovs[iovs_num++] = (struct iovec){ rec, sizeof(*rec) };
+        iovs[iovs_num++] = (struct iovec){ ios[ii].buf, ios[ii].len };
+        log_end += sizeof(*rec) + ios[ii].len;
+        
+        // log is written in batches of records
+        if (iovs_num == CKPT_BATCH || ii == count - 1) {
+            int rv = __write_iovs(iovs, iovs_num, at);
+            if (rv < 0) return rv;
+            
+            iovs_num = 0;
+            at = log_end;
+        }
+    }
+    
+    // reads after the last write
+    if (iovs_num > 0) {
+        return __write_iovs(iovs, iovs_num, at);
+    }
+    
+    return 0;
+}
+
+/* Takes a checkpoint of everything written since the last one, the data
+   file has all of it or none of it after a crash, returns 0 or -ERRNO */
+int
+ckpt_sync()
+{
+    if (pending == 0) {
+        return 0;
+    }
+    
+    if (fdatasync(log_fd) < 0) return -errno;
+    
+    ckpt_head head = {
+        .magic = CKPT_MAGIC,
+        .applied = 0,
+        .seq = last.seq + 1,
+        .count = pending,
+        .bytes = log_end - CKPT_RECORDS,
+        .records_crc = pending_crc,
+    };
+    
+    // checkpoint is taken once its head is in the log
+    int rv = __write_head(&head);
+    if (rv < 0) return rv;
+    
+    last = head;
+    log_end = CKPT_RECORDS;
+    pending = 0;
+    pending_crc = 0;
+    
+    rv = __apply(&last, 0);
+    if (rv < 0) return rv;
+    
+    last.applied = 1;
+    rv = __write_head(&last);
+    
+    trace("|--CKPT: checkpoint %ld of %ld writes, %ld bytes\n", // log
+          last.seq, last.count, last.bytes);
+    
+    return rv;
+}
@@ -0,0 +1,37 @@
+//
+//  ckpt.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef ckpt_h
+#define ckpt_h
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "blkdev.h"
+
+#define CKPT_MAGIC      0x4f4c434b  // "OLCK" at the heads of a checkpoint log
+#define CKPT_INTERVAL   60          // default seconds between checkpoints
+
+/* One of the two heads of a checkpoint log, the valid one with the larger
+   sequence number is the last checkpoint */
+typedef struct ckpt_head {
+    int             magic;      // CKPT_MAGIC
+    int             applied;    // its blocks are in the data file
+    int64_t         seq;        // number of the checkpoint
+    int64_t         count;      // records of the checkpoint
+    int64_t         bytes;      // bytes of the records
+    uint32_t        records_crc;    // crc32c of the records
+    uint32_t        head_crc;   // crc32c of the head before this field
+} ckpt_head;
+
+int     ckpt_open(const char* data_file, const size_t create_size);
+void    ckpt_close();
+int     ckpt_submit(blkdev_io* ios, const int count);
+int     ckpt_sync();
+
+#endif /* ckpt_h */
@@ -0,0 +1,27 @@
+//
+//  clone.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef clone_h
+#define clone_h
+
+#include <sys/ioctl.h>
+#include <stdint.h>
+
+#define CLONE_PATH_MAX  1024        // longest source path of a clone
+
+/* Copies a range of "src" into the file the ioctl is called on, whole
+   blocks are shared with the source instead of being copied */
+typedef struct olfs_clone {
+    uint64_t    src_off;    // first byte of the source
+    uint64_t    dst_off;    // where it goes in the destination
+    uint64_t    len;        // bytes, 0 copies to the end of the source
+    char        src[CLONE_PATH_MAX];    // source path inside of the mount
+} olfs_clone;
+
+#define OLFS_IOC_CLONE  _IOW('O', 1, olfs_clone)
+
+#endif /* clone_h */
@@ -0,0 +1,578 @@
+//
+//  csum.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "utils.h"
+#include "blkdev.h"
+#include "bcache.h"
+
+#include "csum.h"
+
+
+/* ========================= CONSTANTS ===================================== */
+#define CRC32C_POLY     0x82f63b78  // Castagnoli, bits reversed
+#define SCRUB_BATCH     64          // blocks scrubbed between pauses
+#define SCRUB_PAUSE_NS  10000000    // pause between batches, 10ms
+#define CSUM_PAGES      256         // pages of a paged table kept in memory
+
+/*
+ * Table keeps CRC32C of every data block as it was last written to the
+ * data file, CSUM_NONE for blocks never written with checksums.
+ * Checksums are computed when the block cache writes a block back and
+ * checked when it reads one, blocks in the cache are trusted.
+ *
+ * A mapped disk maps the table with the rest of the data file. Otherwise
+ * its pages are read with blkdev into a few slots of their own, the
+ * block cache can not keep them as it computes checksums while it writes
+ * its own blocks back.
+ */
+
+/* Page of a paged table in memory */
+typedef struct csum_page {
+    int         page;       // page of the table, -1 for a free slot
+    int         dirty;      // changed since it was read
+    int         used;       // looked at since the clock passed it
+    uint32_t*   sums;
+} csum_page;
+
+
+/* ========================= VARIABLES ===================================== */
+static uint32_t*        table;      // checksums of a mapped disk, or NULL
+static csum_page*       pages;      // slots of a paged table, or NULL
+static int*             slots;      // slot of every page, -1 if not in one
+static int              page_num;   // slots
+static int              page_sums;  // checksums in a page
+static int              hand;       // slot the clock looks at next
+static off_t            table_off;  // where a paged table is in the file
+static char*            page_buf;   // memory of all slots
+static pthread_mutex_t  table_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t           first;      // block of the first checksum
+static int              blocks;     // checksums in the table
+static int              bsize;
+static int              verify;     // check blocks read by the cache
+
+static uint32_t         crc_table[256];
+static uint32_t         (*crc_fn)(uint32_t, const void*, size_t);
+static pthread_once_t   crc_once = PTHREAD_ONCE_INIT;
+
+// counters for the stats
+static size_t           verified;
+static size_t           errors;
+static size_t           scrub_passes;
+static size_t           scrub_blocks;
+static int              bad[CSUM_BAD_MAX];  // data blocks which failed last
+static int              bad_num;
+
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   wake = PTHREAD_COND_INITIALIZER;
+static pthread_t        scrubber;
+static int              interval;   // seconds between scrub passes
+static int              running;
+
+
+
+
+/* ==================== LOCAL HELPERS ===================================== */
+/* Computes CRC32C a byte at a time */
+static
+uint32_t
+__crc_soft(uint32_t crc, const void* data, size_t len)
+{
+    const unsigned char* pp = data;
+    
+    while (len-- > 0) {
+        crc = crc_table[(crc ^ *pp++) & 0xff] ^ (crc >> 8);
+    }
+    
+    return crc;
+}
+
+#if defined(__x86_64__)
+/* Computes CRC32C eight bytes at a time with the SSE4.2 instruction */
+__attribute__((target("sse4.2")))
+static
+uint32_t
+__crc_sse42(uint32_t crc, const void* data, size_t len)
+{
+    const unsigned char* pp = data;
+    uint64_t crc64 = crc;
+    
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, pp, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        pp += sizeof(word);
+    }
+    
+    crc = (uint32_t)crc64;
+    while (len-- > 0) {
+        crc = _mm_crc32_u8(crc, *pp++);
+    }
+    
+    return crc;
+}
+#endif
+
+/* Picks the fastest CRC32C the CPU has */
+static
+void
+__crc_setup()
+{
+    for (uint32_t ii = 0; ii < 256; ++ii) {
+        uint32_t crc = ii;
+        
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        
+        crc_table[ii] = crc;
+    }
+    
+    crc_fn = __crc_soft;
+
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_fn = __crc_sse42;
+    }
+#endif
+}
+
+/* Remembers that data block "dno" failed its check */
+static
+void
+__record_bad(const int dno)
+{
+    pthread_mutex_lock(&lock);
+    
+    errors += 1;
+    
+    int known = 0;
+    for (int ii = 0; ii < bad_num; ++ii) {
+        known |= (bad[ii] == dno);
+    }
+    
+    // oldest ones are forgotten first
+    if (!known) {
+        if (bad_num == CSUM_BAD_MAX) {
+            memmove(bad, bad + 1, (CSUM_BAD_MAX - 1) * sizeof(int));
+            bad_num -= 1;
+        }
+        
+        bad[bad_num++] = dno;
+    }
+    
+    pthread_mutex_unlock(&lock);
+    
+    fprintf(stderr, "|--CSUM: data block %d does not match its checksum\n",
+            dno);
+}
+
+/* Reads page "page" of the table into a slot, the clock takes the slot
+   of a page not looked at since it passed last, returns the slot */
+static
+int
+__page_in(const int page)
+{
+    while (pages[hand].used) {
+        pages[hand].used = 0;
+        hand = (hand + 1) % page_num;
+    }
+    
+    int slot = hand;
+    csum_page* victim = &pages[slot];
+    hand = (hand + 1) % page_num;
+    
+    if (victim->page >= 0) {
+        if (victim->dirty) {
+            int rv = blkdev_write(victim->sums, bsize,
+                                  table_off + (off_t)victim->page * bsize);
+            assert(rv == 0);
+        }
+        
+        slots[victim->page] = -1;
+    }
+    
+    int rv = blkdev_read(victim->sums, bsize, table_off + (off_t)page * bsize);
+    assert(rv == 0);
+    
+    victim->page = page;
+    victim->dirty = 0;
+    slots[page] = slot;
+    
+    return slot;
+}
+
+/* Returns the checksum of the "ii"-th block of the table, the page of
+   a paged table is marked changed when "write" is set, table_lock has
+   to be held */
+static
+uint32_t*
+__entry(const size_t ii, const int write)
+{
+    if (table != NULL) {
+        return table + ii;
+    }
+    
+    int page = ii / page_sums;
+    int slot = slots[page];
+    
+    if (slot < 0) {
+        slot = __page_in(page);
+    }
+    
+    pages[slot].used = 1;
+    pages[slot].dirty |= write;
+    
+    return pages[slot].sums + ii % page_sums;
+}
+
+/* Returns the checksum of the "ii"-th block of the table */
+static
+uint32_t
+__sum_of(const size_t ii)
+{
+    pthread_mutex_lock(&table_lock);
+    uint32_t sum = *__entry(ii, 0);
+    pthread_mutex_unlock(&table_lock);
+    
+    return sum;
+}
+
+/* Resets the counters of a new table of "count" blocks */
+static
+void
+__init(const size_t first_blk, const int count, const int block_size,
+       const int verify_reads)
+{
+    pthread_once(&crc_once, __crc_setup);
+    
+    first = first_blk;
+    blocks = count;
+    bsize = block_size;
+    verify = verify_reads;
+    
+    verified = 0;
+    errors = 0;
+    scrub_passes = 0;
+    scrub_blocks = 0;
+    bad_num = 0;
+    
+    trace("|--CSUM: checksums of %d blocks with %s%s\n", count, // log
+          (crc_fn == __crc_soft) ? "a table" : "SSE4.2",
+          verify ? ", verified on read" : "");
+}
+
+/* Reads every checksummed block which is not cached, one pass after
+   another, pauses between batches so operations keep the disk */
+static
+void*
+__scrubber_main(void* arg)
+{
+    void* buf = blkdev_alloc(bsize);
+    struct timespec pause = { 0, SCRUB_PAUSE_NS };
+    
+    pthread_mutex_lock(&lock);
+    
+    while (running) {
+        pthread_mutex_unlock(&lock);
+        
+        int done = 0;
+        for (int ii = 0; ii < blocks && running; ++ii) {
+            if (__sum_of(ii) == CSUM_NONE) {
+                continue;
+            }
+            
+            bcache_scrub(first + ii, buf);
+            done += 1;
+            
+            if (done % SCRUB_BATCH == 0) {
+                nanosleep(&pause, NULL);
+            }
+        }
+        
+        pthread_mutex_lock(&lock);
+        
+        scrub_passes += 1;
+        scrub_blocks += done;
+        trace("|--CSUM: scrubbed %d blocks, %zu errors so far\n", // log
+              done, errors);
+        
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval;
+        
+        int rv = 0;
+        while (running && rv != ETIMEDOUT) {
+            rv = pthread_cond_timedwait(&wake, &lock, &deadline);
+        }
+    }
+    
+    pthread_mutex_unlock(&lock);
+    free(buf);
+    
+    return NULL;
+}
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Continues CRC32C "crc" over "len" bytes of "data" */
+uint32_t
+csum_crc32c(uint32_t crc, const void* data, const size_t len)
+{
+    pthread_once(&crc_once, __crc_setup);
+    
+    return ~crc_fn(~crc, data, len);
+}
+
+/* Returns the checksum stored for a block of "data", never CSUM_NONE */
+uint32_t
+csum_block(const void* data, const int block_size)
+{
+    uint32_t sum = csum_crc32c(0, data, block_size);
+    
+    return (sum == CSUM_NONE) ? 1 : sum;
+}
+
+/* Keeps checksums of "count" blocks from "first_blk" in the mapped
+   "sums", blocks read through the cache are checked when "verify_reads"
+   is set */
+void
+csum_init(uint32_t* sums, const size_t first_blk, const int count,
+          const int block_size, const int verify_reads)
+{
+    assert(sums != NULL);
+    
+    table = sums;
+    __init(first_blk, count, block_size, verify_reads);
+}
+
+/* Keeps checksums like csum_init() in the table at "sums_off" of the data
+   file, a few of its pages are kept in memory, all of them with
+   "keep_all" which leaves their writes to csum_sync() */
+void
+csum_init_paged(const off_t sums_off, const size_t first_blk,
+                const int count, const int block_size,
+                const int verify_reads, const int keep_all)
+{
+    int sums_per_page = block_size / sizeof(uint32_t);
+    int table_pages = div_up(count, sums_per_page);
+    
+    table_off = sums_off;
+    page_sums = sums_per_page;
+    page_num = keep_all ? table_pages : min(CSUM_PAGES, table_pages);
+    hand = 0;
+    
+    page_buf = blkdev_alloc((size_t)page_num * block_size);
+    pages = malloc(page_num * sizeof(csum_page));
+    slots = malloc(table_pages * sizeof(int));
+    assert(pages != NULL && slots != NULL);
+    
+    for (int ii = 0; ii < page_num; ++ii) {
+        char* sums = page_buf + (size_t)ii * block_size;
+        pages[ii] = (csum_page){ -1, 0, 0, (uint32_t*)sums };
+    }
+    
+    for (int ii = 0; ii < table_pages; ++ii) {
+        slots[ii] = -1;
+    }
+    
+    __init(first_blk, count, block_size, verify_reads);
+}
+
+/* Writes the changed pages of a paged table, returns 0 or -ERRNO */
+int
+csum_sync()
+{
+    int rv = 0;
+    
+    pthread_mutex_lock(&table_lock);
+    
+    for (int ii = 0; pages != NULL && ii < page_num; ++ii) {
+        if (pages[ii].page < 0 || !pages[ii].dirty) {
+            continue;
+        }
+        
+        int err = blkdev_write(pages[ii].sums, bsize,
+                               table_off + (off_t)pages[ii].page * bsize);
+        
+        if (err < 0 && rv == 0) rv = err;
+        if (err == 0) pages[ii].dirty = 0;
+    }
+    
+    pthread_mutex_unlock(&table_lock);
+    
+    return rv;
+}
+
+/* Forgets the table, blocks are not checksummed any more, changed pages
+   of a paged one have to be written by csum_sync() before */
+void
+csum_stop()
+{
+    assert(!running);
+    
+    table = NULL;
+    
+    free(pages);
+    free(slots);
+    free(page_buf);
+    pages = NULL;
+    slots = NULL;
+    page_buf = NULL;
+}
+
+/* Are checksums kept? */
+int
+csum_active()
+{
+    return table != NULL || pages != NULL;
+}
+
+/* Are blocks read by the cache checked? */
+int
+csum_verifies()
+{
+    return csum_active() && verify;
+}
+
+/* Stores the checksum of "data" written as block "blk" */
+void
+csum_update(const size_t blk, const void* data)
+{
+    if (!csum_active() || blk < first || blk - first >= (size_t)blocks) {
+        return;
+    }
+    
+    uint32_t sum = csum_block(data, bsize);
+    
+    pthread_mutex_lock(&table_lock);
+    *__entry(blk - first, 1) = sum;
+    pthread_mutex_unlock(&table_lock);
+}
+
+/* Forgets the checksum of block "blk" */
+void
+csum_clear(const size_t blk)
+{
+    if (!csum_active() || blk < first || blk - first >= (size_t)blocks) {
+        return;
+    }
+    
+    pthread_mutex_lock(&table_lock);
+    
+    // pages of the table which were never written stay untouched
+    if (*__entry(blk - first, 0) != CSUM_NONE) {
+        *__entry(blk - first, 1) = CSUM_NONE;
+    }
+    
+    pthread_mutex_unlock(&table_lock);
+}
+
+/* Checks "data" read as block "blk", returns 0 or -EIO */
+int
+csum_check(const size_t blk, const void* data)
+{
+    if (!csum_active() || blk < first || blk - first >= (size_t)blocks) {
+        return 0;
+    }
+    
+    uint32_t sum = __sum_of(blk - first);
+    if (sum == CSUM_NONE) {
+        return 0;
+    }
+    
+    __sync_fetch_and_add(&verified, 1);
+    
+    if (csum_block(data, bsize) == sum) {
+        return 0;
+    }
+    
+    __record_bad(blk - first);
+    
+    return -EIO;
+}
+
+/* Starts reading all blocks in the background every "interval" seconds */
+void
+csum_scrub_start(const int scrub_interval)
+{
+    assert(scrub_interval > 0);
+    
+    if (!csum_active()) {
+        trace("|--CSUM: no checksums to scrub\n"); // log
+        return;
+    }
+    
+    interval = scrub_interval;
+    running = 1;
+    
+    int rv = pthread_create(&scrubber, NULL, __scrubber_main, NULL);
+    assert(rv == 0);
+}
+
+/* Stops the scrubber, it finishes the block it reads */
+void
+csum_scrub_stop()
+{
+    if (!running) {
+        return;
+    }
+    
+    pthread_mutex_lock(&lock);
+    running = 0;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    
+    pthread_join(scrubber, NULL);
+}
+
+/* Writes the counters as text into "buf", returns their length, only the
+   length when "size" is 0 and -ERANGE when they do not fit */
+int
+csum_stats(char* buf, const size_t size)
+{
+    char text[256 + CSUM_BAD_MAX * 12];
+    
+    pthread_mutex_lock(&lock);
+    
+    int len = snprintf(text, sizeof(text),
+                       "checksums %s\n"
+                       "verified %zu\n"
+                       "errors %zu\n"
+                       "scrub_passes %zu\n"
+                       "scrubbed %zu\n"
+                       "bad_blocks",
+                       !csum_active() ? "off" : verify ? "verify" : "on",
+                       verified, errors, scrub_passes, scrub_blocks);
+    
+    for (int ii = 0; ii < bad_num; ++ii) {
+        len += snprintf(text + len, sizeof(text) - len, " %d", bad[ii]);
+    }
+    
+    len += snprintf(text + len, sizeof(text) - len, "\n");
+    
+    pthread_mutex_unlock(&lock);
+    
+    if (size == 0) return len;
+    if (size < (size_t)len) return -ERANGE;
+    
+    memcpy(buf, text, len);
+    
+    return len;
+}
@@ -0,0 +1,39 @@
+//
+//  csum.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef csum_h
+#define csum_h
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define CSUM_NONE       0           // block was never written with a checksum
+#define CSUM_BAD_MAX    64          // bad blocks remembered for the stats
+
+uint32_t    csum_crc32c(uint32_t crc, const void* data, const size_t len);
+uint32_t    csum_block(const void* data, const int block_size);
+
+void        csum_init(uint32_t* table, const size_t first_blk,
+                      const int count, const int block_size, const int verify);
+void        csum_init_paged(const off_t sums_off, const size_t first_blk,
+                            const int count, const int block_size,
+                            const int verify, const int keep_all);
+int         csum_sync();
+void        csum_stop();
+int         csum_active();
+int         csum_verifies();
+
+void        csum_update(const size_t blk, const void* data);
+void        csum_clear(const size_t blk);
+int         csum_check(const size_t blk, const void* data);
+
+void        csum_scrub_start(const int interval);
+void        csum_scrub_stop();
+int         csum_stats(char* buf, const size_t size);
+
+#endif /* csum_h */
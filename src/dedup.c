@@ -0,0 +1,128 @@
+//
+//  dedup.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "dedup.h"
+
+
+/* ========================= VARIABLES ===================================== */
+/* Data block which was written with the given content */
+typedef struct dedup_entry {
+    uint64_t    hash;       // hash of the block content
+    int         dno;        // block which had it, -1 for an empty slot
+    int         _reserved;
+} dedup_entry;
+
+static int              active;
+static int              bsize;
+
+// index is a cache, a new block takes the slot of an old one
+static dedup_entry*     entries;
+static size_t           entry_mask;
+
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Starts indexing content of "dnum" data blocks of "block_size" bytes */
+void
+dedup_init(const int dnum, const int block_size)
+{
+    bsize = block_size;
+    
+    // one slot per block up to the largest index
+    size_t entries_num = 1;
+    while (entries_num < (size_t)dnum && entries_num < DEDUP_MAX_ENTRIES) {
+        entries_num <<= 1;
+    }
+    
+    entries = malloc(entries_num * sizeof(dedup_entry));
+    assert(entries != NULL);
+    entry_mask = entries_num - 1;
+    
+    for (size_t ii = 0; ii < entries_num; ++ii) {
+        entries[ii].dno = -1;
+    }
+    
+    active = 1;
+    
+    trace("|--DEDUP: indexing up to %ld blocks\n", entries_num); // log
+}
+
+/* Drops the index */
+void
+dedup_stop()
+{
+    if (!active) {
+        return;
+    }
+    
+    free(entries);
+    entries = NULL;
+    active = 0;
+}
+
+/* Are written blocks looked up in the index? */
+int
+dedup_active()
+{
+    return active;
+}
+
+/* Returns hash of the content of a data block */
+uint64_t
+dedup_hash(const char* data)
+{
+    uint64_t hash = 0xcbf29ce484222325ull ^ (uint64_t)bsize;
+    
+    // eight bytes at a time, block sizes are multiples of 512
+    for (int ii = 0; ii < bsize; ii += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + ii, sizeof(word));
+        
+        hash ^= word;
+        hash *= 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 29;
+    }
+    
+    return hash;
+}
+
+/* Returns block which was written with content of "hash", -1 if none,
+   the caller compares the content, the block could have changed since */
+int
+dedup_find(const uint64_t hash)
+{
+    pthread_mutex_lock(&lock);
+    
+    dedup_entry* entry = &entries[hash & entry_mask];
+    int dno = (entry->dno >= 0 && entry->hash == hash) ? entry->dno : -1;
+    
+    pthread_mutex_unlock(&lock);
+    
+    return dno;
+}
+
+/* Remembers that block "dno" was written with content of "hash" */
+void
+dedup_insert(const uint64_t hash, const int dno)
+{
+    pthread_mutex_lock(&lock);
+    
+    dedup_entry* entry = &entries[hash & entry_mask];
+    entry->hash = hash;
+    entry->dno = dno;
+    
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,24 @@
+//
+//  dedup.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef dedup_h
+#define dedup_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define DEDUP_MAX_ENTRIES   (1 << 20)   // largest content index
+
+void        dedup_init(const int dnum, const int block_size);
+void        dedup_stop();
+int         dedup_active();
+
+uint64_t    dedup_hash(const char* data);
+int         dedup_find(const uint64_t hash);
+void        dedup_insert(const uint64_t hash, const int dno);
+
+#endif /* dedup_h */
@@ -9,6 +9,7 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <string.h>
+#include <errno.h>
 #include <math.h>
 #include <assert.h>
 
@@ -18,8 +19,9 @@
 #include "directory.h"
 
 
-static const int DENTRY_COUNT =  BLOCK_SIZE / sizeof(dentry);
 static void dir_print(inode* dir);
+static void dir_init_block(dentry* entries);
+static int  dir_name_eq(dentry* entry, const char* name, int len);
 
 
 /* Initializes directory */
@@ -29,15 +31,44 @@ dir_init(inode* dir, int parent_ino)
     assert(dir != NULL);
     assert(parent_ino >= 0);
     
-    dblock* block = disk_get_dblock(dir->dptrs[0]);
-    dentry* entries = (dentry*)block;
+    dentry* entries = dir_get_dentry(dir, 0);
+    
+    // clean all entries
+    dir_init_block(entries);
     
     // add perent directory
     strcpy(entries[0].iname, "..");
     entries[0].ino = parent_ino;
+}
+
+/* Returns number of entries in one directory block */
+int
+dir_dentry_count()
+{
+    return disk_block_size() / sizeof(dentry);
+}
+
+/* Returns entries stored in the "blk"-th block of the directory */
+dentry*
+dir_get_dentry(inode* dir, int blk)
+{
+    assert(dir != NULL);
+    assert(blk >= 0 && blk < dir->dnum);
     
-    // clean all other entries
-    for (int ii = 1; ii < DENTRY_COUNT; ++ii) {
+    int dno = disk_map_block(dir, blk, 0);
+    assert(dno >= 0);
+    
+    return (dentry*)disk_get_dblock(dno);
+}
+
+/* Marks all entries of a new directory block as free */
+static
+void
+dir_init_block(dentry* entries)
+{
+    int count = dir_dentry_count();
+    
+    for (int ii = 0; ii < count; ++ii) {
         entries[ii].ino = -1;
     }
 }
@@ -58,46 +89,137 @@ dir_get_ino(inode* dir, const char* iname)
     assert(dir != NULL);
     assert(iname != NULL);
     
-    printf("| --- iname: %s\n", iname); // log
-    
-    dir_print(dir); // log
+    return dir_lookup(dir, iname, strlen(iname));
+}
+
+/* Is the name in the entry equal to "len" bytes of the "name"? */
+static
+int
+dir_name_eq(dentry* entry, const char* name, int len)
+{
+    return entry->ino != -1
+        && strncmp(entry->iname, name, len) == 0
+        && entry->iname[len] == '\0';
+}
+
+/* Returns ino of the entry named by "len" bytes of "name", otherwise -1 */
+int
+dir_lookup(inode* dir, const char* name, int len)
+{
+    assert(dir != NULL);
+    assert(name != NULL);
     
-    dblock* block = disk_get_dblock(dir->dptrs[0]);
-    dentry* entries = (dentry*)block;
+    int count = dir_dentry_count();
     
-    for (int ii = 0; ii < DENTRY_COUNT; ++ii) {
-        if (streq(entries[ii].iname, iname)) {
-            return entries[ii].ino;
+    for (int blk = 0; blk < dir->dnum; ++blk) {
+        dentry* entries = dir_get_dentry(dir, blk);
+        
+        for (int ii = 0; ii < count; ++ii) {
+            if (dir_name_eq(&entries[ii], name, len)) {
+                return entries[ii].ino;
+            }
         }
     }
     
     return -1;
 }
 
+/* Has the directory no entries except of the parent? */
+int
+dir_is_empty(inode* dir)
+{
+    assert(dir != NULL);
+    
+    int count = dir_dentry_count();
+    
+    for (int blk = 0; blk < dir->dnum; ++blk) {
+        dentry* entries = dir_get_dentry(dir, blk);
+        
+        for (int ii = 0; ii < count; ++ii) {
+            if (entries[ii].ino != -1 && !streq(entries[ii].iname, "..")) {
+                return 0;
+            }
+        }
+    }
+    
+    return 1;
+}
+
+/* Points parent entry of the directory to "parent_ino" */
+void
+dir_set_parent(inode* dir, int parent_ino)
+{
+    assert(dir != NULL);
+    assert(parent_ino >= 0);
+    
+    dentry* entries = dir_get_dentry(dir, 0);
+    entries[0].ino = parent_ino;
+}
+
+/* Returns ino of the parent directory, the root is its own parent */
+int
+dir_get_parent(inode* dir)
+{
+    assert(dir != NULL);
+    
+    dentry* entries = dir_get_dentry(dir, 0);
+    return entries[0].ino;
+}
+
 /* Adds inode to the directory */
 void
 dir_add_inode(inode* dir, int ino, const char* iname)
 {
-    assert(dir != NULL);
     assert(iname != NULL);
+    
+    dir_add_name(dir, ino, iname, strlen(iname));
+}
+
+/* Adds inode named by "len" bytes of "name", returns 0 or -ENOSPC */
+int
+dir_add_name(inode* dir, int ino, const char* name, int len)
+{
+    assert(dir != NULL);
+    assert(name != NULL);
     assert(ino >= 0);
+    assert(len <= INAME_MAX);
     
-    printf("| --- iname: %s\n", iname); // log
+    int count = dir_dentry_count();
+    dentry* entries = NULL;
+    int free_ii = -1;
     
-    dblock* block = disk_get_dblock(dir->dptrs[0]);
-    dentry* entries = (dentry*)block;
+    // look for a free entry in the existing blocks
+    for (int blk = 0; blk < dir->dnum && free_ii < 0; ++blk) {
+        entries = dir_get_dentry(dir, blk);
+        
+        for (int ii = 0; ii < count; ++ii) {
+            if (entries[ii].ino == -1) {
+                free_ii = ii;
+                break;
+            }
+        }
+    }
     
-    for (int ii = 0; ii < DENTRY_COUNT; ++ii) {
-        if (entries[ii].ino == -1) {
-            strcpy(entries[ii].iname, iname);
-            entries[ii].ino = ino;
-            
-            printf("| --- iname: %s, ino: %d\n",     // log
-                   entries[ii].iname, entries[ii].ino);
-            
-            return;
+    // all blocks are full, grow the directory by one block
+    if (free_ii < 0) {
+        int dno = disk_map_block(dir, dir->dnum, 1);
+        if (dno < 0) {
+            return -ENOSPC;
         }
+        
+        entries = (dentry*)disk_get_dblock(dno);
+        dir_init_block(entries);
+        free_ii = 0;
     }
+    
+    memcpy(entries[free_ii].iname, name, len);
+    entries[free_ii].iname[len] = '\0';
+    entries[free_ii].ino = ino;
+    
+    trace("| --- iname: %s, ino: %d\n",      // log
+          entries[free_ii].iname, entries[free_ii].ino);
+    
+    return 0;
 }
 
 /* Deletes inode from the directory */
@@ -107,13 +229,37 @@ dir_delete_inode(inode* dir, int ino)
     assert(dir != NULL);
     assert(ino >= 0);
     
-    dblock* block = disk_get_dblock(dir->dptrs[0]);
-    dentry* entries = (dentry*)block;
+    int count = dir_dentry_count();
+    
+    for (int blk = 0; blk < dir->dnum; ++blk) {
+        dentry* entries = dir_get_dentry(dir, blk);
+        
+        for (int ii = 0; ii < count; ++ii) {
+            if (entries[ii].ino == ino) {
+                entries[ii].ino = -1;
+                return;
+            }
+        }
+    }
+}
+
+/* Deletes entry named by "len" bytes of "name" from the directory */
+void
+dir_delete_name(inode* dir, const char* name, int len)
+{
+    assert(dir != NULL);
+    assert(name != NULL);
+    
+    int count = dir_dentry_count();
     
-    for (int ii = 0; ii < DENTRY_COUNT; ++ii) {
-        if (entries[ii].ino == ino) {
-            entries[ii].ino = -1;
-            return;
+    for (int blk = 0; blk < dir->dnum; ++blk) {
+        dentry* entries = dir_get_dentry(dir, blk);
+        
+        for (int ii = 0; ii < count; ++ii) {
+            if (dir_name_eq(&entries[ii], name, len)) {
+                entries[ii].ino = -1;
+                return;
+            }
         }
     }
 }
@@ -125,10 +271,9 @@ dir_print(inode* dir)
 {
     assert(dir != NULL);
     
-    dblock* block = disk_get_dblock(dir->dptrs[0]);
-    dentry* entries = (dentry*)block;
+    dentry* entries = dir_get_dentry(dir, 0);
     
-    // change to DENTRY_COUNT to print all
+    // change to dir_dentry_count() to print all
     int max = 5;
     for (int ii = 0; ii < max; ++ii) {
         printf("| --- iname: %s, ino: %d\n",     // log
@@ -11,6 +11,8 @@
 #include <stdio.h>
 #include "disk.h"
 
+#define INAME_MAX 47    // longest name which fits in a dentry
+
 typedef struct dentry {
     char iname[48];
     int  ino;
@@ -20,8 +22,15 @@ typedef struct dentry {
 void    dir_init(inode* dir, int parent_ino);
 int     is_dir(inode* node);
 int     dir_get_ino(inode* dir, const char* iname);
+int     dir_lookup(inode* dir, const char* name, int len);
+int     dir_is_empty(inode* dir);
+void    dir_set_parent(inode* dir, int parent_ino);
+int     dir_get_parent(inode* dir);
 void    dir_delete_inode(inode* dir, int ino);
+void    dir_delete_name(inode* dir, const char* name, int len);
 void    dir_add_inode(inode* dir, int ino, const char* iname);
-dentry* dir_get_dentry(inode* dir);
+int     dir_add_name(inode* dir, int ino, const char* name, int len);
+dentry* dir_get_dentry(inode* dir, int blk);
+int     dir_dentry_count();
 
 #endif /* directory_h */
@@ -0,0 +1,267 @@
+//
+//  discard.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "group.h"
+#include "bcache.h"
+#include "csum.h"
+
+#include "discard.h"
+
+
+/* ========================= CONSTANTS ===================================== */
+#define DISCARD_QUEUE   1024        // freed ranges waiting for the trim thread
+
+static const int TRIM_INTERVAL = 1; // seconds between passes of the thread
+
+/*
+ * Freed data blocks are punched out of the data file with fallocate, the
+ * host gets their space back and they read as zeroes. Blocks are punched
+ * before they go back to their group in the inline mode, the trim thread
+ * punches only the blocks of a range which are still free when it gets to
+ * it. Blocks an operation has in the cache are skipped.
+ */
+
+
+/* ========================= VARIABLES ===================================== */
+typedef struct discard_range {
+    int         dno;        // first freed block
+    int         count;      // blocks in the range
+} discard_range;
+
+static discard_mode     mode = DISCARD_OFF;
+static int              fd = -1;
+static off_t            start;      // offset of the first data block
+static size_t           first_blk;  // block of the data file of dno 0
+static int              bsize;
+
+// ranges freed since the last pass of the trim thread
+static discard_range    queue[DISCARD_QUEUE];
+static int              queued;
+
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   wake = PTHREAD_COND_INITIALIZER;
+static pthread_t        trimmer;
+static int              running;
+
+
+
+
+/* ==================== LOCAL HELPERS ===================================== */
+/* Punches "count" blocks from "dno" on out of the data file */
+static
+void
+__punch_range(const int dno, const int count)
+{
+    int flags = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+    
+    if (fallocate(fd, flags, start + (off_t)dno * bsize,
+                  (off_t)count * bsize) < 0) {
+        fprintf(stderr, "|--DISCARD: punching failed (%d), stopped\n",
+                -errno);
+        mode = DISCARD_OFF;
+        return;
+    }
+    
+    // holes read as zeroes, old checksums would not match them
+    for (int ii = 0; ii < count; ++ii) {
+        csum_clear(first_blk + dno + ii);
+    }
+}
+
+/* Punches freed blocks out, blocks an operation still has are skipped */
+static
+void
+__punch(const int dno, const int count)
+{
+    int from = dno;
+    
+    for (int blk = dno; blk <= dno + count; ++blk) {
+        int end = (blk == dno + count);
+        
+        if (!end && bcache_forget(first_blk + blk) == 0) {
+            continue;
+        }
+        
+        if (blk > from && mode != DISCARD_OFF) {
+            __punch_range(from, blk - from);
+        }
+        
+        from = blk + 1;
+    }
+}
+
+/* Punches the blocks of "ranges" which are still free */
+static
+void
+__trim(const discard_range* ranges, const int count)
+{
+    for (int ii = 0; ii < count; ++ii) {
+        group_trim(ranges[ii].dno, ranges[ii].count, __punch);
+    }
+}
+
+/* Punches freed ranges every TRIM_INTERVAL seconds or when the queue
+   gets half full */
+static
+void*
+__trimmer_main(void* arg)
+{
+    static discard_range taken[DISCARD_QUEUE];
+    
+    pthread_mutex_lock(&lock);
+    
+    while (running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += TRIM_INTERVAL;
+        
+        pthread_cond_timedwait(&wake, &lock, &deadline);
+        
+        // blocks are freed meanwhile into an empty queue
+        int count = queued;
+        memcpy(taken, queue, count * sizeof(discard_range));
+        queued = 0;
+        
+        pthread_mutex_unlock(&lock);
+        __trim(taken, count);
+        pthread_mutex_lock(&lock);
+    }
+    
+    pthread_mutex_unlock(&lock);
+    
+    return NULL;
+}
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Starts punching freed blocks of "data_file" out of it, its data blocks
+   start at "data_start", returns 0 or -ERRNO */
+int
+discard_init(const char* data_file, const discard_mode discard,
+             const off_t data_start, const int block_size)
+{
+    mode = DISCARD_OFF;
+    
+    if (discard == DISCARD_OFF) {
+        return 0;
+    }
+    
+    fd = open(data_file, O_RDWR);
+    if (fd < 0) return -errno;
+    
+    mode = discard;
+    start = data_start;
+    bsize = block_size;
+    first_blk = data_start / block_size;
+    queued = 0;
+    
+    trace("|--DISCARD: freed blocks are punched out %s\n", // log
+          (mode == DISCARD_ASYNC) ? "by a trim thread" : "right away");
+    
+    return 0;
+}
+
+/* Starts the trim thread of DISCARD_ASYNC, a process which forks after
+   the mount calls it in the child, ranges wait in the queue until then */
+void
+discard_start()
+{
+    if (mode != DISCARD_ASYNC) {
+        return;
+    }
+    
+    running = 1;
+    
+    int rv = pthread_create(&trimmer, NULL, __trimmer_main, NULL);
+    assert(rv == 0);
+}
+
+/* Stops the trim thread, ranges it did not get to are punched now */
+void
+discard_stop()
+{
+    pthread_mutex_lock(&lock);
+    
+    int thread = running;
+    running = 0;
+    
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    
+    if (thread) {
+        pthread_join(trimmer, NULL);
+    }
+    
+    pthread_mutex_lock(&lock);
+    __trim(queue, queued);
+    queued = 0;
+    pthread_mutex_unlock(&lock);
+    
+    if (fd >= 0) {
+        close(fd);
+    }
+    
+    fd = -1;
+    mode = DISCARD_OFF;
+}
+
+/* Gives "count" blocks from "dno" on which are about to be freed to the
+   discard mode */
+void
+discard_blocks(const int dno, const int count)
+{
+    if (mode == DISCARD_OFF) {
+        return;
+    }
+    
+    // blocks are still ours, nobody can take them meanwhile
+    if (mode == DISCARD_INLINE) {
+        __punch(dno, count);
+        return;
+    }
+    
+    pthread_mutex_lock(&lock);
+    
+    discard_range* last = (queued > 0) ? &queue[queued - 1] : NULL;
+    
+    // run freed right after the last one makes it longer
+    if (last != NULL && last->dno + last->count == dno) {
+        last->count += count;
+    }
+    
+    else {
+        // full queue is punched by the thread which freed the blocks
+        if (queued == DISCARD_QUEUE) {
+            __trim(queue, queued);
+            queued = 0;
+        }
+        
+        queue[queued].dno = dno;
+        queue[queued].count = count;
+        queued += 1;
+    }
+    
+    if (queued >= DISCARD_QUEUE / 2) {
+        pthread_cond_signal(&wake);
+    }
+    
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,27 @@
+//
+//  discard.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef discard_h
+#define discard_h
+
+#include <sys/types.h>
+#include <stdio.h>
+
+/* What happens to the space of freed data blocks in the data file */
+typedef enum discard_mode {
+    DISCARD_OFF,        // it stays allocated with the old data
+    DISCARD_INLINE,     // it is punched out as the blocks are freed
+    DISCARD_ASYNC,      // freed ranges are punched out by a trim thread
+} discard_mode;
+
+int     discard_init(const char* data_file, const discard_mode mode,
+                     const off_t data_start, const int block_size);
+void    discard_start();
+void    discard_stop();
+void    discard_blocks(const int dno, const int count);
+
+#endif /* discard_h */
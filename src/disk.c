@@ -8,8 +8,13 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <unistd.h>
+#include <stdint.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <string.h>
 #include <time.h>
@@ -20,6 +25,18 @@
 #include "utils.h"
 #include "bmap.h"
 #include "directory.h"
+#include "atime.h"
+#include "group.h"
+#include "blkdev.h"
+#include "bcache.h"
+#include "readahead.h"
+#include "lz.h"
+#include "dedup.h"
+#include "csum.h"
+#include "discard.h"
+#include "stripe.h"
+#include "tier.h"
+#include "ckpt.h"
 
 #include "disk.h"
 
@@ -33,307 +50,376 @@ const int DIRECTORY_MODE = S_IFDIR | 0755;
 const int FILE_MODE = S_IFREG | 0644;
 const int SYMLINK_MODE = S_IFLNK | 0777;
 
+#define PREFETCH_BATCH  64          // blocks read by the cache at once
+#define RECLAIM_BATCH   4096        // blocks an orphan loses at once
+#define COMPACT_BATCH   256         // blocks compaction moves at once
+#define EVICT_CKPT_GAP  100         // ms at least between checkpoints
+                                    // evictions ask for
+#define TOUCH_CHUNK     256         // data blocks of a mapped disk whose
+                                    // checksums are refreshed together
+#define HUGE_MIN_DISK   (512 * HUGE_PAGE_SIZE)  // smallest disk whose
+                                                // regions are aligned
+#define COMPRESS_XATTR  "user.olfs.compress"    // "1" compresses new clusters
+#define STATS_XATTR     "user.olfs.stats"       // counters, on the root only
+#define COMPACT_XATTR   "user.olfs.compact"     // set on the root to compact
+#define CHECKPOINT_XATTR "user.olfs.checkpoint" // set on the root to checkpoint
+
 
 /* ========================= VARIABLES ===================================== */
 // pointers to disk structures in allocated memmory
 static char*    imap;       // bitmap for inodes
-static char*    iptr;       // inodes
+static char*    iptr;       // inodes, NULL when read through the cache
 static char*    dmap;       // bitmap for data blocks
-static char*    dptr;       // data blocks
+static unsigned short* rmap; // extra owners of data blocks, NULL when
+                            // read through the cache or there are none
+static char*    dptr;       // data blocks, NULL when read through the cache
 
 static int      root_ino;   // ino of the root inode
+static size_t   disk_size;  // size of the mapped data file
+static size_t   meta_size;  // bytes before the block tables kept in memory
+static size_t   iptr_blk;   // first block of the inode table
+static size_t   rmap_blk;   // first block of the owner counts
+static size_t   dptr_blk;   // first data block
+static char*    touched;    // chunks of a mapped disk handed out since
+                            // mount, NULL when checksums are not kept
+static int      read_only;  // snapshot is mounted, nothing changes
+static unsigned map_gen;    // grows when a block leaves a file, windows of
+                            // open files read before it are stale
+static int      scrub_interval; // seconds between scrub passes, 0 for none
+
+// unlinked inodes whose blocks are freed in background
+static pthread_mutex_t  orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   orphan_wake = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t  reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t        reclaimer;
+static int              reclaiming; // reclaimer thread runs
+
+// cached disks write what changed at checkpoints, RAM mode only then
+static char*            meta_shadow;    // metadata of the last checkpoint,
+                                        // NULL when mapped or read-only
+static pthread_mutex_t  ckpt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   ckpt_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t        checkpointer;
+static int              checkpointing;  // checkpointer thread runs
+static int              ckpt_interval;  // seconds between checkpoints
+static int              ckpt_asked;     // an eviction asked for one
+
+// block geometry of the mounted disk
+static int      bsize;      // bytes in a data block
+static int      bshift;     // log2 of bsize, -1 if not a power of two
+
+// result of walking a path, names point into the path itself
+typedef struct path_res {
+    inode*      dir;        // parent directory, NULL for the root
+    const char* leaf;       // last name in the path, not NUL terminated
+    int         leaf_len;   // length of the last name
+    inode*      node;       // inode of the last name, NULL if absent
+} path_res;
+
+// adjacent data blocks which are returned to their groups at once
+typedef struct free_run {
+    int         first;      // first block of the run
+    int         count;      // blocks in the run, 0 for none
+} free_run;
+
+// blocks moved by one compaction step, old ones are freed after it
+typedef struct compact_state {
+    int         limit;      // blocks at or past it are moved
+    int         low;        // where the search for a free block starts
+    int         count;      // blocks moved by the step
+    int         old[COMPACT_BATCH];     // where they were
+} compact_state;
 
 
 /* ========================= FUNCTIONS ===================================== */
-static int      __get_free_ino();
-static int      __get_free_dno();
+static int      __get_free_ino(inode* dir, int mode);
+static int      __get_free_dno(int goal);
 
-static char*    __get_iname(const char* path);
-static char*    __parent_path(const char* path);
-static int      __find_ino(const char* path);
+static int      __resolve(const char* path, path_res* res);
+static int      __lookup(const char* path, inode** node);
 
-static int      __exists_inode(const char* path);
-static inode*   __get_inode(const char *path);
-static inode*   __create_inode(inode* dir, const char* iname, int mode);
+static inode*   __create_inode(inode* dir, const char* name, int len,
+                               int mode);
+static void     __delete_inode(inode* node);
 
 static void     __update_stat(const inode* node, struct stat *st);
 
-static void     __read_data(inode* file, char *buf, size_t size, off_t offset);
-static int      __create_indirect_dptr();
-static void     __write_data(inode* node, const char* buf,
-                             size_t size, off_t offset);
-static void     __truncate_up(inode* file, size_t size);
+static size_t   __block_of(size_t offset);
+static size_t   __offset_in_block(size_t offset);
+static int      __ptrs_per_block();
+static int64_t  __max_file_size();
+static int      __block_path(int lblk, int path[INDIRECT_LEVELS]);
+static int*     __tree_root(inode* file, int depth);
+static int*     __index_block(inode* file, const int* path, int depth,
+                              int create, int goal);
+static int*     __block_slot(inode* file, int lblk, int create, int goal);
+static int      __map_block(inode* file, int lblk, int create, int goal);
+static void     __cursor_attach(inode* file, map_cursor* cur);
+static int*     __cursor_slot(inode* file, int lblk, map_cursor* cur);
+static int      __cursor_map(inode* file, int lblk, map_cursor* cur);
+static int      __cursor_own(inode* file, int lblk, int goal, int keep,
+                             map_cursor* cur);
+
+static void     __prefetch(inode* file, int first, int last, map_cursor* cur);
+static void     __read_ahead(inode* file, int from, int count);
+static void     __read_data(inode* file, char *buf, size_t size, off_t offset,
+                            map_cursor* cur);
+static int      __read_file(inode* file, char *buf, size_t size,
+                            off_t offset, open_file* of);
+static int      __write_file(inode* file, const char *buf, size_t size,
+                             off_t offset, open_file* of);
+static int      __create_indirect_dptr(int goal);
+static size_t   __write_data(inode* node, const char* buf,
+                             size_t size, off_t offset, map_cursor* cur);
+static int      __free_tree(inode* file, int dno, int depth, const int* path,
+                            free_run* run);
+static void     __free_blocks(inode* file, int from);
 static void     __truncate_down(inode* file, size_t size);
 static void     __truncate(inode* file, size_t size);
 
+static int      __is_clustered(const inode* file);
+static int      __cmap_depth(const inode* file);
+static int*     __cluster_slot(inode* file, int cc, int create);
+static void     __free_cmap(int dno, int depth);
+static void     __unmap_block(inode* file, int lblk);
+static int      __cluster_valid(int cc, size_t file_size);
+static void     __read_cluster(inode* file, int cc, int valid,
+                               char* data, char* tmp);
+static int      __write_cluster(inode* file, int cc, int valid,
+                                const char* data, char* tmp);
+static void     __read_clusters(inode* file, char* buf,
+                                size_t size, off_t offset);
+static size_t   __write_clusters(inode* file, const char* buf,
+                                 size_t size, off_t offset);
+static void     __truncate_clusters(inode* file, size_t size);
+
+static int      __has_rmap();
+static unsigned short* __rmap_at(int dno);
+static void     __rmap_dirty(int dno);
+static int      __share_dno(int dno);
+static void     __put_dno(int dno);
+static void     __run_put(free_run* run, int dno);
+static void     __run_flush(free_run* run);
+static int      __is_shared(int dno);
+static int      __own_block(inode* file, int lblk, int goal, int keep);
+static int      __dedup_block(inode* file, int lblk, const char* data,
+                              uint64_t hash, int goal);
+static int      __share_block(inode* src, int s, inode* dst, int d);
+static void     __copy_range(inode* src, off_t from_off,
+                             inode* dst, off_t to_off, size_t len);
+static int      __do_clone_range(const char *from, off_t from_off,
+                                 const char *to, off_t to_off, size_t len);
+
+static void     __compact_slot(int* slot, compact_state* cs);
+static void     __compact_tree(int* slot, int depth, compact_state* cs);
+static void     __compact_inode(inode* node, compact_state* cs);
+
 static inode*   __get_inode_from_ino(const int ino);
 
-static int      __get_max_inum(size_t data_file_size);
+static void     __orphan_add(inode* node);
+static void     __orphan_remove(const int ino);
+static int      __reclaim_step();
+static void     __start_reclaimer();
+static void     __stop_reclaimer();
+
+static int      __write_metadata();
+static void     __start_checkpointer();
+static void     __stop_checkpointer();
+
+static int      __do_access(const char *path);
+static int      __do_getattr(const char *path, struct stat *st);
+static int      __do_mknod(const char *path, int mode);
+static int      __do_rename(const char *from, const char *to);
+static int      __do_chmod(const char *path, mode_t mode);
+static int      __do_utimens(const char* path, const struct timespec ts[2]);
+static int      __do_link(const char *from, const char *to);
+static int      __do_unlink(const char *path);
+static int      __do_read(const char *path, char *buf,
+                          size_t size, off_t offset, open_file* of);
+static int      __do_write(const char *path, const char *buf,
+                           size_t size, off_t offset, open_file* of);
+static int      __do_truncate(const char *path, off_t size);
+static int      __do_lookup(const char *path);
+static int      __do_getattr_ino(const int ino, struct stat *st);
+static int      __do_read_ino(const int ino, char *buf,
+                              size_t size, off_t offset, open_file* of);
+static int      __do_write_ino(const int ino, const char *buf,
+                               size_t size, off_t offset, open_file* of);
+static int      __do_mkdir(const char *path, mode_t mode);
+static int      __do_rmdir(const char *path);
+static int      __do_readdir(const char *path, void *buf,
+                             disk_fill_fn filler);
+static int      __do_symlink(const char *from, const char *to);
+static int      __do_readlink(const char *path, char *buf, size_t size);
+
+static int      __do_setxattr(const char *path, const char *name,
+                              const char *value, size_t size);
+static int      __do_getxattr(const char *path, const char *name,
+                              char *value, size_t size);
+static int      __do_listxattr(const char *path, char *list, size_t size);
+
+static int      __layout_disk(superblock* sb, size_t data_file_size,
+                              int block_size, int bpi, int huge);
 
 
 
 
 /* ========================= No HELPERS =================================== */
-/* Returns ino of a first free inode, if all used returns -1 */
+/* Returns ino of a free inode for a new node in "dir", if all used -1 */
 static
 int
-__get_free_ino()
+__get_free_ino(inode* dir, int mode)
 {
-    // go through all inodes in bitmap
-    for (int ino = 0; ino < sblock->inum; ino++) {
-        
-        // when free inode found
-        if (bmap_isfree(imap, ino)) {
-            
-            // mark inode as used in bitmap
-            bmap_set(imap, ino);
-            
-            // return ino
-            return ino;
-        }
+    int parent_ino = (dir != NULL) ? dir->ino : -1;
+    int ino = group_alloc_ino(parent_ino, S_ISDIR(mode));
+    
+    // orphans could still hold the inodes which are missing, a batch which
+    // is being freed meanwhile is waited for
+    for (int more = 1; ino < 0 && more; ) {
+        more = __reclaim_step();
+        ino = group_alloc_ino(parent_ino, S_ISDIR(mode));
     }
     
-    // no free inodes
-    return -1;
+    return ino;
 }
 
-/* Returns dno of a dblock, otherwise -1 */
+/* Returns dno of a free dblock close to "goal", otherwise -1 */
 static
 int
-__get_free_dno()
+__get_free_dno(int goal)
 {
-    // go through all dblock in bitmap
-    for (int dno = 0; dno < sblock->dnum; dno++) {
-        
-        // when free dblock found
-        if (bmap_isfree(dmap, dno)) {
-            
-            // mark dblock as used in bitmap
-            bmap_set(dmap, dno);
-            
-            // return dno
-            return dno;
-        }
+    int dno = group_alloc_dno(max(goal, 0));
+    
+    // blocks of unlinked files could still be on their way back
+    for (int more = 1; dno < 0 && more; ) {
+        more = __reclaim_step();
+        dno = group_alloc_dno(max(goal, 0));
     }
     
-    // no free dblocks
-    return -1;
+    return dno;
 }
 
 
 
 
 /* ========================= PATH ========================================= */
-/* Returns last name of an inode from the path */
-static
-char*
-__get_iname(const char* path)
-{
-    const char* delim = "/";
-    
-    // copy path into stack
-    char fullpath[strlen(path)];
-    strcpy(fullpath, path);
-    
-    // create buffer for strtok_r
-    char* restpath = NULL;
-    
-    // set first token
-    char* curr_token = strtok_r(fullpath, delim, &restpath);
-    char* next_token = strtok_r(NULL, delim, &restpath);
-    
-    // when next token is NULL, curr is the one we want
-    while (next_token != NULL) {
-        
-        // get token and next token
-        curr_token = next_token;
-        next_token = strtok_r(NULL, delim, &restpath);
-    }
-    
-    // get length of the iname
-    size_t iname_len = strlen(curr_token);
-    
-    // allocate iname on the heap
-    char* iname = malloc(iname_len + 1);
-    assert(iname != NULL);
-    iname[iname_len] = '\0';
-    strcpy(iname, curr_token);
-
-    return iname;
-}
-
-/* Returns path to the parent directory */
-static
-char*
-__parent_path(const char* path)
-{
-    // get length of the path
-    size_t path_len = strlen(path);
-    
-    printf("|--NUFS: finding parent path of %s, with length = %ld\n", // log
-           path, path_len);
-    
-    // get the length of the iname
-    char* iname = __get_iname(path);
-    size_t iname_len = strlen(iname);
-    
-    printf("|--NUFS: last iname is %s, with length = %ld\n", // log
-           iname, iname_len);
-    
-    // get length of the parent path
-    size_t parent_len = path_len - iname_len;
-    
-    // allocate parent path on the heap
-    char* parent = malloc(parent_len + 1);
-    assert(parent != NULL);
-    parent[parent_len] = '\0';
-    strncpy(parent, path, parent_len);
-    
-    printf("|--NUFS: parent path is %s, with length %ld\n", // log
-           parent, parent_len);
-    
-    free(iname);
-    
-    return parent;
-}
-
-/* Returns ino given by the path, if impossible, returns -1 */
+/* Walks the path once filling "res", returns 0 or -ERRNO on a bad path */
 static
 int
-__find_ino(const char* path)
+__resolve(const char* path, path_res* res)
 {
-    printf("|---#FUNC: __find_ino(%s)\n", path); // log
-    const char* delim = "/";
-    
-    // check if target is root
-    if (streq(path, delim)) {
-        printf("|---@: path is the root with ino %d\n", root_ino); // log
-        return root_ino;
-    }
-    
-    // copy path into stack
-    char fullpath[strlen(path)];
-    strcpy(fullpath, path);
-    
-    // create buffer for strtok_r
-    char* restpath = NULL;
-
-    // get name of the target node
-    char* target_name = __get_iname(fullpath);
-    printf("|---> target is %s \n", target_name); // log
+    trace("|---#FUNC: __resolve(%s)\n", path); // log
     
-    // set first token
-    char* token = strtok_r(fullpath, delim, &restpath);
-    printf("|---> token is %s \n", token); // log
+    inode* dir = NULL;
+    inode* node = __get_inode_from_ino(root_ino);
+    const char* name = path;
+    int len = 0;
     
-    // assign curr dir to be root
-    inode* curr_dir = __get_inode_from_ino(root_ino);
+    const char* curr = path;
     
-    // declare curr_inode, and curr_ino
-    inode* curr_node;
-    int curr_ino;
-    
-    while (token != NULL) {
+    while (1) {
         
-        // get curr ino from the current directory
-        curr_ino = dir_get_ino(curr_dir, token);
+        // skip separators
+        while (*curr == '/') ++curr;
         
-        // token is not in the current directory
-        if (curr_ino < 0) {
-            printf("|---E: token not found in the directory\n"); // log
-            return -ENOENT;
-        }
+        // reached the end of the path
+        if (*curr == '\0') break;
         
-        // get curr inode
-        curr_node = __get_inode_from_ino(curr_ino);
+        // find the end of the name
+        const char* end = curr;
+        while (*end != '\0' && *end != '/') ++end;
         
-        // curr inode is the target inode
-        if (streq(token, target_name)) {
-            printf("|---@: ino of the path is %d\n", curr_ino); // log
-            return curr_ino;
-        }
+        // previous name has to be an existing directory
+        if (node == NULL) return -ENOENT;
+        if (!is_dir(node)) return -ENOTDIR;
         
-        // curr inode is a directory, continue searching
-        if (is_dir(curr_node)) {
-            
-            // curr inode is the new directory
-            curr_dir = curr_node;
-            
-            // get next token
-            token = strtok_r(NULL, delim, &restpath);
-        }
+        dir = node;
+        name = curr;
+        len = (int)(end - curr);
         
-        // curr inode is a file, but target != node, end the loop
-        else {
-            break;
-        }
+        // name does not fit into a dentry
+        if (len > INAME_MAX) return -ENAMETOOLONG;
+        
+        int ino = dir_lookup(dir, name, len);
+        node = (ino >= 0) ? __get_inode_from_ino(ino) : NULL;
+        
+        curr = end;
     }
     
-    free(target_name);
+    res->dir = dir;
+    res->leaf = name;
+    res->leaf_len = len;
+    res->node = node;
     
-    // inode does not exist
-    printf("|---E: reached end of the loop\n"); // log
-    return -ENOENT;
+    trace("|---@: ino of the path is %d\n", // log
+          (node != NULL) ? node->ino : -1);
+    
+    return 0;
 }
 
-
-
-/* ========================= INODE LOCAL HELPERS =========================== */
-/* Checks if inode exists, returns 1 on success, and 0 on failure */
+/* Sets "node" to the inode at the path, returns 0 or -ERRNO */
 static
 int
-__exists_inode(const char* path)
+__lookup(const char* path, inode** node)
 {
-    printf("|---#FUNC: __exists_inode(%s)\n", path); // log
+    path_res res;
     
-    int ino = __find_ino(path);
+    int rv = __resolve(path, &res);
+    if (rv < 0) return rv;
     
-    // exists
-    if (ino >= 0) {
-        printf("|---@: inode at path %s DOES exist and has ino %d\n", // log
-               path, ino);
-        return 1;
-    }
+    // inode does not exist
+    if (res.node == NULL) return -ENOENT;
     
-    // does not exist
-    else {
-        printf("|---@: inode at path %s DOES NOT exist\n", path); // log
-        return 0;
-    }
+    *node = res.node;
+    
+    return 0;
 }
 
-/* Returns pointer to the inode with the given path, if such exists */
-static
-inode*
-__get_inode(const char *path)
-{
-    return __get_inode_from_ino(__find_ino(path));
-}
 
-/* Creates new inode with the given mode */
+
+/* ========================= INODE LOCAL HELPERS =========================== */
+/* Creates new inode named by "len" bytes of "name", NULL if out of space */
 static
 inode*
-__create_inode(inode* dir, const char* iname, int mode)
+__create_inode(inode* dir, const char* name, int len, int mode)
 {
-    printf("|--NUFS: __create_inode iname: %s\n", iname); // log
+    trace("|--NUFS: __create_inode iname: %.*s\n", len, name); // log
+    
+    int ino = __get_free_ino(dir, mode);
+    if (ino < 0) return NULL;
+    
+    int dno = __get_free_dno(group_goal_dno(ino));
+    if (dno < 0) {
+        group_free_ino(ino);
+        return NULL;
+    }
     
-    int ino = __get_free_ino();
     inode* node = __get_inode_from_ino(ino);
+    atime_forget(ino);
+    
+    // freed blocks keep their data, holes of the new file read as zeroes
+    memset(disk_get_dblock(dno), 0, bsize);
     
     node->ino = ino;
     node->mode = mode;
     
     node->size = 0;
     node->nlink = 1;
-    node->dptrs[0] = __get_free_dno();
+    node->dptrs[0] = dno;
     
     for (int ii = 1; ii < BLOCKS_NUM; ++ii) {
         node->dptrs[ii] = -1;
     }
     
     node->indirect_dptr = -1;
+    node->double_dptr = -1;
+    node->triple_dptr = -1;
     node->dnum = 1;
     
+    // new files are compressed like the rest of their directory
+    node->flags = (dir != NULL) ? (dir->flags & INODE_COMPRESS) : 0;
+    node->cmap_dptr = -1;
+    
     node->uid = getuid();
     node->gid = getgid();
     
@@ -343,7 +429,7 @@ __create_inode(inode* dir, const char* iname, int mode)
     node->mtime = tt;
     
     // root is created
-    if (dir == NULL && iname == NULL) {
+    if (dir == NULL) {
         dir_init(node, node->ino);
         return node;
     }
@@ -353,7 +439,11 @@ __create_inode(inode* dir, const char* iname, int mode)
         dir_init(node, dir->ino);
     }
     
-    dir_add_inode(dir, node->ino, iname);
+    // no space to grow the directory
+    if (dir_add_name(dir, node->ino, name, len) < 0) {
+        __delete_inode(node);
+        return NULL;
+    }
     
     return node;
 }
@@ -376,12 +466,14 @@ __update_stat(const inode* node, struct stat *st)
     st->st_gid      = node->gid;
     
     st->st_size     = node->size;
-    st->st_blksize  = BLOCK_SIZE;
-    st->st_blocks   = node->dnum * 8; // convert to 512 blocks
+    st->st_blksize  = bsize;
+    st->st_blocks   = node->dnum * (bsize / 512); // convert to 512 blocks
+    
+    int atime = atime_get(node);
     
     struct timespec atime_spec;
-    atime_spec.tv_sec = node->atime;
-    atime_spec.tv_nsec = node->atime * 1000 * 1000 * 1000; // nanoseconds
+    atime_spec.tv_sec = atime;
+    atime_spec.tv_nsec = atime * 1000 * 1000 * 1000; // nanoseconds
 
     struct timespec mtime_spec;
     mtime_spec.tv_sec = node->mtime;
@@ -404,312 +496,600 @@ __update_stat(const inode* node, struct stat *st)
 dblock*
 disk_get_dblock(const int dno)
 {
-    return ((dblock*)dptr) + dno;
+    // block is read through the cache
+    if (dptr == NULL) {
+        return (dblock*)bcache_get(dptr_blk + dno);
+    }
+    
+    // checksums of the chunk are refreshed at unmount
+    if (touched != NULL) {
+        touched[dno / TOUCH_CHUNK] = 1;
+    }
+    
+    // power of two sizes shift instead of multiplying
+    if (bshift >= 0) {
+        return (dblock*)(dptr + ((size_t)dno << bshift));
+    }
+    
+    return (dblock*)(dptr + (size_t)dno * bsize);
 }
 
-
 /* Returns pointer to the inode with the given ino */
-static
 inode*
-__get_inode_from_ino(const int ino)
+disk_get_inode(const int ino)
 {
-    return ((inode*)iptr + ino);
+    return __get_inode_from_ino(ino);
 }
 
-
-
-
-/* ==================== INODE ============================================== */
-/* Checks if a file exists, returns 0 on success, and -ENOENT on failure */
+/* Returns number of bytes in a data block of the mounted disk */
 int
-disk_access(const char *path)
+disk_block_size()
 {
-    printf("|---#FUNC: disk_access(%s)\n", path); // log
-    
-    // inode does not exist
-    if (!__exists_inode(path)) return -ENOENT;
-    
-    // update time stamps
-    inode* node = __get_inode(path);
-    time_t tt = time(NULL);
-    node->atime = tt;
+    return bsize;
+}
+
+/* Returns index of the file block which holds byte at "offset" */
+static
+size_t
+__block_of(size_t offset)
+{
+    // power of two sizes shift instead of dividing
+    if (bshift >= 0) {
+        return offset >> bshift;
+    }
     
-    printf("|---@: done\n"); // log
+    return offset / bsize;
+}
+
+/* Returns position of byte at "offset" inside of its block */
+static
+size_t
+__offset_in_block(size_t offset)
+{
+    // power of two sizes mask instead of dividing
+    if (bshift >= 0) {
+        return offset & (bsize - 1);
+    }
     
-    // inode exists
-    return 0;
+    return offset % bsize;
 }
 
-/* Gets object's attributes into "st" */
+/* Returns number of block pointers which fit in an indirect block */
+static
 int
-disk_getattr(const char *path, struct stat *st)
+__ptrs_per_block()
 {
-    printf("|---#FUNC: disk_getattr(%s)\n", path); // log
-    
-    // inode does not exist
-    if (!__exists_inode(path)) return -ENOENT;
+    return bsize / sizeof(int);
+}
 
-    // inode exists
-    inode* node = __get_inode(path);
-    printf("|---> got inode with ino %d\n", node->ino); // log
-    
-    // update time stamps
-    time_t tt = time(NULL);
-    node->atime = tt;
-    
-    // update "st" struct
-    __update_stat(node, st);
-    printf("|---> updated stat struct\n"); // log
-    
-    printf("|---@: done\n"); // log
+/* Returns bytes in the largest file, its blocks are numbered with an int */
+static
+int64_t
+__max_file_size()
+{
+    int64_t ppb = __ptrs_per_block();
+    int64_t blocks = BLOCKS_NUM + ppb + ppb * ppb + ppb * ppb * ppb;
     
-    return 0;
+    return ((blocks < INT_MAX) ? blocks : INT_MAX) * bsize;
 }
 
-/* Creates an inode with the given mode */
+/* Fills "path" with the index of the "lblk"-th block of the file in every
+   indirect block on the way to it, returns how many there are, 0 for
+   direct blocks and -1 if the file can not have the block */
+static
 int
-disk_mknod(const char *path, int mode)
+__block_path(int lblk, int path[INDIRECT_LEVELS])
 {
-    // find parent directory path
-    char* dir_path = __parent_path(path);
+    if (lblk < BLOCKS_NUM) {
+        path[0] = lblk;
+        return 0;
+    }
     
-    // parent direcory does not exist
-    if (!__exists_inode(dir_path)) return -ENOENT;
+    int ppb = __ptrs_per_block();
+    int64_t index = lblk - BLOCKS_NUM;
+    int64_t span = ppb;
     
-    // inode already exists
-    if (__exists_inode(path)) return -EEXIST;
+    // every level points to "ppb" times more blocks than the one before
+    for (int depth = 1; depth <= INDIRECT_LEVELS; ++depth) {
+        if (index < span) {
+            for (int ll = depth - 1; ll >= 0; --ll) {
+                path[ll] = index % ppb;
+                index /= ppb;
+            }
+            
+            return depth;
+        }
+        
+        index -= span;
+        span *= ppb;
+    }
+    
+    return -1;
+}
+
+/* Returns the inode pointer to the tree of "depth" indirect levels */
+static
+int*
+__tree_root(inode* file, int depth)
+{
+    switch (depth) {
+        case 1: return &file->indirect_dptr;
+        case 2: return &file->double_dptr;
+        case 3: return &file->triple_dptr;
+    }
     
-    // get parent directory inode
-    inode* dir = __get_inode(dir_path);
+    assert(0);
+    return NULL;
+}
+
+/* Returns pointers of the last indirect block on "path" of "depth" levels,
+   NULL if it is missing, when "create" is set missing ones are made */
+static
+int*
+__index_block(inode* file, const int* path, int depth, int create, int goal)
+{
+    int* slot = __tree_root(file, depth);
     
-    // get iname of the node to be created
-    char* iname = __get_iname(path);
-    printf("|--NUFS: iname: %s\n", iname); // log
+    for (int ll = 0; ; ++ll) {
+        
+        // there is no indirect block on this level
+        if (*slot < 0) {
+            if (!create) {
+                return NULL;
+            }
+            
+            *slot = __create_indirect_dptr(goal);
+            trace("|---> created new indirect pointer (%d)\n", // log
+                  *slot);
+            
+            if (*slot < 0) {
+                return NULL;
+            }
+        }
+        
+        int* ptrs = (int*)disk_get_dblock(*slot);
+        
+        if (ll == depth - 1) {
+            return ptrs;
+        }
+        
+        slot = ptrs + path[ll];
+    }
+}
+
+/* Returns pointer to the "lblk"-th block of the file, NULL if the file can
+   not have it, when "create" is set missing indirect blocks are made */
+static
+int*
+__block_slot(inode* file, int lblk, int create, int goal)
+{
+    int path[INDIRECT_LEVELS];
+    int depth = __block_path(lblk, path);
     
-    // node is a directory
-    if (S_ISDIR(mode)) {
-        printf("|--NUFS: node is a directory: %s\n", iname); // log
-        __create_inode(dir, iname, DIRECTORY_MODE);
+    // file can not have that many blocks
+    if (depth < 0) {
+        return NULL;
     }
     
-    // node is a file
-    else {
-        printf("|--NUFS: node is a file: %s\n", iname); // log
-        __create_inode(dir, iname, FILE_MODE);
+    // block is pointed directly from the inode
+    if (depth == 0) {
+        return &file->dptrs[lblk];
     }
     
-    free(iname);
-    free(dir_path);
+    int* ptrs = __index_block(file, path, depth, create, goal);
     
-    return 0;
+    return (ptrs == NULL) ? NULL : ptrs + path[depth - 1];
 }
 
-
-/* Moves node "from" "to" and renames */
+/* Returns dno of the "lblk"-th block of the file, -1 if there is none,
+   when "create" is set missing blocks are allocated close to "goal" */
+static
 int
-disk_rename(const char *from, const char *to)
+__map_block(inode* file, int lblk, int create, int goal)
 {
-    // "from" inode does not exist
-    if (!__exists_inode(from)) return -ENOENT;
-    
-    // "to" inode does exist
-    if (__exists_inode(to)) return -EEXIST;
-
-    // get path to the old directory
-    char* old_dir_path = __parent_path(from);
-    inode* old_dir = __get_inode(old_dir_path);
+    int* slot = __block_slot(file, lblk, create, goal);
     
-    // find file ino
-    int file_ino = __find_ino(from);
+    // file can not have the block
+    if (slot == NULL) {
+        return -1;
+    }
     
-    // delete file from the old directory
-    dir_delete_inode(old_dir, file_ino);
-
-    // get path to the new directory
-    char* new_dir_path = __parent_path(to);
+    // if data block is not assigned, get one
+    if (*slot < 0 && create) {
+        *slot = __get_free_dno(goal);
+        file->dnum += (*slot >= 0);
+    }
     
-    // new directory does not exist
-    if (!__exists_inode(new_dir_path)) return -ENOENT;
+    return *slot;
+}
 
-    inode* new_dir = __get_inode(new_dir_path);
+/* Makes "cur" follow the file, a cursor of another file starts over */
+static
+void
+__cursor_attach(inode* file, map_cursor* cur)
+{
+    if (cur->ino != file->ino) {
+        cur->ino = file->ino;
+        cur->count = 0;
+        cur->goal = -1;
+    }
+}
 
-    // get new filename
-    char* new_filename = __get_iname(to);
+/* Returns the entry of the window of "cur" for the "lblk"-th block of the
+   file, the window moves to "lblk" when it does not hold the block or is
+   stale, NULL for direct blocks and blocks without an indirect block */
+static
+int*
+__cursor_slot(inode* file, int lblk, map_cursor* cur)
+{
+    if (cur == NULL || lblk < BLOCKS_NUM) {
+        return NULL;
+    }
     
-    // add file to the new directory
-    dir_add_inode(new_dir, file_ino, new_filename);
+    // window is good while no block left any file since it was read
+    int index = lblk - cur->first;
+    if (cur->gen == map_gen && index >= 0 && index < cur->count) {
+        return &cur->ptrs[index];
+    }
     
-    free(new_filename);
-    free(old_dir_path);
-    free(new_dir_path);
+    cur->first = lblk;
+    cur->count = 0;
+    cur->gen = map_gen;
     
-    inode* node = __get_inode(from);
+    // window does not go past the indirect block holding "lblk"
+    int path[INDIRECT_LEVELS];
+    int depth = __block_path(lblk, path);
+    int* ptrs = (depth > 0) ? __index_block(file, path, depth, 0, 0) : NULL;
     
-    // update time stamps
-    time_t tt = time(NULL);
-    node->atime = tt;
-    node->mtime = tt;
+    if (ptrs == NULL) {
+        return NULL;
+    }
     
-    return 0;
+    index = path[depth - 1];
+    cur->count = min(CURSOR_PTRS, __ptrs_per_block() - index);
+    memcpy(cur->ptrs, ptrs + index, cur->count * sizeof(int));
+    
+    return &cur->ptrs[0];
 }
 
-/* Changes mode of the node */
+/* Returns dno of the "lblk"-th block of the file like __map_block() without
+   creating it, through the window of "cur" when there is one */
+static
 int
-disk_chmod(const char *path, mode_t mode)
+__cursor_map(inode* file, int lblk, map_cursor* cur)
 {
-    // inode does not exist
-    if (!__exists_inode(path)) return -ENOENT;
-
-    inode* node = __get_inode(path);
+    int* ent = __cursor_slot(file, lblk, cur);
     
-    node->mode = mode;
+    if (ent != NULL && *ent >= 0) {
+        return *ent;
+    }
     
-    // update time stamps
-    time_t tt = time(NULL);
-    node->atime = tt;
-    node->mtime = tt;
+    // holes could have been filled through other open files
+    int dno = __map_block(file, lblk, 0, 0);
+    if (ent != NULL) {
+        *ent = dno;
+    }
     
-    return 0;
+    return dno;
 }
 
-
-/* Updates timestamps of the inode */
+/* Returns dno of the "lblk"-th block of the file which can be written like
+   __own_block(), a block from the window of "cur" which is not shared is
+   written where it is */
+static
 int
-disk_utimens(const char* path, const struct timespec ts[2])
+__cursor_own(inode* file, int lblk, int goal, int keep, map_cursor* cur)
 {
-    // inode does not exist
-    if (!__exists_inode(path)) return -ENOENT;
+    int* ent = __cursor_slot(file, lblk, cur);
     
-    inode* node = __get_inode(path);
-    node->atime = ts[0].tv_sec;
-    node->mtime = ts[1].tv_sec;
+    if (ent != NULL && *ent >= 0 && !__is_shared(*ent)) {
+        return *ent;
+    }
     
-    return 0;
+    int dno = __own_block(file, lblk, goal, keep);
+    
+    // copy of a shared block made the window stale
+    if (ent != NULL && cur->gen == map_gen) {
+        *ent = dno;
+    }
+    
+    return dno;
 }
 
-
-
-
-/* ==================== FILE =============================================== */
-/* Creates a hard link to existing file */
+/* Returns dno of the "lblk"-th block of the node, allocating if "create" */
 int
-disk_link(const char *from, const char *to)
+disk_map_block(inode* node, const int lblk, const int create)
 {
-    // "from" inode does not exist
-    if (!__exists_inode(from)) return -ENOENT;
+    int goal = (lblk > 0) ? __map_block(node, lblk - 1, 0, 0) + 1
+                          : group_goal_dno(node->ino);
     
-    // "to" inode does exist
-    if (__exists_inode(to)) return -EEXIST;
+    return __map_block(node, lblk, create, goal);
+}
 
-    // get path to the new directory
-    char* new_dir_path = __parent_path(to);
-    
-    // new directory does not exist
-    if (!__exists_inode(new_dir_path)) return -ENOENT;
 
-    // get new directory node
-    inode* new_dir = __get_inode(new_dir_path);
+/* Returns pointer to the inode with the given ino */
+static
+inode*
+__get_inode_from_ino(const int ino)
+{
+    // inode block is read through the cache
+    if (iptr == NULL) {
+        size_t offset = (size_t)ino * sizeof(inode);
+        char* block = bcache_get(iptr_blk + __block_of(offset));
+        
+        return (inode*)(block + __offset_in_block(offset));
+    }
     
-    // get new filename and file ino
-    int file_ino = __find_ino(from);
-    char* new_filename = __get_iname(to);
+    return ((inode*)iptr + ino);
+}
+
+/* Marks the inode as changed by an operation which only reads */
+void
+disk_dirty_inode(const inode* node)
+{
+    if (iptr == NULL) {
+        size_t offset = (size_t)node->ino * sizeof(inode);
+        bcache_dirty(iptr_blk + __block_of(offset));
+    }
+}
+
+
+
+
+/* ==================== INODE ============================================== */
+/* Checks if a file exists, returns 0 on success, and -ENOENT on failure */
+static
+int
+__do_access(const char *path)
+{
+    trace("|---#FUNC: disk_access(%s)\n", path); // log
     
-    // update number of hard links in the node
-    inode* file = __get_inode(from);
-    file->nlink += 1;
+    inode* node;
+    int rv = __lookup(path, &node);
+    if (rv < 0) return rv;
     
-    // add hard link to the new directory
-    dir_add_inode(new_dir, file_ino, new_filename);
+    // update time stamps
+    atime_touch(node);
+    
+    trace("|---@: done\n"); // log
+    
+    // inode exists
+    return 0;
+}
+
+/* Gets object's attributes into "st" */
+static
+int
+__do_getattr(const char *path, struct stat *st)
+{
+    trace("|---#FUNC: disk_getattr(%s)\n", path); // log
     
-    free(new_filename);
-    free(new_dir_path);
+    inode* node;
+    int rv = __lookup(path, &node);
+    if (rv < 0) return rv;
+    
+    // inode exists
+    trace("|---> got inode with ino %d\n", node->ino); // log
     
     // update time stamps
-    time_t tt = time(NULL);
-    file->atime = tt;
-    file->mtime = tt;
+    atime_touch(node);
+    
+    // update "st" struct
+    __update_stat(node, st);
+    trace("|---> updated stat struct\n"); // log
+    
+    trace("|---@: done\n"); // log
     
     return 0;
 }
 
-/* Deletes inode from the file system */
+/* Creates an inode with the given mode */
 static
-void
-__delete_inode(inode* node)
+int
+__do_mknod(const char *path, int mode)
 {
-    // free inode from the bitmap
-    bmap_free(imap, node->ino);
+    // walk the path, parent direcory has to exist
+    path_res res;
+    int rv = __resolve(path, &res);
+    if (rv < 0) return rv;
     
-    // free all direct inode data blocks
-    for (int ii = 0; ii < BLOCKS_NUM; ++ii) {
-        
-        int dno = node->dptrs[ii];
+    // inode already exists
+    if (res.node != NULL) return -EEXIST;
+    
+    trace("|--NUFS: iname: %.*s\n", res.leaf_len, res.leaf); // log
+    
+    // node is a directory or a file
+    int node_mode = S_ISDIR(mode) ? DIRECTORY_MODE : FILE_MODE;
+    
+    if (__create_inode(res.dir, res.leaf, res.leaf_len, node_mode) == NULL) {
+        return -ENOSPC;
+    }
+    
+    return 0;
+}
+
+
+/* Is directory "node" "dir" or one of the directories above it? */
+static
+int
+__is_ancestor(const inode* node, inode* dir)
+{
+    // walk up to the root, which is its own parent, a broken disk with a
+    // cycle of parents is not walked forever
+    for (int depth = 0; depth < sblock->inum; ++depth) {
+        if (dir->ino == node->ino) return 1;
         
-        // reached free data blocks
-        if (dno < 0) {
-            break;
-        }
+        int parent_ino = dir_get_parent(dir);
+        if (parent_ino == dir->ino) return 0;
         
-        // data block is not free
-        else {
-            bmap_free(dmap, dno);
-        }
+        dir = __get_inode_from_ino(parent_ino);
     }
     
-    // no indirect data blocks
-    if (node->indirect_dptr < 0) {
-        return;
+    return 0;
+}
+
+/* Moves node "from" "to" and renames */
+static
+int
+__do_rename(const char *from, const char *to)
+{
+    path_res old_res;
+    path_res new_res;
+    
+    int rv = __resolve(from, &old_res);
+    if (rv < 0) return rv;
+    
+    // "from" inode does not exist
+    if (old_res.node == NULL) return -ENOENT;
+    
+    // root can not be moved
+    if (old_res.dir == NULL) return -EBUSY;
+    
+    rv = __resolve(to, &new_res);
+    if (rv < 0) return rv;
+    
+    // "to" inode does exist
+    if (new_res.node != NULL) return -EEXIST;
+    
+    inode* node = old_res.node;
+    
+    // directory can not move into itself or below it
+    if (is_dir(node) && __is_ancestor(node, new_res.dir)) return -EINVAL;
+    
+    // add file to the new directory before it leaves the old one
+    rv = dir_add_name(new_res.dir, node->ino, new_res.leaf, new_res.leaf_len);
+    if (rv < 0) return rv;
+    
+    // delete file from the old directory
+    dir_delete_name(old_res.dir, old_res.leaf, old_res.leaf_len);
+    
+    // moved directory gets a new parent
+    if (is_dir(node)) {
+        dir_set_parent(node, new_res.dir->ino);
     }
     
-    // free all inderect inode data blocks
-    int* indirect_dptrs = (int*)disk_get_dblock(node->indirect_dptr);
+    // update time stamps
+    time_t tt = time(NULL);
+    node->atime = tt;
+    node->mtime = tt;
     
-    int indir_blocks_count = BLOCK_SIZE / sizeof(int);
-    for (int ii = 0; ii < indir_blocks_count; ++ii) {
-        
-        int dno = indirect_dptrs[ii];
-        
-        // reached free data blocks
-        if (dno < 0) {
-            break;
-        }
-        
-        // data block is not free
-        else {
-            bmap_free(dmap, dno);
-        }
+    return 0;
+}
+
+/* Changes mode of the node */
+static
+int
+__do_chmod(const char *path, mode_t mode)
+{
+    inode* node;
+    int rv = __lookup(path, &node);
+    if (rv < 0) return rv;
+    
+    node->mode = mode;
+    
+    // update time stamps
+    time_t tt = time(NULL);
+    node->atime = tt;
+    node->mtime = tt;
+    
+    return 0;
+}
+
+
+/* Updates timestamps of the inode */
+static
+int
+__do_utimens(const char* path, const struct timespec ts[2])
+{
+    inode* node;
+    int rv = __lookup(path, &node);
+    if (rv < 0) return rv;
+    
+    atime_forget(node->ino);
+    node->atime = ts[0].tv_sec;
+    node->mtime = ts[1].tv_sec;
+    
+    return 0;
+}
+
+
+
+
+/* ==================== FILE =============================================== */
+/* Creates a hard link to existing file */
+static
+int
+__do_link(const char *from, const char *to)
+{
+    inode* file;
+    int rv = __lookup(from, &file);
+    if (rv < 0) return rv;
+    
+    path_res new_res;
+    rv = __resolve(to, &new_res);
+    if (rv < 0) return rv;
+    
+    // "to" inode does exist
+    if (new_res.node != NULL) return -EEXIST;
+    
+    // add hard link to the new directory
+    rv = dir_add_name(new_res.dir, file->ino, new_res.leaf, new_res.leaf_len);
+    if (rv < 0) return rv;
+    
+    // update number of hard links in the node
+    file->nlink += 1;
+    
+    // update time stamps
+    time_t tt = time(NULL);
+    file->atime = tt;
+    file->mtime = tt;
+    
+    return 0;
+}
+
+/* Deletes inode from the file system */
+static
+void
+__delete_inode(inode* node)
+{
+    // free the cluster map
+    if (node->flags & INODE_CMAP) {
+        __free_cmap(node->cmap_dptr, __cmap_depth(node));
     }
     
-    // free the indirect pointer itself
-    bmap_free(dmap, node->indirect_dptr);
+    // free all data blocks and indirect blocks
+    __free_blocks(node, 0);
+    
+    // free inode from the bitmap, it can be taken again from now on
+    group_free_ino(node->ino);
+    atime_forget(node->ino);
 }
 
 /* Removes a link to file, when last link removed, deletes a file */
+static
 int
-disk_unlink(const char *path)
+__do_unlink(const char *path)
 {
+    path_res res;
+    int rv = __resolve(path, &res);
+    if (rv < 0) return rv;
+    
     // inode does not exist
-    if (!__exists_inode(path)) return -ENOENT;
-
-    inode* file = __get_inode(path);
+    if (res.node == NULL) return -ENOENT;
     
-    // get path to the directory
-    char* dir_path = __parent_path(path);
-    inode* dir = __get_inode(dir_path);
+    inode* file = res.node;
     
     // delete hard link from the directory
-    dir_delete_inode(dir, file->ino);
+    dir_delete_name(res.dir, res.leaf, res.leaf_len);
     
     // decrement number of hard links to the file
     file->nlink -= 1;
     
-    // if no hard links exist, file is deleted
+    // if no hard links exist, blocks of the file are freed in background
     if (file->nlink == 0) {
-        __delete_inode(file);
+        __orphan_add(file);
     }
     
-    free(dir_path);
-    
     // update time stamps
     time_t tt = time(NULL);
     file->atime = tt;
@@ -718,23 +1098,132 @@ disk_unlink(const char *path)
     return 0;
 }
 
+/* Reads blocks "first" to "last" of the file into the cache in batches */
+static
+void
+__prefetch(inode* file, int first, int last, map_cursor* cur)
+{
+    // mapped disk is paged in by the kernel
+    if (dptr != NULL) {
+        return;
+    }
+    
+    size_t blks[PREFETCH_BATCH];
+    
+    for (int lblk = first; lblk <= last; ) {
+        int num = 0;
+        
+        for (; lblk <= last && num < PREFETCH_BATCH; ++lblk) {
+            int dno = __cursor_map(file, lblk, cur);
+            
+            if (dno >= 0) {
+                blks[num++] = dptr_blk + dno;
+            }
+        }
+        
+        bcache_prefetch(blks, num);
+    }
+}
+
+/* Starts reading "count" blocks of the file from "from" in background */
+static
+void
+__read_ahead(inode* file, int from, int count)
+{
+    trace("|---> read ahead %d blocks from %d\n", count, from); // log
+    
+    // the cache reads them in its own thread
+    if (dptr == NULL) {
+        ra_queue(file->ino, from, count);
+        return;
+    }
+    
+    // the kernel is told about every run of adjacent blocks
+    long page = sysconf(_SC_PAGESIZE);
+    int run_start = -1;
+    int run_len = 0;
+    
+    for (int lblk = from; lblk <= from + count; ++lblk) {
+        int dno = (lblk < from + count) ? __map_block(file, lblk, 0, 0) : -1;
+        
+        // block continues the run
+        if (dno >= 0 && dno == run_start + run_len) {
+            run_len += 1;
+            continue;
+        }
+        
+        if (run_len > 0) {
+            char* addr = disk_get_dblock(run_start)->data;
+            char* start = (char*)((uintptr_t)addr & ~(uintptr_t)(page - 1));
+            size_t len = (size_t)run_len * bsize + (addr - start);
+            
+            madvise(start, len, MADV_WILLNEED);
+        }
+        
+        run_start = dno;
+        run_len = (dno >= 0);
+    }
+}
+
+/* Reads "count" blocks of inode "ino" from "from" into the cache */
+void
+disk_prefetch(const int ino, const int from, const int count)
+{
+    bcache_op_begin();
+    
+    inode* file = __get_inode_from_ino(ino);
+    
+    // file could have been deleted or truncated since
+    int last = min(from + count, __block_of(file->size + bsize - 1)) - 1;
+    __prefetch(file, from, last, NULL);
+    
+    bcache_op_end(0);
+}
+
+/* Starts the state of a newly opened file */
+void
+disk_open_init(open_file* of)
+{
+    ra_init(&of->ra);
+    
+    of->map.ino = -1;
+    of->map.count = 0;
+    of->map.goal = -1;
+}
+
 /* Reads data from the file */
 static
 void
-__read_data(inode* file, char *buf, size_t size, off_t offset)
+__read_data(inode* file, char *buf, size_t size, off_t offset,
+            map_cursor* cur)
 {
     // find the starting data block
-    int start_block = offset / BLOCK_SIZE;
-    printf("|---> start_block = %d\n", start_block); // log
+    int start_block = __block_of(offset);
+    trace("|---> start_block = %d\n", start_block); // log
+    
+    if (cur != NULL) {
+        __cursor_attach(file, cur);
+    }
+    
+    // all blocks of the range are read at once
+    if (size > 0) {
+        __prefetch(file, start_block, __block_of(offset + size - 1), cur);
+    }
+    
+    // compressed clusters are read whole
+    if (__is_clustered(file)) {
+        __read_clusters(file, buf, size, offset);
+        return;
+    }
     
     size_t curr = 0;
     size_t left = size;
     off_t read_off = 0;
-    off_t off = offset % BLOCK_SIZE;
-    printf("|---> off = %ld\n", off); // log
+    off_t off = __offset_in_block(offset);
+    trace("|---> off = %ld\n", off); // log
     
-    // iterating through data blocks in the file
-    for (int ii = start_block; ii < file->dnum; ++ii) {
+    // iterating through data blocks in the file, holes read as zeroes
+    for (int ii = start_block; ; ++ii) {
         
         // decrement left by how much was read on previus itteration
         left -= curr;
@@ -744,57 +1233,75 @@ __read_data(inode* file, char *buf, size_t size, off_t offset)
         
         // increment offset by how much was read on previus itteration
         read_off += curr;
-        printf("|---> read_off = %ld\n", read_off); // log
+        trace("|---> read_off = %ld\n", read_off); // log
         
-        // update curr to be BLOCK_SIZE, or what is left
-        curr = (left > BLOCK_SIZE) ? BLOCK_SIZE : left;
+        // update curr to be rest of the block, or what is left
+        curr = (left > bsize - off) ? bsize - off : left;
         
         // need to find next data block number
-        int dno;
+        int dno = __cursor_map(file, ii, cur);
+        trace("|---> dno = %d\n", dno); // log
         
-        // there still free data blocks in standart array
-        if (ii < BLOCKS_NUM) {
-            
-            // get next data block number
-            dno = file->dptrs[ii];
+        // block was never written
+        if (dno < 0) {
+            memset(buf + read_off, 0, curr);
         }
         
-        // no more data data block left in standart array
+        // copy data into current "buf"
         else {
-            
-            // get next data block number
-            int* indirect_dptrs = (int*)disk_get_dblock(file->indirect_dptr);
-            dno = indirect_dptrs[ii - BLOCKS_NUM];
+            dblock* block = disk_get_dblock(dno);
+            memcpy(buf + read_off, block->data + off, curr);
+            tier_touch(dno);
         }
         
-        printf("|---> dno = %ld\n", dno); // log
-        
-        // get next data block
-        dblock* block = disk_get_dblock(dno);
-
-        // copy data into current "buf"
-        memcpy(buf + read_off, block->data + off, curr);
-        
         // make sure in the next block all data is read
         off = 0;
     }
 }
 
 /* Reads data from the file into "buf" */
+static
 int
-disk_read(const char *path, char *buf, size_t size, off_t offset)
+__do_read(const char *path, char *buf, size_t size, off_t offset,
+          open_file* of)
 {
-    // inode does not exist
-    if (!__exists_inode(path)) return -ENOENT;
+    inode* file;
+    int rv = __lookup(path, &file);
+    if (rv < 0) return rv;
+    
+    return __read_file(file, buf, size, offset, of);
+}
+
+/* Reads "size" bytes of "file" at "offset" into "buf", stops at the end
+   of the file, returns number of bytes read */
+static
+int
+__read_file(inode* file, char *buf, size_t size, off_t offset, open_file* of)
+{
+    // nothing is read past the end
+    if (offset >= file->size) {
+        size = 0;
+    }
     
-    inode* file = __get_inode(path);
+    else if (offset + size > (size_t)file->size) {
+        size = file->size - offset;
+    }
     
     // read data from the file
-    __read_data(file, buf, size, offset);
+    __read_data(file, buf, size, offset, (of != NULL) ? &of->map : NULL);
+    
+    // sequential readers get the next blocks before they ask for them
+    if (of != NULL && size > 0) {
+        int from;
+        int count = ra_access(&of->ra, offset, size, bsize, &from);
+        
+        if (count > 0) {
+            __read_ahead(file, from, count);
+        }
+    }
     
     // update time stamps
-    time_t tt = time(NULL);
-    file->atime = tt;
+    atime_touch(file);
     
     return size;
 }
@@ -802,12 +1309,18 @@ disk_read(const char *path, char *buf, size_t size, off_t offset)
 /* Creates indirect pointer to data blocks */
 static
 int
-__create_indirect_dptr()
+__create_indirect_dptr(int goal)
 {
-    int indirect_dptr = __get_free_dno();
+    int indirect_dptr = __get_free_dno(goal);
+    
+    // no space for the indirect block
+    if (indirect_dptr < 0) {
+        return -1;
+    }
+    
     int* ptrs = (int*)disk_get_dblock(indirect_dptr);
     
-    int ptrs_count = BLOCK_SIZE / sizeof(int);
+    int ptrs_count = __ptrs_per_block();
     
     for (int ii = 0; ii < ptrs_count; ++ii) {
         ptrs[ii] = -1;
@@ -816,20 +1329,36 @@ __create_indirect_dptr()
     return indirect_dptr;
 }
 
-/* Writes data into the file */
+/* Writes data into the file, returns number of bytes written, less than
+   "size" when the disk is full or the file can not have more blocks */
 static
-void
-__write_data(inode* file, const char* buf, size_t size, off_t offset)
+size_t
+__write_data(inode* file, const char* buf, size_t size, off_t offset,
+             map_cursor* cur)
 {
+    // compressed clusters are written whole
+    if (__is_clustered(file)) {
+        return __write_clusters(file, buf, size, offset);
+    }
+    
     // find the starting data block
-    int start_block = (int)offset / BLOCK_SIZE;
-    printf("|---> start_block = %d\n", start_block); // log
+    int start_block = __block_of(offset);
+    trace("|---> start_block = %d\n", start_block); // log
     
     size_t curr = 0;
     size_t left = size;
     off_t written_off = 0;
-    off_t off = offset % BLOCK_SIZE;
-    printf("|---> off = %ld\n", off); // log
+    off_t off = __offset_in_block(offset);
+    trace("|---> off = %ld\n", off); // log
+    
+    // keep blocks of the file next to each other, an open file goes on
+    // from the block its last write stopped at
+    int goal = group_goal_dno(file->ino);
+    
+    if (cur != NULL) {
+        __cursor_attach(file, cur);
+        goal = (cur->goal >= 0) ? cur->goal : goal;
+    }
     
     // iterating through data blocks in the file
     for (int ii = start_block; ; ++ii) {
@@ -842,77 +1371,105 @@ __write_data(inode* file, const char* buf, size_t size, off_t offset)
         
         // increment offset by how much was written on previus itteration
         written_off += curr;
-        printf("|---> written_off = %ld\n", written_off); // log
+        trace("|---> written_off = %ld\n", written_off); // log
         
-        // update curr to be BLOCK_SIZE, or what is left
-        curr = (left > BLOCK_SIZE) ? BLOCK_SIZE : left;
+        // update curr to be rest of the block, or what is left
+        curr = (left > bsize - off) ? bsize - off : left;
         
-        // need to find next data block number
-        int dno;
+        // whole block which is already on the disk is shared
+        int whole = (curr == bsize);
+        uint64_t hash = 0;
         
-        // there still free data blocks in standart array
-        if (ii < BLOCKS_NUM) {
+        if (whole && dedup_active()) {
+            hash = dedup_hash(buf + written_off);
             
-            // get next data block number
-            dno = file->dptrs[ii];
-            
-            // if data block is not assigned, get one
-            if (dno < 0) {
-                dno = __get_free_dno();
-                file->dptrs[ii] = dno;
-                file->dnum += 1;
+            if (__dedup_block(file, ii, buf + written_off, hash, goal) >= 0) {
+                continue;
             }
         }
         
-        // no more data data block left in standart array
-        else {
-            
-            // there is no indirect dptr
-            if (file->indirect_dptr < 0) {
-                file->indirect_dptr = __create_indirect_dptr();
-                printf("|---> created new indirect pointer (%d)\n", // log
-                       file->indirect_dptr);
-            }
-            
-            int* indirect_dptrs = (int*)disk_get_dblock(file->indirect_dptr);
-            dno = indirect_dptrs[ii - BLOCKS_NUM];
-            printf("|---> addr[%d]\n", ii - BLOCKS_NUM); // log
-            
-            // if data block is not assigned, get one
-            if (dno < 0) {
-                dno = __get_free_dno();
-                indirect_dptrs[ii - BLOCKS_NUM] = dno;
-                file->dnum += 1;
-            }
+        // block of a hole which is written in part is cleared first
+        int fresh = !whole && __cursor_map(file, ii, cur) < 0;
+        
+        // need to find next data block number, get one if not assigned,
+        // shared block is copied before it is changed
+        int dno = __cursor_own(file, ii, goal, !whole, cur);
+        trace("|---> dno = %d\n", dno); // log
+        
+        // no space left for the data
+        if (dno < 0) {
+            break;
         }
         
-        printf("|---> dno = %ld\n", dno); // log
+        goal = dno + 1;
         
         // get next data block
         dblock* block = disk_get_dblock(dno);
+        tier_touch(dno);
+        
+        if (fresh) {
+            memset(block->data, 0, bsize);
+        }
 
         // copy data into current data block from "buf"
         memcpy(block->data + off, buf + written_off, curr);
         
+        // later copies of the block can share it
+        if (whole && dedup_active()) {
+            dedup_insert(hash, dno);
+        }
+        
         // make sure in the next block all data is written
         off = 0;
     }
+    
+    if (cur != NULL) {
+        cur->goal = goal;
+    }
+    
+    return size - left;
 }
 
 /* Writes data from "buf" into the file */
+static
 int
-disk_write(const char *path, const char *buf, size_t size, off_t offset)
+__do_write(const char *path, const char *buf, size_t size, off_t offset,
+           open_file* of)
 {
-    // inode does not exist
-    if (!__exists_inode(path)) return -ENOENT;
+    inode* file;
+    int rv = __lookup(path, &file);
+    if (rv < 0) return rv;
     
-    inode* file = __get_inode(path);
+    return __write_file(file, buf, size, offset, of);
+}
+
+/* Writes "size" bytes of "buf" into "file" at "offset", returns number of
+   bytes written */
+static
+int
+__write_file(inode* file, const char *buf, size_t size, off_t offset,
+             open_file* of)
+{
+    // file can not have blocks past its last triple indirect one
+    if (offset + size > (size_t)__max_file_size()) {
+        return -EFBIG;
+    }
     
     // write new data into the file
-    __write_data(file, buf, size, offset);
+    size_t done = __write_data(file, buf, size, offset,
+                               (of != NULL) ? &of->map : NULL);
     
-    // update file stat
-    file->size = file->size + size;
+    // nothing fit on the disk
+    if (done == 0 && size > 0) {
+        return -ENOSPC;
+    }
+    
+    size = done;
+    
+    // update file stat, writes inside of the file do not grow it
+    if (offset + size > (size_t)file->size) {
+        file->size = offset + size;
+    }
     
     // update time stamps
     time_t tt = time(NULL);
@@ -922,92 +1479,112 @@ disk_write(const char *path, const char *buf, size_t size, off_t offset)
     return size;
 }
 
-/* Free extra data blocks */
+/* Frees the blocks the indirect block "dno" of "depth" levels points to
+   from "path" on, all of them when "path" is NULL, and the block itself
+   when nothing is left in it, returns 1 if it was freed, freed blocks are
+   gathered in "run" */
 static
-void
-__truncate_down(inode* file, size_t size)
+int
+__free_tree(inode* file, int dno, int depth, const int* path, free_run* run)
 {
-    // find the starting data block
-    int new_size = (int)(file->size - size);
-    int start_block = new_size / BLOCK_SIZE;
-    printf("|---> start_block = %d\n", start_block); // log
+    int* ptrs = (int*)disk_get_dblock(dno);
+    int count = __ptrs_per_block();
+    int first = (path != NULL) ? path[0] : 0;
     
-    // free all direct inode data blocks after start block
-    for (int ii = start_block; ii < BLOCKS_NUM; ++ii) {
+    for (int ii = first; ii < count; ++ii) {
+        if (ptrs[ii] < 0) {
+            continue;
+        }
         
-        int dno = file->dptrs[ii];
+        // only the first block of the range can be cut in the middle
+        const int* rest = (path != NULL && ii == first) ? path + 1 : NULL;
         
-        // reached free data blocks
-        if (dno < 0) {
-            return;
+        if (depth > 1) {
+            if (__free_tree(file, ptrs[ii], depth - 1, rest, run)) {
+                ptrs[ii] = -1;
+            }
         }
         
-        // data block is not free
         else {
-            bmap_free(dmap, dno);
+            __run_put(run, ptrs[ii]);
+            ptrs[ii] = -1;
+            file->dnum -= 1;
         }
     }
     
-    // no indirect data blocks
-    if (file->indirect_dptr < 0) {
-        return;
+    // blocks before the range are still pointed to
+    for (int ii = 0; ii < count; ++ii) {
+        if (ptrs[ii] >= 0) {
+            return 0;
+        }
     }
     
-    // blocks starts after direct pointers
-    int indi_start_block;
-    if (start_block > BLOCKS_NUM) {
-        indi_start_block = start_block;
-    }
+    __run_put(run, dno);
     
-    // blocks started somewhere in direct pointers
-    else {
-        indi_start_block = 0;
+    return 1;
+}
+
+/* Frees the "from"-th block of the file and all blocks after it, holes
+   are skipped a whole indirect block at a time and adjacent blocks are
+   returned to their groups at once */
+static
+void
+__free_blocks(inode* file, int from)
+{
+    int path[INDIRECT_LEVELS];
+    int depth = __block_path(from, path);
+    
+    // file does not have such blocks
+    if (depth < 0) {
+        return;
     }
     
-    // free all inderect inode data blocks after start_block or 0
-    int* indirect_dptrs = (int*)disk_get_dblock(file->indirect_dptr);
+    free_run run = { 0, 0 };
     
-    int indir_blocks_count = BLOCK_SIZE / sizeof(int);
-    for (int ii = indi_start_block; ii < indir_blocks_count; ++ii) {
-        
-        int dno = indirect_dptrs[ii];
-        
-        // reached free data blocks
-        if (dno < 0) {
-            break;
+    // direct blocks from "from" on
+    for (int ii = (depth == 0) ? from : BLOCKS_NUM; ii < BLOCKS_NUM; ++ii) {
+        if (file->dptrs[ii] >= 0) {
+            __run_put(&run, file->dptrs[ii]);
+            file->dptrs[ii] = -1;
+            file->dnum -= 1;
         }
+    }
+    
+    // trees before the one holding "from" keep their blocks
+    for (int dd = max(depth, 1); dd <= INDIRECT_LEVELS; ++dd) {
+        int* root = __tree_root(file, dd);
+        const int* start = (dd == depth) ? path : NULL;
         
-        // data block is not free
-        else {
-            bmap_free(dmap, dno);
+        if (*root >= 0 && __free_tree(file, *root, dd, start, &run)) {
+            *root = -1;
         }
     }
     
-    if (indi_start_block == 0) {
-        // free the indirect pointer itself
-        bmap_free(dmap, file->indirect_dptr);
-    }
+    __run_flush(&run);
 }
 
-/* Add enough data blocks */
+/* Free extra data blocks */
 static
 void
-__truncate_up(inode* file, size_t size)
+__truncate_down(inode* file, size_t size)
 {
-    size_t new_size = file->size - size;
-    char* buf = malloc(new_size);
-    assert(buf != NULL);
-    
-    int offset = file->size;
+    // find the first data block past the new end
+    int start_block = __block_of(size + bsize - 1);
+    trace("|---> start_block = %d\n", start_block); // log
     
-    // fill buffer with zeroes
-    for (int ii = 0; ii < new_size; ++ii) {
-        buf[ii] = '\0';
-    }
+    __free_blocks(file, start_block);
     
-    __write_data(file, buf, new_size, offset);
+    // rest of the last block reads as zeroes when the file grows again
+    size_t off = __offset_in_block(size);
+    int lblk = __block_of(size);
     
-    free(buf);
+    if (off > 0 && __map_block(file, lblk, 0, 0) >= 0) {
+        int dno = __own_block(file, lblk, group_goal_dno(file->ino), 1);
+        
+        if (dno >= 0) {
+            memset(disk_get_dblock(dno)->data + off, 0, bsize - off);
+        }
+    }
 }
 
 /* Truncate file to the given size */
@@ -1020,23 +1597,30 @@ __truncate(inode* file, size_t size)
         return;
     }
     
+    // clustered files drop whole clusters
+    if (__is_clustered(file)) {
+        __truncate_clusters(file, size);
+        return;
+    }
+    
     // truncate to smaller size
     if (size < file->size) {
         __truncate_down(file, size);
     }
     
-    // truncate to bigger size
-    __truncate_up(file, size);
+    // bigger size leaves a hole which reads as zeroes, nothing is written
 }
 
 /* Truncates file to the given size */
+static
 int
-disk_truncate(const char *path, off_t size)
+__do_truncate(const char *path, off_t size)
 {
-    // inode does not exist
-    if (!__exists_inode(path)) return -ENOENT;
+    inode* file;
+    int rv = __lookup(path, &file);
+    if (rv < 0) return rv;
     
-    inode* file = __get_inode(path);
+    if (size > __max_file_size()) return -EFBIG;
     
     // truncate the file
     __truncate(file, size);
@@ -1053,294 +1637,2743 @@ disk_truncate(const char *path, off_t size)
 }
 
 
-/* ==================== DIRECTORY ========================================== */
-/* Creates new directory */
-int disk_mkdir(const char *path, mode_t mode)
+/* ==================== COMPRESSION ======================================== */
+/* Are reads and writes of the file done by whole clusters? */
+static
+int
+__is_clustered(const inode* file)
 {
-    return disk_mknod(path, DIRECTORY_MODE);
+    // only regular files are compressed
+    if (!S_ISREG(file->mode)) {
+        return 0;
+    }
+    
+    return (file->flags & (INODE_COMPRESS | INODE_CMAP)) != 0;
 }
 
-/* Removes directory */
-int disk_rmdir(const char *path)
+/* Returns how many index blocks are above the cluster map of the file */
+static
+int
+__cmap_depth(const inode* file)
 {
-    // inode does not exist
-    if (!__exists_inode(path)) return -ENOENT;
-    
-    // get parent directory inode
-    char* parent_dir_path = __parent_path(path);
-    inode* parent_dir = __get_inode(parent_dir_path);
-    
-    // get directory inode
-    inode* dir = __get_inode(path);
+    return (file->flags & INODE_CMAP_DEPTH) >> CMAP_DEPTH_SHIFT;
+}
+
+/* Returns new block of the cluster map filled with byte "fill", -1 if
+   there is no space */
+static
+int
+__new_cmap_block(inode* file, int fill)
+{
+    int dno = __get_free_dno(group_goal_dno(file->ino));
     
-    // directory is empty, delete it
-    if (dir->size == 0) {
-        dir_delete_inode(parent_dir, dir->ino);
-        // TODO: clean data blocks
-        return 0;
+    if (dno >= 0) {
+        memset(disk_get_dblock(dno)->data, fill, bsize);
     }
     
-    free(parent_dir_path);
-    
-    // directory is not empty
-    return -ENOTEMPTY;
+    return dno;
 }
 
-/* Lists the contents of a directory using "filler" into "buf" */
-int
-disk_readdir(const char *path, void *buf, fuse_fill_dir_t filler)
+/* Returns the compressed size of the cluster "cc", 0 for a raw cluster,
+   NULL if it has no place in the map and "create" is not set or there is
+   no space, the map gets a level of index blocks above it every time it
+   runs out of clusters like the block pointers of a file */
+static
+int*
+__cluster_slot(inode* file, int cc, int create)
 {
-    // inode does not exist
-    if (!__exists_inode(path)) return -ENOENT;
-    
-    // inode exists
-    inode* dir = __get_inode(path);
+    int ppb = __ptrs_per_block();
     
-    // create structrure for attributes
-    struct stat st;
+    if (!(file->flags & INODE_CMAP)) {
+        if (!create) {
+            return NULL;
+        }
+        
+        // every cluster written so far is raw
+        int dno = __new_cmap_block(file, 0);
+        if (dno < 0) {
+            return NULL;
+        }
+        
+        file->cmap_dptr = dno;
+        file->flags |= INODE_CMAP;
+    }
     
-    // update "st" struct
-    __update_stat(dir, &st);
-   
-    // add dir to the list
-    filler(buf, ".", &st, 0);
+    int depth = __cmap_depth(file);
+    int64_t span = ppb;
+    for (int ll = 0; ll < depth; ++ll) {
+        span *= ppb;
+    }
     
-    // get all entries in the directory
-    dblock* block = disk_get_dblock(dir->dptrs[0]);
-    dentry* entries = (dentry*)block;
+    // old map becomes the first one under a new index block
+    while (cc >= span) {
+        if (!create || depth == CMAP_LEVELS) {
+            return NULL;
+        }
+        
+        int dno = __new_cmap_block(file, 0xff);
+        if (dno < 0) {
+            return NULL;
+        }
+        
+        ((int*)disk_get_dblock(dno))[0] = file->cmap_dptr;
+        file->cmap_dptr = dno;
+        
+        depth += 1;
+        span *= ppb;
+        file->flags &= ~INODE_CMAP_DEPTH;
+        file->flags |= depth << CMAP_DEPTH_SHIFT;
+    }
     
-    int dentry_count = BLOCK_SIZE / sizeof(dentry);
+    int* slot = &file->cmap_dptr;
     
-    for (int ii = 0; ii < dentry_count; ++ii) {
+    for (int ll = depth; ll > 0; --ll) {
+        span /= ppb;
+        slot = (int*)disk_get_dblock(*slot) + cc / span;
+        cc %= span;
         
-        if (entries[ii].ino != -1) {
-            inode* node = __get_inode_from_ino(entries[ii].ino);
-            __update_stat(node, &st);
-            filler(buf, entries[ii].iname, &st, 0);
+        // clusters under a missing block are raw
+        if (*slot < 0) {
+            if (!create) {
+                return NULL;
+            }
+            
+            *slot = __new_cmap_block(file, (ll > 1) ? 0xff : 0);
+            if (*slot < 0) {
+                return NULL;
+            }
         }
     }
     
-    // update time stamps
-    time_t tt = time(NULL);
-    dir->atime = tt;
+    return (int*)disk_get_dblock(*slot) + cc;
+}
+
+/* Frees the cluster map block "dno" and the ones under its "depth" levels
+   of index blocks */
+static
+void
+__free_cmap(int dno, int depth)
+{
+    if (depth > 0) {
+        int* ptrs = (int*)disk_get_dblock(dno);
+        
+        for (int ii = 0; ii < __ptrs_per_block(); ++ii) {
+            if (ptrs[ii] >= 0) {
+                __free_cmap(ptrs[ii], depth - 1);
+            }
+        }
+    }
     
-    return 0;
+    discard_blocks(dno, 1);
+    tier_forget(dno, 1);
+    group_free_dno(dno);
 }
 
+/* Frees the "lblk"-th block of the file if it has one */
+static
+void
+__unmap_block(inode* file, int lblk)
+{
+    int* slot = __block_slot(file, lblk, 0, 0);
+    
+    if (slot != NULL && *slot >= 0) {
+        __put_dno(*slot);
+        *slot = -1;
+        file->dnum -= 1;
+    }
+}
 
-/* ========================= SYMLINKS ====================================== */
-/* Creates symlink "from" "to" */
+/* Returns how many bytes of the cluster "cc" are inside of the file */
+static
 int
-disk_symlink(const char *from, const char *to)
+__cluster_valid(int cc, size_t file_size)
 {
-    // "from" inode does not exist
-    if (!__exists_inode(from)) return -ENOENT;
+    size_t cluster_size = (size_t)CLUSTER_BLOCKS * bsize;
+    size_t start = (size_t)cc * cluster_size;
     
-    // "to" inode does exist
-    if (__exists_inode(to)) return -EEXIST;
-
-    // get path to the new directory
-    char* new_dir_path = __parent_path(to);
+    if (file_size <= start) {
+        return 0;
+    }
     
-    // new directory does not exist
-    if (!__exists_inode(new_dir_path)) return -ENOENT;
+    return (int)min(file_size - start, cluster_size);
+}
 
-    // get new directory node
-    inode* new_dir = __get_inode(new_dir_path);
-    
-    // get new filename
-    char* new_filename = __get_iname(to);
+/* Reads the cluster "cc" into "data", only "valid" bytes of it are taken
+   from the disk and the rest is zeroed, "tmp" holds the compressed data */
+static
+void
+__read_cluster(inode* file, int cc, int valid, char* data, char* tmp)
+{
+    int cluster_size = CLUSTER_BLOCKS * bsize;
+    int first = cc * CLUSTER_BLOCKS;
     
-    // create symbolic link
-    inode* file = __create_inode(new_dir, new_filename, SYMLINK_MODE);
+    int* slot = __cluster_slot(file, cc, 0);
+    int clen = (slot != NULL) ? *slot : 0;
+    int len = 0;
     
-    // save the link intp file data
-    dblock* block = disk_get_dblock(file->dptrs[0]);
-    strcpy(block->data, from);
-    file->size = strlen(from);
+    // compressed cluster is gathered from its first blocks
+    if (clen > 0 && valid > 0) {
+        int blks = div_up(clen, bsize);
+        
+        for (int ii = 0; ii < blks; ++ii) {
+            int dno = __map_block(file, first + ii, 0, 0);
+            assert(dno >= 0);
+            
+            memcpy(tmp + ii * bsize, disk_get_dblock(dno)->data, bsize);
+        }
+        
+        len = lz_decompress(tmp, clen, data, cluster_size);
+        
+        // corrupted cluster reads as zeroes
+        if (len < 0) {
+            fprintf(stderr, "|---> cluster %d of inode %d is corrupted\n",
+                    cc, file->ino);
+            len = 0;
+        }
+        
+        // truncated file keeps the rest of the cluster until it is written
+        len = min(len, valid);
+    }
     
-    free(new_filename);
-    free(new_dir_path);
+    // raw cluster is read block by block, missing blocks are zeroes
+    else {
+        for (; len < valid; len += bsize) {
+            int curr = min(bsize, valid - len);
+            int dno = __map_block(file, first + len / bsize, 0, 0);
+            
+            if (dno < 0) {
+                memset(data + len, 0, curr);
+            }
+            
+            else {
+                memcpy(data + len, disk_get_dblock(dno)->data, curr);
+            }
+        }
+        
+        len = valid;
+    }
     
-    return 0;
+    memset(data + len, 0, cluster_size - len);
 }
 
-/* Reads symlink */
+/* Writes "valid" bytes of the cluster "cc" from "data", compressed when
+   that saves a block, returns -ENOSPC with the cluster left as it was */
+static
 int
-disk_readlink(const char *path, char *buf, size_t size)
+__write_cluster(inode* file, int cc, int valid, const char* data, char* tmp)
 {
-    // inode does not exist
-    if (!__exists_inode(path)) return -ENOENT;
+    int first = cc * CLUSTER_BLOCKS;
+    int raw_blks = div_up(valid, bsize);
+    int clen = -1;
     
-    inode* file = __get_inode(path);
+    // compressed cluster has to fit in fewer blocks than the raw one
+    if ((file->flags & INODE_COMPRESS) && raw_blks > 1) {
+        clen = lz_compress(data, valid, tmp, (raw_blks - 1) * bsize);
+    }
     
-    // read data from the file
-    dblock* block = disk_get_dblock(file->dptrs[0]);
-    strncpy(buf, block->data, size);
+    // no space for the cluster map keeps the cluster raw
+    int* slot = __cluster_slot(file, cc, clen > 0);
+    if (slot == NULL) {
+        clen = -1;
+    }
     
-    // update time stamps
-    time_t tt = time(NULL);
-    file->atime = tt;
+    const char* src = (clen > 0) ? tmp : data;
+    int len = (clen > 0) ? clen : valid;
+    int blks = div_up(len, bsize);
+    
+    // all blocks are taken before anything is overwritten
+    int dnos[CLUSTER_BLOCKS];
+    int goal = (first > 0) ? __map_block(file, first - 1, 0, 0) + 1 : -1;
+    if (goal <= 0) {
+        goal = group_goal_dno(file->ino);
+    }
+    
+    for (int ii = 0; ii < blks; ++ii) {
+        dnos[ii] = __own_block(file, first + ii, goal, 0);
+        if (dnos[ii] < 0) return -ENOSPC;
+        
+        goal = dnos[ii] + 1;
+    }
+    
+    // tail of the last block is zeroed for the file to grow over it
+    for (int ii = 0; ii < blks; ++ii) {
+        char* block = disk_get_dblock(dnos[ii])->data;
+        int curr = min(bsize, len - ii * bsize);
+        
+        memcpy(block, src + ii * bsize, curr);
+        memset(block + curr, 0, bsize - curr);
+    }
+    
+    // blocks the cluster does not need any more
+    for (int ii = blks; ii < CLUSTER_BLOCKS; ++ii) {
+        __unmap_block(file, first + ii);
+    }
+    
+    if (slot != NULL) {
+        *slot = max(clen, 0);
+    }
     
     return 0;
 }
 
-
-
-
-/* ========================= MOUNT DISK ==================================== */
-/* Reinitialize NUFS with given data_file */
+/* Reads data of a clustered file one cluster at a time */
 static
 void
-remount_disk(const char* data_file)
+__read_clusters(inode* file, char* buf, size_t size, off_t offset)
 {
-    printf("|--NUFS: Start reinitializing old data file at %s\n", // log
-           data_file);
-    
-    struct stat st;
-    int rv = stat(data_file, &st);
-    assert(rv != -1);
-    size_t data_file_size = st.st_size;
-    assert(data_file_size <= ONE_MB);
-    printf("|--NUFS: Old data file size is %ld\n", data_file_size); // log
+    size_t cluster_size = (size_t)CLUSTER_BLOCKS * bsize;
+    char* data = malloc(cluster_size);
+    char* tmp = malloc(cluster_size);
+    assert(data != NULL && tmp != NULL);
+    
+    for (size_t done = 0; done < size; ) {
+        int cc = (offset + done) / cluster_size;
+        size_t off = (offset + done) % cluster_size;
+        size_t curr = min(cluster_size - off, size - done);
+        
+        __read_cluster(file, cc, __cluster_valid(cc, file->size), data, tmp);
+        memcpy(buf + done, data + off, curr);
+        
+        done += curr;
+    }
     
-    // open data file
-    int fd = open(data_file, O_RDWR, 0644);
-    assert(fd != -1);
-    printf("|--NUFS: Opened old data file\n"); // log
+    free(data);
+    free(tmp);
+}
+
+/* Writes data of a clustered file one cluster at a time, returns number
+   of bytes written */
+static
+size_t
+__write_clusters(inode* file, const char* buf, size_t size, off_t offset)
+{
+    size_t cluster_size = (size_t)CLUSTER_BLOCKS * bsize;
+    size_t new_size = (offset + size > (size_t)file->size) ? offset + size
+                                                           : file->size;
     
-    // truncate data file to 1MB
-    rv = ftruncate(fd, ONE_MB);
-    assert(rv != -1);
-    printf("|--NUFS: Truncated old data file to %ld\n", ONE_MB); // log
+    char* data = malloc(cluster_size);
+    char* tmp = malloc(cluster_size);
+    assert(data != NULL && tmp != NULL);
     
-    // mmap data file into memory
-    sblock = mmap(NULL, data_file_size,
-                  PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    assert(sblock != NULL);
-    printf("|--NUFS: Mmaped old data file in memmory\n"); // log
+    size_t done = 0;
     
-    // close file descriptor of the data file
-    rv = close(fd);
-    assert(rv != -1);
-    printf("|--NUFS: Closed file descriptor of the old data file\n"); // log
+    while (done < size) {
+        int cc = (offset + done) / cluster_size;
+        size_t off = (offset + done) % cluster_size;
+        size_t curr = min(cluster_size - off, size - done);
+        int valid = __cluster_valid(cc, new_size);
+        
+        // cluster which is only partly overwritten is read first
+        if (off > 0 || curr < valid) {
+            __read_cluster(file, cc, __cluster_valid(cc, file->size),
+                           data, tmp);
+        }
+        
+        memcpy(data + off, buf + done, curr);
+        
+        // no space left for the data
+        if (__write_cluster(file, cc, valid, data, tmp) < 0) {
+            break;
+        }
+        
+        done += curr;
+    }
     
-    // update relative pointers
-    imap = sblock->imap + (char*)sblock;
-    iptr = sblock->iptr + (char*)sblock;
-    dmap = sblock->dmap + (char*)sblock;
-    dptr = sblock->dptr + (char*)sblock;
-    printf("|--NUFS: Updated relative pointers\n"); // log
+    free(data);
+    free(tmp);
     
-    // update root pointer
-    root_ino = sblock->root_ino;
-    inode* root = __get_inode_from_ino(root_ino);
-    root->atime = time(NULL);
-    printf("|--NUFS: Updated root pointer\n"); // log
-}
-
-/* Calculate number of inodes in the FS of the given data file size */
-static
-int
-__get_max_inum(size_t data_file_size)
-{
-    return (data_file_size * 4 - sizeof(superblock) * 4)
-    /(sizeof(inode) * 4 + sizeof(dblock) * 4 + 2);
+    return done;
 }
 
-/* Creates new disk for NUFS (1MB size) at given data_file path */
+/* Frees clusters past "size", the last one is written again without
+   the bytes which are cut off */
 static
 void
-create_disk(const char* data_file)
+__truncate_clusters(inode* file, size_t size)
 {
-    // update NUFS LOG
-    printf("|--NUFS: Start creation of new disk at %s\n", data_file); // log
+    size_t cluster_size = (size_t)CLUSTER_BLOCKS * bsize;
     
-    size_t data_file_size = ONE_MB;
+    // growing file reads zeroes past the old end
+    if (size > file->size) {
+        return;
+    }
     
-    // create data file
-    int fd = open(data_file, O_RDWR | O_CREAT, 0644);
-    assert(fd != -1);
-    printf("|--NUFS: Created new data file\n"); // log
+    // div_up() of an empty file would wrap around
+    int keep = (size > 0) ? div_up(size, cluster_size) : 0;
+    int old = (file->size > 0) ? div_up(file->size, cluster_size) : 0;
     
-    // truncate data file to 1MB
-    int rv = ftruncate(fd, data_file_size);
-    assert(rv != -1);
-    printf("|--NUFS: Truncated new data file to %ld\n", data_file_size); // log
+    for (int cc = keep; cc < old; ++cc) {
+        for (int ii = 0; ii < CLUSTER_BLOCKS; ++ii) {
+            __unmap_block(file, cc * CLUSTER_BLOCKS + ii);
+        }
+        
+        int* slot = __cluster_slot(file, cc, 0);
+        if (slot != NULL) {
+            *slot = 0;
+        }
+    }
     
-    // mmap data file into memory
-    sblock = mmap(NULL, data_file_size,
-                 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    assert(sblock != NULL);
-    printf("|--NUFS: Mmaped data file into memory\n"); // log
+    // file is empty or ends on a cluster boundary
+    if (size % cluster_size == 0) {
+        return;
+    }
     
-    // close file descriptor of the data file
-    rv = close(fd);
-    assert(rv != -1);
-    printf("|--NUFS: Closed data file\n"); // log
-    
-    // get number of inodes and data blocks
-    sblock->inum = __get_max_inum(data_file_size);
-    sblock->dnum = sblock->inum;
-    printf("|--NUFS: Calculated number of inodes: %d\n",
-           sblock->inum); // log
-    printf("|--NUFS: Calculated number of data blocks: %d\n",
-           sblock->dnum); // log
-    
-    // calculate sizes of bitmaps and iptr region
-    size_t imap_size = div_up(sblock->inum, 4);
-    size_t dmap_size = div_up(sblock->dnum, 4);
-    size_t iptr_size = sblock->inum * sizeof(inode);
-    printf("|--NUFS: Calculated imap_size: %ld\n", imap_size); // log
-    printf("|--NUFS: Calculated dmap_size: %ld\n", dmap_size); // log
-    printf("|--NUFS: Calculated iptr_size: %ld\n", iptr_size); // log
-    
-    // get pointers to the virtual disk adresses
-    imap = ((char*)sblock) + sizeof(superblock);
-    dmap = imap + imap_size;
-    iptr = dmap + dmap_size;
-    dptr = iptr + iptr_size;
-    printf("|--NUFS: Got pointers to virtual disk\n"); // log
-    
-    // update relative pointers in superblock
-    sblock->imap = imap - (char*)sblock;
-    sblock->dmap = dmap - (char*)sblock;
-    sblock->iptr = iptr - (char*)sblock;
-    sblock->dptr = dptr - (char*)sblock;
-    printf("|--NUFS: Updated relative pointers\n"); // log
-    
-    // initialize bitmaps
-    bmap_init(imap, imap_size);
-    bmap_init(dmap, dmap_size);
+    int valid = size % cluster_size;
     
-    // create root inode
-    inode* root = __create_inode(NULL, NULL, DIRECTORY_MODE);
-    sblock->root_ino = root->ino;
-    root_ino = root->ino;
-    printf("|--NUFS: Created new root with ino %d\n", root_ino); // log
+    char* data = malloc(cluster_size);
+    char* tmp = malloc(cluster_size);
+    assert(data != NULL && tmp != NULL);
     
-    // initialize root directory
-    // dir_init(root, root_ino);
-    // printf("|--NUFS: Initialized new root as directory\n"); // log
+    __read_cluster(file, keep - 1, valid, data, tmp);
+    __write_cluster(file, keep - 1, valid, data, tmp);
     
-    printf("|--NUFS: Created new disk\n"); // log
+    free(data);
+    free(tmp);
 }
 
-/* Initializes disk for NUFS in data_file */
-void
-disk_mount(const char* data_file)
+
+
+
+/* ==================== SHARED BLOCKS ====================================== */
+/* Can blocks of the disk have more than one owner? */
+static
+int
+__has_rmap()
 {
+    return sblock->rmap > 0;
+}
+
+/* Returns pointer to the count of extra owners of the data block "dno" */
+static
+unsigned short*
+__rmap_at(int dno)
+{
+    // count block is read through the cache
+    if (rmap == NULL) {
+        size_t offset = (size_t)dno * sizeof(unsigned short);
+        char* block = bcache_get(rmap_blk + __block_of(offset));
+        
+        return (unsigned short*)(block + __offset_in_block(offset));
+    }
+    
+    return rmap + dno;
+}
+
+/* Marks the count of the data block "dno" as changed */
+static
+void
+__rmap_dirty(int dno)
+{
+    if (rmap == NULL) {
+        size_t offset = (size_t)dno * sizeof(unsigned short);
+        bcache_dirty(rmap_blk + __block_of(offset));
+    }
+}
+
+/* Adds an owner to the data block "dno", returns 0 if it can not have more */
+static
+int
+__share_dno(int dno)
+{
+    if (!__has_rmap()) {
+        return 0;
+    }
+    
+    unsigned short* owners = __rmap_at(dno);
+    if (*owners == USHRT_MAX) {
+        return 0;
+    }
+    
+    *owners += 1;
+    __rmap_dirty(dno);
+    
+    return 1;
+}
+
+/* Removes an owner of the data block "dno", the last one frees it */
+static
+void
+__put_dno(int dno)
+{
+    free_run run = { 0, 0 };
+    
+    __run_put(&run, dno);
+    __run_flush(&run);
+}
+
+/* Removes an owner of the data block "dno" like __put_dno(), the last one
+   adds it to "run", blocks next to the run grow it */
+static
+void
+__run_put(free_run* run, int dno)
+{
+    // open files look their block pointers up again
+    map_gen += 1;
+    
+    // other blocks of files still point to it
+    if (__is_shared(dno)) {
+        *__rmap_at(dno) -= 1;
+        __rmap_dirty(dno);
+        return;
+    }
+    
+    if (run->count > 0 && dno == run->first + run->count) {
+        run->count += 1;
+        return;
+    }
+    
+    if (run->count > 0 && dno == run->first - 1) {
+        run->first = dno;
+        run->count += 1;
+        return;
+    }
+    
+    __run_flush(run);
+    
+    run->first = dno;
+    run->count = 1;
+}
+
+/* Returns the blocks of "run" to their groups, the run is empty after */
+static
+void
+__run_flush(free_run* run)
+{
+    if (run->count > 0) {
+        discard_blocks(run->first, run->count);
+        tier_forget(run->first, run->count);
+        group_free_range(run->first, run->count);
+    }
+    
+    run->count = 0;
+}
+
+/* Does more than one block of the files point to the data block "dno"? */
+static
+int
+__is_shared(int dno)
+{
+    return __has_rmap() && *__rmap_at(dno) > 0;
+}
+
+/* Returns dno of the "lblk"-th block of the file which can be written,
+   a shared block is replaced by a copy, with its data if "keep" is set,
+   -1 if there is no space */
+static
+int
+__own_block(inode* file, int lblk, int goal, int keep)
+{
+    int dno = __map_block(file, lblk, 1, goal);
+    
+    if (dno < 0 || !__is_shared(dno)) {
+        return dno;
+    }
+    
+    int copy = __get_free_dno(goal);
+    if (copy < 0) {
+        return -1;
+    }
+    
+    // block which is written whole does not need the old data
+    if (keep) {
+        memcpy(disk_get_dblock(copy)->data, disk_get_dblock(dno)->data, bsize);
+    }
+    
+    *__block_slot(file, lblk, 0, 0) = copy;
+    __put_dno(dno);
+    trace("|---> copied shared block %d to %d\n", dno, copy); // log
+    
+    return copy;
+}
+
+/* Points the "lblk"-th block of the file to a block which holds "data",
+   returns its dno or -1 if no such block is known */
+static
+int
+__dedup_block(inode* file, int lblk, const char* data, uint64_t hash, int goal)
+{
+    int dno = dedup_find(hash);
+    
+    // index is not updated when blocks are freed or written again
+    if (dno < 0 || bmap_isfree(dmap, dno)) {
+        return -1;
+    }
+    
+    if (memcmp(disk_get_dblock(dno)->data, data, bsize) != 0) {
+        return -1;
+    }
+    
+    int old = __map_block(file, lblk, 0, 0);
+    
+    // block already points there
+    if (old == dno) {
+        return dno;
+    }
+    
+    int* slot = __block_slot(file, lblk, 1, goal);
+    if (slot == NULL || !__share_dno(dno)) {
+        return -1;
+    }
+    
+    if (old >= 0) {
+        __put_dno(old);
+    }
+    
+    else {
+        file->dnum += 1;
+    }
+    
+    *slot = dno;
+    trace("|---> shared block %d\n", dno); // log
+    
+    return dno;
+}
+
+
+
+
+/* Points the "d"-th block of "dst" to the "s"-th block of "src",
+   returns -1 if the block can not get one more owner */
+static
+int
+__share_block(inode* src, int s, inode* dst, int d)
+{
+    int dno = __map_block(src, s, 0, 0);
+    
+    // hole of the source is a hole of the copy
+    if (dno < 0) {
+        __unmap_block(dst, d);
+        return 0;
+    }
+    
+    int* slot = __block_slot(dst, d, 1, dno);
+    if (slot == NULL) {
+        return -1;
+    }
+    
+    // block already points there
+    if (*slot == dno) {
+        return 0;
+    }
+    
+    if (!__share_dno(dno)) {
+        return -1;
+    }
+    
+    if (*slot >= 0) {
+        __put_dno(*slot);
+    }
+    
+    else {
+        dst->dnum += 1;
+    }
+    
+    *slot = dno;
+    
+    return 0;
+}
+
+/* Copies "len" bytes of "src" from "from_off" to "dst" at "to_off"
+   through a buffer */
+static
+void
+__copy_range(inode* src, off_t from_off, inode* dst, off_t to_off, size_t len)
+{
+    char* buf = malloc(bsize);
+    assert(buf != NULL);
+    
+    for (size_t done = 0; done < len; ) {
+        size_t curr = min(bsize, len - done);
+        
+        __read_data(src, buf, curr, from_off + done, NULL);
+        __write_data(dst, buf, curr, to_off + done, NULL);
+        
+        done += curr;
+    }
+    
+    free(buf);
+}
+
+/* Copies "len" bytes of file "from" at "from_off" into file "to" at
+   "to_off", whole blocks are shared, returns number of bytes copied */
+static
+int
+__do_clone_range(const char *from, off_t from_off,
+                 const char *to, off_t to_off, size_t len)
+{
+    // ranges come from any user of the mount through the ioctl
+    if (from_off < 0 || to_off < 0 || len > INT64_MAX
+        || (int64_t)len > INT64_MAX - from_off
+        || (int64_t)len > INT64_MAX - to_off) {
+        return -EINVAL;
+    }
+    
+    inode* src;
+    int rv = __lookup(from, &src);
+    if (rv < 0) return rv;
+    
+    inode* dst;
+    rv = __lookup(to, &dst);
+    if (rv < 0) return rv;
+    
+    // only data of regular files is copied
+    if (!S_ISREG(src->mode) || !S_ISREG(dst->mode)) return -EINVAL;
+    
+    // nothing to copy past the end of the source
+    if (from_off >= src->size) return 0;
+    
+    if (len == 0 || from_off + len > src->size) {
+        len = src->size - from_off;
+    }
+    
+    if (to_off + len > (size_t)__max_file_size()) return -EFBIG;
+    
+    // ranges of one file can not overlap
+    if (src == dst && from_off < to_off + len && to_off < from_off + len) {
+        return -EINVAL;
+    }
+    
+    size_t done = 0;
+    
+    // blocks line up in both files, the disk counts owners and
+    // clusters of compressed files are not split
+    if (__offset_in_block(from_off) == __offset_in_block(to_off)
+        && __has_rmap() && !__is_clustered(src) && !__is_clustered(dst)) {
+        
+        // part of the first block is copied
+        done = min((bsize - __offset_in_block(from_off)) % bsize, len);
+        __copy_range(src, from_off, dst, to_off, done);
+        
+        for (; len - done >= bsize; done += bsize) {
+            int s = __block_of(from_off + done);
+            int d = __block_of(to_off + done);
+            
+            // block has as many owners as it can count
+            if (__share_block(src, s, dst, d) < 0) {
+                __copy_range(src, from_off + done, dst, to_off + done, bsize);
+            }
+        }
+    }
+    
+    // the rest is copied
+    __copy_range(src, from_off + done, dst, to_off + done, len - done);
+    
+    // update file stat
+    if (to_off + len > (size_t)dst->size) {
+        dst->size = to_off + len;
+    }
+    
+    // update time stamps
+    time_t tt = time(NULL);
+    dst->atime = tt;
+    dst->mtime = tt;
+    
+    trace("|---> cloned %ld bytes\n", len); // log
+    
+    return len;
+}
+
+
+
+
+/* ==================== COMPACTION ========================================= */
+/* Moves the block in "slot" into the lowest free block when it is at or
+   past the limit, shared blocks stay, the old block is kept in "cs" */
+static
+void
+__compact_slot(int* slot, compact_state* cs)
+{
+    int old = *slot;
+    
+    // step is full, or other files point to it too
+    if (cs->count == COMPACT_BATCH || old < cs->limit || __is_shared(old)) {
+        return;
+    }
+    
+    int dno = __get_free_dno(cs->low);
+    if (dno < 0) {
+        return;
+    }
+    
+    // nothing is free before it
+    if (dno >= old) {
+        __put_dno(dno);
+        return;
+    }
+    
+    memcpy(disk_get_dblock(dno), disk_get_dblock(old), bsize);
+    *slot = dno;
+    
+    // open files must not write to the old block before it is freed
+    map_gen += 1;
+    
+    cs->low = dno + 1;
+    cs->old[cs->count++] = old;
+}
+
+/* Moves the indirect block in "slot" of "depth" levels and the blocks
+   under it */
+static
+void
+__compact_tree(int* slot, int depth, compact_state* cs)
+{
+    if (*slot < 0) {
+        return;
+    }
+    
+    __compact_slot(slot, cs);
+    
+    int* ptrs = (int*)disk_get_dblock(*slot);
+    int count = __ptrs_per_block();
+    
+    for (int ii = 0; ii < count && cs->count < COMPACT_BATCH; ++ii) {
+        if (depth > 1) {
+            __compact_tree(&ptrs[ii], depth - 1, cs);
+        }
+        
+        else if (ptrs[ii] >= 0) {
+            __compact_slot(&ptrs[ii], cs);
+        }
+    }
+}
+
+/* Moves up to COMPACT_BATCH blocks of the file which are past the limit */
+static
+void
+__compact_inode(inode* node, compact_state* cs)
+{
+    for (int ii = 0; ii < BLOCKS_NUM; ++ii) {
+        if (node->dptrs[ii] >= 0) {
+            __compact_slot(&node->dptrs[ii], cs);
+        }
+    }
+    
+    // index blocks of the cluster map point to blocks like indirect ones
+    if (node->flags & INODE_CMAP) {
+        if (__cmap_depth(node) == 0) {
+            __compact_slot(&node->cmap_dptr, cs);
+        }
+        
+        else {
+            __compact_tree(&node->cmap_dptr, __cmap_depth(node), cs);
+        }
+    }
+    
+    for (int dd = 1; dd <= INDIRECT_LEVELS; ++dd) {
+        __compact_tree(__tree_root(node, dd), dd, cs);
+    }
+}
+
+
+
+
+/* ==================== DIRECTORY ========================================== */
+/* Creates new directory */
+static
+int
+__do_mkdir(const char *path, mode_t mode)
+{
+    return __do_mknod(path, DIRECTORY_MODE);
+}
+
+/* Removes directory */
+static
+int
+__do_rmdir(const char *path)
+{
+    path_res res;
+    int rv = __resolve(path, &res);
+    if (rv < 0) return rv;
+    
+    // inode does not exist
+    if (res.node == NULL) return -ENOENT;
+    
+    // inode is not a directory
+    if (!is_dir(res.node)) return -ENOTDIR;
+    
+    // root can not be removed
+    if (res.dir == NULL) return -EBUSY;
+    
+    // directory is not empty
+    if (!dir_is_empty(res.node)) return -ENOTEMPTY;
+    
+    // directory is empty, delete it with its data blocks
+    dir_delete_name(res.dir, res.leaf, res.leaf_len);
+    __delete_inode(res.node);
+    
+    return 0;
+}
+
+/* Lists the contents of a directory using "filler" into "buf" */
+static
+int
+__do_readdir(const char *path, void *buf, disk_fill_fn filler)
+{
+    inode* dir;
+    int rv = __lookup(path, &dir);
+    if (rv < 0) return rv;
+    
+    // inode is not a directory
+    if (!is_dir(dir)) return -ENOTDIR;
+    
+    // create structrure for attributes
+    struct stat st;
+    
+    // update "st" struct
+    __update_stat(dir, &st);
+   
+    // add dir to the list, the filler stops it when it is full
+    int stop = filler(buf, ".", &st);
+    
+    // get all entries in the directory
+    int dentry_count = dir_dentry_count();
+    
+    for (int blk = 0; blk < dir->dnum && !stop; ++blk) {
+        dentry* entries = dir_get_dentry(dir, blk);
+        
+        for (int ii = 0; ii < dentry_count && !stop; ++ii) {
+            
+            if (entries[ii].ino != -1) {
+                inode* node = __get_inode_from_ino(entries[ii].ino);
+                __update_stat(node, &st);
+                stop = filler(buf, entries[ii].iname, &st);
+            }
+        }
+    }
+    
+    // update time stamps
+    atime_touch(dir);
+    
+    return 0;
+}
+
+
+/* ========================= SYMLINKS ====================================== */
+/* Creates symlink "from" "to" */
+static
+int
+__do_symlink(const char *from, const char *to)
+{
+    // link target is kept in one data block
+    size_t from_len = strlen(from);
+    if (from_len >= (size_t)bsize) return -ENAMETOOLONG;
+    
+    path_res res;
+    int rv = __resolve(to, &res);
+    if (rv < 0) return rv;
+    
+    // "to" inode does exist
+    if (res.node != NULL) return -EEXIST;
+    
+    // create symbolic link
+    inode* file = __create_inode(res.dir, res.leaf, res.leaf_len,
+                                 SYMLINK_MODE);
+    if (file == NULL) return -ENOSPC;
+    
+    // save the link intp file data
+    dblock* block = disk_get_dblock(file->dptrs[0]);
+    memcpy(block->data, from, from_len + 1);
+    file->size = from_len;
+    
+    return 0;
+}
+
+/* Reads symlink */
+static
+int
+__do_readlink(const char *path, char *buf, size_t size)
+{
+    inode* file;
+    int rv = __lookup(path, &file);
+    if (rv < 0) return rv;
+    
+    // read data from the file
+    dblock* block = disk_get_dblock(file->dptrs[0]);
+    strncpy(buf, block->data, size);
+    
+    // update time stamps
+    atime_touch(file);
+    
+    return 0;
+}
+
+
+
+
+/* ========================= OPEN INODES =================================== */
+/* Gets inode "ino" which was looked up before, -ESTALE if it is deleted
+   or waits on the orphan list to be */
+static
+int
+__get_open_inode(const int ino, inode** node)
+{
+    if (ino < 0 || ino >= sblock->inum || bmap_isfree(imap, ino)) {
+        return -ESTALE;
+    }
+    
+    *node = __get_inode_from_ino(ino);
+    
+    return ((*node)->nlink == 0) ? -ESTALE : 0;
+}
+
+/* Returns ino of the node at "path" */
+static
+int
+__do_lookup(const char *path)
+{
+    inode* node;
+    int rv = __lookup(path, &node);
+    
+    return (rv < 0) ? rv : node->ino;
+}
+
+/* Gets attributes of inode "ino" into "st" */
+static
+int
+__do_getattr_ino(const int ino, struct stat *st)
+{
+    inode* node;
+    int rv = __get_open_inode(ino, &node);
+    if (rv < 0) return rv;
+    
+    __update_stat(node, st);
+    
+    return 0;
+}
+
+/* Reads from inode "ino" like __do_read() without walking a path */
+static
+int
+__do_read_ino(const int ino, char *buf, size_t size, off_t offset,
+              open_file* of)
+{
+    inode* file;
+    int rv = __get_open_inode(ino, &file);
+    if (rv < 0) return rv;
+    
+    if (is_dir(file)) return -EISDIR;
+    
+    return __read_file(file, buf, size, offset, of);
+}
+
+/* Writes into inode "ino" like __do_write() without walking a path */
+static
+int
+__do_write_ino(const int ino, const char *buf, size_t size, off_t offset,
+               open_file* of)
+{
+    inode* file;
+    int rv = __get_open_inode(ino, &file);
+    if (rv < 0) return rv;
+    
+    if (is_dir(file)) return -EISDIR;
+    
+    return __write_file(file, buf, size, offset, of);
+}
+
+
+
+
+/* ========================= ORPHANS ======================================= */
+/* Puts the inode which lost its last name on the orphan list, unlink
+   returns right away and the reclaimer frees the blocks later */
+static
+void
+__orphan_add(inode* node)
+{
+    pthread_mutex_lock(&orphan_lock);
+    
+    node->next_orphan = sblock->orphans;
+    sblock->orphans = node->ino;
+    
+    pthread_cond_signal(&orphan_wake);
+    pthread_mutex_unlock(&orphan_lock);
+}
+
+/* Takes "ino" off the orphan list, orphan_lock must be held */
+static
+void
+__orphan_remove(const int ino)
+{
+    int* link = &sblock->orphans;
+    
+    while (*link != ino) {
+        assert(*link >= 0);
+        link = &__get_inode_from_ino(*link)->next_orphan;
+    }
+    
+    *link = __get_inode_from_ino(ino)->next_orphan;
+}
+
+/* Frees the last RECLAIM_BATCH blocks of the first orphan, the inode goes
+   with its last batch, returns 0 if there are no orphans, the reclaimer
+   and allocations on a full disk take batches one at a time */
+static
+int
+__reclaim_step()
+{
+    pthread_mutex_lock(&reclaim_lock);
+    
+    pthread_mutex_lock(&orphan_lock);
+    int ino = sblock->orphans;
+    pthread_mutex_unlock(&orphan_lock);
+    
+    if (ino < 0) {
+        pthread_mutex_unlock(&reclaim_lock);
+        return 0;
+    }
+    
+    bcache_op_begin();
+    inode* node = __get_inode_from_ino(ino);
+    
+    int nblocks = __block_of(node->size + bsize - 1);
+    int from = max(nblocks - RECLAIM_BATCH, 0);
+    
+    // file gets shorter until one batch is left
+    if (from > 0) {
+        __free_blocks(node, from);
+        node->size = (int64_t)from * bsize;
+    }
+    
+    else {
+        pthread_mutex_lock(&orphan_lock);
+        __orphan_remove(ino);
+        pthread_mutex_unlock(&orphan_lock);
+        
+        __delete_inode(node);
+    }
+    
+    bcache_op_end(1);
+    pthread_mutex_unlock(&reclaim_lock);
+    
+    return 1;
+}
+
+/* Frees blocks of orphans one batch at a time until unmount */
+static
+void*
+__reclaimer_main(void* arg)
+{
+    pthread_mutex_lock(&orphan_lock);
+    
+    while (reclaiming) {
+        // sleep until unlink leaves an orphan
+        if (sblock->orphans < 0) {
+            pthread_cond_wait(&orphan_wake, &orphan_lock);
+            continue;
+        }
+        
+        // unlinks and unmount get the lock between batches, owner counts,
+        // map_gen and the bitmaps are changed by operations without locks
+        // so a batch runs between them
+        pthread_mutex_unlock(&orphan_lock);
+        
+        bcache_op_begin_alone();
+        __reclaim_step();
+        bcache_op_end(0);
+        
+        pthread_mutex_lock(&orphan_lock);
+    }
+    
+    pthread_mutex_unlock(&orphan_lock);
+    
+    return NULL;
+}
+
+/* Starts the reclaimer, orphans left by a crash are freed first */
+static
+void
+__start_reclaimer()
+{
+    // snapshots do not change
+    if (read_only) {
+        return;
+    }
+    
+    int count = 0;
+    
+    bcache_op_begin();
+    for (int ino = sblock->orphans; ino >= 0; ++count) {
+        ino = __get_inode_from_ino(ino)->next_orphan;
+    }
+    bcache_op_end(0);
+    
+    if (count > 0) {
+        trace("|--NUFS: Replaying %d orphans\n", count); // log
+    }
+    
+    reclaiming = 1;
+    int rv = pthread_create(&reclaimer, NULL, __reclaimer_main, NULL);
+    assert(rv == 0);
+}
+
+/* Stops the reclaimer after its current batch, orphans it did not get to
+   stay on the list in the data file */
+static
+void
+__stop_reclaimer()
+{
+    pthread_mutex_lock(&orphan_lock);
+    
+    int running = reclaiming;
+    reclaiming = 0;
+    
+    pthread_cond_signal(&orphan_wake);
+    pthread_mutex_unlock(&orphan_lock);
+    
+    if (running) {
+        pthread_join(reclaimer, NULL);
+    }
+}
+
+
+
+
+/* ========================= CHECKPOINTS =================================== */
+/* Writes the blocks of the metadata kept in memory which changed since
+   the last checkpoint into the data file, returns 0 or -ERRNO */
+static
+int
+__write_metadata()
+{
+    assert(meta_shadow != NULL);
+    
+    int chunks = div_up(meta_size, bsize);
+    blkdev_io* ios = malloc(chunks * sizeof(blkdev_io));
+    assert(ios != NULL);
+    int num = 0;
+    
+    for (size_t off = 0; off < meta_size; off += bsize) {
+        size_t len = (meta_size - off < (size_t)bsize) ? meta_size - off
+                                                       : (size_t)bsize;
+        char* block = (char*)sblock + off;
+        
+        if (memcmp(block, meta_shadow + off, len) == 0) {
+            continue;
+        }
+        
+        memcpy(meta_shadow + off, block, len);
+        
+        ios[num].buf = block;
+        ios[num].len = len;
+        ios[num].offset = off;
+        ios[num].write = 1;
+        num += 1;
+    }
+    
+    int rv = blkdev_submit(ios, num);
+    free(ios);
+    
+    return rv;
+}
+
+/* Waits on ckpt_wake until unmount or "ms" milliseconds pass, or an
+   eviction asks for a checkpoint when "asked" is set, ckpt_lock has to
+   be held */
+static
+void
+__checkpointer_wait(const long ms, const int asked)
+{
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    
+    long nsec = until.tv_nsec + (ms % 1000) * 1000000;
+    until.tv_sec += ms / 1000 + nsec / 1000000000;
+    until.tv_nsec = nsec % 1000000000;
+    
+    int rv = 0;
+    while (checkpointing && !(asked && ckpt_asked) && rv != ETIMEDOUT) {
+        rv = pthread_cond_timedwait(&ckpt_wake, &ckpt_lock, &until);
+    }
+}
+
+/* Takes a checkpoint every "ckpt_interval" seconds until unmount, and
+   soon after the cache wrote back a block, so the metadata which leads
+   to it follows */
+static
+void*
+__checkpointer_main(void* arg)
+{
+    pthread_mutex_lock(&ckpt_lock);
+    
+    while (checkpointing) {
+        __checkpointer_wait(ckpt_interval * 1000L, 1);
+        if (!checkpointing) break;
+        
+        int asked = ckpt_asked;
+        ckpt_asked = 0;
+        
+        // operations wait for the checkpoint, unmount does not
+        pthread_mutex_unlock(&ckpt_lock);
+        int rv = disk_checkpoint();
+        pthread_mutex_lock(&ckpt_lock);
+        
+        if (rv < 0) {
+            fprintf(stderr, "|--NUFS: Checkpoint failed (%d)\n", rv);
+        }
+        
+        // evictions of a long write do not stop operations all the time
+        if (asked) {
+            __checkpointer_wait(EVICT_CKPT_GAP, 0);
+        }
+    }
+    
+    pthread_mutex_unlock(&ckpt_lock);
+    
+    return NULL;
+}
+
+/* Asks the checkpointer for a checkpoint, the cache evicted a dirty block */
+static
+void
+__ask_checkpoint()
+{
+    if (ckpt_asked) {
+        return;
+    }
+    
+    pthread_mutex_lock(&ckpt_lock);
+    ckpt_asked = 1;
+    pthread_cond_signal(&ckpt_wake);
+    pthread_mutex_unlock(&ckpt_lock);
+}
+
+/* Starts taking checkpoints of a cached disk every "ckpt_interval"
+   seconds and after evictions, 0 leaves them to requests and unmount */
+static
+void
+__start_checkpointer()
+{
+    if (meta_shadow == NULL || ckpt_interval <= 0) {
+        return;
+    }
+    
+    checkpointing = 1;
+    ckpt_asked = 0;
+    
+    int rv = pthread_create(&checkpointer, NULL, __checkpointer_main, NULL);
+    assert(rv == 0);
+    
+    bcache_on_evict(__ask_checkpoint);
+}
+
+/* Stops the checkpointer, unmount takes the last checkpoint */
+static
+void
+__stop_checkpointer()
+{
+    if (bcache_active()) {
+        bcache_on_evict(NULL);
+    }
+    
+    pthread_mutex_lock(&ckpt_lock);
+    
+    int running = checkpointing;
+    checkpointing = 0;
+    
+    pthread_cond_signal(&ckpt_wake);
+    pthread_mutex_unlock(&ckpt_lock);
+    
+    if (running) {
+        pthread_join(checkpointer, NULL);
+    }
+}
+
+
+
+
+/* ========================= EXTENDED ATTRIBUTES =========================== */
+/* Sets an attribute, only COMPRESS_XATTR of "1" or "0" is supported,
+   returns 1 when COMPACT_XATTR is set on the root and 2 for
+   CHECKPOINT_XATTR */
+static
+int
+__do_setxattr(const char *path, const char *name, const char *value,
+              size_t size)
+{
+    inode* node;
+    int rv = __lookup(path, &node);
+    if (rv < 0) return rv;
+    
+    // root is asked to compact the disk, it is done by the caller
+    if (node->ino == root_ino && strcmp(name, COMPACT_XATTR) == 0) {
+        return 1;
+    }
+    
+    if (node->ino == root_ino && strcmp(name, CHECKPOINT_XATTR) == 0) {
+        return 2;
+    }
+    
+    // no other attributes are stored
+    if (strcmp(name, COMPRESS_XATTR) != 0) return -ENOTSUP;
+    
+    // value is a single digit
+    if (size != 1 || (value[0] != '0' && value[0] != '1')) return -EINVAL;
+    
+    // clusters already written keep their form until they are rewritten
+    if (value[0] == '1') {
+        node->flags |= INODE_COMPRESS;
+    }
+    
+    else {
+        node->flags &= ~INODE_COMPRESS;
+    }
+    
+    return 0;
+}
+
+/* Gets an attribute into "value", returns its size */
+static
+int
+__do_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    inode* node;
+    int rv = __lookup(path, &node);
+    if (rv < 0) return rv;
+    
+    // counters are not stored, they are made up when read
+    if (node->ino == root_ino && strcmp(name, STATS_XATTR) == 0) {
+        return csum_stats(value, size);
+    }
+    
+    // no other attributes are stored
+    if (strcmp(name, COMPRESS_XATTR) != 0) return -ENODATA;
+    
+    // caller asks for the size only
+    if (size == 0) return 1;
+    
+    value[0] = (node->flags & INODE_COMPRESS) ? '1' : '0';
+    
+    return 1;
+}
+
+/* Lists names of the attributes into "list", returns its size */
+static
+int
+__do_listxattr(const char *path, char *list, size_t size)
+{
+    inode* node;
+    int rv = __lookup(path, &node);
+    if (rv < 0) return rv;
+    
+    int len = sizeof(COMPRESS_XATTR);
+    int stats = (node->ino == root_ino);
+    if (stats) len += sizeof(STATS_XATTR);
+    
+    // caller asks for the size only
+    if (size == 0) return len;
+    
+    if (size < len) return -ERANGE;
+    memcpy(list, COMPRESS_XATTR, sizeof(COMPRESS_XATTR));
+    
+    if (stats) {
+        memcpy(list + sizeof(COMPRESS_XATTR), STATS_XATTR,
+               sizeof(STATS_XATTR));
+    }
+    
+    return len;
+}
+
+
+
+
+/* ==================== OPERATIONS ========================================= */
+/* Blocks an operation gets stay in memory until it returns, blocks of
+   operations which change the disk are written back when evicted, an
+   operation fails with the error of a block it could not read */
+int
+disk_access(const char *path)
+{
+    bcache_op_begin();
+    int rv = __do_access(path);
+    int err = bcache_op_end(0);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_getattr(const char *path, struct stat *st)
+{
+    bcache_op_begin();
+    int rv = __do_getattr(path, st);
+    int err = bcache_op_end(0);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_mknod(const char *path, int mode)
+{
+    if (read_only) return -EROFS;
+    
+    bcache_op_begin();
+    int rv = __do_mknod(path, mode);
+    int err = bcache_op_end(1);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_rename(const char *from, const char *to)
+{
+    if (read_only) return -EROFS;
+    
+    bcache_op_begin();
+    int rv = __do_rename(from, to);
+    int err = bcache_op_end(1);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_chmod(const char *path, mode_t mode)
+{
+    if (read_only) return -EROFS;
+    
+    bcache_op_begin();
+    int rv = __do_chmod(path, mode);
+    int err = bcache_op_end(1);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_utimens(const char* path, const struct timespec ts[2])
+{
+    if (read_only) return -EROFS;
+    
+    bcache_op_begin();
+    int rv = __do_utimens(path, ts);
+    int err = bcache_op_end(1);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_link(const char *from, const char *to)
+{
+    if (read_only) return -EROFS;
+    
+    bcache_op_begin();
+    int rv = __do_link(from, to);
+    int err = bcache_op_end(1);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_unlink(const char *path)
+{
+    if (read_only) return -EROFS;
+    
+    bcache_op_begin();
+    int rv = __do_unlink(path);
+    int err = bcache_op_end(1);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_read(const char *path, char *buf, size_t size, off_t offset,
+          open_file* of)
+{
+    bcache_op_begin();
+    int rv = __do_read(path, buf, size, offset, of);
+    int err = bcache_op_end(0);
+    
+    // data did not match its checksum or could not be read
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_write(const char *path, const char *buf, size_t size, off_t offset,
+           open_file* of)
+{
+    if (read_only) return -EROFS;
+    
+    bcache_op_begin();
+    int rv = __do_write(path, buf, size, offset, of);
+    int err = bcache_op_end(1);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_truncate(const char *path, off_t size)
+{
+    if (read_only) return -EROFS;
+    
+    bcache_op_begin();
+    int rv = __do_truncate(path, size);
+    int err = bcache_op_end(1);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_clone_range(const char *from, off_t from_off,
+                 const char *to, off_t to_off, size_t len)
+{
+    if (read_only) return -EROFS;
+    
+    bcache_op_begin();
+    int rv = __do_clone_range(from, from_off, to, to_off, len);
+    int err = bcache_op_end(1);
+    
+    return (err < 0) ? err : rv;
+}
+
+/* Moves blocks at the end of the disk into free blocks before them, so
+   all used blocks fit at its start, one operation per inode, returns
+   number of blocks moved */
+int
+disk_compact()
+{
+    if (read_only) return -EROFS;
+    
+    // every block past the used count has a free one before it
+    compact_state cs;
+    cs.limit = sblock->dnum - group_free_dblocks();
+    cs.low = 0;
+    
+    int moved = 0;
+    
+    for (int ino = 0; ino < sblock->inum; ++ino) {
+        if (!group_ino_used(ino)) {
+            continue;
+        }
+        
+        do {
+            cs.count = 0;
+            
+            bcache_op_begin();
+            inode* node = __get_inode_from_ino(ino);
+            
+            // blocks of orphans are left to the reclaimer
+            if (node->nlink > 0) {
+                __compact_inode(node, &cs);
+            }
+            
+            bcache_op_end(cs.count > 0);
+            
+            // old blocks are not used by the step any more, so discard
+            // can punch them, adjacent ones go back together
+            bcache_op_begin();
+            free_run run = { 0, 0 };
+            
+            for (int ii = 0; ii < cs.count; ++ii) {
+                __run_put(&run, cs.old[ii]);
+            }
+            
+            __run_flush(&run);
+            bcache_op_end(cs.count > 0);
+            
+            moved += cs.count;
+        } while (cs.count == COMPACT_BATCH);
+    }
+    
+    trace("|--NUFS: Compaction moved %d blocks under %d\n", // log
+          moved, cs.limit);
+    
+    return moved;
+}
+
+/* Writes the blocks and metadata which changed since the last checkpoint
+   into the data file at once, after the running operations end, returns
+   0 or -ERRNO, -EINVAL when the disk is mapped or a snapshot */
+int
+disk_checkpoint()
+{
+    if (meta_shadow == NULL) return -EINVAL;
+    
+    bcache_quiesce();
+    
+    // checksums of the blocks are computed while they are written
+    int rv = bcache_sync();
+    if (rv == 0) rv = csum_sync();
+    if (rv == 0) rv = __write_metadata();
+    if (rv == 0) rv = blkdev_sync();
+    
+    bcache_resume();
+    
+    return rv;
+}
+
+int
+disk_lookup(const char *path)
+{
+    bcache_op_begin();
+    int rv = __do_lookup(path);
+    int err = bcache_op_end(0);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_getattr_ino(const int ino, struct stat *st)
+{
+    bcache_op_begin();
+    int rv = __do_getattr_ino(ino, st);
+    int err = bcache_op_end(0);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_read_ino(const int ino, char *buf, size_t size, off_t offset,
+              open_file* of)
+{
+    bcache_op_begin();
+    int rv = __do_read_ino(ino, buf, size, offset, of);
+    int err = bcache_op_end(0);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_write_ino(const int ino, const char *buf, size_t size, off_t offset,
+               open_file* of)
+{
+    if (read_only) return -EROFS;
+    
+    bcache_op_begin();
+    int rv = __do_write_ino(ino, buf, size, offset, of);
+    int err = bcache_op_end(1);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_mkdir(const char *path, mode_t mode)
+{
+    if (read_only) return -EROFS;
+    
+    bcache_op_begin();
+    int rv = __do_mkdir(path, mode);
+    int err = bcache_op_end(1);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_rmdir(const char *path)
+{
+    if (read_only) return -EROFS;
+    
+    bcache_op_begin();
+    int rv = __do_rmdir(path);
+    int err = bcache_op_end(1);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_readdir(const char *path, void *buf, disk_fill_fn filler)
+{
+    bcache_op_begin();
+    int rv = __do_readdir(path, buf, filler);
+    int err = bcache_op_end(0);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_symlink(const char *from, const char *to)
+{
+    if (read_only) return -EROFS;
+    
+    bcache_op_begin();
+    int rv = __do_symlink(from, to);
+    int err = bcache_op_end(1);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_readlink(const char *path, char *buf, size_t size)
+{
+    bcache_op_begin();
+    int rv = __do_readlink(path, buf, size);
+    int err = bcache_op_end(0);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_setxattr(const char *path, const char *name, const char *value,
+              size_t size)
+{
+    if (read_only) return -EROFS;
+    
+    bcache_op_begin();
+    int rv = __do_setxattr(path, name, value, size);
+    int err = bcache_op_end(1);
+    if (err < 0) return err;
+    
+    // compaction takes its own operation for every inode
+    if (rv == 1) {
+        rv = disk_compact();
+        rv = min(rv, 0);
+    }
+    
+    // checkpoint waits until no operation runs
+    if (rv == 2) {
+        rv = disk_checkpoint();
+    }
+    
+    return rv;
+}
+
+int
+disk_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    bcache_op_begin();
+    int rv = __do_getxattr(path, name, value, size);
+    int err = bcache_op_end(0);
+    
+    return (err < 0) ? err : rv;
+}
+
+int
+disk_listxattr(const char *path, char *list, size_t size)
+{
+    bcache_op_begin();
+    int rv = __do_listxattr(path, list, size);
+    int err = bcache_op_end(0);
+    
+    return (err < 0) ? err : rv;
+}
+
+
+
+
+/* ========================= MOUNT DISK ==================================== */
+/* Returns a number which tells new data files of a disk from others */
+static
+int64_t
+__new_id()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    
+    return ((int64_t)now.tv_sec * 1000000000 + now.tv_nsec) ^ getpid();
+}
+
+/* Is "data_file", or the directory a new one goes to, on hugetlbfs? */
+static
+int
+__on_hugetlbfs(const char* data_file)
+{
+    struct statfs fs;
+    
+    if (statfs(data_file, &fs) == 0) {
+        return fs.f_type == HUGETLBFS_MAGIC;
+    }
+    
+    char dir[PATH_MAX];
+    snprintf(dir, PATH_MAX, "%s", data_file);
+    
+    char* slash = strrchr(dir, '/');
+    if (slash == NULL) strcpy(dir, ".");
+    else if (slash == dir) dir[1] = 0;
+    else *slash = 0;
+    
+    return statfs(dir, &fs) == 0 && fs.f_type == HUGETLBFS_MAGIC;
+}
+
+/* Maps "size" bytes of "fd" at a huge page boundary, so regions of the
+   disk aligned in the file are aligned in memory too, and asks for huge
+   pages unless the file is on hugetlbfs which has nothing else, returns
+   MAP_FAILED when it can not */
+static
+void*
+__map_huge(const int fd, const size_t size, const int hugetlb)
+{
+    size_t len = div_up(size, HUGE_PAGE_SIZE) * HUGE_PAGE_SIZE;
+    size_t mapped = div_up(size, getpagesize()) * getpagesize();
+    
+    // reserve a huge page more than needed and map the file into it
+    char* area = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED) return MAP_FAILED;
+    
+    char* start = (char*)(div_up((uintptr_t)area, HUGE_PAGE_SIZE)
+                          * HUGE_PAGE_SIZE);
+    
+    void* base = mmap(start, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED, fd, 0);
+    
+    if (base == MAP_FAILED) {
+        munmap(area, len + HUGE_PAGE_SIZE);
+        return MAP_FAILED;
+    }
+    
+    // rest of the reservation goes back
+    if (start > area) {
+        munmap(area, start - area);
+    }
+    
+    if (area + len + HUGE_PAGE_SIZE > start + mapped) {
+        munmap(start + mapped, area + len + HUGE_PAGE_SIZE - start - mapped);
+    }
+    
+    // page cache of most file systems keeps small pages anyway
+    if (!hugetlb && madvise(base, size, MADV_HUGEPAGE) < 0) {
+        trace("|--NUFS: No huge pages for the data file (%d)\n", // log
+              -errno);
+    }
+    
+    trace("|--NUFS: Mapped data file at a huge page boundary%s\n", // log
+          hugetlb ? " on hugetlbfs" : "");
+    
+    return base;
+}
+
+/* Maps the whole data file into memory, in huge pages when "huge" is
+   set, and puts its superblock into "sbp", returns 0 or -ERRNO */
+static
+int
+__map_disk(const char* data_file, size_t create_size, const int huge,
+           superblock** sbp)
+{
+    int flags = (create_size > 0) ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR;
+    
+    // open data file
+    int fd = open(data_file, flags, 0644);
+    
+    if (fd < 0) {
+        int err = -errno;
+        fprintf(stderr, "|--NUFS: Can not open %s (%d)\n", data_file, err);
+        return err;
+    }
+    
+    trace("|--NUFS: Opened data file\n"); // log
+    
+    // files on hugetlbfs are made of whole huge pages
+    struct statfs fs;
+    int hugetlb = huge && fstatfs(fd, &fs) == 0
+               && fs.f_type == HUGETLBFS_MAGIC;
+    
+    if (hugetlb && create_size > 0) {
+        create_size = div_up(create_size, fs.f_bsize) * fs.f_bsize;
+    }
+    
+    // truncate new data file to its size, the file stays sparse
+    if (create_size > 0 && ftruncate(fd, create_size) < 0) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    
+    struct stat st;
+    int rv = fstat(fd, &st);
+    assert(rv != -1);
+    disk_size = st.st_size;
+    
+    // superblock has to be there before it is looked at
+    if (disk_size < BLOCK_SIZE) {
+        fprintf(stderr, "|--NUFS: %s is too small for a disk\n", data_file);
+        close(fd);
+        return -EINVAL;
+    }
+    
+    // mmap data file into memory
+    void* base;
+    
+    if (huge) {
+        base = __map_huge(fd, disk_size, hugetlb);
+    }
+    
+    else {
+        base = mmap(NULL, disk_size,
+                    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    
+    // close file descriptor of the data file, the map keeps it
+    int err = (base == MAP_FAILED) ? -errno : 0;
+    close(fd);
+    
+    if (err < 0) return err;
+    
+    trace("|--NUFS: Mmaped data file into memory\n"); // log
+    
+    *sbp = (superblock*)base;
+    return 0;
+}
+
+/* Does "sb" describe a disk this code can mount with "opts"? Returns 0
+   or -EINVAL and tells why */
+static
+int
+__check_super(const superblock* sb, const char* data_file,
+              const mount_opts* opts)
+{
+    if (sb->magic != OLFS_MAGIC) {
+        fprintf(stderr, "|--NUFS: %s is not a disk\n", data_file);
+        return -EINVAL;
+    }
+    
+    // data blocks are in other data files too
+    if (sb->stripes > 1 && opts->stripe == NULL) {
+        fprintf(stderr, "|--NUFS: %s is striped over %d data files, "
+                "give the others with --stripe\n", data_file, sb->stripes);
+        return -EINVAL;
+    }
+    
+    // cold data blocks are in the slow tier
+    if (sb->tier_slots > 0 && opts->tier == NULL) {
+        fprintf(stderr, "|--NUFS: %s is the fast tier of a disk, "
+                "give the slow one with --tier\n", data_file);
+        return -EINVAL;
+    }
+    
+    // inodes of disks made before large files are smaller
+    if (sb->isize != sizeof(inode)) {
+        fprintf(stderr, "|--NUFS: %s has %d byte inodes, format it again\n",
+                data_file, sb->isize ? sb->isize : 64);
+        return -EINVAL;
+    }
+    
+    return 0;
+}
+
+/* Returns bytes of metadata the block cache keeps in memory, everything
+   before the owner counts, checksums and inodes which are paged */
+static
+size_t
+__meta_size(const superblock* sb)
+{
+    if (sb->rmap > 0) return sb->rmap;
+    if (sb->csum > 0) return sb->csum;
+    
+    return sb->iptr;
+}
+
+/* Opens the data file for the block cache and puts its superblock into
+   "sbp", the superblock, group descriptors and bitmaps stay in memory and
+   the rest is cached, returns 0 or -ERRNO */
+static
+int
+__open_cached(const char* data_file, const mount_opts* opts,
+              const superblock* layout, superblock** sbp)
+{
+    size_t create_size = (layout != NULL) ? opts->size : 0;
+    int rv;
+    
+    stripe_geom geom;
+    tier_geom tiers;
+    
+    // snapshots and branches are layers over the data file
+    if (opts->branch != NULL || opts->from != NULL) {
+        rv = blkdev_open_layers(data_file, opts->branch, opts->from,
+                                opts->reset);
+    }
+    
+    // data blocks of a new set start at the same place in every data file
+    else if (opts->stripe != NULL) {
+        if (layout != NULL) {
+            if (opts->stripe_unit % layout->bsize != 0) return -EINVAL;
+            
+            geom.unit = opts->stripe_unit;
+            geom.data_off = layout->dptr;
+            geom.id = __new_id();
+        }
+        
+        rv = blkdev_open_stripes(data_file, opts->stripe, opts->direct,
+                                 create_size, &geom);
+    }
+    
+    // slots of a new fast tier hold 1/8 of the data blocks unless told
+    else if (opts->tier != NULL) {
+        if (layout != NULL) {
+            size_t fast = opts->tier_fast;
+            if (fast == 0) fast = (size_t)layout->dnum / 8 * layout->bsize;
+            
+            int slots = fast / layout->bsize;
+            
+            tiers.bsize = layout->bsize;
+            tiers.slots = (slots < 1) ? 1 : min(slots, layout->dnum);
+            tiers.dnum = layout->dnum;
+            tiers.data_off = layout->dptr;
+            tiers.id = __new_id();
+        }
+        
+        rv = blkdev_open_tier(data_file, opts->tier, opts->direct,
+                              layout != NULL, &tiers);
+    }
+    
+    // data file of RAM mode is written by checkpoints only
+    else if (opts->ram) {
+        rv = blkdev_open_ckpt(data_file, create_size);
+    }
+    
+    else {
+        rv = blkdev_open(data_file, opts->io, opts->direct, create_size);
+    }
+    
+    // layers refuse a data file which changed under them, and the like
+    if (rv < 0) {
+        fprintf(stderr, "|--NUFS: Can not open %s (%d)\n", data_file, rv);
+        return rv;
+    }
+    
+    superblock* sb;
+    
+    // new disk starts with empty metadata
+    if (layout != NULL) {
+        meta_size = __meta_size(layout);
+        sb = opts->huge ? blkdev_alloc_huge(meta_size)
+                        : blkdev_alloc(meta_size);
+        memset(sb, 0, meta_size);
+        *sb = *layout;
+    }
+    
+    // superblock tells how much metadata to read
+    else {
+        superblock* head = blkdev_alloc(BLOCK_SIZE);
+        rv = blkdev_read(head, BLOCK_SIZE, 0);
+        if (rv == 0) rv = __check_super(head, data_file, opts);
+        meta_size = __meta_size(head);
+        free(head);
+        
+        if (rv < 0) {
+            blkdev_close();
+            return rv;
+        }
+        
+        sb = opts->huge ? blkdev_alloc_huge(meta_size)
+                        : blkdev_alloc(meta_size);
+        rv = blkdev_read(sb, meta_size, 0);
+        
+        if (rv < 0) {
+            fprintf(stderr, "|--NUFS: Can not read metadata of %s (%d)\n",
+                    data_file, rv);
+            free(sb);
+            blkdev_close();
+            return rv;
+        }
+    }
+    
+    // superblock and the other data files have to be of the same set
+    if (opts->stripe != NULL && layout != NULL) {
+        sb->stripes = geom.count;
+        sb->stripe_unit = geom.unit;
+        sb->stripe_id = geom.id;
+    }
+    
+    else if (opts->stripe != NULL) {
+        if (sb->stripes != geom.count || sb->stripe_id != geom.id
+            || sb->dptr != geom.data_off) {
+            fprintf(stderr,
+                    "|--NUFS: %s is not the first data file of the set\n",
+                    data_file);
+            rv = -EINVAL;
+        }
+    }
+    
+    // superblock and the slow tier have to be of the same disk
+    if (opts->tier != NULL && layout != NULL) {
+        sb->tier_slots = tiers.slots;
+        sb->tier_id = tiers.id;
+    }
+    
+    else if (opts->tier != NULL) {
+        if (sb->tier_id != tiers.id || sb->dptr != tiers.data_off
+            || sb->dnum != tiers.dnum) {
+            fprintf(stderr, "|--NUFS: %s is not the fast tier of %s\n",
+                    data_file, opts->tier);
+            rv = -EINVAL;
+        }
+    }
+    
+    if (rv < 0) {
+        free(sb);
+        blkdev_close();
+        return rv;
+    }
+    
+    // RAM mode caches the whole disk, nothing is written back before
+    // the next checkpoint
+    size_t cache_size = opts->cache_size;
+    
+    if (opts->ram) {
+        cache_size = sb->dptr + (size_t)sb->dnum * sb->bsize;
+    }
+    
+    // checkpoints write only the metadata blocks which changed
+    if (!read_only) {
+        meta_shadow = calloc(meta_size, 1);
+        assert(meta_shadow != NULL);
+        
+        if (layout == NULL) memcpy(meta_shadow, sb, meta_size);
+    }
+    
+    bcache_init(cache_size, sb->bsize, opts->huge);
+    trace("|--NUFS: Read %ld bytes of metadata\n", meta_size); // log
+    
+    *sbp = sb;
+    return 0;
+}
+
+/* Points disk structures into the opened data file */
+static
+void
+__attach_disk(superblock* sb)
+{
+    sblock = sb;
+    imap = sblock->imap + (char*)sblock;
+    dmap = sblock->dmap + (char*)sblock;
+    
+    // block geometry was chosen when the disk was created
+    bsize = sblock->bsize;
+    bshift = sblock->bshift;
+    
+    // owner counts, inodes and data blocks are read through the cache
+    if (bcache_active()) {
+        rmap = NULL;
+        iptr = NULL;
+        dptr = NULL;
+        rmap_blk = sblock->rmap / bsize;
+        iptr_blk = sblock->iptr / bsize;
+        dptr_blk = sblock->dptr / bsize;
+    }
+    
+    // older disks have no owner counts and do not share blocks
+    else {
+        rmap = __has_rmap() ? (unsigned short*)(sblock->rmap + (char*)sblock)
+                            : NULL;
+        iptr = sblock->iptr + (char*)sblock;
+        dptr = sblock->dptr + (char*)sblock;
+    }
+    
+    trace("|--NUFS: Updated relative pointers\n"); // log
+}
+
+/* Keeps checksums of data blocks, the cache checks blocks it reads when
+   "verify" is set and a scrubber reads them all every "scrub" seconds */
+static
+void
+__start_checksums(const mount_opts* opts)
+{
+    scrub_interval = 0;
+    
+    // older disks have no place for them
+    if (sblock->csum == 0) {
+        return;
+    }
+    
+    size_t first = sblock->dptr / bsize;
+    
+    // the cache pages the table, RAM mode writes it at checkpoints only
+    if (bcache_active()) {
+        csum_init_paged(sblock->csum, first, sblock->dnum, bsize,
+                        opts->verify, opts->ram);
+        scrub_interval = opts->scrub;
+        return;
+    }
+    
+    // mapped blocks are not read by the cache, they get checksums at unmount
+    if (opts->verify || opts->scrub > 0) {
+        trace("|--NUFS: Checksums are checked by pread and uring\n"); // log
+    }
+    
+    uint32_t* sums = (uint32_t*)(sblock->csum + (char*)sblock);
+    csum_init(sums, first, sblock->dnum, bsize, 0);
+    
+    if (!read_only) {
+        touched = calloc(div_up(sblock->dnum, TOUCH_CHUNK), 1);
+        assert(touched != NULL);
+    }
+}
+
+/* Punches freed blocks out of the data file when asked to, layers keep
+   their sectors in files of their own */
+static
+void
+__start_discard(const char* data_file, const mount_opts* opts)
+{
+    if (opts->discard == DISCARD_OFF || read_only) {
+        return;
+    }
+    
+    if (opts->branch != NULL) {
+        trace("|--NUFS: Branches are not discarded\n"); // log
+        return;
+    }
+    
+    if (opts->stripe != NULL) {
+        trace("|--NUFS: Striped data files are not discarded\n"); // log
+        return;
+    }
+    
+    if (opts->tier != NULL) {
+        trace("|--NUFS: Tiered data files are not discarded\n"); // log
+        return;
+    }
+    
+    // punched blocks would reach the data file before their checkpoint
+    if (opts->ram) {
+        trace("|--NUFS: RAM mode is not discarded\n"); // log
+        return;
+    }
+    
+    int rv = discard_init(data_file, opts->discard, sblock->dptr, bsize);
+    
+    if (rv < 0) {
+        trace("|--NUFS: No discard (%d)\n", rv); // log
+    }
+}
+
+/* Computes checksums of the used blocks in the chunks a mapped disk
+   handed out, its writes do not go through the cache which keeps them
+   up to date otherwise, other blocks kept theirs */
+static
+void
+__refresh_checksums()
+{
+    if (touched == NULL) {
+        return;
+    }
+    
+    size_t first = sblock->dptr / bsize;
+    int chunks = div_up(sblock->dnum, TOUCH_CHUNK);
+    
+    for (int chunk = 0; chunk < chunks; ++chunk) {
+        if (!touched[chunk]) {
+            continue;
+        }
+        
+        int end = min((chunk + 1) * TOUCH_CHUNK, sblock->dnum);
+        
+        for (int dno = chunk * TOUCH_CHUNK; dno < end; ++dno) {
+            if (bmap_isfree(dmap, dno)) {
+                csum_clear(first + dno);
+            }
+            
+            else {
+                csum_update(first + dno, dptr + (size_t)dno * bsize);
+            }
+        }
+    }
+    
+    free(touched);
+    touched = NULL;
+}
+
+/* Reinitialize NUFS with given data_file, returns 0 or -ERRNO */
+static
+int
+remount_disk(const char* data_file, const mount_opts* opts)
+{
+    trace("|--NUFS: Start reinitializing old data file at %s\n", // log
+          data_file);
+    
+    superblock* sb;
+    int rv;
+    
+    // cache checks the superblock before it reads the rest
+    if (opts->io == IO_MMAP) {
+        rv = __map_disk(data_file, 0, opts->huge, &sb);
+        if (rv < 0) return rv;
+        
+        rv = __check_super(sb, data_file, opts);
+        
+        if (rv < 0) {
+            munmap(sb, disk_size);
+            return rv;
+        }
+    }
+    
+    else {
+        rv = __open_cached(data_file, opts, NULL, &sb);
+        if (rv < 0) return rv;
+    }
+    
+    __attach_disk(sb);
+    
+    // prepare allocation groups
+    group_mount(sblock, opts->thin);
+    
+    // older disks can not share blocks
+    if (opts->dedup && __has_rmap()) {
+        dedup_init(sblock->dnum, bsize);
+    }
+    
+    __start_checksums(opts);
+    
+    __start_discard(data_file, opts);
+    
+    // update root pointer
+    bcache_op_begin();
+    root_ino = sblock->root_ino;
+    inode* root = __get_inode_from_ino(root_ino);
+    atime_touch(root);
+    bcache_op_end(0);
+    trace("|--NUFS: Updated root pointer\n"); // log
+    
+    return 0;
+}
+/* Returns "off" moved up to a multiple of "align", 0 leaves it as is */
+static
+size_t
+__align_region(const size_t off, const size_t align)
+{
+    return (align > 0) ? div_up(off, align) * align : off;
+}
+
+/* Places disk structures of a "data_file_size" disk at block boundaries,
+   every region starts a huge page when "huge" is set, returns 0 or -EINVAL
+   on bad geometry */
+static
+int
+__layout_disk(superblock* sb, size_t data_file_size,
+              int block_size, int bpi, int huge)
+{
+    // block size must be one of the supported ones
+    if (block_size < MIN_BLOCK_SIZE || block_size > MAX_BLOCK_SIZE
+        || block_size % 512 != 0) {
+        return -EINVAL;
+    }
+    
+    // inode table and metadata must leave room for data
+    if (bpi < (int)sizeof(inode) || data_file_size < (size_t)block_size * 16) {
+        return -EINVAL;
+    }
+    
+    if ((data_file_size / bpi) * sizeof(inode) >= data_file_size / 2) {
+        return -EINVAL;
+    }
+    
+    sb->magic = OLFS_MAGIC;
+    
+    // block geometry chosen for this disk
+    sb->bsize = block_size;
+    sb->bshift = ilog2(block_size);
+    sb->bpi = bpi;
+    sb->isize = sizeof(inode);
+    sb->orphans = -1;
+    
+    // get number of inodes and all blocks of the disk
+    size_t blocks = data_file_size / block_size;
+    sb->inum = data_file_size / bpi;
+    
+    // calculate sizes of groups, bitmaps and iptr region in blocks
+    size_t gptr_size = group_table_size(data_file_size, block_size);
+    size_t gptr_blocks = div_up(gptr_size, block_size);
+    size_t imap_blocks = div_up(div_up(sb->inum, 8), block_size);
+    size_t dmap_blocks = div_up(div_up(blocks, 8), block_size);
+    size_t rmap_blocks = div_up(blocks * sizeof(unsigned short), block_size);
+    size_t csum_blocks = div_up(blocks * sizeof(uint32_t), block_size);
+    size_t iptr_blocks = div_up(sb->inum * sizeof(inode), block_size);
+    trace("|--NUFS: Calculated imap blocks: %ld\n", imap_blocks); // log
+    trace("|--NUFS: Calculated dmap blocks: %ld\n", dmap_blocks); // log
+    trace("|--NUFS: Calculated iptr blocks: %ld\n", iptr_blocks); // log
+    
+    // huge pages of small disks would be mostly padding
+    size_t align = 0;
+    
+    if (huge && HUGE_PAGE_SIZE % block_size == 0
+        && data_file_size >= HUGE_MIN_DISK) {
+        align = HUGE_PAGE_SIZE;
+    }
+    
+    else if (huge) {
+        trace("|--NUFS: Regions are not aligned to huge pages\n"); // log
+    }
+    
+    // superblock takes the first block, regions follow it
+    sb->gptr = __align_region(block_size, align);
+    sb->imap = __align_region(sb->gptr + gptr_blocks * block_size, align);
+    sb->dmap = __align_region(sb->imap + imap_blocks * block_size, align);
+    sb->rmap = __align_region(sb->dmap + dmap_blocks * block_size, align);
+    sb->csum = __align_region(sb->rmap + rmap_blocks * block_size, align);
+    sb->iptr = __align_region(sb->csum + csum_blocks * block_size, align);
+    sb->dptr = __align_region(sb->iptr + iptr_blocks * block_size, align);
+    
+    // huge page padding can leave no room for data
+    if (sb->dptr >= data_file_size) {
+        return -EINVAL;
+    }
+    
+    // data blocks take the rest of the disk
+    sb->dnum = blocks - sb->dptr / block_size;
+    trace("|--NUFS: Calculated number of inodes: %d\n",
+          sb->inum); // log
+    trace("|--NUFS: Calculated number of data blocks: %d\n",
+          sb->dnum); // log
+    
+    return 0;
+}
+
+/* Creates new disk for NUFS at given data_file path, returns 0 or -ERRNO */
+static
+int
+create_disk(const char* data_file, const mount_opts* opts)
+{
+    // update NUFS LOG
+    trace("|--NUFS: Start creation of new disk at %s\n", data_file); // log
+    
+    // place all structures on the disk
+    superblock layout;
+    memset(&layout, 0, sizeof(layout));
+    int err = __layout_disk(&layout, opts->size, opts->bsize, opts->bpi,
+                            opts->huge);
+    
+    // options come from the command line or a program of the library
+    if (err < 0) {
+        fprintf(stderr, "|--NUFS: %zu bytes do not make a disk of %d byte "
+                "blocks and %d bytes per inode\n", opts->size, opts->bsize,
+                opts->bpi);
+        return err;
+    }
+    
+    superblock* sb;
+    
+    if (opts->io == IO_MMAP) {
+        int rv = __map_disk(data_file, opts->size, opts->huge, &sb);
+        if (rv < 0) return rv;
+        
+        *sb = layout;
+    }
+    
+    else {
+        int rv = __open_cached(data_file, opts, &layout, &sb);
+        if (rv < 0) return rv;
+    }
+    
+    // split data blocks and inodes into allocation groups
+    group_format(sb);
+    __attach_disk(sb);
+    
+    // bitmaps and inode table are initialized group by group on first use
+    group_mount(sblock, opts->thin);
+    
+    // older disks can not share blocks
+    if (opts->dedup && __has_rmap()) {
+        dedup_init(sblock->dnum, bsize);
+    }
+    
+    __start_checksums(opts);
+    
+    __start_discard(data_file, opts);
+    
+    // create root inode
+    bcache_op_begin();
+    inode* root = __create_inode(NULL, NULL, 0, DIRECTORY_MODE);
+    sblock->root_ino = root->ino;
+    root_ino = root->ino;
+    bcache_op_end(1);
+    trace("|--NUFS: Created new root with ino %d\n", root_ino); // log
+    
+    trace("|--NUFS: Created new disk\n"); // log
+    
+    return 0;
+}
+
+/* Formats "data_file" as a new disk, regions start at huge pages when
+   "huge" is set, returns 0 or -EINVAL on bad geometry */
+int
+disk_format(const char* data_file, size_t size, int bsize, int bpi,
+            int huge)
+{
+    mount_opts opts = {
+        .size = size,
+        .bsize = bsize,
+        .bpi = bpi,
+        .io = IO_MMAP,
+        .huge = huge,
+    };
+    
+    int rv = create_disk(data_file, &opts);
+    if (rv < 0) return rv;
+    
+    disk_unmount();
+    
+    return 0;
+}
+
+/* Initializes disk for NUFS in data_file, returns 0 or -ERRNO when it can
+   not be opened */
+int
+disk_mount(const char* data_file, const mount_opts* given)
+{
+    mount_opts layered = *given;
+    const mount_opts* opts = &layered;
+    
+    // layers, stripes, tiers and RAM mode each have a backend of their own
+    int layers = (opts->branch != NULL || opts->from != NULL);
+    int backends = layers + (opts->stripe != NULL) + (opts->tier != NULL)
+                 + (opts->ram != 0);
+    
+    // files on hugetlbfs can only be mapped
+    int hugetlb = opts->huge && __on_hugetlbfs(data_file);
+    
+    if (backends > 1 || (hugetlb && backends > 0)) {
+        fprintf(stderr,
+                "|--NUFS: Layers, stripes, tiers, RAM mode and hugetlbfs "
+                "do not go together\n");
+        return -EINVAL;
+    }
+    
+    // layers are read and written with pread only, snapshots do not change
+    if (layers) {
+        if (access(data_file, F_OK) < 0) return -errno;
+        
+        if (opts->io != IO_PREAD || opts->direct) {
+            trace("|--NUFS: Layers use pread without O_DIRECT\n"); // log
+        }
+        
+        layered.io = IO_PREAD;
+        layered.direct = 0;
+        
+        read_only = (opts->branch == NULL);
+        if (read_only) layered.atime = ATIME_NOATIME;
+    }
+    
+    // data files of a set are read and written by a thread of their own
+    if (opts->stripe != NULL) {
+        if (opts->io != IO_PREAD) {
+            trace("|--NUFS: Striped data files use pread\n"); // log
+        }
+        
+        layered.io = IO_PREAD;
+    }
+    
+    // blocks of a tiered disk move while it is mounted
+    if (opts->tier != NULL) {
+        if (opts->io != IO_PREAD) {
+            trace("|--NUFS: Tiered data files use pread\n"); // log
+        }
+        
+        layered.io = IO_PREAD;
+    }
+    
+    // whole disk is cached, the data file gets checkpoints only
+    if (opts->ram) {
+        layered.io = IO_PREAD;
+        layered.direct = 0;
+    }
+    
+    // files on hugetlbfs can not be read or written, only mapped
+    if (hugetlb) {
+        if (opts->io != IO_MMAP) {
+            trace("|--NUFS: Data files on hugetlbfs use mmap\n"); // log
+        }
+        
+        layered.io = IO_MMAP;
+    }
+    
+    // atime policy is needed before the root is touched
+    atime_init(opts->atime, opts->lazy_interval);
+    
     int rv = access(data_file, F_OK);
     
     // data file exists
     if (rv == 0) {
-        printf("|--NUFS: Data file %s DOES exist\n", data_file); // log
-        remount_disk(data_file);
+        trace("|--NUFS: Data file %s DOES exist\n", data_file); // log
+        rv = remount_disk(data_file, opts);
     }
     
     // data file does not exist
     else {
-        printf("|--NUFS: Data file %s DOES NOT exists\n", data_file); // log
-        create_disk(data_file);
+        trace("|--NUFS: Data file %s DOES NOT exists\n", data_file); // log
+        rv = create_disk(data_file, opts);
+    }
+    
+    if (rv < 0) {
+        atime_stop();
+        read_only = 0;
+        return rv;
     }
+    
+    // data file has the new disk or the mount from the first checkpoint
+    if (opts->ram) {
+        rv = disk_checkpoint();
+        assert(rv == 0);
+    }
+    
+    ckpt_interval = opts->checkpoint;
+    
+    return 0;
+}
+
+/* Starts the background threads of the mounted disk, a process which
+   forks after disk_mount(), like a FUSE daemon, calls it in the child */
+void
+disk_start()
+{
+    // data files of a set and tiers have threads of their own, the cache
+    // reads ahead in background
+    if (bcache_active()) {
+        blkdev_start();
+        ra_start();
+    }
+    
+    atime_start();
+    discard_start();
+    
+    if (scrub_interval > 0) {
+        csum_scrub_start(scrub_interval);
+    }
+    
+    // blocks of unlinked files are freed in background
+    __start_reclaimer();
+    
+    __start_checkpointer();
+}
+
+/* Writes everything back and unmaps the data file */
+void
+disk_unmount()
+{
+    trace("|--NUFS: Unmounting data file\n"); // log
+    
+    // write pending atimes in one batch
+    __stop_checkpointer();
+    ra_stop();
+    __stop_reclaimer();
+    csum_scrub_stop();
+    atime_stop();
+    dedup_stop();
+    discard_stop();
+    group_unmount();
+    
+    // cached blocks go first, metadata after them
+    if (bcache_active()) {
+        int rv = bcache_stop();
+        
+        if (rv < 0) {
+            fprintf(stderr, "|--NUFS: Cached blocks were not written (%d)\n",
+                    rv);
+        }
+        
+        // metadata of a snapshot stays as it was
+        rv = read_only ? 0 : __write_metadata();
+        assert(rv == 0);
+        
+        rv = csum_sync();
+        assert(rv == 0);
+        
+        rv = blkdev_sync();
+        assert(rv == 0);
+        
+        csum_stop();
+        blkdev_close();
+        free(sblock);
+        free(meta_shadow);
+        meta_shadow = NULL;
+        read_only = 0;
+        trace("|--NUFS: Closed data file\n"); // log
+        return;
+    }
+    
+    __refresh_checksums();
+    csum_stop();
+    
+    int rv = msync(sblock, disk_size, MS_SYNC);
+    assert(rv != -1);
+    
+    rv = munmap(sblock, disk_size);
+    assert(rv != -1);
+    trace("|--NUFS: Unmapped data file\n"); // log
 }
@@ -11,15 +11,37 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <fuse.h>
 
-#define BLOCK_SIZE 4096
+#include "blkdev.h"
+#include "readahead.h"
+#include "discard.h"
+
+#define BLOCK_SIZE      4096        // default size of a data block
+#define MIN_BLOCK_SIZE  1024
+#define MAX_BLOCK_SIZE  65536
 #define BLOCKS_NUM 3
+#define INDIRECT_LEVELS 3           // single, double and triple indirect
+
+#define OLFS_MAGIC      0x4f4c4653  // "OLFS" at the start of every data file
+
+#define INODE_COMPRESS  0x1         // new clusters are compressed
+#define INODE_CMAP      0x2         // inode has a cluster map
+#define INODE_CMAP_DEPTH 0xc        // index levels above the cluster map
+#define CMAP_DEPTH_SHIFT 2
+#define CMAP_LEVELS     2           // index levels for the clusters of the
+                                    // largest file at any block size
+#define CLUSTER_BLOCKS  4           // blocks compressed together
+
+#define CURSOR_PTRS     64          // block pointers an open file keeps
 
 
 /* ========================= STRUCTURES =================================== */
 /* Holds all relative pointers */
 typedef struct superblock {
+    int             magic;      // OLFS_MAGIC
+    
     ptrdiff_t       imap;       // relative pointer to bitmap for inodes
     ptrdiff_t       iptr;       // relative pointer to the inodes array
     int             inum;       // total number of inodes
@@ -29,6 +51,33 @@ typedef struct superblock {
     int             dnum;       // total number of data blocks
     
     int             root_ino;   // ino of the root directory
+    
+    ptrdiff_t       gptr;       // relative pointer to the group descriptors
+    int             gnum;       // total number of allocation groups
+    int             ipg;        // inodes per group
+    int             bpg;        // data blocks per group
+    
+    int             bsize;      // bytes in a data block
+    int             bshift;     // log2 of bsize, -1 if not a power of two
+    int             bpi;        // bytes of the disk per inode
+    
+    ptrdiff_t       rmap;       // relative pointer to extra owners of blocks,
+                                // 0 on disks made before blocks were shared
+    ptrdiff_t       csum;       // relative pointer to checksums of blocks,
+                                // 0 on disks made before they were kept
+    int             isize;      // bytes in an inode, 0 on disks made with
+                                // 64 byte inodes which can not be mounted
+    int             orphans;    // first unlinked inode whose blocks are not
+                                // freed yet, -1 for none
+    
+    int             stripes;    // data files the data blocks are striped
+                                // over, 0 or 1 when there is only this one
+    int             stripe_unit;    // bytes of a data file before the next
+    int64_t         stripe_id;  // same in the head of the other data files
+    
+    int             tier_slots; // data blocks the fast tier keeps, 0 when
+                                // all of them are in this data file
+    int64_t         tier_id;    // same in the heads of both tiers
 } superblock;
 
 
@@ -36,7 +85,7 @@ typedef struct superblock {
 typedef struct inode {
     int         ino;            // inode number (id)
     int         mode;           // permission & type
-    int         size;           // bytes
+    int64_t     size;           // bytes
     
     int         uid;            // user id
     int         gid;            // group id
@@ -50,18 +99,118 @@ typedef struct inode {
     
     int         dptrs[BLOCKS_NUM];      // direct data block pointers
     int         indirect_dptr;          // single indirect pointer
+    int         double_dptr;            // double indirect pointer
+    int         triple_dptr;            // triple indirect pointer
+    
+    int         flags;                  // INODE_COMPRESS, INODE_CMAP and
+                                        // the depth of the cluster map
+    int         cmap_dptr;              // compressed size of every cluster,
+                                        // or index blocks over the sizes
+    
+    int         next_orphan;            // next inode of the orphan list, -1
+                                        // at its end
+    
+    int         _reserved[12];          // 128 bytes, no inode crosses a block
 } inode;
 
 
-/* Data block */
+/* Data block, only first superblock->bsize bytes belong to it */
 typedef struct dblock {
-    char data[BLOCK_SIZE];
+    char data[MAX_BLOCK_SIZE];
 } dblock;
 
 
+/* Window of indirect block pointers an open file used last, valid while
+   no mapping of any file was removed since it was read */
+typedef struct map_cursor {
+    int         ino;            // file of the window, -1 before first use
+    unsigned    gen;            // generation of the block maps it was read at
+    int         first;          // logical block of ptrs[0]
+    int         count;          // pointers in the window, 0 for none
+    int         goal;           // block after the last one written, or -1
+    int         ptrs[CURSOR_PTRS];
+} map_cursor;
+
+
+/* State an open file keeps between its reads and writes */
+typedef struct open_file {
+    ra_state    ra;             // read ahead of the file
+    map_cursor  map;            // block pointers of the file
+} open_file;
+
+
+/* When reads update the access time */
+typedef enum atime_mode {
+    ATIME_STRICT,       // on every access
+    ATIME_RELATIME,     // when older than mtime/ctime or a day old
+    ATIME_NOATIME,      // never
+    ATIME_LAZY,         // relatime, kept in memory and written in batches
+} atime_mode;
+
+
+/* Options given at mount time */
+typedef struct mount_opts {
+    atime_mode  atime;          // atime update policy
+    int         lazy_interval;  // seconds between lazytime flushes
+    size_t      size;           // bytes in the data file when it is created
+    int         bsize;          // block size of a created data file
+    int         bpi;            // bytes per inode of a created data file
+    
+    io_backend  io;             // how blocks get into memory
+    size_t      cache_size;     // bytes of cached blocks for the cache backends
+    int         direct;         // bypass the page cache with O_DIRECT
+    
+    int         dedup;          // share data blocks with equal content
+    
+    const char* branch;         // writable layer "data_file@branch", or NULL
+    const char* from;           // snapshot under a new branch, or mounted
+                                // read-only without a branch, or NULL
+    int         reset;          // start the branch again from "from"
+    
+    int         verify;         // check data blocks read against checksums
+    int         scrub;          // seconds between scrub passes, 0 for none
+    
+    discard_mode discard;       // punch freed blocks out of the data file
+    int         thin;           // allocate from the start of the data file
+    
+    const char* stripe;         // other data files the data blocks are
+                                // striped over, comma separated, or NULL
+    int         stripe_unit;    // bytes of a created data file before the next
+    
+    const char* tier;           // slow tier of the data blocks, the data
+                                // file is the fast one, or NULL
+    size_t      tier_fast;      // bytes of data blocks a created fast tier
+                                // keeps, 0 for 1/8 of the disk
+    
+    int         ram;            // keep the whole disk in memory, the data
+                                // file is written by checkpoints only
+    int         checkpoint;     // seconds between checkpoints of the cache
+                                // backends, 0 for checkpoints on request
+                                // only
+    
+    int         huge;           // back the disk in memory with huge pages,
+                                // created disks start regions at them
+} mount_opts;
+
+/* Gets every name of a listed directory, non-zero stops the listing */
+typedef int (*disk_fill_fn)(void* buf, const char* name, const struct stat* st);
+
+
 /* ========================= FUNCTIONS ==================================== */
-void    disk_mount(const char* data_file);
+int     disk_format(const char* data_file, size_t size, int bsize, int bpi,
+                    int huge);
+int     disk_mount(const char* data_file, const mount_opts* opts);
+void    disk_start();
+void    disk_unmount();
 dblock* disk_get_dblock(const int dno);
+inode*  disk_get_inode(const int ino);
+void    disk_dirty_inode(const inode* node);
+int     disk_block_size();
+int     disk_map_block(inode* node, const int lblk, const int create);
+void    disk_prefetch(const int ino, const int from, const int count);
+void    disk_open_init(open_file* of);
+int     disk_compact();
+int     disk_checkpoint();
 
 int disk_access(const char *path);
 int disk_getattr(const char *path, struct stat *st);
@@ -72,15 +221,32 @@ int disk_utimens(const char* path, const struct timespec ts[2]);
 
 int disk_link(const char *from, const char *to);
 int disk_unlink(const char *path);
-int disk_read(const char *path, char *buf, size_t size, off_t offset);
-int disk_write(const char *path, const char *buf, size_t size, off_t offset);
+int disk_read(const char *path, char *buf, size_t size, off_t offset,
+              open_file* of);
+int disk_write(const char *path, const char *buf, size_t size, off_t offset,
+               open_file* of);
 int disk_truncate(const char *path, off_t size);
+int disk_clone_range(const char *from, off_t from_off,
+                     const char *to, off_t to_off, size_t len);
+
+int disk_lookup(const char *path);
+int disk_getattr_ino(const int ino, struct stat *st);
+int disk_read_ino(const int ino, char *buf, size_t size, off_t offset,
+                  open_file* of);
+int disk_write_ino(const int ino, const char *buf, size_t size, off_t offset,
+                   open_file* of);
 
 int disk_mkdir(const char *path, mode_t mode);
 int disk_rmdir(const char *path);
-int disk_readdir(const char *path, void *buf, fuse_fill_dir_t filler);
+int disk_readdir(const char *path, void *buf, disk_fill_fn filler);
 
 int disk_symlink(const char *from, const char *to);
 int disk_readlink(const char *path, char *buf, size_t size);
 
+int disk_setxattr(const char *path, const char *name, const char *value,
+                  size_t size);
+int disk_getxattr(const char *path, const char *name, char *value,
+                  size_t size);
+int disk_listxattr(const char *path, char *list, size_t size);
+
 #endif /* disk_h */
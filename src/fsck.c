@@ -0,0 +1,612 @@
+//
+//  fsck.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "bmap.h"
+#include "directory.h"
+#include "group.h"
+#include "csum.h"
+
+#include "fsck.h"
+
+
+/* ========================= VARIABLES ===================================== */
+// pointers to disk structures of the checked data file
+static superblock*      sblock;
+static group*           groups;
+static char*            imap;
+static char*            dmap;
+static unsigned short*  rmap;       // extra owners of data blocks, or NULL
+static uint32_t*        sums;       // checksums of data blocks, or NULL
+static char*            iptr;
+static char*            dptr;
+
+// state rebuilt by the check
+static int*             refs;       // names pointing to every inode
+static unsigned char*   new_imap;   // inodes which are in use
+static unsigned char*   new_dmap;   // data blocks which are reachable
+static int*             owners;     // pointers to every data block
+static unsigned char*   orphaned;   // inodes on the orphan list
+
+static int              repair;     // write fixes into the data file?
+static long             errors;     // problems found so far
+static long             fixed;      // problems repaired so far
+
+typedef void (*fsck_pass)(const int gg);
+
+typedef struct fsck_worker {
+    pthread_t   thread;
+    fsck_pass   pass;
+    int         first;      // first group of the worker
+    int         last;       // group after the last one
+} fsck_worker;
+
+
+
+
+/* ==================== LOCAL HELPERS ===================================== */
+/* Records a problem, and that it was repaired if it is "fixable" */
+static
+void
+__report(const char* what, const int id, const int fixable)
+{
+    int fix = repair && fixable;
+    printf("fsck.olfs: %s %d%s\n", what, id, fix ? ", fixed" : "");
+    
+    __atomic_add_fetch(&errors, 1, __ATOMIC_RELAXED);
+    
+    if (fix) {
+        __atomic_add_fetch(&fixed, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Returns pointer to the inode with the given ino */
+static
+inode*
+__inode(const int ino)
+{
+    return (inode*)iptr + ino;
+}
+
+/* Returns pointer to the data block with the given dno */
+static
+char*
+__dblock(const int dno)
+{
+    return dptr + (size_t)dno * sblock->bsize;
+}
+
+/* Is inode "ino" marked as used in the data file? */
+static
+int
+__ino_used(const int ino)
+{
+    int gg = ino / sblock->ipg;
+    
+    if (!(groups[gg].flags & GROUP_INODES_INIT)) {
+        return 0;
+    }
+    
+    return !bmap_isfree(imap, ino);
+}
+
+/* Marks "pos" in the rebuilt "bmap", returns 1 if it was marked already */
+static
+int
+__claim(unsigned char* bmap, const int pos)
+{
+    unsigned char bit = 1 << (pos % 8);
+    unsigned char old = __atomic_fetch_or(&bmap[pos / 8], bit,
+                                          __ATOMIC_RELAXED);
+    
+    return (old & bit) != 0;
+}
+
+/* Returns dno of the "lblk"-th block of the node, or -1 */
+static
+int
+__map_block(inode* node, const int lblk)
+{
+    if (lblk < BLOCKS_NUM) {
+        return node->dptrs[lblk];
+    }
+    
+    int ppb = sblock->bsize / sizeof(int);
+    int roots[INDIRECT_LEVELS] = {
+        node->indirect_dptr, node->double_dptr, node->triple_dptr
+    };
+    
+    int64_t index = lblk - BLOCKS_NUM;
+    int64_t span = ppb;
+    
+    // find the tree holding the block and walk down to it
+    for (int depth = 1; depth <= INDIRECT_LEVELS; ++depth) {
+        if (index >= span) {
+            index -= span;
+            span *= ppb;
+            continue;
+        }
+        
+        int dno = roots[depth - 1];
+        
+        for (int64_t step = span / ppb; ; step /= ppb) {
+            if (dno < 0 || dno >= sblock->dnum) {
+                return -1;
+            }
+            
+            dno = ((int*)__dblock(dno))[index / step % ppb];
+            
+            if (step == 1) {
+                return dno;
+            }
+        }
+    }
+    
+    return -1;
+}
+
+/* Claims a data block of inode "ino", returns 0 if the pointer is bad */
+static
+int
+__claim_dno(const int ino, const int dno)
+{
+    if (dno >= sblock->dnum) {
+        __report("block pointer out of range in inode", ino, 1);
+        return 0;
+    }
+    
+    // shared blocks are checked against their owner counts later
+    if (owners != NULL) {
+        __atomic_add_fetch(&owners[dno], 1, __ATOMIC_RELAXED);
+    }
+    
+    if (__claim(new_dmap, dno) && owners == NULL) {
+        __report("data block claimed twice, second owner is inode", ino, 0);
+    }
+    
+    return 1;
+}
+
+/* Claims the indirect block "slot" of "depth" levels with every block it
+   points to, bad pointers are dropped */
+static
+void
+__claim_tree(const int ino, int* slot, const int depth)
+{
+    if (*slot < 0) {
+        return;
+    }
+    
+    if (!__claim_dno(ino, *slot)) {
+        if (repair) *slot = -1;
+        return;
+    }
+    
+    int* ptrs = (int*)__dblock(*slot);
+    int count = sblock->bsize / sizeof(int);
+    
+    for (int ii = 0; ii < count; ++ii) {
+        if (ptrs[ii] < 0) {
+            continue;
+        }
+        
+        if (depth > 1) {
+            __claim_tree(ino, &ptrs[ii], depth - 1);
+        }
+        
+        else if (!__claim_dno(ino, ptrs[ii])) {
+            if (repair) ptrs[ii] = -1;
+        }
+    }
+}
+
+/* Claims all data blocks of inode "ino" in the rebuilt block bitmap */
+static
+void
+__claim_blocks(const int ino)
+{
+    inode* node = __inode(ino);
+    
+    for (int ii = 0; ii < BLOCKS_NUM; ++ii) {
+        if (node->dptrs[ii] >= 0 && !__claim_dno(ino, node->dptrs[ii])) {
+            if (repair) node->dptrs[ii] = -1;
+        }
+    }
+    
+    // cluster map with index blocks above it is claimed like a tree
+    int cmap_depth = (node->flags & INODE_CMAP_DEPTH) >> CMAP_DEPTH_SHIFT;
+    
+    if ((node->flags & INODE_CMAP) && cmap_depth > 0) {
+        __claim_tree(ino, &node->cmap_dptr, cmap_depth);
+    }
+    
+    else if ((node->flags & INODE_CMAP) && !__claim_dno(ino, node->cmap_dptr)) {
+        if (repair) node->cmap_dptr = -1;
+    }
+    
+    if ((node->flags & INODE_CMAP) && node->cmap_dptr < 0) {
+        node->flags &= ~(INODE_CMAP | INODE_CMAP_DEPTH);
+    }
+    
+    __claim_tree(ino, &node->indirect_dptr, 1);
+    __claim_tree(ino, &node->double_dptr, 2);
+    __claim_tree(ino, &node->triple_dptr, 3);
+}
+
+/* Counts names in the directory "ino", drops names of free inodes */
+static
+void
+__count_names(const int ino)
+{
+    inode* dir = __inode(ino);
+    int count = sblock->bsize / sizeof(dentry);
+    
+    for (int blk = 0; blk < dir->dnum; ++blk) {
+        int dno = __map_block(dir, blk);
+        
+        if (dno < 0 || dno >= sblock->dnum) {
+            continue;
+        }
+        
+        dentry* entries = (dentry*)__dblock(dno);
+        
+        for (int ii = 0; ii < count; ++ii) {
+            int child = entries[ii].ino;
+            
+            // free entry or link back to the parent
+            if (child == -1 || streq(entries[ii].iname, "..")) {
+                continue;
+            }
+            
+            if (child < 0 || child >= sblock->inum || !__ino_used(child)) {
+                __report("name pointing to a free inode in directory", ino, 1);
+                if (repair) entries[ii].ino = -1;
+                continue;
+            }
+            
+            __atomic_add_fetch(&refs[child], 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+
+
+
+/* ==================== PASSES ============================================ */
+/* Pass 1: counts names of every inode in the directories of the group */
+static
+void
+__pass_names(const int gg)
+{
+    int first = gg * sblock->ipg;
+    int last = min(first + sblock->ipg, sblock->inum);
+    
+    for (int ino = first; ino < last; ++ino) {
+        if (__ino_used(ino) && S_ISDIR(__inode(ino)->mode)) {
+            __count_names(ino);
+        }
+    }
+}
+
+/* Marks inodes on the orphan list, they keep their blocks without names
+   until the reclaimer frees them, a bad link ends the list */
+static
+void
+__pass_orphans()
+{
+    int* link = &sblock->orphans;
+    
+    while (*link >= 0) {
+        int ino = *link;
+        
+        // list loops or points to an inode which is free or has names
+        if (ino >= sblock->inum || !__ino_used(ino) || refs[ino] > 0
+            || __claim(orphaned, ino)) {
+            __report("bad orphan list entry", ino, 1);
+            if (repair) *link = -1;
+            return;
+        }
+        
+        link = &__inode(ino)->next_orphan;
+    }
+}
+
+/* Pass 2: rebuilds bitmaps from the inodes of the group which have names */
+static
+void
+__pass_blocks(const int gg)
+{
+    int first = gg * sblock->ipg;
+    int last = min(first + sblock->ipg, sblock->inum);
+    
+    for (int ino = first; ino < last; ++ino) {
+        if (!__ino_used(ino)) {
+            continue;
+        }
+        
+        int orphan = (orphaned[ino / 8] >> (ino % 8)) & 1;
+        
+        // nothing points to the inode, it will be freed
+        if (refs[ino] == 0 && ino != sblock->root_ino && !orphan) {
+            __report("unreferenced inode", ino, 1);
+            continue;
+        }
+        
+        __claim(new_imap, ino);
+        __claim_blocks(ino);
+        
+        // root has no name, other inodes have one per hard link, orphans
+        // have none
+        int nlink = (ino == sblock->root_ino) ? 1 : refs[ino];
+        if (__inode(ino)->nlink != nlink) {
+            __report("wrong link count in inode", ino, 1);
+            if (repair) __inode(ino)->nlink = nlink;
+        }
+    }
+}
+
+/* Pass 3: compares bitmaps and free counters of the group with rebuilt ones */
+static
+void
+__pass_groups(const int gg)
+{
+    int ifirst = gg * sblock->ipg;
+    int icount = max(min(sblock->ipg, sblock->inum - ifirst), 0);
+    int dfirst = gg * sblock->bpg;
+    int dcount = max(min(sblock->bpg, sblock->dnum - dfirst), 0);
+    
+    int used_inodes = 0;
+    int bad_inodes = 0;
+    for (int ino = ifirst; ino < ifirst + icount; ++ino) {
+        int used = !bmap_isfree(new_imap, ino);
+        used_inodes += used;
+        bad_inodes += (used != __ino_used(ino));
+    }
+    
+    int dinit = groups[gg].flags & GROUP_DBLOCKS_INIT;
+    int used_dblocks = 0;
+    int bad_dblocks = 0;
+    for (int dno = dfirst; dno < dfirst + dcount; ++dno) {
+        int used = !bmap_isfree(new_dmap, dno);
+        used_dblocks += used;
+        bad_dblocks += (used != (dinit && !bmap_isfree(dmap, dno)));
+    }
+    
+    // data of a used block is what was written last
+    int bad_sums = 0;
+    for (int dno = dfirst; sums != NULL && dno < dfirst + dcount; ++dno) {
+        if (bmap_isfree(new_dmap, dno) || sums[dno] == CSUM_NONE) {
+            continue;
+        }
+        
+        bad_sums += (csum_block(__dblock(dno), sblock->bsize) != sums[dno]);
+    }
+    
+    // every pointer but the first one is an extra owner
+    int bad_owners = 0;
+    for (int dno = dfirst; rmap != NULL && dno < dfirst + dcount; ++dno) {
+        bad_owners += (rmap[dno] != max(owners[dno] - 1, 0));
+    }
+    
+    if (bad_inodes > 0) {
+        __report("inode bitmap differs in group", gg, 1);
+    }
+    
+    if (bad_dblocks > 0) {
+        __report("data block bitmap differs in group", gg, 1);
+    }
+    
+    int free_inodes = icount - used_inodes;
+    int free_dblocks = dcount - used_dblocks;
+    
+    if (bad_owners > 0) {
+        __report("wrong owner counts of data blocks in group", gg, 1);
+    }
+    
+    // lost data can not be repaired
+    if (bad_sums > 0) {
+        __report("data blocks not matching their checksums in group", gg, 0);
+    }
+    
+    if (groups[gg].free_inodes != free_inodes
+        || groups[gg].free_dblocks != free_dblocks) {
+        __report("wrong free counters in group", gg, 1);
+    }
+    
+    if (!repair) {
+        return;
+    }
+    
+    // write rebuilt bitmaps, the group is initialized from now on
+    if (bad_inodes > 0) {
+        for (int ino = ifirst; ino < ifirst + icount; ++ino) {
+            if (bmap_isfree(new_imap, ino)) bmap_free(imap, ino);
+            else bmap_set(imap, ino);
+        }
+        
+        groups[gg].flags |= GROUP_INODES_INIT;
+    }
+    
+    if (bad_dblocks > 0) {
+        for (int dno = dfirst; dno < dfirst + dcount; ++dno) {
+            if (bmap_isfree(new_dmap, dno)) bmap_free(dmap, dno);
+            else bmap_set(dmap, dno);
+        }
+        
+        groups[gg].flags |= GROUP_DBLOCKS_INIT;
+    }
+    
+    if (bad_owners > 0) {
+        for (int dno = dfirst; dno < dfirst + dcount; ++dno) {
+            rmap[dno] = max(owners[dno] - 1, 0);
+        }
+    }
+    
+    groups[gg].free_inodes = free_inodes;
+    groups[gg].free_dblocks = free_dblocks;
+}
+
+/* Runs the pass of the worker over its groups */
+static
+void*
+__worker_main(void* arg)
+{
+    fsck_worker* worker = (fsck_worker*)arg;
+    
+    for (int gg = worker->first; gg < worker->last; ++gg) {
+        worker->pass(gg);
+    }
+    
+    return NULL;
+}
+
+/* Runs "pass" over all groups split between "threads" workers */
+static
+void
+__run_pass(fsck_pass pass, const int threads)
+{
+    fsck_worker workers[threads];
+    int per_worker = div_up(sblock->gnum, threads);
+    
+    for (int ii = 0; ii < threads; ++ii) {
+        workers[ii].pass = pass;
+        workers[ii].first = min(ii * per_worker, sblock->gnum);
+        workers[ii].last = min(workers[ii].first + per_worker, sblock->gnum);
+        
+        int rv = pthread_create(&workers[ii].thread, NULL,
+                                __worker_main, &workers[ii]);
+        assert(rv == 0);
+    }
+    
+    for (int ii = 0; ii < threads; ++ii) {
+        pthread_join(workers[ii].thread, NULL);
+    }
+}
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Checks "data_file" with "threads" workers, repairs it if "fix" is set */
+int
+fsck_check(const char* data_file, const int threads, const int fix)
+{
+    assert(threads > 0);
+    
+    repair = fix;
+    errors = 0;
+    fixed = 0;
+    
+    int fd = open(data_file, fix ? O_RDWR : O_RDONLY);
+    if (fd == -1) {
+        printf("fsck.olfs: can not open %s\n", data_file);
+        return FSCK_FAILED;
+    }
+    
+    struct stat st;
+    int rv = fstat(fd, &st);
+    assert(rv != -1);
+    
+    int prot = fix ? PROT_READ | PROT_WRITE : PROT_READ;
+    void* base = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+    close(fd);
+    
+    if (base == MAP_FAILED) {
+        printf("fsck.olfs: can not map %s\n", data_file);
+        return FSCK_FAILED;
+    }
+    
+    sblock = (superblock*)base;
+    if ((size_t)st.st_size < sizeof(superblock) || sblock->magic != OLFS_MAGIC) {
+        printf("fsck.olfs: %s is not an olfs data file\n", data_file);
+        munmap(base, st.st_size);
+        return FSCK_FAILED;
+    }
+    
+    if (sblock->isize != sizeof(inode)) {
+        printf("fsck.olfs: %s has inodes of an older layout\n", data_file);
+        munmap(base, st.st_size);
+        return FSCK_FAILED;
+    }
+    
+    // data blocks are in the other data files of the set
+    if (sblock->stripes > 1) {
+        printf("fsck.olfs: %s is striped over %d data files, "
+               "they can not be checked\n", data_file, sblock->stripes);
+        munmap(base, st.st_size);
+        return FSCK_FAILED;
+    }
+    
+    // cold data blocks are in the slow tier
+    if (sblock->tier_slots > 0) {
+        printf("fsck.olfs: %s is the fast tier of a disk, "
+               "it can not be checked\n", data_file);
+        munmap(base, st.st_size);
+        return FSCK_FAILED;
+    }
+    
+    groups = (group*)(sblock->gptr + (char*)base);
+    imap = sblock->imap + (char*)base;
+    dmap = sblock->dmap + (char*)base;
+    iptr = sblock->iptr + (char*)base;
+    dptr = sblock->dptr + (char*)base;
+    rmap = (sblock->rmap > 0) ? (unsigned short*)(sblock->rmap + (char*)base)
+                              : NULL;
+    sums = (sblock->csum > 0) ? (uint32_t*)(sblock->csum + (char*)base) : NULL;
+    
+    refs = calloc(sblock->inum, sizeof(int));
+    new_imap = calloc(div_up(sblock->inum, 8), 1);
+    new_dmap = calloc(div_up(sblock->dnum, 8), 1);
+    orphaned = calloc(div_up(sblock->inum, 8), 1);
+    assert(refs != NULL && new_imap != NULL && new_dmap != NULL);
+    assert(orphaned != NULL);
+    
+    // disks which share blocks count pointers to them
+    owners = NULL;
+    if (rmap != NULL) {
+        owners = calloc(sblock->dnum, sizeof(int));
+        assert(owners != NULL);
+    }
+    
+    int workers = min(threads, sblock->gnum);
+    printf("fsck.olfs: checking %d groups with %d threads\n",
+           sblock->gnum, workers);
+    
+    __run_pass(__pass_names, workers);
+    __pass_orphans();
+    __run_pass(__pass_blocks, workers);
+    __run_pass(__pass_groups, workers);
+    
+    if (fix) {
+        msync(base, st.st_size, MS_SYNC);
+    }
+    
+    free(refs);
+    free(new_imap);
+    free(new_dmap);
+    free(owners);
+    free(orphaned);
+    munmap(base, st.st_size);
+    
+    printf("fsck.olfs: %ld errors, %ld fixed\n", errors, fixed);
+    
+    if (errors == 0) {
+        return FSCK_OK;
+    }
+    
+    return (fixed == errors) ? FSCK_FIXED : FSCK_ERRORS;
+}
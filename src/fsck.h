@@ -0,0 +1,20 @@
+//
+//  fsck.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef fsck_h
+#define fsck_h
+
+#include <stdio.h>
+
+#define FSCK_OK         0   // no errors found
+#define FSCK_FIXED      1   // errors found and repaired
+#define FSCK_ERRORS     4   // errors left in the data file
+#define FSCK_FAILED     8   // data file could not be checked
+
+int     fsck_check(const char* data_file, const int threads, const int repair);
+
+#endif /* fsck_h */
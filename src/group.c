@@ -0,0 +1,413 @@
+//
+//  group.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "bmap.h"
+
+#include "group.h"
+
+
+/* ========================= VARIABLES ===================================== */
+static superblock*      sblock;
+static group*           groups;     // group descriptors in the data file
+static char*            imap;       // bitmap for inodes
+static char*            dmap;       // bitmap for data blocks
+
+static pthread_mutex_t* locks;      // one lock per group
+static unsigned int     dir_rotor;  // group where next directory goes
+static int              thin;       // allocations keep to the first groups
+
+
+
+
+/* ==================== LOCAL HELPERS ===================================== */
+/* Returns number of inodes in the group "gg" */
+static
+int
+__inodes_in(const int gg)
+{
+    return min(sblock->ipg, sblock->inum - gg * sblock->ipg);
+}
+
+/* Returns number of data blocks in the group "gg" */
+static
+int
+__dblocks_in(const int gg)
+{
+    return min(sblock->bpg, sblock->dnum - gg * sblock->bpg);
+}
+
+/* Initializes inode bitmap and table of the group, lock must be held */
+static
+void
+__init_inodes(const int gg)
+{
+    int first = gg * sblock->ipg;
+    int last = first + __inodes_in(gg);
+    trace("|--GROUP: initializing inodes of group %d\n", gg); // log
+    
+    bmap_init_range(imap, first, last - first);
+    
+    // inode table is cleared block by block
+    int per_block = disk_block_size() / sizeof(inode);
+    
+    for (int ino = first; ino < last; ) {
+        int run = min(per_block - ino % per_block, last - ino);
+        memset(disk_get_inode(ino), 0, run * sizeof(inode));
+        ino += run;
+    }
+    
+    groups[gg].flags |= GROUP_INODES_INIT;
+}
+
+/* Initializes data block bitmap of the group, lock must be held */
+static
+void
+__init_dblocks(const int gg)
+{
+    int first = gg * sblock->bpg;
+    int count = __dblocks_in(gg);
+    trace("|--GROUP: initializing data blocks of group %d\n", gg); // log
+    
+    // blocks themselves are cleaned when allocated
+    bmap_init_range(dmap, first, count);
+    
+    groups[gg].flags |= GROUP_DBLOCKS_INIT;
+}
+
+/* Takes an inode from the group, lock must be held, returns ino or -1 */
+static
+int
+__take_ino(const int gg)
+{
+    if (groups[gg].free_inodes == 0) {
+        return -1;
+    }
+    
+    if (!(groups[gg].flags & GROUP_INODES_INIT)) {
+        __init_inodes(gg);
+    }
+    
+    int first = gg * sblock->ipg;
+    int ino = bmap_find_free(imap, first, first + __inodes_in(gg));
+    assert(ino >= 0);
+    
+    bmap_set(imap, ino);
+    groups[gg].free_inodes -= 1;
+    
+    return ino;
+}
+
+/* Takes a data block from the group starting at "goal", returns dno or -1 */
+static
+int
+__take_dno(const int gg, const int goal)
+{
+    if (groups[gg].free_dblocks == 0) {
+        return -1;
+    }
+    
+    if (!(groups[gg].flags & GROUP_DBLOCKS_INIT)) {
+        __init_dblocks(gg);
+    }
+    
+    int first = gg * sblock->bpg;
+    int last = first + __dblocks_in(gg);
+    
+    // look after the goal first, then wrap around
+    int dno = bmap_find_free(dmap, goal, last);
+    if (dno < 0) {
+        dno = bmap_find_free(dmap, first, goal);
+    }
+    assert(dno >= 0);
+    
+    bmap_set(dmap, dno);
+    groups[gg].free_dblocks -= 1;
+    
+    return dno;
+}
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Returns bytes needed for group descriptors of a "data_file_size" disk */
+size_t
+group_table_size(const size_t data_file_size, const int block_size)
+{
+    // every group has one block of data block bitmap
+    size_t group_size = (size_t)8 * block_size * block_size;
+    
+    return (data_file_size / group_size + 1) * sizeof(group);
+}
+
+/* Splits the disk described by "sb" into groups, all left uninitialized */
+void
+group_format(superblock* sb)
+{
+    // every group has one block of data block bitmap
+    sb->gnum = div_up(sb->dnum, 8 * sb->bsize);
+    
+    // group slices of bitmaps start at whole bytes
+    sb->bpg = div_up(div_up(sb->dnum, sb->gnum), 8) * 8;
+    sb->ipg = div_up(div_up(sb->inum, sb->gnum), 8) * 8;
+    trace("|--GROUP: %d groups of %d inodes and %d blocks\n", // log
+          sb->gnum, sb->ipg, sb->bpg);
+    
+    sblock = sb;
+    groups = (group*)(sb->gptr + (char*)sb);
+    
+    for (int gg = 0; gg < sb->gnum; ++gg) {
+        groups[gg].flags = 0;
+        groups[gg].free_inodes = max(__inodes_in(gg), 0);
+        groups[gg].free_dblocks = max(__dblocks_in(gg), 0);
+    }
+}
+
+/* Prepares groups of the mounted disk for allocation, with "thin_alloc"
+   inodes and blocks are taken from the start of the disk first, so the
+   sparse data file only grows as far as it is used */
+void
+group_mount(superblock* sb, const int thin_alloc)
+{
+    sblock = sb;
+    groups = (group*)(sb->gptr + (char*)sb);
+    imap = sb->imap + (char*)sb;
+    dmap = sb->dmap + (char*)sb;
+    
+    locks = malloc(sb->gnum * sizeof(pthread_mutex_t));
+    assert(locks != NULL);
+    
+    for (int gg = 0; gg < sb->gnum; ++gg) {
+        pthread_mutex_init(&locks[gg], NULL);
+    }
+    
+    dir_rotor = 0;
+    thin = thin_alloc;
+}
+
+/* Releases in memory state of the groups */
+void
+group_unmount()
+{
+    for (int gg = 0; gg < sblock->gnum; ++gg) {
+        pthread_mutex_destroy(&locks[gg]);
+    }
+    
+    free(locks);
+    locks = NULL;
+}
+
+/* Returns ino of a free inode near its parent, if all used returns -1 */
+int
+group_alloc_ino(const int parent_ino, const int is_dir)
+{
+    int gnum = sblock->gnum;
+    int start;
+    
+    // everything goes as low as it fits
+    if (thin) {
+        start = 0;
+    }
+    
+    // directories are spread across groups to leave room for their files
+    else if (is_dir || parent_ino < 0) {
+        start = __sync_fetch_and_add(&dir_rotor, 1) % gnum;
+    }
+    
+    // files go in the group of their directory
+    else {
+        start = parent_ino / sblock->ipg;
+    }
+    
+    // first pass skips busy groups, so parallel creators spread out
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int ii = 0; ii < gnum; ++ii) {
+            int gg = (start + ii) % gnum;
+            
+            if (groups[gg].free_inodes == 0) {
+                continue;
+            }
+            
+            if (pass == 0) {
+                if (pthread_mutex_trylock(&locks[gg]) != 0) continue;
+            }
+            else {
+                pthread_mutex_lock(&locks[gg]);
+            }
+            
+            int ino = __take_ino(gg);
+            pthread_mutex_unlock(&locks[gg]);
+            
+            if (ino >= 0) {
+                return ino;
+            }
+        }
+    }
+    
+    // no free inodes
+    return -1;
+}
+
+/* Returns dno of a free data block at or after "goal", otherwise -1 */
+int
+group_alloc_dno(const int goal)
+{
+    int gnum = sblock->gnum;
+    
+    // goal after the last block starts from the beginning
+    int from_goal = (goal < sblock->dnum) ? goal : 0;
+    int start = from_goal / sblock->bpg;
+    
+    for (int ii = 0; ii < gnum; ++ii) {
+        int gg = (start + ii) % gnum;
+        
+        if (groups[gg].free_dblocks == 0) {
+            continue;
+        }
+        
+        // goal only matters in its own group
+        int from = (ii == 0) ? from_goal : gg * sblock->bpg;
+        
+        pthread_mutex_lock(&locks[gg]);
+        int dno = __take_dno(gg, from);
+        pthread_mutex_unlock(&locks[gg]);
+        
+        if (dno >= 0) {
+            return dno;
+        }
+    }
+    
+    // no free data blocks
+    return -1;
+}
+
+/* Returns inode "ino" to its group */
+void
+group_free_ino(const int ino)
+{
+    int gg = ino / sblock->ipg;
+    
+    pthread_mutex_lock(&locks[gg]);
+    
+    bmap_free(imap, ino);
+    groups[gg].free_inodes += 1;
+    
+    pthread_mutex_unlock(&locks[gg]);
+}
+
+/* Returns data block "dno" to its group */
+void
+group_free_dno(const int dno)
+{
+    int gg = dno / sblock->bpg;
+    
+    pthread_mutex_lock(&locks[gg]);
+    
+    bmap_free(dmap, dno);
+    groups[gg].free_dblocks += 1;
+    
+    pthread_mutex_unlock(&locks[gg]);
+}
+
+/* Returns "count" adjacent data blocks from "dno" on to their groups */
+void
+group_free_range(const int dno, const int count)
+{
+    for (int pos = dno; pos < dno + count; ) {
+        int gg = pos / sblock->bpg;
+        int run = min(dno + count, (gg + 1) * sblock->bpg) - pos;
+        
+        pthread_mutex_lock(&locks[gg]);
+        
+        bmap_free_range(dmap, pos, run);
+        groups[gg].free_dblocks += run;
+        
+        pthread_mutex_unlock(&locks[gg]);
+        
+        pos += run;
+    }
+}
+
+/* Calls "fn" for every run of the "count" blocks from "dno" on which is
+   still free, the group stays locked meanwhile so none of them is taken */
+void
+group_trim(const int dno, const int count, group_trim_fn fn)
+{
+    for (int pos = dno; pos < dno + count; ) {
+        int gg = pos / sblock->bpg;
+        int end = min(dno + count, (gg + 1) * sblock->bpg);
+        
+        pthread_mutex_lock(&locks[gg]);
+        
+        while (pos < end) {
+            int run = pos;
+            
+            while (run < end && bmap_isfree(dmap, run)) {
+                ++run;
+            }
+            
+            if (run > pos) {
+                fn(pos, run - pos);
+            }
+            
+            // skip the block which was taken again
+            pos = run + 1;
+        }
+        
+        pthread_mutex_unlock(&locks[gg]);
+        
+        pos = end;
+    }
+}
+
+/* Returns data block where allocation for inode "ino" should start */
+int
+group_goal_dno(const int ino)
+{
+    int gg = ino / sblock->ipg;
+    
+    // lowest free block is taken first
+    if (thin) {
+        return 0;
+    }
+    
+    // inode groups and block groups line up one to one
+    return min(gg, sblock->gnum - 1) * sblock->bpg;
+}
+
+/* Is inode "ino" in use? */
+int
+group_ino_used(const int ino)
+{
+    int gg = ino / sblock->ipg;
+    
+    // bitmap of a group is only valid once it is initialized
+    if (!(groups[gg].flags & GROUP_INODES_INIT)) {
+        return 0;
+    }
+    
+    return !bmap_isfree(imap, ino);
+}
+
+/* Returns number of free data blocks of all groups */
+int
+group_free_dblocks()
+{
+    int free = 0;
+    
+    for (int gg = 0; gg < sblock->gnum; ++gg) {
+        free += groups[gg].free_dblocks;
+    }
+    
+    return free;
+}
@@ -0,0 +1,43 @@
+//
+//  group.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef group_h
+#define group_h
+
+#include <stdio.h>
+#include "disk.h"
+
+#define GROUP_INODES_INIT   1   // inode bitmap and table are initialized
+#define GROUP_DBLOCKS_INIT  2   // data block bitmap is initialized
+
+/* Allocation group - own slice of inodes and data blocks */
+typedef struct group {
+    int flags;              // which parts of the group are initialized
+    int free_inodes;        // number of free inodes in the group
+    int free_dblocks;       // number of free data blocks in the group
+    int _reserved;
+} group;
+
+/* Gets runs of free data blocks found by group_trim() */
+typedef void (*group_trim_fn)(const int dno, const int count);
+
+size_t  group_table_size(const size_t data_file_size, const int block_size);
+void    group_format(superblock* sb);
+void    group_mount(superblock* sb, const int thin_alloc);
+void    group_unmount();
+
+int     group_alloc_ino(const int parent_ino, const int is_dir);
+int     group_alloc_dno(const int goal);
+void    group_free_ino(const int ino);
+void    group_free_dno(const int dno);
+void    group_free_range(const int dno, const int count);
+int     group_goal_dno(const int ino);
+int     group_ino_used(const int ino);
+int     group_free_dblocks();
+void    group_trim(const int dno, const int count, group_trim_fn fn);
+
+#endif /* group_h */
@@ -0,0 +1,234 @@
+//
+//  lz.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+
+/* ========================= CONSTANTS ===================================== */
+#define LZ_MIN_MATCH    4           // shortest match worth an offset
+#define LZ_MAX_OFFSET   65535       // offsets are stored in two bytes
+#define LZ_HASH_BITS    12          // positions remembered by the compressor
+
+/*
+ * Data is a list of sequences, every one of them is
+ *
+ *   token           literal length in the high nibble,
+ *                   match length - LZ_MIN_MATCH in the low nibble
+ *   [length bytes]  nibble of 15 continues in bytes of 255 and the rest
+ *   literals
+ *   offset          two bytes, little endian
+ *   [length bytes]  same for the match length
+ *
+ * the last sequence ends after its literals and has no match.
+ */
+
+
+
+
+/* ==================== LOCAL HELPERS ===================================== */
+/* Reads four bytes at "pp" */
+static
+uint32_t
+__read32(const unsigned char* pp)
+{
+    uint32_t value;
+    memcpy(&value, pp, sizeof(value));
+    
+    return value;
+}
+
+/* Returns slot of the hash table for four bytes of "value" */
+static
+int
+__hash(const uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Writes the rest of "len" after a nibble of 15, returns NULL if no space */
+static
+unsigned char*
+__put_length(unsigned char* out, const unsigned char* end, int len)
+{
+    for (; len >= 255; len -= 255) {
+        if (out == end) return NULL;
+        *out++ = 255;
+    }
+    
+    if (out == end) return NULL;
+    *out++ = len;
+    
+    return out;
+}
+
+/* Reads the rest of a length after a nibble of 15, returns -1 if cut off */
+static
+int
+__get_length(const unsigned char** in, const unsigned char* end)
+{
+    int len = 0;
+    unsigned char byte;
+    
+    do {
+        if (*in == end) return -1;
+        byte = *(*in)++;
+        len += byte;
+    } while (byte == 255);
+    
+    return len;
+}
+
+/* Writes one sequence, "match_len" of 0 is the last one, NULL if no space */
+static
+unsigned char*
+__put_sequence(unsigned char* out, const unsigned char* end,
+               const unsigned char* literals, const int lit_len,
+               const int offset, const int match_len)
+{
+    int match_code = (match_len > 0) ? match_len - LZ_MIN_MATCH : 0;
+    
+    if (out == end) return NULL;
+    unsigned char* token = out++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4
+           | (match_code < 15 ? match_code : 15);
+    
+    if (lit_len >= 15) {
+        out = __put_length(out, end, lit_len - 15);
+        if (out == NULL) return NULL;
+    }
+    
+    if (end - out < lit_len) return NULL;
+    memcpy(out, literals, lit_len);
+    out += lit_len;
+    
+    // last sequence has literals only
+    if (match_len == 0) {
+        return out;
+    }
+    
+    if (end - out < 2) return NULL;
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+    
+    if (match_code >= 15) {
+        out = __put_length(out, end, match_code - 15);
+    }
+    
+    return out;
+}
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Compresses "src_len" bytes of "src" into "dst", returns compressed
+   length or -1 when it does not fit into "dst_cap" bytes */
+int
+lz_compress(const char* src, const int src_len, char* dst, const int dst_cap)
+{
+    const unsigned char* in = (const unsigned char*)src;
+    unsigned char* out = (unsigned char*)dst;
+    const unsigned char* out_end = out + dst_cap;
+    
+    // last position where every four bytes were seen
+    int table[1 << LZ_HASH_BITS];
+    memset(table, 0xff, sizeof(table));
+    
+    int anchor = 0;
+    int pos = 0;
+    
+    while (pos + LZ_MIN_MATCH <= src_len) {
+        uint32_t value = __read32(in + pos);
+        int slot = __hash(value);
+        int cand = table[slot];
+        table[slot] = pos;
+        
+        // no match here, try the next byte
+        if (cand < 0 || pos - cand > LZ_MAX_OFFSET
+            || __read32(in + cand) != value) {
+            pos += 1;
+            continue;
+        }
+        
+        int match_len = LZ_MIN_MATCH;
+        while (pos + match_len < src_len
+               && in[cand + match_len] == in[pos + match_len]) {
+            match_len += 1;
+        }
+        
+        out = __put_sequence(out, out_end, in + anchor, pos - anchor,
+                             pos - cand, match_len);
+        if (out == NULL) return -1;
+        
+        pos += match_len;
+        anchor = pos;
+    }
+    
+    out = __put_sequence(out, out_end, in + anchor, src_len - anchor, 0, 0);
+    if (out == NULL) return -1;
+    
+    return out - (unsigned char*)dst;
+}
+
+/* Decompresses "src_len" bytes of "src" into "dst", returns decompressed
+   length or -1 when the data is corrupt or longer than "dst_cap" bytes */
+int
+lz_decompress(const char* src, const int src_len, char* dst, const int dst_cap)
+{
+    const unsigned char* in = (const unsigned char*)src;
+    const unsigned char* in_end = in + src_len;
+    unsigned char* out = (unsigned char*)dst;
+    unsigned char* out_end = out + dst_cap;
+    
+    while (in < in_end) {
+        int token = *in++;
+        
+        int lit_len = token >> 4;
+        if (lit_len == 15) {
+            int more = __get_length(&in, in_end);
+            if (more < 0) return -1;
+            lit_len += more;
+        }
+        
+        if (in_end - in < lit_len || out_end - out < lit_len) return -1;
+        memcpy(out, in, lit_len);
+        in += lit_len;
+        out += lit_len;
+        
+        // last sequence
+        if (in == in_end) {
+            break;
+        }
+        
+        if (in_end - in < 2) return -1;
+        int offset = in[0] | in[1] << 8;
+        in += 2;
+        
+        int match_len = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            int more = __get_length(&in, in_end);
+            if (more < 0) return -1;
+            match_len += more;
+        }
+        
+        if (offset == 0 || offset > out - (unsigned char*)dst) return -1;
+        if (out_end - out < match_len) return -1;
+        
+        // match can overlap what it copies
+        const unsigned char* from = out - offset;
+        for (int ii = 0; ii < match_len; ++ii) {
+            out[ii] = from[ii];
+        }
+        
+        out += match_len;
+    }
+    
+    return out - (unsigned char*)dst;
+}
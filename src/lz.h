@@ -0,0 +1,18 @@
+//
+//  lz.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef lz_h
+#define lz_h
+
+#include <stdio.h>
+
+int     lz_compress(const char* src, const int src_len,
+                    char* dst, const int dst_cap);
+int     lz_decompress(const char* src, const int src_len,
+                      char* dst, const int dst_cap);
+
+#endif /* lz_h */
@@ -5,6 +5,7 @@
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <dirent.h>
 #include <string.h>
@@ -17,6 +18,9 @@
 #include "utils.h"
 #include "directory.h"
 #include "disk.h"
+#include "bcache.h"
+#include "clone.h"
+#include "olfs.h"
 
 
 /* ==================== INODE ============================================== */
@@ -104,7 +108,7 @@ nufs_utimens(const char* path, const struct timespec ts[2])
 
 
 /* ==================== FILE =============================================== */
-/* Checks if file exist */
+/* Checks if file exist, starts tracking how it is read and written */
 int
 nufs_open(const char *path, struct fuse_file_info *fi)
 {
@@ -112,11 +116,29 @@ nufs_open(const char *path, struct fuse_file_info *fi)
     
     int rv = disk_access(path);
     
+    // every open file has its own access pattern and block pointers
+    open_file* of = malloc(sizeof(open_file));
+    assert(of != NULL);
+    disk_open_init(of);
+    fi->fh = (uintptr_t)of;
+    
     printf("@->: %d\n\n\n", rv); // log
     
     return 0;
 }
 
+/* Forgets the access pattern and block pointers of the closed file */
+int
+nufs_release(const char *path, struct fuse_file_info *fi)
+{
+    printf("#-SYSCALL: release(%s)\n", path); // log
+    
+    free((open_file*)(uintptr_t)fi->fh);
+    fi->fh = 0;
+    
+    return 0;
+}
+
 // TODO: implements: man 2 link
 /* Creates a new hard link to existing file */
 int
@@ -153,7 +175,8 @@ nufs_read(const char *path, char *buf, size_t size, off_t offset,
     printf("#-SYSCALL: read(%s, %ld bytes, @+%ld)\n", // log
            path, size, offset);
     
-    int rv = disk_read(path, buf, size, offset);
+    open_file* of = (open_file*)(uintptr_t)fi->fh;
+    int rv = disk_read(path, buf, size, offset, of);
     
     printf("@->: %d\n\n\n", rv); // log
     
@@ -168,7 +191,8 @@ nufs_write(const char *path, const char *buf, size_t size, off_t offset,
     printf("#-SYSCALL: write(%s, %ld bytes, @+%ld)\n", // log
            path, size, offset);
     
-    int rv = disk_write(path, buf, size, offset);
+    open_file* of = (open_file*)(uintptr_t)fi->fh;
+    int rv = disk_write(path, buf, size, offset, of);
     
     printf("@->: %d\n\n\n", rv); // log
     
@@ -188,6 +212,30 @@ nufs_truncate(const char *path, off_t size)
     return 0;
 }
 
+/* Handles OLFS_IOC_CLONE, which copies a range of another file into this
+   one, whole blocks are shared instead of being copied */
+int
+nufs_ioctl(const char *path, int cmd, void *arg, struct fuse_file_info *fi,
+           unsigned int flags, void *data)
+{
+    printf("#-SYSCALL: ioctl(%s, %x)\n", path, cmd); // log
+    
+    // 32 bit callers lay the argument out differently
+    if (flags & FUSE_IOCTL_COMPAT) return -ENOSYS;
+    
+    if ((unsigned int)cmd != OLFS_IOC_CLONE) return -ENOTTY;
+    
+    olfs_clone* args = (olfs_clone*)data;
+    args->src[CLONE_PATH_MAX - 1] = '\0';
+    
+    int rv = disk_clone_range(args->src, args->src_off,
+                              path, args->dst_off, args->len);
+    
+    printf("@->: %d\n\n\n", rv); // log
+    
+    return (rv < 0) ? rv : 0;
+}
+
 
 
 
@@ -218,6 +266,23 @@ nufs_rmdir(const char *path)
     return rv;
 }
 
+/* FUSE filler of a listing, the disk code lists whole directories so it
+   does not pass offsets */
+typedef struct nufs_dir {
+    void*           buf;
+    fuse_fill_dir_t filler;
+} nufs_dir;
+
+/* Passes one name of the directory to FUSE, 1 when its buffer is full */
+static
+int
+nufs_fill_dir(void* buf, const char* name, const struct stat* st)
+{
+    nufs_dir* dir = buf;
+    
+    return dir->filler(dir->buf, name, st, 0);
+}
+
 /* Lists the contents of a directory using "filler" into "buf" */
 int
 nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
@@ -225,7 +290,8 @@ nufs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 {
     printf("#-SYSCALL: readdir(%s)\n", path); // log
     
-    int rv = disk_readdir(path, buf, filler);
+    nufs_dir dir = { buf, filler };
+    int rv = disk_readdir(path, &dir, nufs_fill_dir);
      
     printf("@->: %d\n\n\n", rv); // log
     
@@ -265,7 +331,76 @@ nufs_readlink(const char *path, char *buf, size_t size)
 
 
 
+/* ==================== EXTENDED ATTRIBUTES ================================ */
+/* Sets an attribute, "user.olfs.compress" turns compression on and off */
+int
+nufs_setxattr(const char *path, const char *name, const char *value,
+              size_t size, int flags)
+{
+    printf("#-SYSCALL: setxattr(%s, %s)\n", path, name); // log
+    
+    int rv = disk_setxattr(path, name, value, size);
+    
+    printf("@->: %d\n\n\n", rv); // log
+    
+    return rv;
+}
+
+/* Gets an attribute into "value", returns its size */
+int
+nufs_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    printf("#-SYSCALL: getxattr(%s, %s)\n", path, name); // log
+    
+    int rv = disk_getxattr(path, name, value, size);
+    
+    printf("@->: %d\n\n\n", rv); // log
+    
+    return rv;
+}
+
+/* Lists names of the attributes into "list", returns its size */
+int
+nufs_listxattr(const char *path, char *list, size_t size)
+{
+    printf("#-SYSCALL: listxattr(%s)\n", path); // log
+    
+    int rv = disk_listxattr(path, list, size);
+    
+    printf("@->: %d\n\n\n", rv); // log
+    
+    return rv;
+}
+
+
+
+
 /* ==================== NUFS GENERAL ======================================= */
+/* Starts the background threads of the disk once FUSE runs, in the daemon
+   it forked off unless "-f" is given */
+void*
+nufs_init(struct fuse_conn_info* conn)
+{
+    printf("#-SYSCALL: init()\n"); // log
+    
+    disk_start();
+    
+    printf("@->: done\n\n\n"); // log
+    
+    return NULL;
+}
+
+/* Writes everything back when FUSE unmounts the filesystem */
+void
+nufs_destroy(void* private_data)
+{
+    printf("#-SYSCALL: destroy()\n"); // log
+    
+    disk_unmount();
+    
+    printf("@->: done\n\n\n"); // log
+}
+
 /* Initialiaze FUSE operations as NUFS functions */
 void
 nufs_init_fuse_opers(struct fuse_operations* opers)
@@ -282,11 +417,13 @@ nufs_init_fuse_opers(struct fuse_operations* opers)
     opers->utimens  = nufs_utimens;
     
     opers->open     = nufs_open;
+    opers->release  = nufs_release;
     opers->link     = nufs_link;
     opers->unlink   = nufs_unlink;
     opers->read     = nufs_read;
     opers->write    = nufs_write;
     opers->truncate = nufs_truncate;
+    opers->ioctl    = nufs_ioctl;
     
     opers->mkdir    = nufs_mkdir;
     opers->rmdir    = nufs_rmdir;
@@ -294,6 +431,13 @@ nufs_init_fuse_opers(struct fuse_operations* opers)
     
     opers->symlink  = nufs_symlink;
     opers->readlink = nufs_readlink;
+    
+    opers->setxattr  = nufs_setxattr;
+    opers->getxattr  = nufs_getxattr;
+    opers->listxattr = nufs_listxattr;
+    
+    opers->init     = nufs_init;
+    opers->destroy  = nufs_destroy;
 }
 
 
@@ -304,6 +448,10 @@ struct fuse_operations fuse_opers;
 int
 main(int argc, char *argv[])
 {
+    // take out NUFS options
+    mount_opts opts;
+    if (olfs_parse_opts(&argc, argv, &opts) < 0) return 1;
+    
     assert(argc > 2 && argc < 6);
     
     printf("\n\n====================== NUFS LOG ======================\n\n");
@@ -313,7 +461,14 @@ main(int argc, char *argv[])
     
     // initialize superblock for NUFS in given data file
     printf("#-DISK: Mounting %s as data file\n", data_file);
-    disk_mount(data_file);
+    int rv = disk_mount(data_file, &opts);
+    
+    if (rv < 0) {
+        fprintf(stderr, "nufs: can not mount %s: %s\n", data_file,
+                strerror(-rv));
+        return 1;
+    }
+    
     printf("@->: Success\n\n"); // log
 
     // initialize FUSE operations in NUFS
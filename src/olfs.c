@@ -0,0 +1,481 @@
+//
+//  olfs.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "disk.h"
+#include "bcache.h"
+#include "stripe.h"
+#include "ckpt.h"
+
+#include "olfs.h"
+
+
+/* ========================= VARIABLES ===================================== */
+struct olfs {
+    pthread_mutex_t lock;       // one call at a time
+    int             files;      // open files, all are closed before unmount
+};
+
+struct olfs_file {
+    olfs_t*         fs;
+    int             ino;        // looked up once, used by every call
+    int             flags;      // O_RDONLY, O_WRONLY or O_RDWR
+    open_file       state;      // read ahead and block pointers of it
+};
+
+// disk code keeps the mounted data file in its globals, so a process
+// mounts one at a time, threads mounting at once take turns on the lock
+static pthread_mutex_t  mount_lock = PTHREAD_MUTEX_INITIALIZER;
+static olfs_t*          mounted;
+
+
+
+
+/* ==================== OPTIONS ============================================ */
+/* Reports option "arg" with a value which is not one, returns -EINVAL */
+static
+int
+__bad_opt(const char* arg)
+{
+    fprintf(stderr, "olfs: bad value in %s\n", arg);
+    return -EINVAL;
+}
+
+/* Returns whole number of seconds in "str", or -1 if it is not one */
+static
+int
+__parse_seconds(const char* str)
+{
+    char* end = NULL;
+    long seconds = strtol(str, &end, 10);
+    
+    if (end == str || *end != '\0' || seconds < 0 || seconds > INT_MAX) {
+        return -1;
+    }
+    
+    return seconds;
+}
+
+/* Returns size in "str" like "4K" if it fits an int, or -1 */
+static
+int
+__parse_int_size(const char* str)
+{
+    size_t size = parse_size(str);
+    return (size > 0 && size <= INT_MAX) ? (int)size : -1;
+}
+
+/* Takes NUFS options out of "argv", leaves the rest for FUSE, returns 0 or
+   -EINVAL when a value of one is bad, the others are taken out anyway */
+int
+olfs_parse_opts(int* argc, char* argv[], mount_opts* opts)
+{
+    // defaults keep the old behaviour
+    opts->atime = ATIME_STRICT;
+    opts->lazy_interval = 60;
+    opts->size = 1024 * 1024;
+    opts->bsize = BLOCK_SIZE;
+    opts->bpi = BLOCK_SIZE;
+    opts->io = IO_MMAP;
+    opts->cache_size = BCACHE_SIZE;
+    opts->direct = 0;
+    opts->dedup = 0;
+    opts->branch = NULL;
+    opts->from = NULL;
+    opts->reset = 0;
+    opts->verify = 0;
+    opts->scrub = 0;
+    opts->discard = DISCARD_OFF;
+    opts->thin = 0;
+    opts->stripe = NULL;
+    opts->stripe_unit = STRIPE_UNIT;
+    opts->tier = NULL;
+    opts->tier_fast = 0;
+    opts->ram = 0;
+    opts->checkpoint = CKPT_INTERVAL;
+    opts->huge = 0;
+    
+    int rv = 0;
+    int kept = 1;
+    for (int ii = 1; ii < *argc; ++ii) {
+        char* arg = argv[ii];
+        
+        if (streq(arg, "--strictatime")) {
+            opts->atime = ATIME_STRICT;
+        }
+        else if (streq(arg, "--relatime")) {
+            opts->atime = ATIME_RELATIME;
+        }
+        else if (streq(arg, "--noatime")) {
+            opts->atime = ATIME_NOATIME;
+        }
+        else if (strncmp(arg, "--lazytime", 10) == 0
+                 && (arg[10] == '\0' || arg[10] == '=')) {
+            opts->atime = ATIME_LAZY;
+            
+            // optional flush interval: --lazytime=SECONDS
+            if (arg[10] == '=') {
+                opts->lazy_interval = __parse_seconds(arg + 11);
+                if (opts->lazy_interval <= 0) rv = __bad_opt(arg);
+            }
+        }
+        
+        // geometry is checked against the size when the disk is created
+        else if (strncmp(arg, "--size=", 7) == 0) {
+            opts->size = parse_size(arg + 7);
+            if (opts->size == 0) rv = __bad_opt(arg);
+        }
+        
+        else if (strncmp(arg, "--block-size=", 13) == 0) {
+            opts->bsize = __parse_int_size(arg + 13);
+            if (opts->bsize < 0) rv = __bad_opt(arg);
+        }
+        else if (strncmp(arg, "--bytes-per-inode=", 18) == 0) {
+            opts->bpi = __parse_int_size(arg + 18);
+            if (opts->bpi < 0) rv = __bad_opt(arg);
+        }
+        
+        else if (streq(arg, "--io=mmap")) {
+            opts->io = IO_MMAP;
+        }
+        else if (streq(arg, "--io=pread")) {
+            opts->io = IO_PREAD;
+        }
+        else if (streq(arg, "--io=uring")) {
+            opts->io = IO_URING;
+        }
+        else if (strncmp(arg, "--cache-size=", 13) == 0) {
+            opts->cache_size = parse_size(arg + 13);
+            if (opts->cache_size == 0) rv = __bad_opt(arg);
+        }
+        else if (streq(arg, "--direct")) {
+            opts->direct = 1;
+        }
+        
+        else if (streq(arg, "--dedup")) {
+            opts->dedup = 1;
+        }
+        
+        else if (strncmp(arg, "--branch=", 9) == 0) {
+            opts->branch = arg + 9;
+        }
+        else if (strncmp(arg, "--from=", 7) == 0) {
+            opts->from = arg + 7;
+        }
+        else if (streq(arg, "--reset")) {
+            opts->reset = 1;
+        }
+        
+        else if (streq(arg, "--verify")) {
+            opts->verify = 1;
+        }
+        else if (strncmp(arg, "--scrub", 7) == 0
+                 && (arg[7] == '\0' || arg[7] == '=')) {
+            opts->scrub = 24 * 60 * 60;
+            
+            // optional pass interval: --scrub=SECONDS
+            if (arg[7] == '=') {
+                opts->scrub = __parse_seconds(arg + 8);
+                if (opts->scrub <= 0) rv = __bad_opt(arg);
+            }
+        }
+        
+        else if (streq(arg, "--discard") || streq(arg, "--discard=inline")) {
+            opts->discard = DISCARD_INLINE;
+        }
+        else if (streq(arg, "--discard=async")) {
+            opts->discard = DISCARD_ASYNC;
+        }
+        else if (streq(arg, "--thin")) {
+            opts->thin = 1;
+        }
+        else if (streq(arg, "--hugepages")) {
+            opts->huge = 1;
+        }
+        
+        else if (strncmp(arg, "--stripe=", 9) == 0) {
+            opts->stripe = arg + 9;
+        }
+        else if (strncmp(arg, "--stripe-unit=", 14) == 0) {
+            opts->stripe_unit = __parse_int_size(arg + 14);
+            if (opts->stripe_unit < 0) rv = __bad_opt(arg);
+        }
+        
+        else if (strncmp(arg, "--tier=", 7) == 0) {
+            opts->tier = arg + 7;
+        }
+        else if (strncmp(arg, "--tier-fast=", 12) == 0) {
+            opts->tier_fast = parse_size(arg + 12);
+            if (opts->tier_fast == 0) rv = __bad_opt(arg);
+        }
+        
+        else if (streq(arg, "--ram")) {
+            opts->ram = 1;
+        }
+        else if (strncmp(arg, "--checkpoint=", 13) == 0) {
+            opts->checkpoint = __parse_seconds(arg + 13);
+            if (opts->checkpoint < 0) rv = __bad_opt(arg);
+        }
+        
+        // not ours, FUSE gets it
+        else {
+            argv[kept++] = arg;
+        }
+    }
+    
+    *argc = kept;
+    return rv;
+}
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Mounts "data_file" inside of the process with NULL terminated nufs
+   "options" like "--io=pread", returns 0, -EBUSY while another one is
+   mounted, -EINVAL when it is not a disk or does not go with "options",
+   or -ERRNO */
+int
+olfs_mount(const char* data_file, const char* const* options, olfs_t** fs)
+{
+    int argc = 1;
+    while (options != NULL && options[argc - 1] != NULL) {
+        argc += 1;
+    }
+    
+    // parser takes what it knows and leaves the rest
+    char* argv[argc + 1];
+    argv[0] = "olfs";
+    for (int ii = 1; ii < argc; ++ii) {
+        argv[ii] = (char*)options[ii - 1];
+    }
+    argv[argc] = NULL;
+    
+    mount_opts opts;
+    int rv = olfs_parse_opts(&argc, argv, &opts);
+    
+    if (rv < 0 || argc != 1) return -EINVAL;
+    
+    pthread_mutex_lock(&mount_lock);
+    
+    if (mounted != NULL) {
+        pthread_mutex_unlock(&mount_lock);
+        return -EBUSY;
+    }
+    
+    olfs_t* olfs = malloc(sizeof(olfs_t));
+    assert(olfs != NULL);
+    pthread_mutex_init(&olfs->lock, NULL);
+    olfs->files = 0;
+    
+    rv = disk_mount(data_file, &opts);
+    
+    if (rv < 0) {
+        pthread_mutex_destroy(&olfs->lock);
+        free(olfs);
+    }
+    
+    // nothing forks in between
+    else {
+        disk_start();
+        mounted = olfs;
+        *fs = olfs;
+    }
+    
+    pthread_mutex_unlock(&mount_lock);
+    
+    return rv;
+}
+
+/* Writes everything back and unmounts the data file */
+void
+olfs_unmount(olfs_t* fs)
+{
+    pthread_mutex_lock(&mount_lock);
+    assert(fs == mounted);
+    assert(fs->files == 0);
+    
+    disk_unmount();
+    
+    pthread_mutex_destroy(&fs->lock);
+    free(fs);
+    mounted = NULL;
+    pthread_mutex_unlock(&mount_lock);
+}
+
+/* Opens the file at "path" with O_CREAT, O_EXCL and O_TRUNC of "flags",
+   a new file gets "mode", returns 0 or -ERRNO */
+int
+olfs_open(olfs_t* fs, const char* path, const int flags, const mode_t mode,
+          olfs_file_t** file)
+{
+    pthread_mutex_lock(&fs->lock);
+    
+    int ino = disk_lookup(path);
+    
+    if (ino >= 0 && (flags & O_CREAT) && (flags & O_EXCL)) {
+        ino = -EEXIST;
+    }
+    
+    // file is created once and opened by its ino from now on
+    if (ino == -ENOENT && (flags & O_CREAT)) {
+        ino = disk_mknod(path, S_IFREG);
+        if (ino == 0) ino = disk_chmod(path, S_IFREG | (mode & 07777));
+        if (ino == 0) ino = disk_lookup(path);
+    }
+    
+    int writable = (flags & O_ACCMODE) != O_RDONLY;
+    
+    if (ino >= 0 && writable && (flags & O_TRUNC)) {
+        int rv = disk_truncate(path, 0);
+        if (rv < 0) ino = rv;
+    }
+    
+    if (ino >= 0) {
+        olfs_file_t* opened = malloc(sizeof(olfs_file_t));
+        assert(opened != NULL);
+        
+        opened->fs = fs;
+        opened->ino = ino;
+        opened->flags = flags & O_ACCMODE;
+        disk_open_init(&opened->state);
+        
+        fs->files += 1;
+        *file = opened;
+    }
+    
+    pthread_mutex_unlock(&fs->lock);
+    
+    return (ino < 0) ? ino : 0;
+}
+
+/* Closes the file */
+void
+olfs_close(olfs_file_t* file)
+{
+    olfs_t* fs = file->fs;
+    
+    pthread_mutex_lock(&fs->lock);
+    fs->files -= 1;
+    pthread_mutex_unlock(&fs->lock);
+    
+    free(file);
+}
+
+/* Reads up to "size" bytes at "offset", returns number of bytes read */
+int
+olfs_read(olfs_file_t* file, void* buf, const size_t size, const off_t offset)
+{
+    if (file->flags == O_WRONLY) return -EBADF;
+    
+    pthread_mutex_lock(&file->fs->lock);
+    int rv = disk_read_ino(file->ino, buf, size, offset, &file->state);
+    pthread_mutex_unlock(&file->fs->lock);
+    
+    return rv;
+}
+
+/* Writes "size" bytes at "offset", returns number of bytes written */
+int
+olfs_write(olfs_file_t* file, const void* buf, const size_t size,
+           const off_t offset)
+{
+    if (file->flags == O_RDONLY) return -EBADF;
+    
+    pthread_mutex_lock(&file->fs->lock);
+    int rv = disk_write_ino(file->ino, buf, size, offset, &file->state);
+    pthread_mutex_unlock(&file->fs->lock);
+    
+    return rv;
+}
+
+/* Gets attributes of the open file into "st" */
+int
+olfs_fstat(olfs_file_t* file, struct stat* st)
+{
+    pthread_mutex_lock(&file->fs->lock);
+    int rv = disk_getattr_ino(file->ino, st);
+    pthread_mutex_unlock(&file->fs->lock);
+    
+    return rv;
+}
+
+/* Gets attributes of the node at "path" into "st" */
+int
+olfs_stat(olfs_t* fs, const char* path, struct stat* st)
+{
+    pthread_mutex_lock(&fs->lock);
+    int rv = disk_getattr(path, st);
+    pthread_mutex_unlock(&fs->lock);
+    
+    return rv;
+}
+
+/* Calls "fn" with "ctx" for every name of the directory at "path" */
+int
+olfs_readdir(olfs_t* fs, const char* path, olfs_dir_fn fn, void* ctx)
+{
+    pthread_mutex_lock(&fs->lock);
+    int rv = disk_readdir(path, ctx, fn);
+    pthread_mutex_unlock(&fs->lock);
+    
+    return rv;
+}
+
+/* Creates a directory at "path" */
+int
+olfs_mkdir(olfs_t* fs, const char* path, const mode_t mode)
+{
+    pthread_mutex_lock(&fs->lock);
+    int rv = disk_mkdir(path, mode);
+    pthread_mutex_unlock(&fs->lock);
+    
+    return rv;
+}
+
+/* Moves data blocks at the end of the data file down into free blocks
+   before them, returns number of blocks moved */
+int
+olfs_compact(olfs_t* fs)
+{
+    pthread_mutex_lock(&fs->lock);
+    int rv = disk_compact();
+    pthread_mutex_unlock(&fs->lock);
+    
+    return rv;
+}
+
+/* Writes everything changed since the last checkpoint of a disk mounted
+   with --ram, pread or uring into its data file at once, returns 0 or
+   -ERRNO */
+int
+olfs_checkpoint(olfs_t* fs)
+{
+    pthread_mutex_lock(&fs->lock);
+    int rv = disk_checkpoint();
+    pthread_mutex_unlock(&fs->lock);
+    
+    return rv;
+}
+
+/* Deletes the file or link at "path", open files of it become stale */
+int
+olfs_unlink(olfs_t* fs, const char* path)
+{
+    pthread_mutex_lock(&fs->lock);
+    int rv = disk_unlink(path);
+    pthread_mutex_unlock(&fs->lock);
+    
+    return rv;
+}
@@ -0,0 +1,50 @@
+//
+//  olfs.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef olfs_h
+#define olfs_h
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+struct mount_opts;
+
+/* Data file mounted inside of the process, calls on it are serialized and
+   a process mounts one at a time */
+typedef struct olfs olfs_t;
+
+/* File opened on a mounted data file */
+typedef struct olfs_file olfs_file_t;
+
+/* Gets every name of a listed directory, non-zero stops the listing */
+typedef int (*olfs_dir_fn)(void* ctx, const char* name, const struct stat* st);
+
+int     olfs_parse_opts(int* argc, char* argv[], struct mount_opts* opts);
+
+int     olfs_mount(const char* data_file, const char* const* options,
+                   olfs_t** fs);
+void    olfs_unmount(olfs_t* fs);
+
+int     olfs_open(olfs_t* fs, const char* path, const int flags,
+                  const mode_t mode, olfs_file_t** file);
+void    olfs_close(olfs_file_t* file);
+int     olfs_read(olfs_file_t* file, void* buf, const size_t size,
+                  const off_t offset);
+int     olfs_write(olfs_file_t* file, const void* buf, const size_t size,
+                   const off_t offset);
+int     olfs_fstat(olfs_file_t* file, struct stat* st);
+
+int     olfs_stat(olfs_t* fs, const char* path, struct stat* st);
+int     olfs_readdir(olfs_t* fs, const char* path, olfs_dir_fn fn, void* ctx);
+int     olfs_mkdir(olfs_t* fs, const char* path, const mode_t mode);
+int     olfs_unlink(olfs_t* fs, const char* path);
+int     olfs_compact(olfs_t* fs);
+int     olfs_checkpoint(olfs_t* fs);
+
+#endif /* olfs_h */
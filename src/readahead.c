@@ -0,0 +1,160 @@
+//
+//  readahead.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#include <pthread.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "disk.h"
+
+#include "readahead.h"
+
+
+/* ========================= CONSTANTS ===================================== */
+#define RA_QUEUE        64          // read ahead requests waiting for the worker
+
+
+/* ========================= VARIABLES ===================================== */
+/* Blocks of a file the worker should read */
+typedef struct ra_request {
+    int ino;
+    int from;
+    int count;
+} ra_request;
+
+static ra_request       queue[RA_QUEUE];
+static int              head;       // next request to take
+static int              queued;     // requests in the queue
+
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   wake = PTHREAD_COND_INITIALIZER;
+static pthread_t        worker;
+static int              running;
+
+
+
+
+/* ==================== LOCAL HELPERS ===================================== */
+/* Reads blocks ahead while readers copy what they already have */
+static
+void*
+__worker_main(void* arg)
+{
+    pthread_mutex_lock(&lock);
+    
+    while (running) {
+        if (queued == 0) {
+            pthread_cond_wait(&wake, &lock);
+            continue;
+        }
+        
+        ra_request req = queue[head];
+        head = (head + 1) % RA_QUEUE;
+        queued -= 1;
+        
+        pthread_mutex_unlock(&lock);
+        disk_prefetch(req.ino, req.from, req.count);
+        pthread_mutex_lock(&lock);
+    }
+    
+    pthread_mutex_unlock(&lock);
+    
+    return NULL;
+}
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Starts tracking of a newly opened file */
+void
+ra_init(ra_state* ra)
+{
+    ra->next = 0;
+    ra->window = 0;
+    ra->ahead = 0;
+}
+
+/* Records a read of "size" bytes at "offset", returns how many blocks
+   starting at "from" should be read ahead, 0 when none */
+int
+ra_access(ra_state* ra, const off_t offset, const size_t size,
+          const int block_size, int* from)
+{
+    int last = (offset + size - 1) / block_size;
+    int sequential = (offset == ra->next);
+    ra->next = offset + size;
+    
+    // random access backs off
+    if (!sequential) {
+        ra->window = 0;
+        ra->ahead = 0;
+        return 0;
+    }
+    
+    // sequential stream doubles the window up to the largest one
+    ra->window = (ra->window == 0) ? RA_MIN : min(ra->window * 2, RA_MAX);
+    
+    // next window is read when the reader gets into the second half
+    if (ra->ahead > last + ra->window / 2) {
+        return 0;
+    }
+    
+    *from = max(ra->ahead, last + 1);
+    int count = last + 1 + ra->window - *from;
+    ra->ahead = *from + count;
+    
+    return count;
+}
+
+/* Starts the worker which reads ahead for the block cache */
+void
+ra_start()
+{
+    head = 0;
+    queued = 0;
+    running = 1;
+    
+    int rv = pthread_create(&worker, NULL, __worker_main, NULL);
+    assert(rv == 0);
+}
+
+/* Stops the worker, requests left in the queue are dropped */
+void
+ra_stop()
+{
+    if (!running) {
+        return;
+    }
+    
+    pthread_mutex_lock(&lock);
+    running = 0;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    
+    pthread_join(worker, NULL);
+}
+
+/* Asks the worker to read "count" blocks of inode "ino" from "from" */
+void
+ra_queue(const int ino, const int from, const int count)
+{
+    pthread_mutex_lock(&lock);
+    
+    // read ahead is only a hint, a full queue drops it
+    if (queued < RA_QUEUE) {
+        ra_request* req = &queue[(head + queued) % RA_QUEUE];
+        req->ino = ino;
+        req->from = from;
+        req->count = count;
+        queued += 1;
+        
+        pthread_cond_signal(&wake);
+    }
+    
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,32 @@
+//
+//  readahead.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef readahead_h
+#define readahead_h
+
+#include <sys/types.h>
+#include <stdio.h>
+
+#define RA_MIN          4           // blocks read ahead of a new stream
+#define RA_MAX          256         // largest window in blocks
+
+/* Access pattern of one open file */
+typedef struct ra_state {
+    off_t   next;           // offset right after the previous read
+    int     window;         // blocks to keep read ahead, 0 for random access
+    int     ahead;          // first block which was not read ahead yet
+} ra_state;
+
+void    ra_init(ra_state* ra);
+int     ra_access(ra_state* ra, const off_t offset, const size_t size,
+                  const int block_size, int* from);
+
+void    ra_start();
+void    ra_stop();
+void    ra_queue(const int ino, const int from, const int count);
+
+#endif /* readahead_h */
@@ -0,0 +1,487 @@
+//
+//  snapshot.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "snapshot.h"
+
+
+/* ========================= CONSTANTS ===================================== */
+#define SNAP_HEAD_SIZE  4096        // bytes before the sector bitmap
+#define SNAP_DEPTH      64          // longest chain of layers
+
+/*
+ * Layer file "data_file@name" is sparse and made of
+ *
+ *   snap_head       at 0
+ *   sector bitmap   at SNAP_HEAD_SIZE, bit set when the layer has the sector
+ *   sectors         at __data_off(), in the same places as in the data file
+ *
+ * a read takes every sector from the topmost layer which has it, and from
+ * the data file when none has, a write only goes into the top layer.
+ */
+
+
+/* ========================= VARIABLES ===================================== */
+/* Open layer of the chain */
+typedef struct snap_layer {
+    int             fd;
+    unsigned char*  bitmap;     // sectors the layer has
+    off_t           data_off;   // where sector 0 is kept in the layer file
+    int             dirty;      // bitmap changed since it was written
+} snap_layer;
+
+static snap_layer       layers[SNAP_DEPTH];     // top first
+static int              depth;
+static int              base_fd = -1;
+static int              writable;   // top layer is a branch
+static size_t           data_size;
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+
+/* ==================== LOCAL HELPERS ===================================== */
+/* Writes path of the layer "name" of "data_file" into "path" */
+static
+void
+__layer_path(char* path, const char* data_file, const char* name)
+{
+    snprintf(path, PATH_MAX, "%s@%s", data_file, name);
+}
+
+/* Returns bytes of the bitmap for a data file of "size" bytes */
+static
+size_t
+__bitmap_len(const size_t size)
+{
+    return div_up(div_up(size, SNAP_SECTOR), 8);
+}
+
+/* Returns offset of sector 0 in a layer of a data file of "size" bytes */
+static
+off_t
+__data_off(const size_t size)
+{
+    return SNAP_HEAD_SIZE + div_up(__bitmap_len(size), 4096) * 4096;
+}
+
+/* Reads "len" bytes at "offset", bytes past the end of the file are zeros */
+static
+int
+__read_full(const int file, void* buf, const size_t len, const off_t offset)
+{
+    size_t done = 0;
+    
+    while (done < len) {
+        ssize_t rv = pread(file, (char*)buf + done, len - done, offset + done);
+        
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv < 0) return -errno;
+        
+        if (rv == 0) {
+            memset((char*)buf + done, 0, len - done);
+            break;
+        }
+        
+        done += rv;
+    }
+    
+    return 0;
+}
+
+/* Writes "len" bytes at "offset" */
+static
+int
+__write_full(const int file, const void* buf, const size_t len,
+             const off_t offset)
+{
+    size_t done = 0;
+    
+    while (done < len) {
+        ssize_t rv = pwrite(file, (const char*)buf + done,
+                            len - done, offset + done);
+        
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv < 0) return -errno;
+        
+        done += rv;
+    }
+    
+    return 0;
+}
+
+/* Creates an empty layer at "path" over "parent", returns 0 or -ERRNO */
+static
+int
+__make_layer(const char* path, const char* parent, const int frozen,
+             const size_t size, const struct timespec base_mtime)
+{
+    if (strlen(parent) >= SNAP_NAME_MAX) return -ENAMETOOLONG;
+    
+    int file = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file < 0) return -errno;
+    
+    char block[SNAP_HEAD_SIZE] = { 0 };
+    snap_head* head = (snap_head*)block;
+    
+    head->magic = SNAP_MAGIC;
+    head->frozen = frozen;
+    head->size = size;
+    head->base_mtime = base_mtime;
+    strcpy(head->parent, parent);
+    
+    // bitmap and sectors stay holes until something is written
+    int rv = __write_full(file, block, sizeof(block), 0);
+    if (rv == 0 && ftruncate(file, __data_off(size) + size) < 0) rv = -errno;
+    if (rv == 0 && fsync(file) < 0) rv = -errno;
+    
+    close(file);
+    
+    return rv;
+}
+
+/* Opens the layer at "path" below the open ones, returns 0 or -ERRNO */
+static
+int
+__open_layer(const char* path, const int rw, snap_head* head)
+{
+    if (depth == SNAP_DEPTH) return -ELOOP;
+    
+    int file = open(path, rw ? O_RDWR : O_RDONLY);
+    if (file < 0) return -errno;
+    
+    int rv = __read_full(file, head, sizeof(*head), 0);
+    if (rv == 0 && head->magic != SNAP_MAGIC) rv = -EINVAL;
+    if (rv < 0) {
+        close(file);
+        return rv;
+    }
+    
+    size_t len = __bitmap_len(head->size);
+    unsigned char* bitmap = malloc(len);
+    assert(bitmap != NULL);
+    
+    rv = __read_full(file, bitmap, len, SNAP_HEAD_SIZE);
+    if (rv < 0) {
+        free(bitmap);
+        close(file);
+        return rv;
+    }
+    
+    snap_layer* layer = &layers[depth++];
+    layer->fd = file;
+    layer->bitmap = bitmap;
+    layer->data_off = __data_off(head->size);
+    layer->dirty = 0;
+    
+    return 0;
+}
+
+/* Returns the layer which has "sector", "depth" for the data file */
+static
+int
+__layer_of(const size_t sector)
+{
+    for (int ii = 0; ii < depth; ++ii) {
+        if (layers[ii].bitmap[sector / 8] & (1 << (sector % 8))) {
+            return ii;
+        }
+    }
+    
+    return depth;
+}
+
+/* Reads "len" bytes at "offset" from the layers which have them */
+static
+int
+__snap_read(char* buf, const size_t len, const off_t offset)
+{
+    size_t first = offset / SNAP_SECTOR;
+    size_t count = len / SNAP_SECTOR;
+    
+    pthread_mutex_lock(&lock);
+    
+    int rv = 0;
+    for (size_t ii = 0; ii < count && rv == 0; ) {
+        
+        // run of sectors in the same layer is one read
+        int src = __layer_of(first + ii);
+        size_t run = 1;
+        while (ii + run < count && __layer_of(first + ii + run) == src) {
+            run += 1;
+        }
+        
+        int file = (src < depth) ? layers[src].fd : base_fd;
+        off_t at = (src < depth) ? layers[src].data_off : 0;
+        
+        rv = __read_full(file, buf + ii * SNAP_SECTOR, run * SNAP_SECTOR,
+                         at + (first + ii) * SNAP_SECTOR);
+        ii += run;
+    }
+    
+    pthread_mutex_unlock(&lock);
+    
+    return rv;
+}
+
+/* Writes "len" bytes at "offset" into the top layer */
+static
+int
+__snap_write(const char* buf, const size_t len, const off_t offset)
+{
+    assert(writable);
+    
+    snap_layer* top = &layers[0];
+    
+    int rv = __write_full(top->fd, buf, len, top->data_off + offset);
+    if (rv < 0) return rv;
+    
+    size_t first = offset / SNAP_SECTOR;
+    size_t count = len / SNAP_SECTOR;
+    
+    pthread_mutex_lock(&lock);
+    
+    for (size_t ss = first; ss < first + count; ++ss) {
+        top->bitmap[ss / 8] |= 1 << (ss % 8);
+    }
+    
+    top->dirty = 1;
+    
+    pthread_mutex_unlock(&lock);
+    
+    return 0;
+}
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Opens "data_file" through its layers: "branch" on top of snapshot "from"
+   (data file itself when NULL) is created when missing or "reset", without
+   "branch" snapshot "from" is opened read-only, returns 0 or -ERRNO */
+int
+snap_open(const char* data_file, const char* branch,
+          const char* from, const int reset)
+{
+    assert(branch != NULL || from != NULL);
+    assert(depth == 0);
+    
+    struct stat st;
+    if (stat(data_file, &st) < 0) return -errno;
+    
+    char path[PATH_MAX];
+    int rv = 0;
+    
+    // new branch only costs a header
+    if (branch != NULL) {
+        __layer_path(path, data_file, branch);
+        
+        if (reset || access(path, F_OK) < 0) {
+            rv = __make_layer(path, from ? from : "", 0, st.st_size, st.st_mtim);
+            if (rv < 0) return rv;
+            
+            trace("|--SNAP: %s branch %s from %s\n", // log
+                  reset ? "reset" : "created", branch, from ? from : "data");
+        }
+    }
+    
+    writable = (branch != NULL);
+    data_size = st.st_size;
+    
+    const char* name = writable ? branch : from;
+    char parent[SNAP_NAME_MAX];
+    
+    // top layer, then every snapshot below it
+    for (;;) {
+        snap_head head;
+        __layer_path(path, data_file, name);
+        
+        rv = __open_layer(path, writable && depth == 0, &head);
+        if (rv < 0) break;
+        
+        if (head.size != data_size
+            || head.base_mtime.tv_sec != st.st_mtim.tv_sec
+            || head.base_mtime.tv_nsec != st.st_mtim.tv_nsec) {
+            fprintf(stderr, "|--SNAP: data file changed under %s\n", name);
+            rv = -ESTALE;
+            break;
+        }
+        
+        // branches are written, snapshots are not
+        if (head.frozen == (writable && depth == 1)) {
+            fprintf(stderr, "|--SNAP: %s is %s\n",
+                    name, head.frozen ? "a snapshot" : "a branch");
+            rv = -EINVAL;
+            break;
+        }
+        
+        if (head.parent[0] == 0) {
+            break;
+        }
+        
+        memcpy(parent, head.parent, SNAP_NAME_MAX);
+        parent[SNAP_NAME_MAX - 1] = 0;
+        name = parent;
+    }
+    
+    if (rv == 0) {
+        base_fd = open(data_file, O_RDONLY);
+        if (base_fd < 0) rv = -errno;
+    }
+    
+    if (rv < 0) {
+        snap_close();
+        return rv;
+    }
+    
+    trace("|--SNAP: opened %s over %d layer(s)%s\n", data_file, // log
+          depth, writable ? "" : " read-only");
+    
+    return 0;
+}
+
+/* Writes bitmaps back and closes every layer */
+void
+snap_close()
+{
+    snap_sync();
+    
+    for (int ii = 0; ii < depth; ++ii) {
+        close(layers[ii].fd);
+        free(layers[ii].bitmap);
+    }
+    
+    if (base_fd >= 0) {
+        close(base_fd);
+    }
+    
+    depth = 0;
+    base_fd = -1;
+    writable = 0;
+}
+
+/* Does every I/O of the batch, all of them are made of whole sectors */
+int
+snap_submit(blkdev_io* ios, const int count)
+{
+    for (int ii = 0; ii < count; ++ii) {
+        assert(ios[ii].offset % SNAP_SECTOR == 0);
+        assert(ios[ii].len % SNAP_SECTOR == 0);
+        assert(ios[ii].offset + ios[ii].len <= data_size);
+        
+        int rv = ios[ii].write
+            ? __snap_write(ios[ii].buf, ios[ii].len, ios[ii].offset)
+            : __snap_read(ios[ii].buf, ios[ii].len, ios[ii].offset);
+        
+        if (rv < 0) return rv;
+    }
+    
+    return 0;
+}
+
+/* Makes written sectors and the bitmap of the top layer durable */
+int
+snap_sync()
+{
+    if (!writable || depth == 0) {
+        return 0;
+    }
+    
+    snap_layer* top = &layers[0];
+    
+    // sectors first, so the bitmap never points to what is not there
+    if (fdatasync(top->fd) < 0) return -errno;
+    
+    pthread_mutex_lock(&lock);
+    
+    int rv = 0;
+    if (top->dirty) {
+        rv = __write_full(top->fd, top->bitmap, __bitmap_len(data_size),
+                          SNAP_HEAD_SIZE);
+        if (rv == 0) top->dirty = 0;
+    }
+    
+    pthread_mutex_unlock(&lock);
+    
+    if (rv == 0 && fdatasync(top->fd) < 0) rv = -errno;
+    
+    return rv;
+}
+
+/* Freezes "branch" of the unmounted "data_file" as snapshot "name" and
+   starts the branch again on top of it, without "branch" freezes the data
+   file as it is, returns 0 or -ERRNO */
+int
+snap_create(const char* data_file, const char* branch, const char* name)
+{
+    char path[PATH_MAX];
+    __layer_path(path, data_file, name);
+    
+    if (strlen(name) >= SNAP_NAME_MAX) return -ENAMETOOLONG;
+    if (access(path, F_OK) == 0) return -EEXIST;
+    
+    // empty snapshot of the data file itself
+    if (branch == NULL) {
+        struct stat st;
+        if (stat(data_file, &st) < 0) return -errno;
+        
+        return __make_layer(path, "", 1, st.st_size, st.st_mtim);
+    }
+    
+    snap_head head;
+    int rv = snap_head_read(data_file, branch, &head);
+    if (rv < 0) return rv;
+    if (head.frozen) return -EINVAL;
+    
+    char branch_path[PATH_MAX];
+    __layer_path(branch_path, data_file, branch);
+    
+    // branch keeps its sectors under the new name
+    if (rename(branch_path, path) < 0) return -errno;
+    
+    int file = open(path, O_RDWR);
+    if (file < 0) return -errno;
+    
+    head.frozen = 1;
+    rv = __write_full(file, &head, sizeof(head), 0);
+    if (rv == 0 && fsync(file) < 0) rv = -errno;
+    close(file);
+    
+    if (rv < 0) return rv;
+    
+    return __make_layer(branch_path, name, 0, head.size, head.base_mtime);
+}
+
+/* Reads the head of the layer "name" of "data_file", returns 0 or -ERRNO */
+int
+snap_head_read(const char* data_file, const char* name, snap_head* head)
+{
+    char path[PATH_MAX];
+    __layer_path(path, data_file, name);
+    
+    int file = open(path, O_RDONLY);
+    if (file < 0) return -errno;
+    
+    int rv = __read_full(file, head, sizeof(*head), 0);
+    close(file);
+    
+    if (rv == 0 && head->magic != SNAP_MAGIC) rv = -EINVAL;
+    
+    return rv;
+}
@@ -0,0 +1,42 @@
+//
+//  snapshot.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef snapshot_h
+#define snapshot_h
+
+#include <sys/types.h>
+#include <time.h>
+#include <stdio.h>
+
+#include "blkdev.h"
+
+#define SNAP_MAGIC      0x4f4c534e  // "OLSN" at the start of every layer
+#define SNAP_NAME_MAX   64          // longest name of a snapshot or branch
+#define SNAP_SECTOR     512         // bytes a layer keeps or leaves to the
+                                    // layer below, every I/O is made of them
+
+/* Layer of changes on top of a data file, kept in "data_file@name" */
+typedef struct snap_head {
+    int             magic;      // SNAP_MAGIC
+    int             frozen;     // snapshot, only branches on top change
+    size_t          size;       // bytes of the data file
+    struct timespec base_mtime; // data file has to stay as it was
+    char            parent[SNAP_NAME_MAX];  // layer below, "" for data file
+} snap_head;
+
+int     snap_open(const char* data_file, const char* branch,
+                  const char* from, const int reset);
+void    snap_close();
+int     snap_submit(blkdev_io* ios, const int count);
+int     snap_sync();
+
+int     snap_create(const char* data_file, const char* branch,
+                    const char* name);
+int     snap_head_read(const char* data_file, const char* name,
+                       snap_head* head);
+
+#endif /* snapshot_h */
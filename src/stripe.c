@@ -0,0 +1,573 @@
+//
+//  stripe.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "stripe.h"
+
+
+/* ========================= CONSTANTS ===================================== */
+#define STRIPE_HEAD_SIZE    4096    // bytes before the data of a member
+
+/*
+ * Set of data files is one disk. The first data file is laid out as when
+ * it is alone, everything before the first data block stays in it. Data
+ * blocks after it are cut into units which go round the members:
+ *
+ *   unit u of the data       member u % count, at unit u / count of it
+ *   data of the first one    at the first data block, as when it is alone
+ *   data of the others       at STRIPE_HEAD_SIZE, after their stripe_head
+ *
+ * every member has a thread of its own once stripe_start() is called, the
+ * parts of a batch which go to different members are read and written at
+ * the same time. Before it the submitter does them one after another.
+ */
+
+
+/* ========================= VARIABLES ===================================== */
+/* I/Os of a batch which are left to the member threads */
+typedef struct stripe_batch {
+    pthread_mutex_t lock;
+    pthread_cond_t  done;
+    int             pending;    // members which did not finish their part
+    int             err;        // first error of a member, 0 for none
+} stripe_batch;
+
+/* Part of a batch one member does */
+typedef struct stripe_job {
+    blkdev_io*          ios;    // offsets are in the member
+    int                 count;
+    stripe_batch*       batch;
+    struct stripe_job*  next;
+} stripe_job;
+
+/* Open data file of the set */
+typedef struct stripe_member {
+    int             fd;
+    off_t           data_off;   // where its first unit is kept
+    
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    stripe_job*     jobs;       // waiting for the thread, oldest first
+    stripe_job*     last;
+    int             running;
+} stripe_member;
+
+static stripe_member    set[STRIPE_MAX];
+static int              members_num;
+static int              started;    // members have their threads
+static int              unit;
+static off_t            data_off;   // offset of the first unit in the set
+
+
+
+
+/* ==================== LOCAL HELPERS ===================================== */
+/* Reads "len" bytes at "offset", bytes past the end of the file are zeros */
+static
+int
+__read_full(const int file, void* buf, const size_t len, const off_t offset)
+{
+    size_t done = 0;
+    
+    while (done < len) {
+        ssize_t rv = pread(file, (char*)buf + done, len - done, offset + done);
+        
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv < 0) return -errno;
+        
+        if (rv == 0) {
+            memset((char*)buf + done, 0, len - done);
+            break;
+        }
+        
+        done += rv;
+    }
+    
+    return 0;
+}
+
+/* Writes "len" bytes at "offset" */
+static
+int
+__write_full(const int file, const void* buf, const size_t len,
+             const off_t offset)
+{
+    size_t done = 0;
+    
+    while (done < len) {
+        ssize_t rv = pwrite(file, (const char*)buf + done,
+                            len - done, offset + done);
+        
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv < 0) return -errno;
+        
+        done += rv;
+    }
+    
+    return 0;
+}
+
+/* Opens data file "path" of the set, returns its fd or -ERRNO */
+static
+int
+__open_member(const char* path, const int create, const int direct)
+{
+    int flags = O_RDWR;
+    if (create) flags |= O_CREAT | O_TRUNC;
+    
+    int file = open(path, flags | (direct ? O_DIRECT : 0), 0644);
+    
+    // file system of the member does not support O_DIRECT
+    if (file < 0 && direct && errno == EINVAL) {
+        trace("|--STRIPE: no O_DIRECT for %s\n", path); // log
+        file = open(path, flags, 0644);
+    }
+    
+    return (file < 0) ? -errno : file;
+}
+
+/* Writes heads of a new set and makes its members sparse files which can
+   hold their units of a disk of "size" bytes, returns 0 or -ERRNO */
+static
+int
+__create_set(const stripe_geom* geom, const size_t size)
+{
+    size_t units = div_up(size - geom->data_off, geom->unit);
+    off_t share = div_up(units, members_num) * geom->unit;
+    
+    stripe_head* head = blkdev_alloc(STRIPE_HEAD_SIZE);
+    int rv = 0;
+    
+    for (int ii = 0; ii < members_num && rv == 0; ++ii) {
+        stripe_member* mb = &set[ii];
+        
+        if (ii > 0) {
+            memset(head, 0, STRIPE_HEAD_SIZE);
+            head->magic = STRIPE_MAGIC;
+            head->index = ii;
+            head->count = members_num;
+            head->unit = geom->unit;
+            head->data_off = geom->data_off;
+            head->id = geom->id;
+            
+            rv = __write_full(mb->fd, head, STRIPE_HEAD_SIZE, 0);
+        }
+        
+        if (rv == 0 && ftruncate(mb->fd, mb->data_off + share) < 0) {
+            rv = -errno;
+        }
+    }
+    
+    free(head);
+    
+    return rv;
+}
+
+/* Reads the set from the heads of its members into "geom", all of them
+   have to be from the same set and in the same order, returns 0 or -ERRNO */
+static
+int
+__read_set(stripe_geom* geom, const char* const* paths)
+{
+    stripe_head* head = blkdev_alloc(STRIPE_HEAD_SIZE);
+    int rv = 0;
+    
+    for (int ii = 1; ii < members_num && rv == 0; ++ii) {
+        rv = __read_full(set[ii].fd, head, STRIPE_HEAD_SIZE, 0);
+        if (rv < 0) break;
+        
+        // first one tells what the others have to say
+        if (ii == 1) {
+            geom->count = head->count;
+            geom->unit = head->unit;
+            geom->data_off = head->data_off;
+            geom->id = head->id;
+        }
+        
+        if (head->magic != STRIPE_MAGIC || head->index != ii
+            || head->count != members_num || head->unit != geom->unit
+            || head->data_off != geom->data_off || head->id != geom->id) {
+            fprintf(stderr,
+                    "|--STRIPE: %s is not data file %d of %d of the set\n",
+                    paths[ii], ii + 1, members_num);
+            rv = -EINVAL;
+        }
+    }
+    
+    free(head);
+    
+    return rv;
+}
+
+/* Cuts "io" of the disk into I/Os of the members at most a unit long,
+   puts them into "parts" and their members into "of", returns their number */
+static
+int
+__split(const blkdev_io* io, blkdev_io* parts, int* of)
+{
+    char* buf = io->buf;
+    size_t len = io->len;
+    off_t offset = io->offset;
+    int num = 0;
+    
+    // metadata is only in the first data file
+    if (offset < data_off) {
+        size_t head = (len < (size_t)(data_off - offset))
+                    ? len : (size_t)(data_off - offset);
+        
+        parts[num] = (blkdev_io){ buf, head, offset, io->write };
+        of[num++] = 0;
+        
+        buf += head;
+        len -= head;
+        offset += head;
+    }
+    
+    while (len > 0) {
+        off_t rel = offset - data_off;
+        off_t index = rel / unit;
+        size_t inside = rel % unit;
+        size_t part = (len < unit - inside) ? len : unit - inside;
+        
+        int member = index % members_num;
+        off_t at = set[member].data_off + (index / members_num) * unit + inside;
+        
+        parts[num] = (blkdev_io){ buf, part, at, io->write };
+        of[num++] = member;
+        
+        buf += part;
+        len -= part;
+        offset += part;
+    }
+    
+    return num;
+}
+
+/* Does "count" I/Os of the member "mb" one after another */
+static
+int
+__member_run(stripe_member* mb, blkdev_io* ios, const int count)
+{
+    for (int ii = 0; ii < count; ++ii) {
+        int rv = ios[ii].write
+            ? __write_full(mb->fd, ios[ii].buf, ios[ii].len, ios[ii].offset)
+            : __read_full(mb->fd, ios[ii].buf, ios[ii].len, ios[ii].offset);
+        
+        if (rv < 0) return rv;
+    }
+    
+    return 0;
+}
+
+/* Thread of a member, does the parts of batches given to it in order */
+static
+void*
+__member_main(void* arg)
+{
+    stripe_member* mb = arg;
+    
+    pthread_mutex_lock(&mb->lock);
+    
+    for (;;) {
+        while (mb->running && mb->jobs == NULL) {
+            pthread_cond_wait(&mb->wake, &mb->lock);
+        }
+        
+        // stopped with nothing left to do
+        if (mb->jobs == NULL) {
+            break;
+        }
+        
+        stripe_job* job = mb->jobs;
+        mb->jobs = job->next;
+        if (mb->jobs == NULL) mb->last = NULL;
+        
+        pthread_mutex_unlock(&mb->lock);
+        
+        int rv = __member_run(mb, job->ios, job->count);
+        
+        // submitter goes on once every member is done
+        stripe_batch* batch = job->batch;
+        pthread_mutex_lock(&batch->lock);
+        
+        if (rv < 0 && batch->err == 0) batch->err = rv;
+        if (--batch->pending == 0) pthread_cond_signal(&batch->done);
+        
+        pthread_mutex_unlock(&batch->lock);
+        
+        pthread_mutex_lock(&mb->lock);
+    }
+    
+    pthread_mutex_unlock(&mb->lock);
+    
+    return NULL;
+}
+
+/* Gives "job" to the thread of the member "mb" */
+static
+void
+__member_queue(stripe_member* mb, stripe_job* job)
+{
+    job->next = NULL;
+    
+    pthread_mutex_lock(&mb->lock);
+    
+    if (mb->last != NULL) {
+        mb->last->next = job;
+    }
+    
+    else {
+        mb->jobs = job;
+    }
+    
+    mb->last = job;
+    
+    pthread_cond_signal(&mb->wake);
+    pthread_mutex_unlock(&mb->lock);
+}
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Opens "data_file" with the comma separated data files in "members" as
+   one disk, a new set of "create_size" bytes is laid out as in "geom" when
+   it is not 0, an existing one fills "geom", returns 0 or -ERRNO */
+int
+stripe_open(const char* data_file, const char* members, const int direct,
+            const size_t create_size, stripe_geom* geom)
+{
+    char* list = strdup(members);
+    assert(list != NULL);
+    
+    const char* paths[STRIPE_MAX];
+    paths[0] = data_file;
+    members_num = 1;
+    
+    char* save = NULL;
+    for (char* name = strtok_r(list, ",", &save); name != NULL;
+         name = strtok_r(NULL, ",", &save)) {
+        if (members_num == STRIPE_MAX) {
+            free(list);
+            return -E2BIG;
+        }
+        
+        paths[members_num++] = name;
+    }
+    
+    if (members_num == 1) {
+        free(list);
+        return -EINVAL;
+    }
+    
+    int create = (create_size > 0);
+    int rv = 0;
+    int opened = 0;
+    
+    for (; opened < members_num; ++opened) {
+        int file = __open_member(paths[opened], create, direct);
+        if (file < 0) {
+            rv = file;
+            break;
+        }
+        
+        set[opened].fd = file;
+    }
+    
+    if (rv == 0 && create) {
+        geom->count = members_num;
+    }
+    
+    // first data file has its data after the metadata
+    if (rv == 0 && !create) {
+        rv = __read_set(geom, paths);
+    }
+    
+    for (int ii = 0; ii < opened; ++ii) {
+        set[ii].data_off = (ii == 0) ? geom->data_off : STRIPE_HEAD_SIZE;
+    }
+    
+    if (rv == 0 && create) {
+        rv = __create_set(geom, create_size);
+    }
+    
+    free(list);
+    
+    if (rv < 0) {
+        for (int ii = 0; ii < opened; ++ii) {
+            close(set[ii].fd);
+        }
+        
+        members_num = 0;
+        return rv;
+    }
+    
+    unit = geom->unit;
+    data_off = geom->data_off;
+    started = 0;
+    
+    trace("|--STRIPE: %d data files, %d byte units\n", // log
+          members_num, unit);
+    
+    return 0;
+}
+
+/* Starts the threads of the members, a process which forks after the open
+   calls it in the child */
+void
+stripe_start()
+{
+    for (int ii = 0; ii < members_num; ++ii) {
+        stripe_member* mb = &set[ii];
+        
+        pthread_mutex_init(&mb->lock, NULL);
+        pthread_cond_init(&mb->wake, NULL);
+        mb->jobs = NULL;
+        mb->last = NULL;
+        mb->running = 1;
+        
+        int rv = pthread_create(&mb->thread, NULL, __member_main, mb);
+        assert(rv == 0);
+    }
+    
+    started = 1;
+}
+
+/* Stops the threads of the members and closes them */
+void
+stripe_close()
+{
+    for (int ii = 0; ii < members_num; ++ii) {
+        stripe_member* mb = &set[ii];
+        
+        if (started) {
+            pthread_mutex_lock(&mb->lock);
+            mb->running = 0;
+            pthread_cond_signal(&mb->wake);
+            pthread_mutex_unlock(&mb->lock);
+            
+            pthread_join(mb->thread, NULL);
+            pthread_mutex_destroy(&mb->lock);
+            pthread_cond_destroy(&mb->wake);
+        }
+        
+        close(mb->fd);
+    }
+    
+    members_num = 0;
+    started = 0;
+}
+
+/* Does all "count" I/Os of the disk, members which have parts of them do
+   their parts at the same time, returns 0 or -ERRNO of the first failed */
+int
+stripe_submit(blkdev_io* ios, const int count)
+{
+    // an I/O is cut at every unit it crosses and at the first data block
+    int most = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        most += ios[ii].len / unit + 2;
+    }
+    
+    blkdev_io* parts = malloc(most * sizeof(blkdev_io));
+    blkdev_io* sorted = malloc(most * sizeof(blkdev_io));
+    int* of = malloc(most * sizeof(int));
+    assert(parts != NULL && sorted != NULL && of != NULL);
+    
+    int num = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        num += __split(&ios[ii], parts + num, of + num);
+    }
+    
+    // parts of every member are put together in their order
+    int first[STRIPE_MAX + 1] = { 0 };
+    for (int ii = 0; ii < num; ++ii) {
+        first[of[ii] + 1] += 1;
+    }
+    
+    int used = 0;
+    for (int mm = 0; mm < members_num; ++mm) {
+        used += (first[mm + 1] > 0);
+        first[mm + 1] += first[mm];
+    }
+    
+    int next[STRIPE_MAX];
+    memcpy(next, first, sizeof(next));
+    for (int ii = 0; ii < num; ++ii) {
+        sorted[next[of[ii]]++] = parts[ii];
+    }
+    
+    int rv = 0;
+    
+    // one member is done right here, without waking its thread
+    if (used == 1) {
+        rv = __member_run(&set[of[0]], sorted, num);
+    }
+    
+    // members without threads yet are done one after another
+    else if (used > 1 && !started) {
+        for (int mm = 0; mm < members_num && rv == 0; ++mm) {
+            rv = __member_run(&set[mm], sorted + first[mm],
+                              first[mm + 1] - first[mm]);
+        }
+    }
+    
+    else if (used > 1) {
+        stripe_batch batch = { PTHREAD_MUTEX_INITIALIZER,
+                               PTHREAD_COND_INITIALIZER, used, 0 };
+        stripe_job jobs[STRIPE_MAX];
+        
+        for (int mm = 0; mm < members_num; ++mm) {
+            if (first[mm + 1] == first[mm]) {
+                continue;
+            }
+            
+            jobs[mm].ios = sorted + first[mm];
+            jobs[mm].count = first[mm + 1] - first[mm];
+            jobs[mm].batch = &batch;
+            __member_queue(&set[mm], &jobs[mm]);
+        }
+        
+        pthread_mutex_lock(&batch.lock);
+        while (batch.pending > 0) {
+            pthread_cond_wait(&batch.done, &batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+        
+        pthread_cond_destroy(&batch.done);
+        pthread_mutex_destroy(&batch.lock);
+        rv = batch.err;
+    }
+    
+    free(parts);
+    free(sorted);
+    free(of);
+    
+    return rv;
+}
+
+/* Waits until everything written reaches all members */
+int
+stripe_sync()
+{
+    for (int ii = 0; ii < members_num; ++ii) {
+        if (fdatasync(set[ii].fd) < 0) return -errno;
+    }
+    
+    return 0;
+}
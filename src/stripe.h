@@ -0,0 +1,47 @@
+//
+//  stripe.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef stripe_h
+#define stripe_h
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "blkdev.h"
+
+#define STRIPE_MAGIC    0x4f4c5354  // "OLST" at the start of every member
+#define STRIPE_MAX      16          // most data files of a set
+#define STRIPE_UNIT     65536       // default bytes of a member before the next
+
+/* Head of every data file of a set but the first, which has the metadata */
+typedef struct stripe_head {
+    int             magic;      // STRIPE_MAGIC
+    int             index;      // place of the member in the set
+    int             count;      // data files of the set
+    int             unit;       // bytes of a member before the next one
+    int64_t         data_off;   // offset of the first data block of the set
+    int64_t         id;         // same in all members and the superblock
+} stripe_head;
+
+/* How the data blocks of a set are spread over its members */
+typedef struct stripe_geom {
+    int             count;
+    int             unit;
+    off_t           data_off;
+    int64_t         id;
+} stripe_geom;
+
+int     stripe_open(const char* data_file, const char* members,
+                    const int direct, const size_t create_size,
+                    stripe_geom* geom);
+void    stripe_start();
+void    stripe_close();
+int     stripe_submit(blkdev_io* ios, const int count);
+int     stripe_sync();
+
+#endif /* stripe_h */
@@ -0,0 +1,833 @@
+//
+//  tier.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "utils.h"
+#include "tier.h"
+
+
+/* ========================= CONSTANTS ===================================== */
+#define TIER_HEAD_SIZE  4096        // bytes of a tier_head and its padding
+#define TIER_PAGE       4096        // slot table is written a page at a time
+#define TIER_HOT        4           // accesses which make a slow block hot
+#define TIER_CANDIDATES 1024        // hot blocks waiting for the migrator
+#define TIER_BATCH      256         // blocks the migrator moves in a pass
+#define TIER_DECAY      65536       // counters halved in a pass
+#define TIER_RESERVE    16          // 1/16 of the slots is kept free
+
+static const int TIER_INTERVAL = 1; // seconds between passes of the migrator
+
+/*
+ * Fast data file is laid out as when it is alone up to the first data
+ * block, the data blocks of a tiered disk are kept elsewhere:
+ *
+ *   fast data file     metadata, tier_head at the first data block, the
+ *                      slot table after it and the slots after the table
+ *   slow data file     tier_head at 0, every data block at its own place
+ *                      after TIER_HEAD_SIZE
+ *
+ * slot table has the data block of every slot, -1 for a free one. Block
+ * numbers never change, a block is in the slot the table gives it or in
+ * the slow data file. New blocks take a free slot, reads and writes count
+ * accesses of blocks, and a migrator thread moves hot blocks into slots
+ * and blocks which stay cold out of them.
+ */
+
+
+/* ========================= VARIABLES ===================================== */
+static int              fast_fd = -1;
+static int              slow_fd = -1;
+static int              bsize;
+static int              dnum;
+static off_t            data_off;   // first data block of the disk
+static off_t            slots_off;  // first slot in the fast data file
+
+// slot table as it is in the fast data file, and pages of it changed since
+static int*             table;
+static off_t            table_off;
+static size_t           table_len;
+static unsigned char*   table_dirty;
+static int              slots;
+
+// slot of every block in a slot, open addressing with linear probing
+static int*             index_keys;
+static int*             index_slots;
+static unsigned         index_mask;
+
+static int*             free_slots;
+static int              free_num;
+
+// accesses of every block, halved over time, and blocks which got hot
+static unsigned char*   heat;
+static int              candidates[TIER_CANDIDATES];
+static int              candidates_num;
+
+// submitters read the mapping, moves of blocks take it for themselves
+static pthread_rwlock_t io_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t  lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t  migrator_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   migrator_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t        migrator;
+static int              running;
+
+static char*            move_buf;   // block on its way between the tiers
+static int              hand;       // next slot the clock looks at
+static int              decayed;    // next block whose counter is halved
+static long             promoted;
+static long             demoted;
+
+
+
+
+/* ==================== LOCAL HELPERS ===================================== */
+/* Reads "len" bytes at "offset", bytes past the end of the file are zeros */
+static
+int
+__read_full(const int file, void* buf, const size_t len, const off_t offset)
+{
+    size_t done = 0;
+    
+    while (done < len) {
+        ssize_t rv = pread(file, (char*)buf + done, len - done, offset + done);
+        
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv < 0) return -errno;
+        
+        if (rv == 0) {
+            memset((char*)buf + done, 0, len - done);
+            break;
+        }
+        
+        done += rv;
+    }
+    
+    return 0;
+}
+
+/* Writes "len" bytes at "offset" */
+static
+int
+__write_full(const int file, const void* buf, const size_t len,
+             const off_t offset)
+{
+    size_t done = 0;
+    
+    while (done < len) {
+        ssize_t rv = pwrite(file, (const char*)buf + done,
+                            len - done, offset + done);
+        
+        if (rv < 0 && errno == EINTR) continue;
+        if (rv < 0) return -errno;
+        
+        done += rv;
+    }
+    
+    return 0;
+}
+
+/* Opens data file "path" of a tier, returns its fd or -ERRNO */
+static
+int
+__open_tier(const char* path, const int create, const int direct)
+{
+    int flags = O_RDWR;
+    if (create) flags |= O_CREAT | O_TRUNC;
+    
+    int file = open(path, flags | (direct ? O_DIRECT : 0), 0644);
+    
+    // file system of the tier does not support O_DIRECT
+    if (file < 0 && direct && errno == EINVAL) {
+        trace("|--TIER: no O_DIRECT for %s\n", path); // log
+        file = open(path, flags, 0644);
+    }
+    
+    return (file < 0) ? -errno : file;
+}
+
+/* Returns the first place in the index "dno" can be at */
+static
+unsigned
+__index_hash(const int dno)
+{
+    return ((unsigned)dno * 2654435761u) & index_mask;
+}
+
+/* Returns the slot of block "dno", -1 if it is in the slow data file */
+static
+int
+__index_find(const int dno)
+{
+    for (unsigned ii = __index_hash(dno); index_keys[ii] >= 0;
+         ii = (ii + 1) & index_mask) {
+        if (index_keys[ii] == dno) {
+            return index_slots[ii];
+        }
+    }
+    
+    return -1;
+}
+
+/* Puts block "dno" in "slot" into the index */
+static
+void
+__index_put(const int dno, const int slot)
+{
+    unsigned ii = __index_hash(dno);
+    
+    while (index_keys[ii] >= 0) {
+        ii = (ii + 1) & index_mask;
+    }
+    
+    index_keys[ii] = dno;
+    index_slots[ii] = slot;
+}
+
+/* Takes block "dno" out of the index, entries after it move back so that
+   no lookup stops at the hole */
+static
+void
+__index_remove(const int dno)
+{
+    unsigned ii = __index_hash(dno);
+    
+    while (index_keys[ii] != dno) {
+        assert(index_keys[ii] >= 0);
+        ii = (ii + 1) & index_mask;
+    }
+    
+    index_keys[ii] = -1;
+    
+    for (unsigned jj = (ii + 1) & index_mask; index_keys[jj] >= 0;
+         jj = (jj + 1) & index_mask) {
+        unsigned home = __index_hash(index_keys[jj]);
+        
+        // entry can stay when its home is after the hole
+        int stays = (ii <= jj) ? (ii < home && home <= jj)
+                               : (ii < home || home <= jj);
+        if (stays) {
+            continue;
+        }
+        
+        index_keys[ii] = index_keys[jj];
+        index_slots[ii] = index_slots[jj];
+        index_keys[jj] = -1;
+        ii = jj;
+    }
+}
+
+/* Gives a free slot to block "dno", returns it or -1 if there is none */
+static
+int
+__take_slot(const int dno)
+{
+    if (free_num == 0) {
+        return -1;
+    }
+    
+    int slot = free_slots[--free_num];
+    table[slot] = dno;
+    table_dirty[slot * sizeof(int) / TIER_PAGE] = 1;
+    __index_put(dno, slot);
+    
+    return slot;
+}
+
+/* Frees "slot", its block is in the slow data file from now on */
+static
+void
+__release_slot(const int slot)
+{
+    __index_remove(table[slot]);
+    
+    table[slot] = -1;
+    table_dirty[slot * sizeof(int) / TIER_PAGE] = 1;
+    free_slots[free_num++] = slot;
+}
+
+/* Writes the pages of the slot table which changed, returns 0 or -ERRNO */
+static
+int
+__flush_table()
+{
+    int pages = table_len / TIER_PAGE;
+    
+    for (int ii = 0; ii < pages; ++ii) {
+        if (!table_dirty[ii]) {
+            continue;
+        }
+        
+        int rv = __write_full(fast_fd, (char*)table + ii * TIER_PAGE,
+                              TIER_PAGE, table_off + ii * TIER_PAGE);
+        if (rv < 0) return rv;
+        
+        table_dirty[ii] = 0;
+    }
+    
+    return 0;
+}
+
+/* Returns offset of "slot" in the fast data file */
+static
+off_t
+__slot_off(const int slot)
+{
+    return slots_off + (off_t)slot * bsize;
+}
+
+/* Returns offset of block "dno" in the slow data file */
+static
+off_t
+__home_off(const int dno)
+{
+    return TIER_HEAD_SIZE + (off_t)dno * bsize;
+}
+
+/* Moves block "dno" from the slow data file into a free slot, the
+   caller has the mapping for itself, returns 0 or -ERRNO */
+static
+int
+__promote(const int dno)
+{
+    int rv = __read_full(slow_fd, move_buf, bsize, __home_off(dno));
+    if (rv < 0) return rv;
+    
+    pthread_mutex_lock(&lock);
+    int slot = __take_slot(dno);
+    pthread_mutex_unlock(&lock);
+    
+    if (slot < 0) return -ENOSPC;
+    
+    // block is in the slot before the table says so
+    rv = __write_full(fast_fd, move_buf, bsize, __slot_off(slot));
+    
+    pthread_mutex_lock(&lock);
+    
+    if (rv < 0) {
+        __release_slot(slot);
+    }
+    
+    else {
+        rv = __flush_table();
+        promoted += 1;
+    }
+    
+    pthread_mutex_unlock(&lock);
+    
+    return rv;
+}
+
+/* Moves the block of "slot" back into the slow data file, the caller has
+   the mapping for itself, returns 0 or -ERRNO */
+static
+int
+__demote(const int slot)
+{
+    int dno = table[slot];
+    
+    int rv = __read_full(fast_fd, move_buf, bsize, __slot_off(slot));
+    if (rv == 0) rv = __write_full(slow_fd, move_buf, bsize, __home_off(dno));
+    if (rv < 0) return rv;
+    
+    // slot is free once the table says so
+    pthread_mutex_lock(&lock);
+    __release_slot(slot);
+    rv = __flush_table();
+    demoted += 1;
+    pthread_mutex_unlock(&lock);
+    
+    return rv;
+}
+
+/* Looks for a slot whose block was not used since the clock passed it
+   last, halves counters of the others, returns it or -1 */
+static
+int
+__clock_victim()
+{
+    for (int ii = 0; ii < 2 * slots; ++ii) {
+        int slot = hand;
+        hand = (hand + 1) % slots;
+        
+        int dno = table[slot];
+        if (dno < 0) {
+            continue;
+        }
+        
+        if (heat[dno] == 0) {
+            return slot;
+        }
+        
+        heat[dno] >>= 1;
+    }
+    
+    return -1;
+}
+
+/* Moves hot blocks up and cold ones down, at most TIER_BATCH of them */
+static
+void
+__migrate()
+{
+    int hot[TIER_CANDIDATES];
+    
+    pthread_mutex_lock(&lock);
+    int hot_num = candidates_num;
+    memcpy(hot, candidates, hot_num * sizeof(int));
+    candidates_num = 0;
+    pthread_mutex_unlock(&lock);
+    
+    int moves = 0;
+    
+    // hot blocks take the slots of cold ones
+    for (int ii = 0; ii < hot_num && moves < TIER_BATCH; ++ii) {
+        int dno = hot[ii];
+        
+        pthread_rwlock_wrlock(&io_lock);
+        
+        if (__index_find(dno) < 0 && heat[dno] >= TIER_HOT) {
+            int victim = (free_num == 0) ? __clock_victim() : -1;
+            
+            if (victim >= 0 && __demote(victim) == 0) {
+                moves += 1;
+            }
+            
+            if (free_num > 0 && __promote(dno) == 0) {
+                moves += 1;
+            }
+        }
+        
+        pthread_rwlock_unlock(&io_lock);
+    }
+    
+    // new blocks find free slots
+    while (free_num < slots / TIER_RESERVE && moves < TIER_BATCH) {
+        pthread_rwlock_wrlock(&io_lock);
+        
+        int victim = __clock_victim();
+        int rv = (victim >= 0) ? __demote(victim) : -1;
+        
+        pthread_rwlock_unlock(&io_lock);
+        
+        if (rv < 0) break;
+        moves += 1;
+    }
+    
+    // blocks which are not used any more cool down
+    for (int ii = 0; ii < TIER_DECAY && ii < dnum; ++ii) {
+        heat[decayed] >>= 1;
+        decayed = (decayed + 1) % dnum;
+    }
+}
+
+/* Migrator thread, makes a pass every TIER_INTERVAL seconds */
+static
+void*
+__migrator_main(void* arg)
+{
+    pthread_mutex_lock(&migrator_lock);
+    
+    while (running) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += TIER_INTERVAL;
+        
+        pthread_cond_timedwait(&migrator_wake, &migrator_lock, &until);
+        if (!running) break;
+        
+        pthread_mutex_unlock(&migrator_lock);
+        __migrate();
+        pthread_mutex_lock(&migrator_lock);
+    }
+    
+    pthread_mutex_unlock(&migrator_lock);
+    
+    return NULL;
+}
+
+/* Writes the heads and the empty slot table of new tiers and makes them
+   sparse files which hold all their blocks, returns 0 or -ERRNO */
+static
+int
+__create_tiers(const tier_geom* geom)
+{
+    tier_head* head = blkdev_alloc(TIER_HEAD_SIZE);
+    memset(head, 0, TIER_HEAD_SIZE);
+    
+    head->magic = TIER_MAGIC;
+    head->bsize = geom->bsize;
+    head->slots = geom->slots;
+    head->dnum = geom->dnum;
+    head->data_off = geom->data_off;
+    head->id = geom->id;
+    
+    int rv = __write_full(slow_fd, head, TIER_HEAD_SIZE, 0);
+    
+    head->fast = 1;
+    if (rv == 0) rv = __write_full(fast_fd, head, TIER_HEAD_SIZE, data_off);
+    
+    free(head);
+    
+    for (int ii = 0; ii < slots; ++ii) {
+        table[ii] = -1;
+    }
+    
+    memset(table_dirty, 1, table_len / TIER_PAGE);
+    if (rv == 0) rv = __flush_table();
+    
+    if (rv == 0 && ftruncate(fast_fd, __slot_off(slots)) < 0) rv = -errno;
+    if (rv == 0 && ftruncate(slow_fd, __home_off(dnum)) < 0) rv = -errno;
+    
+    return rv;
+}
+
+/* Reads the heads of both tiers into "geom", they have to be of the same
+   disk, returns 0 or -ERRNO */
+static
+int
+__read_tiers(tier_geom* geom)
+{
+    tier_head* slow = blkdev_alloc(TIER_HEAD_SIZE);
+    tier_head* fast = blkdev_alloc(TIER_HEAD_SIZE);
+    
+    // slow one tells where the head of the fast one is
+    int rv = __read_full(slow_fd, slow, TIER_HEAD_SIZE, 0);
+    if (rv == 0 && (slow->magic != TIER_MAGIC || slow->fast)) rv = -EINVAL;
+    
+    if (rv == 0) {
+        rv = __read_full(fast_fd, fast, TIER_HEAD_SIZE, slow->data_off);
+    }
+    
+    if (rv == 0 && (fast->magic != TIER_MAGIC || !fast->fast
+                    || fast->id != slow->id || fast->slots != slow->slots
+                    || fast->dnum != slow->dnum)) {
+        rv = -EINVAL;
+    }
+    
+    if (rv == 0) {
+        geom->bsize = slow->bsize;
+        geom->slots = slow->slots;
+        geom->dnum = slow->dnum;
+        geom->data_off = slow->data_off;
+        geom->id = slow->id;
+    }
+    
+    free(slow);
+    free(fast);
+    
+    return rv;
+}
+
+
+
+
+/* ==================== FUNCTIONS ========================================= */
+/* Opens "data_file" as the fast tier and "slow_file" as the slow tier of
+   one disk, new tiers are laid out as in "geom" when "create" is set, the
+   heads of existing ones fill it, returns 0 or -ERRNO */
+int
+tier_open(const char* data_file, const char* slow_file, const int direct,
+          const int create, tier_geom* geom)
+{
+    fast_fd = __open_tier(data_file, create, direct);
+    if (fast_fd < 0) return fast_fd;
+    
+    slow_fd = __open_tier(slow_file, create, direct);
+    int rv = (slow_fd < 0) ? slow_fd : 0;
+    
+    if (rv == 0 && !create) {
+        rv = __read_tiers(geom);
+        
+        if (rv < 0) {
+            fprintf(stderr, "|--TIER: %s is not the slow tier of %s\n",
+                    slow_file, data_file);
+        }
+    }
+    
+    if (rv < 0) {
+        if (slow_fd >= 0) close(slow_fd);
+        close(fast_fd);
+        fast_fd = -1;
+        slow_fd = -1;
+        return rv;
+    }
+    
+    bsize = geom->bsize;
+    slots = geom->slots;
+    dnum = geom->dnum;
+    data_off = geom->data_off;
+    
+    table_off = data_off + TIER_HEAD_SIZE;
+    table_len = div_up(slots * sizeof(int), TIER_PAGE) * TIER_PAGE;
+    slots_off = table_off + table_len;
+    
+    table = blkdev_alloc(table_len);
+    table_dirty = calloc(table_len / TIER_PAGE, 1);
+    assert(table_dirty != NULL);
+    
+    rv = create ? __create_tiers(geom)
+                : __read_full(fast_fd, table, table_len, table_off);
+    assert(rv == 0);
+    
+    // index is at most half full
+    unsigned size = 2;
+    while (size < 2 * (unsigned)slots) size *= 2;
+    index_mask = size - 1;
+    
+    index_keys = malloc(size * sizeof(int));
+    index_slots = malloc(size * sizeof(int));
+    free_slots = malloc(slots * sizeof(int));
+    heat = calloc(dnum, 1);
+    assert(index_keys != NULL && index_slots != NULL);
+    assert(free_slots != NULL && heat != NULL);
+    
+    memset(index_keys, 0xff, size * sizeof(int));
+    free_num = 0;
+    
+    // lowest slots are taken first
+    for (int ii = slots - 1; ii >= 0; --ii) {
+        if (table[ii] < 0) {
+            free_slots[free_num++] = ii;
+        }
+        
+        else {
+            __index_put(table[ii], ii);
+        }
+    }
+    
+    move_buf = blkdev_alloc(bsize);
+    candidates_num = 0;
+    hand = 0;
+    decayed = 0;
+    promoted = 0;
+    demoted = 0;
+    
+    trace("|--TIER: %d of %d blocks fit in the fast tier, %d are there\n",
+          slots, dnum, slots - free_num); // log
+    
+    return 0;
+}
+
+/* Starts the migrator, a process which forks after the open calls it in
+   the child */
+void
+tier_start()
+{
+    running = 1;
+    
+    int rv = pthread_create(&migrator, NULL, __migrator_main, NULL);
+    assert(rv == 0);
+}
+
+/* Stops the migrator and closes both tiers */
+void
+tier_close()
+{
+    pthread_mutex_lock(&migrator_lock);
+    
+    int thread = running;
+    running = 0;
+    
+    pthread_cond_signal(&migrator_wake);
+    pthread_mutex_unlock(&migrator_lock);
+    
+    if (thread) {
+        pthread_join(migrator, NULL);
+    }
+    
+    int rv = __flush_table();
+    assert(rv == 0);
+    
+    trace("|--TIER: %ld blocks moved up, %ld down\n", // log
+          promoted, demoted);
+    
+    free(table);
+    free(table_dirty);
+    free(index_keys);
+    free(index_slots);
+    free(free_slots);
+    free(heat);
+    free(move_buf);
+    
+    table = NULL;
+    heat = NULL;
+    
+    close(fast_fd);
+    close(slow_fd);
+    fast_fd = -1;
+    slow_fd = -1;
+}
+
+/* Does all "count" I/Os of the disk in the tiers which have their blocks,
+   written blocks which are in neither get a free slot if there is one,
+   returns 0 or -ERRNO of the first failed one */
+int
+tier_submit(blkdev_io* ios, const int count)
+{
+    int rv = 0;
+    int taken = 0;
+    
+    pthread_rwlock_rdlock(&io_lock);
+    
+    for (int ii = 0; ii < count && rv == 0; ++ii) {
+        char* buf = ios[ii].buf;
+        size_t len = ios[ii].len;
+        off_t offset = ios[ii].offset;
+        int write = ios[ii].write;
+        
+        // metadata is only in the fast data file
+        if (offset < data_off) {
+            size_t head = (len < (size_t)(data_off - offset))
+                        ? len : (size_t)(data_off - offset);
+            
+            rv = write ? __write_full(fast_fd, buf, head, offset)
+                       : __read_full(fast_fd, buf, head, offset);
+            
+            buf += head;
+            len -= head;
+            offset += head;
+        }
+        
+        // blocks next to each other in the same tier are done at once
+        while (len > 0 && rv == 0) {
+            int file = -1;
+            off_t at = 0;
+            size_t run = 0;
+            
+            pthread_mutex_lock(&lock);
+            
+            while (run < len) {
+                off_t rel = offset + run - data_off;
+                int dno = rel / bsize;
+                size_t inside = rel % bsize;
+                size_t part = (len - run < bsize - inside) ? len - run
+                                                           : bsize - inside;
+                
+                int slot = __index_find(dno);
+                
+                // new data goes to the fast tier while it has room
+                if (slot < 0 && write && free_num > 0) {
+                    slot = __take_slot(dno);
+                    taken = 1;
+                }
+                
+                int next = (slot >= 0) ? fast_fd : slow_fd;
+                off_t next_at = (slot >= 0) ? __slot_off(slot) + inside
+                                            : __home_off(dno) + inside;
+                
+                if (run > 0 && (next != file || next_at != at + (off_t)run)) {
+                    break;
+                }
+                
+                if (run == 0) {
+                    file = next;
+                    at = next_at;
+                }
+                
+                run += part;
+            }
+            
+            pthread_mutex_unlock(&lock);
+            
+            rv = write ? __write_full(file, buf, run, at)
+                       : __read_full(file, buf, run, at);
+            
+            buf += run;
+            len -= run;
+            offset += run;
+        }
+    }
+    
+    // slots are taken in the table once their data is written
+    if (taken) {
+        pthread_mutex_lock(&lock);
+        int flushed = __flush_table();
+        pthread_mutex_unlock(&lock);
+        
+        if (rv == 0) rv = flushed;
+    }
+    
+    pthread_rwlock_unlock(&io_lock);
+    
+    return rv;
+}
+
+/* Waits until everything written reaches both tiers */
+int
+tier_sync()
+{
+    if (fdatasync(fast_fd) < 0) return -errno;
+    if (fdatasync(slow_fd) < 0) return -errno;
+    
+    return 0;
+}
+
+/* Counts an access of block "dno", blocks of the slow tier which get hot
+   are moved up by the migrator */
+void
+tier_touch(const int dno)
+{
+    // counts are hints, races between threads only lose some of them
+    if (heat == NULL || dno < 0 || dno >= dnum) {
+        return;
+    }
+    
+    if (heat[dno] < 255) {
+        heat[dno] += 1;
+    }
+    
+    if (heat[dno] != TIER_HOT) {
+        return;
+    }
+    
+    pthread_mutex_lock(&lock);
+    
+    if (candidates_num < TIER_CANDIDATES && __index_find(dno) < 0) {
+        candidates[candidates_num++] = dno;
+    }
+    
+    pthread_mutex_unlock(&lock);
+}
+
+/* Gives the slots of "count" freed blocks from "dno" on back */
+void
+tier_forget(const int dno, const int count)
+{
+    if (heat == NULL) {
+        return;
+    }
+    
+    // I/O in flight to a slot ends before it can be taken again
+    pthread_rwlock_wrlock(&io_lock);
+    pthread_mutex_lock(&lock);
+    
+    for (int ii = dno; ii < dno + count; ++ii) {
+        int slot = __index_find(ii);
+        
+        if (slot >= 0) {
+            __release_slot(slot);
+        }
+        
+        heat[ii] = 0;
+    }
+    
+    int rv = __flush_table();
+    assert(rv == 0);
+    
+    pthread_mutex_unlock(&lock);
+    pthread_rwlock_unlock(&io_lock);
+}
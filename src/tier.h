@@ -0,0 +1,49 @@
+//
+//  tier.h
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#ifndef tier_h
+#define tier_h
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "blkdev.h"
+
+#define TIER_MAGIC      0x4f4c5449  // "OLTI" at the head of both tiers
+
+/* Head of the slow data file and of the tier area of the fast one */
+typedef struct tier_head {
+    int             magic;      // TIER_MAGIC
+    int             fast;       // head of the fast data file
+    int             bsize;      // bytes in a data block
+    int             slots;      // data blocks the fast data file can keep
+    int             dnum;       // data blocks of the disk
+    int64_t         data_off;   // offset of the first data block of the disk
+    int64_t         id;         // same in both tiers and the superblock
+} tier_head;
+
+/* Where the data blocks of a tiered disk are */
+typedef struct tier_geom {
+    int             bsize;
+    int             slots;
+    int             dnum;
+    off_t           data_off;
+    int64_t         id;
+} tier_geom;
+
+int     tier_open(const char* data_file, const char* slow_file,
+                  const int direct, const int create, tier_geom* geom);
+void    tier_start();
+void    tier_close();
+int     tier_submit(blkdev_io* ios, const int count);
+int     tier_sync();
+
+void    tier_touch(const int dno);
+void    tier_forget(const int dno, const int count);
+
+#endif /* tier_h */
@@ -5,6 +5,7 @@
 //  Created by Oleksandr Litus on 11/29/19.
 //
 
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 
@@ -35,3 +36,46 @@ min(const int x, const int y)
 {
     return (x < y) ? x : y;
 }
+
+/* Returns maximum of two ints */
+int
+max(const int x, const int y)
+{
+    return (x > y) ? x : y;
+}
+
+/* Parses size like "4096", "64K", "512M" or "1T" into bytes, 0 if invalid */
+size_t
+parse_size(const char* str)
+{
+    assert(str != NULL);
+    
+    char* suffix = NULL;
+    size_t size = strtoull(str, &suffix, 10);
+    
+    // no digits at all
+    if (suffix == str) {
+        return 0;
+    }
+    
+    switch (*suffix) {
+        case 'T': case 't': size <<= 10; // fall through
+        case 'G': case 'g': size <<= 10; // fall through
+        case 'M': case 'm': size <<= 10; // fall through
+        case 'K': case 'k': size <<= 10; ++suffix; break;
+        default: break;
+    }
+    
+    return (*suffix == '\0') ? size : 0;
+}
+
+/* Returns log2 of "xx" if it is a power of two, otherwise -1 */
+int
+ilog2(const size_t xx)
+{
+    if (xx == 0 || (xx & (xx - 1)) != 0) {
+        return -1;
+    }
+    
+    return __builtin_ctzl(xx);
+}
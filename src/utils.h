@@ -10,8 +10,19 @@
 
 #include <stdio.h>
 
+/* Logs of every call and block, libolfs and nufs print them only when built
+   with "make TRACE=1", arguments are checked either way */
+#ifdef OLFS_TRACE
+#define trace(...)      printf(__VA_ARGS__)
+#else
+#define trace(...)      do { if (0) printf(__VA_ARGS__); } while (0)
+#endif
+
 size_t  div_up(const size_t aa, const size_t bb);
 int     streq(const char* aa, const char* bb);
 int     min(const int x, const int y);
+int     max(const int x, const int y);
+size_t  parse_size(const char* str);
+int     ilog2(const size_t xx);
 
 #endif /* utils_h */
@@ -3,7 +3,7 @@
 use 5.16.0;
 use warnings FATAL => 'all';
 
-use Test::Simple tests => 28;
+use Test::Simple tests => 104;
 use IO::Handle;
 
 sub mount {
@@ -32,6 +32,42 @@ sub read_text {
     return $data;
 }
 
+sub mount_with {
+    my ($file, @opts) = @_;
+    system("mkdir -p mnt");
+    system("(./nufs @opts -s -f mnt $file 2>&1) >> test.log &");
+    sleep 1;
+}
+
+sub crash {
+    system("pkill", "-KILL", "-f", "^\\./nufs .*-f mnt");
+    sleep 1;
+    unmount();
+}
+
+sub fsck_ok {
+    my ($file) = @_;
+    return system("./fsck.olfs $file >> test.log") == 0;
+}
+
+sub set_attr {
+    my ($name, $attr, $value) = @_;
+    return system("setfattr -n $attr -v $value mnt/$name 2>> test.log") == 0;
+}
+
+sub get_attr {
+    my ($name, $attr) = @_;
+    return `getfattr --only-values -n $attr mnt/$name 2>> test.log`;
+}
+
+sub write_at {
+    my ($name, $offset, $data) = @_;
+    open my $fh, "+<", "mnt/$name" or return;
+    seek $fh, $offset, 0;
+    print $fh $data;
+    close $fh;
+}
+
 sub read_text_slice {
     my ($name, $count, $offset) = @_;
     open my $fh, "<", "mnt/$name" or return "";
@@ -160,6 +196,9 @@ write_text("dir1/dir2/dir3/dir4/dir5/hello.txt", $hi0);
 my $hi1 = read_text("dir1/dir2/dir3/dir4/dir5/hello.txt");
 ok($hi0 eq $hi1, "nested directories");
 
+ok(!rename("mnt/dir1", "mnt/dir1/dir2/dir3/moved") && -d "mnt/dir1",
+   "directory can not move below itself");
+
 system("mkdir mnt/numbers");
 for my $ii (1..50) {
     write_text("numbers/$ii.num", "$ii");
@@ -189,3 +228,436 @@ my $mm = `ls mnt/numbers | wc -l`;
 ok($mm == 46, "deleted 4 files");
 
 unmount();
+
+say "#           == Tools ==";
+
+ok(system("./fsck.olfs data.nufs >> test.log") == 0, "fsck finds no errors");
+
+system("rm -f mkfs.nufs");
+system("./mkfs.olfs -s 4M -b 1K -N 2048 mkfs.nufs 2>> test.log");
+ok(system("./fsck.olfs -j 2 mkfs.nufs >> test.log") == 0, "fsck accepts new mkfs image");
+system("rm -f mkfs.nufs");
+
+say "#           == Features ==";
+
+my $feat = "feat.nufs";
+
+sub fresh {
+    system("rm -f $feat $feat\@* $feat.ckpt feat-*.nufs");
+}
+
+# access times
+fresh();
+mount_with($feat, "--size=16M");
+write_text("seen.txt", "read me");
+unmount();
+
+sub atime_of {
+    my ($name) = @_;
+    sleep 2;
+    return (stat "mnt/$name")[8];
+}
+
+mount_with($feat, "--noatime");
+utime(1000, time() - 10, "mnt/seen.txt");
+read_text("seen.txt");
+ok(atime_of("seen.txt") == 1000, "noatime leaves access time alone");
+unmount();
+
+mount_with($feat, "--strictatime");
+read_text("seen.txt");
+ok(atime_of("seen.txt") > 1000, "strictatime updates access time on read");
+unmount();
+
+mount_with($feat, "--relatime");
+utime(1000, time() - 10, "mnt/seen.txt");
+read_text("seen.txt");
+my $seen = atime_of("seen.txt");
+ok($seen > 1000, "relatime updates access time older than the changes");
+
+read_text("seen.txt");
+ok(atime_of("seen.txt") == $seen, "relatime leaves a newer access time alone");
+unmount();
+
+mount_with($feat, "--lazytime=1");
+utime(1000, time() - 10, "mnt/seen.txt");
+read_text("seen.txt");
+ok(atime_of("seen.txt") > 1000, "lazytime shows access time kept in memory");
+unmount();
+
+mount_with($feat, "--noatime");
+ok((stat "mnt/seen.txt")[8] > 1000, "lazytime writes access times at unmount");
+unmount();
+
+# lazy initialization of the groups
+fresh();
+mount_with($feat, "--size=1G");
+write_text("first.txt", "only the first group is set up");
+unmount();
+
+ok((stat $feat)[12] * 512 < 16 << 20, "inode tables of unused groups are not written");
+ok(fsck_ok($feat), "fsck accepts groups which were never set up");
+
+# allocation groups
+fresh();
+mount_with($feat, "--size=1G");
+
+for my $ii (1..4) {
+    system("mkdir mnt/group$ii");
+    write_text("group$ii/file.txt", "in group $ii");
+}
+
+unmount();
+
+ok((stat $feat)[12] * 512 > 12 << 20, "directories are spread over the groups");
+
+mount_with($feat);
+ok(read_text("group4/file.txt") eq "in group 4", "read back a file of another group");
+unmount();
+
+ok(system("./fsck.olfs -j 4 $feat >> test.log") == 0, "fsck checks the groups in parallel");
+
+# read ahead
+fresh();
+mount_with($feat, "--size=16M", "--io=pread", "--cache-size=64K");
+my $ahead = join("", map { sprintf("%08d", $_) } 1..100000);
+write_text("ahead.txt", $ahead);
+unmount();
+
+mount_with($feat, "--io=pread", "--cache-size=64K");
+ok(read_text("ahead.txt") eq $ahead,
+   "read a file sequentially through a small cache");
+ok(read_text_slice("ahead.txt", 8, 8 * 90000) eq sprintf("%08d", 90001),
+   "read near the end after reading ahead");
+ok(read_text_slice("ahead.txt", 8, 8 * 10) eq sprintf("%08d", 11),
+   "read back at the start after a random read");
+unmount();
+
+# compression
+fresh();
+mount_with($feat, "--size=16M");
+
+system("mkdir mnt/logs");
+ok(set_attr("logs", "user.olfs.compress", 1), "compress a directory");
+
+my $log0 = join("\n", ("a line which compresses well") x 4000);
+write_text("logs/big.log", $log0);
+ok(get_attr("logs/big.log", "user.olfs.compress") eq "1",
+   "new file is compressed like its directory");
+
+# more clusters than one map block holds, and more data than the disk
+my $log1 = join("\n", ("a line which compresses well") x 800000);
+write_text("logs/huge.log", $log1);
+
+unmount();
+mount_with($feat);
+
+ok(read_text("logs/big.log") eq $log0, "read back compressed file");
+ok(read_text("logs/huge.log") eq $log1,
+   "read back compressed file bigger than the disk");
+
+unmount();
+ok(fsck_ok($feat), "fsck accepts compressed files");
+
+# dedup
+fresh();
+mount_with($feat, "--size=16M", "--dedup");
+
+my $same = "same block " x 30000;
+write_text("a.dat", $same);
+write_text("b.dat", $same);
+write_at("b.dat", 0, "changed");
+ok(read_text("a.dat") eq $same, "changing a shared block copies it");
+
+system("rm -f mnt/a.dat");
+unmount();
+mount_with($feat, "--dedup");
+
+ok(read_text("b.dat") eq "changed" . substr($same, 7),
+   "shared blocks stay with the other file");
+
+unmount();
+ok(fsck_ok($feat), "fsck counts owners of shared blocks");
+
+# clone
+fresh();
+mount_with($feat, "--size=16M");
+
+write_text("src.txt", $huge0);
+ok(system("./clone.olfs mnt/src.txt mnt/dst.txt 2>> test.log") == 0,
+   "clone a file");
+ok(read_text("dst.txt") eq $huge0, "clone reads like its source");
+
+write_at("dst.txt", 0, "changed");
+ok(read_text("src.txt") eq $huge0, "source keeps its data when the clone changes");
+
+unmount();
+ok(fsck_ok($feat), "fsck accepts blocks shared by clones");
+
+# snapshots and branches
+fresh();
+system("./mkfs.olfs -s 16M $feat >> test.log");
+
+mount_with($feat, "--branch=job");
+write_text("job.txt", "first run");
+unmount();
+
+ok(system("./snap.olfs -b job $feat before-job >> test.log") == 0,
+   "take a snapshot of a branch");
+
+mount_with($feat, "--branch=job");
+write_text("job.txt", "second run");
+unmount();
+
+mount_with($feat, "--from=before-job");
+ok(read_text("job.txt") eq "first run", "snapshot keeps its data");
+unmount();
+
+mount_with($feat, "--branch=job");
+ok(read_text("job.txt") eq "second run", "branch goes on after its snapshot");
+unmount();
+
+ok(`./snap.olfs -l $feat` =~ /before-job/, "snapshots are listed");
+ok(fsck_ok($feat), "branches leave the data file alone");
+
+# checksums and scrub
+fresh();
+mount_with($feat, "--size=16M", "--io=pread", "--verify");
+write_text("sum.txt", $huge0);
+unmount();
+
+mount_with($feat, "--io=pread", "--verify", "--scrub=1");
+ok(read_text("sum.txt") eq $huge0, "read back checked blocks");
+
+sleep 2;
+my $stats = get_attr("", "user.olfs.stats");
+ok($stats =~ /^checksums verify$/m && $stats =~ /^errors 0$/m,
+   "blocks match their checksums");
+ok($stats =~ /^scrub_passes [1-9]/m, "scrubber read the blocks");
+
+unmount();
+ok(fsck_ok($feat), "fsck checks the checksums");
+
+# map cursor
+fresh();
+mount_with($feat, "--size=32M");
+write_text("gone.txt", "x" x 100000);
+
+my $chunk = join("", map { sprintf("%08d", $_) } 1..8192);
+open my $cur, "+>", "mnt/cursor.txt";
+for my $ii (0..31) {
+    sysseek $cur, $ii * length($chunk), 0;
+    syswrite $cur, $chunk;
+    unlink "mnt/gone.txt" if $ii == 15;
+}
+sysseek $cur, 20 * length($chunk) + 8, 0;
+my $mid;
+sysread $cur, $mid, 8;
+close $cur;
+ok($mid eq "00000002", "read through the handle which wrote the file");
+ok(read_text("cursor.txt") eq $chunk x 32,
+   "sequential writes through one handle after blocks were freed");
+unmount();
+
+mount_with($feat);
+ok(read_text_slice("cursor.txt", 8, 31 * length($chunk)) eq "00000001",
+   "read back the last chunk after a remount");
+unmount();
+
+# double and triple indirect blocks
+fresh();
+mount_with($feat, "--size=16M");
+write_text("sparse.bin", "start");
+write_at("sparse.bin", 2 << 30, "midway");
+write_at("sparse.bin", 5 << 30, "far away");
+ok((stat "mnt/sparse.bin")[7] == (5 << 30) + 8,
+   "sparse file past the double indirect blocks");
+unmount();
+
+mount_with($feat);
+ok(read_text_slice("sparse.bin", 8, 5 << 30) eq "far away",
+   "read back a block of the triple indirect tree");
+ok(read_text_slice("sparse.bin", 6, 2 << 30) eq "midway",
+   "read back a block of the double indirect tree");
+ok(read_text_slice("sparse.bin", 4, 3 << 30) eq "\0" x 4,
+   "hole in a large sparse file reads as zeroes");
+unmount();
+ok(fsck_ok($feat), "fsck accepts a large sparse file");
+
+# truncate
+fresh();
+mount_with($feat, "--size=16M");
+my $cut = "y" x 20000;
+write_text("cut.txt", $cut);
+truncate "mnt/cut.txt", 5000;
+truncate "mnt/cut.txt", 12000;
+ok(read_text("cut.txt") eq ("y" x 5000) . ("\0" x 7000),
+   "bytes past a cut in the middle of a block read as zeroes");
+
+write_text("hole.txt", $cut);
+write_at("hole.txt", 3 << 20, "tail");
+truncate "mnt/hole.txt", 4096;
+truncate "mnt/hole.txt", (3 << 20) + 4;
+ok(read_text_slice("hole.txt", 4, 3 << 20) eq "\0" x 4,
+   "truncate frees blocks past the holes");
+
+truncate "mnt/cut.txt", 0;
+write_text("cut.txt", "again");
+unmount();
+
+mount_with($feat);
+ok(read_text("cut.txt") eq "again", "rewrite a file truncated to zero");
+unmount();
+ok(fsck_ok($feat), "fsck accepts truncated files");
+
+# orphans left by a crash
+fresh();
+mount_with($feat, "--size=16M");
+write_text("orphan.dat", "o" x (10 << 20));
+system("rm -f mnt/orphan.dat");
+crash();
+
+ok(fsck_ok($feat), "fsck accepts orphans without names");
+
+mount_with($feat);
+sleep 1;
+write_text("again.dat", "a" x (10 << 20));
+ok(length(read_text("again.dat")) == 10 << 20, "blocks of orphans are freed");
+unmount();
+
+ok(fsck_ok($feat), "fsck accepts the disk after orphans are freed");
+
+# discard
+fresh();
+mount_with($feat, "--size=32M", "--discard");
+write_text("big.bin", "z" x (10 << 20));
+unmount();
+my $written = (stat $feat)[12] * 512;
+
+mount_with($feat, "--discard");
+unlink "mnt/big.bin";
+unmount();
+ok((stat $feat)[12] * 512 < $written - (8 << 20),
+   "deleted blocks are punched out of the data file");
+
+mount_with($feat, "--discard=async");
+write_text("big.bin", "z" x (10 << 20));
+unlink "mnt/big.bin";
+sleep 2;
+unmount();
+ok((stat $feat)[12] * 512 < $written - (8 << 20),
+   "deleted blocks are punched in the background");
+ok(fsck_ok($feat), "fsck accepts a discarded data file");
+
+# thin provisioning
+fresh();
+mount_with($feat, "--size=1G", "--thin");
+for my $ii (1..20) {
+    system("mkdir mnt/thin$ii");
+    write_text("thin$ii/file.txt", "in directory $ii");
+}
+unmount();
+ok((stat $feat)[12] * 512 < 8 << 20,
+   "thin data file only grows as far as it is used");
+
+mount_with($feat);
+ok(read_text("thin20/file.txt") eq "in directory 20",
+   "read back a file of a thin data file");
+unmount();
+ok(fsck_ok($feat), "fsck accepts a thin data file");
+
+# compaction
+fresh();
+mount_with($feat, "--size=16M");
+
+for my $ii (1..20) {
+    write_text("c$ii.txt", $huge0 . $ii);
+}
+
+for my $ii (1..10) {
+    my $xx = $ii * 2 - 1;
+    system("rm mnt/c$xx.txt");
+}
+
+ok(set_attr("", "user.olfs.compact", 1), "compact the data file");
+
+my $kept = 1;
+for my $ii (1..10) {
+    my $xx = $ii * 2;
+    $kept &&= (read_text("c$xx.txt") eq $huge0 . $xx);
+}
+ok($kept, "read back files after compaction");
+
+unmount();
+ok(fsck_ok($feat), "fsck accepts a compacted data file");
+
+# stripes
+fresh();
+mount_with($feat, "--size=16M", "--stripe=feat-1.nufs,feat-2.nufs");
+my $striped = "=over three data files=" x 30000;
+write_text("striped.txt", $striped);
+unmount();
+
+mount_with($feat, "--stripe=feat-1.nufs,feat-2.nufs");
+ok(read_text("striped.txt") eq $striped, "read back striped file");
+unmount();
+
+ok((stat "feat-2.nufs")[12] > 0, "blocks went to the other data files");
+
+mount_with($feat);
+ok(!-e "mnt/striped.txt", "striped data file needs its set");
+unmount();
+
+ok(system("./fsck.olfs $feat >> test.log 2>&1") >> 8 == 8,
+   "fsck says it can not check a striped data file");
+
+# tiers
+fresh();
+mount_with($feat, "--size=16M", "--tier=feat-slow.nufs");
+write_text("tiered.txt", $huge0);
+unmount();
+
+mount_with($feat, "--tier=feat-slow.nufs");
+ok(read_text("tiered.txt") eq $huge0, "read back tiered file");
+unmount();
+
+mount_with($feat);
+ok(!-e "mnt/tiered.txt", "fast tier needs its slow one");
+unmount();
+
+ok(system("./fsck.olfs $feat >> test.log 2>&1") >> 8 == 8,
+   "fsck says it can not check a tiered data file");
+
+# RAM mode and checkpoints
+fresh();
+mount_with($feat, "--size=16M", "--ram", "--checkpoint=0");
+write_text("ram.txt", "kept by a checkpoint");
+ok(set_attr("", "user.olfs.checkpoint", 1), "take a checkpoint");
+
+write_text("lost.txt", "written after it");
+crash();
+
+mount_with($feat, "--ram");
+ok(read_text("ram.txt") eq "kept by a checkpoint", "checkpoint survives a crash");
+ok(!-e "mnt/lost.txt", "writes after the last checkpoint are lost");
+unmount();
+
+ok(fsck_ok($feat), "fsck accepts a checkpointed data file");
+
+# huge pages
+fresh();
+mount_with($feat, "--size=1G", "--hugepages");
+write_text("huge.txt", $huge0);
+unmount();
+
+# offsets are in the superblock, the disk mounts without the option
+mount_with($feat);
+ok(read_text("huge.txt") eq $huge0, "read back a file of a hugepage disk");
+unmount();
+ok(fsck_ok($feat), "fsck accepts a hugepage layout");
+
+system("rm -f $feat");
+system("./mkfs.olfs -H -s 1G $feat >> test.log 2>&1");
+ok(fsck_ok($feat), "fsck accepts a hugepage layout made by mkfs");
+
+fresh();
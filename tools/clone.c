@@ -0,0 +1,112 @@
+//
+//  clone.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "clone.h"
+
+
+/* Prints how to use the tool */
+static
+void
+usage()
+{
+    fprintf(stderr, "usage: clone.olfs source destination\n");
+    exit(2);
+}
+
+/* Returns "path" inside of the mount it is on, NULL if it does not exist */
+static
+char*
+__mount_path(const char* path)
+{
+    char* full = realpath(path, NULL);
+    if (full == NULL) {
+        return NULL;
+    }
+    
+    struct stat st;
+    if (stat(full, &st) == -1) {
+        free(full);
+        return NULL;
+    }
+    
+    // parents on the same device are inside of the mount
+    char* dir = strdup(full);
+    size_t root_len = strlen(full);
+    
+    while (strcmp(dir, "/") != 0) {
+        char* slash = strrchr(dir, '/');
+        
+        // parent of a top level directory is the root
+        if (slash == dir) slash[1] = '\0';
+        else *slash = '\0';
+        
+        struct stat parent;
+        if (stat(dir, &parent) == -1 || parent.st_dev != st.st_dev) {
+            break;
+        }
+        
+        root_len = strlen(dir);
+    }
+    
+    free(dir);
+    
+    // whole path is on one device, there is no mount to strip
+    if (root_len == 1) {
+        root_len = 0;
+    }
+    
+    char* inner = strdup(full[root_len] ? full + root_len : "/");
+    free(full);
+    
+    return inner;
+}
+
+/* Clones a file of the mount inside of it, blocks are shared, not copied */
+int
+main(int argc, char* argv[])
+{
+    if (argc != 3) {
+        usage();
+    }
+    
+    olfs_clone args;
+    memset(&args, 0, sizeof(args));
+    
+    char* src = __mount_path(argv[1]);
+    if (src == NULL || strlen(src) >= CLONE_PATH_MAX) {
+        fprintf(stderr, "clone.olfs: can not use %s\n", argv[1]);
+        return 1;
+    }
+    
+    strcpy(args.src, src);
+    free(src);
+    
+    // destination becomes a copy of the whole source
+    int fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "clone.olfs: can not open %s\n", argv[2]);
+        return 1;
+    }
+    
+    int rv = ioctl(fd, OLFS_IOC_CLONE, &args);
+    close(fd);
+    
+    if (rv == -1) {
+        perror("clone.olfs");
+        return 1;
+    }
+    
+    return 0;
+}
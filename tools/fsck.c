@@ -0,0 +1,45 @@
+//
+//  fsck.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "fsck.h"
+
+
+/* Prints how to use the tool */
+static
+void
+usage()
+{
+    fprintf(stderr, "usage: fsck.olfs [-y] [-j threads] data_file\n");
+    exit(FSCK_FAILED);
+}
+
+/* Checks a data file, with -y repairs it */
+int
+main(int argc, char* argv[])
+{
+    int repair = 0;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "yj:")) != -1) {
+        switch (opt) {
+            case 'y': repair = 1; break;
+            case 'j': threads = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    
+    if (optind != argc - 1 || threads <= 0) {
+        usage();
+    }
+    
+    return fsck_check(argv[optind], threads, repair);
+}
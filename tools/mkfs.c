@@ -0,0 +1,70 @@
+//
+//  mkfs.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include "utils.h"
+#include "disk.h"
+
+
+/* Prints how to use the tool */
+static
+void
+usage()
+{
+    fprintf(stderr, "usage: mkfs.olfs [-H] [-s size] [-b block_size] "
+                    "[-i bytes_per_inode | -N inodes] data_file\n");
+    exit(2);
+}
+
+/* Formats a new data file */
+int
+main(int argc, char* argv[])
+{
+    size_t size = 1024 * 1024;
+    size_t bsize = BLOCK_SIZE;
+    size_t bpi = BLOCK_SIZE;
+    size_t inodes = 0;
+    int huge = 0;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "Hs:b:i:N:")) != -1) {
+        switch (opt) {
+            case 'H': huge = 1; break;
+            case 's': size = parse_size(optarg); break;
+            case 'b': bsize = parse_size(optarg); break;
+            case 'i': bpi = parse_size(optarg); break;
+            case 'N': inodes = parse_size(optarg); break;
+            default: usage();
+        }
+    }
+    
+    if (optind != argc - 1 || size == 0 || bsize == 0 || bpi == 0) {
+        usage();
+    }
+    
+    // inode count is turned into the inode ratio
+    if (inodes > 0) {
+        bpi = size / inodes;
+    }
+    
+    char* data_file = argv[optind];
+    
+    int rv = disk_format(data_file, size, bsize, bpi, huge);
+    
+    if (rv < 0) {
+        fprintf(stderr, "mkfs.olfs: invalid geometry for %s\n", data_file);
+        return 1;
+    }
+    
+    fprintf(stderr, "mkfs.olfs: %s: %zu bytes, %zu byte blocks, "
+                    "one inode per %zu bytes\n", data_file, size, bsize, bpi);
+    
+    return 0;
+}
@@ -0,0 +1,106 @@
+//
+//  snap.c
+//
+//
+//  Created by Oleksandr Litus on 10/18/26.
+//
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "snapshot.h"
+
+
+/* Prints how to use the tool */
+static
+void
+usage()
+{
+    fprintf(stderr, "usage: snap.olfs [-b branch] data_file name\n"
+                    "       snap.olfs -l data_file\n");
+    exit(2);
+}
+
+/* Prints every snapshot and branch of "data_file" */
+static
+int
+__list(const char* data_file)
+{
+    char* dir_copy = strdup(data_file);
+    char* base_copy = strdup(data_file);
+    char* base = basename(base_copy);
+    size_t base_len = strlen(base);
+    
+    DIR* dir = opendir(dirname(dir_copy));
+    if (dir == NULL) {
+        perror("snap.olfs");
+        return 1;
+    }
+    
+    // layers are "data_file@name" next to the data file
+    struct dirent* ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, base, base_len) != 0
+            || ent->d_name[base_len] != '@') {
+            continue;
+        }
+        
+        const char* name = ent->d_name + base_len + 1;
+        snap_head head;
+        
+        if (snap_head_read(data_file, name, &head) < 0) {
+            continue;
+        }
+        
+        printf("%-8s %-24s %s\n", head.frozen ? "snapshot" : "branch",
+               name, head.parent[0] ? head.parent : "-");
+    }
+    
+    closedir(dir);
+    free(dir_copy);
+    free(base_copy);
+    
+    return 0;
+}
+
+/* Takes a snapshot of an unmounted data file or of one of its branches */
+int
+main(int argc, char* argv[])
+{
+    const char* branch = NULL;
+    int list = 0;
+    
+    int opt;
+    while ((opt = getopt(argc, argv, "b:l")) != -1) {
+        switch (opt) {
+            case 'b': branch = optarg; break;
+            case 'l': list = 1; break;
+            default: usage();
+        }
+    }
+    
+    if (list) {
+        if (optind != argc - 1) usage();
+        return __list(argv[optind]);
+    }
+    
+    if (optind != argc - 2) {
+        usage();
+    }
+    
+    const char* data_file = argv[optind];
+    const char* name = argv[optind + 1];
+    
+    int rv = snap_create(data_file, branch, name);
+    if (rv < 0) {
+        fprintf(stderr, "snap.olfs: can not take %s of %s: %s\n",
+                name, branch ? branch : data_file, strerror(-rv));
+        return 1;
+    }
+    
+    return 0;
+}